@@ -13,8 +13,56 @@
 #include <atomic>
 #include <unordered_map>
 #include <numeric>
+#include <set>
+#include <array>
+#include <bitset>
+#include <iomanip>
+#include <functional>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <deque>
+#include <tuple>
+#include <condition_variable>
+#include <csignal>
+#include <memory>
+#include <shared_mutex>
+#include <string_view>
 #ifdef _WIN32
 #include <windows.h>
+#include <conio.h>
+#include <io.h>
+#endif
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#if __has_include(<linux/fs.h>)
+#include <linux/fs.h>
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
 #endif
 #include <limits>
 #if __has_include(<filesystem>)
@@ -60,24 +108,192 @@ static inline void setColor(int color) {
 }
 #endif
 
+/*******************************************************
+ * Execution trace (--trace <file>)
+ *
+ *  Records spans per thread (file reads, parsing, slow lines,
+ *  merging, output writes and waits on queues or the console)
+ *  and writes them at exit as Chrome trace event JSON, which
+ *  Perfetto and chrome://tracing open directly.
+ *
+ *  Every thread appends to a buffer of its own; the buffer's
+ *  mutex is only ever contended by the trace writer, and the
+ *  registry mutex is taken once per thread, when its buffer is
+ *  created. Spans are per file or per phase, never per line,
+ *  except for single lines that take longer than
+ *  TRACE_SLOW_LINE_NS. Waits only become spans when they did
+ *  block. With tracing off a span costs one branch.
+ *
+ *  A Ctrl-C that ends the program (see "Interrupting scans")
+ *  writes the trace before it goes, so interrupted runs can be
+ *  inspected too.
+ *******************************************************/
+static bool g_tracing = false;
+static std::string g_tracePath;
+static std::atomic<bool> g_traceExitRequested{ false };   // set by SIGINT, served by the trace watcher
+static const uint32_t TRACE_NO_FILE = UINT32_MAX;      // span not tied to a file (a FileId otherwise)
+static const uint32_t TRACE_NO_LINE = UINT32_MAX;
+static const size_t   TRACE_MAX_EVENTS = 1u << 20;     // per thread; further spans are only counted
+static const uint64_t TRACE_SLOW_LINE_NS = 200000;     // lines slower than this get a span
+
+struct TraceEvent {
+    const char* name;   // string literal
+    uint64_t startNs;
+    uint64_t durNs;
+    uint32_t file;
+    uint32_t line;
+};
+
+struct TraceBuffer {
+    std::mutex mutex;       // owner vs. trace writer
+    unsigned tid = 0;
+    std::string thread;
+    std::deque<TraceEvent> events;
+    size_t dropped = 0;
+    uint32_t currentFile = TRACE_NO_FILE;   // file of the enclosing span, for slow lines
+};
+
+static std::mutex traceRegistryMutex;
+static std::vector<std::unique_ptr<TraceBuffer>> traceBuffers;
+static const std::chrono::steady_clock::time_point traceEpoch = std::chrono::steady_clock::now();
+
+static inline uint64_t traceNow()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+/** traceBuffer():
+ *   The calling thread's buffer, registered on first use.
+ *   Buffers outlive their threads until the trace is written.
+ */
+static TraceBuffer& traceBuffer()
+{
+    thread_local TraceBuffer* buffer = nullptr;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(traceRegistryMutex);
+        traceBuffers.emplace_back(new TraceBuffer());
+        buffer = traceBuffers.back().get();
+        buffer->tid = (unsigned)traceBuffers.size();
+        buffer->thread = "thread";
+    }
+    return *buffer;
+}
+
+/** traceThreadName(name):
+ *   Names the calling thread in the trace ("parser", ...).
+ */
+static void traceThreadName(const char* name)
+{
+    if (!g_tracing) return;
+    TraceBuffer& buffer = traceBuffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.thread = name;
+}
+
+static void traceRecord(const char* name, uint64_t startNs, uint64_t endNs,
+    uint32_t file = TRACE_NO_FILE, uint32_t line = TRACE_NO_LINE)
+{
+    TraceBuffer& buffer = traceBuffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    if (buffer.events.size() >= TRACE_MAX_EVENTS) {
+        buffer.dropped++;
+        return;
+    }
+    buffer.events.push_back({ name, startNs, endNs - startNs, file, line });
+}
+
+/** TraceSpan:
+ *   Records [construction, destruction) as one span. Given a
+ *   file, slow lines inside the span are attributed to it.
+ */
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, uint32_t file = TRACE_NO_FILE)
+        : m_name(g_tracing ? name : nullptr), m_file(file)
+    {
+        if (!m_name) return;
+        if (m_file != TRACE_NO_FILE) {
+            TraceBuffer& buffer = traceBuffer();
+            m_outerFile = buffer.currentFile;
+            buffer.currentFile = m_file;
+        }
+        m_start = traceNow();
+    }
+    ~TraceSpan()
+    {
+        if (!m_name) return;
+        traceRecord(m_name, m_start, traceNow(), m_file);
+        if (m_file != TRACE_NO_FILE) traceBuffer().currentFile = m_outerFile;
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* m_name;
+    uint32_t m_file;
+    uint32_t m_outerFile = TRACE_NO_FILE;
+    uint64_t m_start = 0;
+};
+
+/** TraceLineTimer:
+ *   Times one expensive line; only lines slower than
+ *   TRACE_SLOW_LINE_NS end up in the trace.
+ */
+class TraceLineTimer {
+public:
+    explicit TraceLineTimer(size_t line)
+        : m_line(line), m_start(g_tracing ? traceNow() : 0) {}
+    ~TraceLineTimer()
+    {
+        if (!g_tracing) return;
+        uint64_t end = traceNow();
+        if (end - m_start < TRACE_SLOW_LINE_NS) return;
+        traceRecord("slow line", m_start, end, traceBuffer().currentFile, (uint32_t)m_line);
+    }
+    TraceLineTimer(const TraceLineTimer&) = delete;
+    TraceLineTimer& operator=(const TraceLineTimer&) = delete;
+
+private:
+    size_t m_line;
+    uint64_t m_start;
+};
+
 /*******************************************************
  * printProgress():
  *   Thread-safe progress bar. Avoids too-frequent updates.
+ *   Workers never wait here: only the caller that claims the
+ *   next ~100ms slot draws, everyone else returns at once.
+ *   The final update (current == total) always goes through.
  *******************************************************/
 void printProgress(size_t current, size_t total, int width = 50) {
-    static auto lastUpdate = high_resolution_clock::now();
-    auto now = high_resolution_clock::now();
-    // update only every ~100ms
-    if (duration_cast<milliseconds>(now - lastUpdate).count() < 100) {
-        return;
+    static std::atomic<long long> lastUpdateMs{ 0 };
+    if (total == 0) return;
+
+    long long now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    long long last = lastUpdateMs.load(std::memory_order_relaxed);
+    if (current < total) {
+        // update only every ~100ms
+        if (now - last < 100 ||
+            !lastUpdateMs.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+            return;
+        }
+    }
+    else {
+        lastUpdateMs.store(now, std::memory_order_relaxed);
     }
-    lastUpdate = now;
 
-    if (total == 0) return;
     float ratio = float(current) / float(total);
     int c = int(ratio * width);
 
-    std::lock_guard<std::mutex> lock(consoleMutex);
+    std::unique_lock<std::mutex> lock(consoleMutex, std::defer_lock);
+    if (current < total) {
+        if (!lock.try_lock()) return;
+    }
+    else if (!lock.try_lock()) {
+        TraceSpan wait("wait consoleMutex");
+        lock.lock();
+    }
     std::cout << "[";
     for (int i = 0; i < width; ++i) {
         if (i < c) std::cout << "#";
@@ -86,6 +302,194 @@ void printProgress(size_t current, size_t total, int width = 50) {
     std::cout << "] " << int(ratio * 100.0f) << " %\r" << std::flush;
 }
 
+/*******************************************************
+ * Archive members
+ *
+ *  Source files inside a .tar/.tar.gz/.zip root (see "Source
+ *  archives") are kept in memory under the virtual path
+ *  "<archive path>/<member path>". Every reader asks here
+ *  first; while no archive is mounted that costs one atomic
+ *  load and no lock.
+ *******************************************************/
+struct ArchiveMember {
+    std::string data;
+    int64_t mtime = 0;   // the archive's: rewriting it invalidates every cache entry
+};
+static std::atomic<bool> g_archivesMounted{ false };
+static std::shared_mutex g_archiveMutex;
+static std::unordered_map<std::string, std::shared_ptr<const ArchiveMember>> g_archiveMembers;
+
+/** archiveMember(path): the mounted member at 'path', or null */
+static std::shared_ptr<const ArchiveMember> archiveMember(const std::string& path)
+{
+    if (!g_archivesMounted.load(std::memory_order_acquire)) return nullptr;
+    std::shared_lock<std::shared_mutex> lock(g_archiveMutex);
+    auto it = g_archiveMembers.find(path);
+    return it == g_archiveMembers.end() ? nullptr : it->second;
+}
+
+/*******************************************************
+ * Source text encoding
+ *
+ *  Sources are parsed as bytes. A UTF-8 BOM is dropped and
+ *  UTF-16 files (with BOM, or recognised by their zero bytes)
+ *  are transcoded to UTF-8 before lines are split; the test
+ *  looks at the first bytes only, so ordinary ASCII/UTF-8
+ *  files cost two comparisons. CP949/EUC-KR needs nothing: it
+ *  is ASCII-compatible and cannot fake a '#', quote or line
+ *  break, so its bytes pass through unchanged. A '\r' ending a
+ *  line is dropped when lines are split for parsing.
+ *******************************************************/
+enum class TextEncoding { Plain, Utf8Bom, Utf16LE, Utf16BE };
+
+/** detectEncoding(data, size): from the first bytes of a file */
+static inline TextEncoding detectEncoding(const char* data, size_t size)
+{
+    if (size < 2) return TextEncoding::Plain;
+    unsigned char b0 = (unsigned char)data[0], b1 = (unsigned char)data[1];
+    if (b0 != 0 && b1 != 0 && b0 < 0xEF) return TextEncoding::Plain;   // the common case
+    if (size >= 3 && b0 == 0xEF && b1 == 0xBB && (unsigned char)data[2] == 0xBF) return TextEncoding::Utf8Bom;
+    if (b0 == 0xFF && b1 == 0xFE) return TextEncoding::Utf16LE;
+    if (b0 == 0xFE && b1 == 0xFF) return TextEncoding::Utf16BE;
+    if (b0 != 0 && b1 != 0) return TextEncoding::Plain;
+
+    // no BOM: UTF-16 if mostly one byte of each unit is zero (ASCII
+    // characters), rarely the other (U+xx00 code points)
+    size_t units = std::min<size_t>(size, 64) / 2;
+    size_t zeroEven = 0, zeroOdd = 0;
+    for (size_t i = 0; i < units; ++i) {
+        zeroEven += data[2 * i] == 0;
+        zeroOdd += data[2 * i + 1] == 0;
+    }
+    if (zeroOdd * 2 >= units && zeroEven * 4 < zeroOdd) return TextEncoding::Utf16LE;
+    if (zeroEven * 2 >= units && zeroOdd * 4 < zeroEven) return TextEncoding::Utf16BE;
+    return TextEncoding::Plain;
+}
+
+/** transcodeUtf16(data, size, bigEndian, out):
+ *   UTF-16 to UTF-8. Runs of eight ASCII code units are packed
+ *   with SSE2 where available; unpaired surrogates and an odd
+ *   trailing byte become U+FFFD.
+ */
+static void transcodeUtf16(const char* data, size_t size, bool bigEndian, std::string& out)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    size_t units = size / 2;
+    out.clear();
+    out.reserve(units + units / 4 + 3);
+    auto unitAt = [&](size_t i) -> uint32_t {
+        return bigEndian ? (p[2 * i] << 8 | p[2 * i + 1]) : (p[2 * i + 1] << 8 | p[2 * i]);
+    };
+    auto put = [&](uint32_t cp) {
+        if (cp < 0x80) {
+            out += (char)cp;
+        }
+        else if (cp < 0x800) {
+            out += (char)(0xC0 | cp >> 6);
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000) {
+            out += (char)(0xE0 | cp >> 12);
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else {
+            out += (char)(0xF0 | cp >> 18);
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    };
+
+    size_t i = 0;
+    while (i < units) {
+#ifdef HAVE_SSE2
+        if (i + 8 <= units) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + 2 * i));
+            if (bigEndian) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            __m128i high = _mm_and_si128(v, _mm_set1_epi16((short)0xFF80));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xFFFF) {
+                char packed[16];
+                _mm_storeu_si128((__m128i*)packed, _mm_packus_epi16(v, v));
+                out.append(packed, 8);
+                i += 8;
+                continue;
+            }
+        }
+#endif
+        uint32_t u = unitAt(i++);
+        if (u >= 0xD800 && u < 0xDC00 && i < units && unitAt(i) >= 0xDC00 && unitAt(i) < 0xE000) {
+            put(0x10000 + ((u - 0xD800) << 10) + (unitAt(i++) - 0xDC00));
+        }
+        else {
+            put(u >= 0xD800 && u < 0xE000 ? 0xFFFD : u);
+        }
+    }
+    if (size & 1) put(0xFFFD);
+}
+
+/** decodeSourceText(data): normalizes 'data' to bytes the parsers read; false if it was already */
+static bool decodeSourceText(std::string& data)
+{
+    TextEncoding encoding = detectEncoding(data.data(), data.size());
+    if (encoding == TextEncoding::Plain) return false;
+    if (encoding == TextEncoding::Utf8Bom) {
+        data.erase(0, 3);
+        return true;
+    }
+    size_t bom = (unsigned char)data[0] >= 0xFE ? 2 : 0;
+    std::string utf8;
+    transcodeUtf16(data.data() + bom, data.size() - bom, encoding == TextEncoding::Utf16BE, utf8);
+    data.swap(utf8);
+    return true;
+}
+
+/** splitLinesInto(data, size, lines, keepCarriageReturns):
+ *   Same line semantics as readBufferedFile(): '\n' separated,
+ *   a last line without terminator is kept if not empty, and a
+ *   '\r' ending a line is dropped unless asked to keep it.
+ */
+static void splitLinesInto(const char* data, size_t size, std::vector<std::string>& lines,
+    bool keepCarriageReturns = false)
+{
+    size_t start = 0;
+    auto push = [&](size_t end) {
+        if (!keepCarriageReturns && end > start && data[end - 1] == '\r') --end;
+        lines.emplace_back(data + start, end - start);
+    };
+    for (const char* nl; start < size && (nl = (const char*)std::memchr(data + start, '\n', size - start)); ) {
+        push((size_t)(nl - data));
+        start = (size_t)(nl - data) + 1;
+    }
+    if (start < size) {
+        push(size);
+    }
+}
+
+/** openSourceStream(path): text stream over a file or an archive member, decoded as above */
+static std::unique_ptr<std::istream> openSourceStream(const std::string& path)
+{
+    if (auto member = archiveMember(path)) {
+        std::string data = member->data;
+        decodeSourceText(data);
+        return std::unique_ptr<std::istream>(new std::istringstream(data));
+    }
+    std::unique_ptr<std::ifstream> file(new std::ifstream(path, std::ios::in | std::ios::binary));
+    if (!file->is_open()) return file;
+    char head[64];
+    file->read(head, sizeof(head));
+    size_t got = (size_t)file->gcount();
+    if (detectEncoding(head, got) != TextEncoding::Plain) {
+        std::string data(head, got);
+        data.append(std::istreambuf_iterator<char>(*file), std::istreambuf_iterator<char>());
+        decodeSourceText(data);
+        return std::unique_ptr<std::istream>(new std::istringstream(data));
+    }
+    file->clear();
+    file->seekg(0);
+    return file;
+}
+
 /*******************************************************
  * readBufferedFile(filename, lines):
  *
@@ -93,6 +497,18 @@ void printProgress(size_t current, size_t total, int width = 50) {
  * file I/O overhead. Stores all lines in a `std::vector<std::string>`.
  *******************************************************/
 void readBufferedFile(const std::string& filename, std::vector<std::string>& lines) {
+    if (auto member = archiveMember(filename)) {
+        const std::string& data = member->data;
+        if (detectEncoding(data.data(), data.size()) == TextEncoding::Plain) {
+            splitLinesInto(data.data(), data.size(), lines);
+        }
+        else {
+            std::string decoded = data;
+            decodeSourceText(decoded);
+            splitLinesInto(decoded.data(), decoded.size(), lines);
+        }
+        return;
+    }
     std::ifstream file(filename, std::ios::in | std::ios::binary);
     if (!file.is_open()) {
         std::cerr << "Error: Unable to open file: " << filename << "\n";
@@ -103,8 +519,17 @@ void readBufferedFile(const std::string& filename, std::vector<std::string>& lin
     std::string line;
     std::string leftover;
 
+    bool first = true;
     while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
         size_t bytesRead = file.gcount();
+        if (first && detectEncoding(buffer.data(), bytesRead) != TextEncoding::Plain) {
+            std::string data(buffer.data(), bytesRead);
+            data.append(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            decodeSourceText(data);
+            splitLinesInto(data.data(), data.size(), lines);
+            return;
+        }
+        first = false;
         std::string chunk(buffer.data(), bytesRead);
 
         // Append leftover from previous chunk if needed
@@ -115,6 +540,7 @@ void readBufferedFile(const std::string& filename, std::vector<std::string>& lin
         while ((pos = chunk.find('\n')) != std::string::npos) {
             line = chunk.substr(0, pos);
             chunk.erase(0, pos + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
             lines.push_back(line); // Store the extracted line
         }
 
@@ -123,920 +549,11252 @@ void readBufferedFile(const std::string& filename, std::vector<std::string>& lin
     }
 
     if (!leftover.empty()) {
+        if (leftover.back() == '\r') leftover.pop_back();
         lines.push_back(leftover); // Add the last remaining line if not terminated with `\n`
     }
 }
 
 /*******************************************************
- * Data Structures
+ * File table
+ *
+ *  Every scanned file is interned once as (directory id, file
+ *  name); directories are interned the same way against their
+ *  parent. A path prefix shared by a million files is thus
+ *  stored once, and a file costs one 16-byte entry plus its
+ *  name. All names live in an arena of fixed-size chunks that
+ *  never move.
+ *
+ *  Scanners, feeds and results pass FileIds around. The full
+ *  path is only assembled to open a file or to write output.
+ *  Components keep their trailing separator, so path() returns
+ *  exactly the string that was interned ('/' and '\' alike).
  *******************************************************/
-struct CodeBlock {
-    std::string filename;
-    std::string content;
-};
+typedef uint32_t FileId;
+typedef std::vector<FileId> FileList;
 
-/*******************************************************
- * Global line-count cache to avoid re-reading files
- *******************************************************/
-static std::mutex lineCountCacheMutex;
-static std::unordered_map<std::string, size_t> lineCountCache;
+class FileTable {
+public:
+    FileTable()
+    {
+        m_dirs.push_back({ "", 0, NO_PARENT }); // 0: the empty prefix of relative paths
+        m_dirSlots.assign(64, EMPTY_SLOT);
+        m_fileSlots.assign(64, EMPTY_SLOT);
+    }
 
-/*******************************************************
- * getFileLineCount(filename):
- *   Returns line count for a single file. Uses a global
- *   cache to avoid re-counting the same file multiple times.
- *******************************************************/
-size_t getFileLineCount(const std::string& filename)
-{
+    /** intern(path): id of 'path', added on first use */
+    FileId intern(const std::string& path)
     {
-        std::lock_guard<std::mutex> lk(lineCountCacheMutex);
-        auto it = lineCountCache.find(filename);
-        if (it != lineCountCache.end()) {
-            return it->second;
+        size_t cut = path.find_last_of("/\\");
+        size_t nameFrom = (cut == std::string::npos) ? 0 : cut + 1;
+        std::string_view dirPart(path.data(), nameFrom);
+        std::string_view name(path.data() + nameFrom, path.size() - nameFrom);
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        if (dirPart != m_lastDirPath) {
+            uint32_t dir = 0;
+            size_t from = 0;
+            while (from < dirPart.size()) {
+                size_t sep = dirPart.find_first_of("/\\", from);
+                dir = internEntry(m_dirs, m_dirSlots, dir, dirPart.substr(from, sep + 1 - from));
+                from = sep + 1;
+            }
+            m_lastDirPath.assign(dirPart.data(), dirPart.size());
+            m_lastDir = dir;
         }
+        return internEntry(m_files, m_fileSlots, m_lastDir, name);
     }
 
-    std::ifstream ifs(filename);
-    if (!ifs.is_open()) {
-        std::lock_guard<std::mutex> lk(lineCountCacheMutex);
-        lineCountCache[filename] = 0;
-        return 0;
+    FileList internAll(const std::vector<std::string>& paths)
+    {
+        FileList ids;
+        ids.reserve(paths.size());
+        for (const auto& p : paths) ids.push_back(intern(p));
+        return ids;
     }
 
-    size_t count = 0;
-    std::string tmp;
-    while (std::getline(ifs, tmp)) {
-        count++;
+    /** path(id): the full path as interned */
+    std::string path(FileId id) const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        const Entry& file = m_files[id];
+        thread_local std::vector<const Entry*> chain; // reused, so only deep trees allocate
+        chain.clear();
+        size_t length = file.length;
+        for (uint32_t d = file.parent; d != NO_PARENT && d != 0; d = m_dirs[d].parent) {
+            chain.push_back(&m_dirs[d]);
+            length += m_dirs[d].length;
+        }
+        std::string out;
+        out.reserve(length);
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+            out.append((*it)->name, (*it)->length);
+        out.append(file.name, file.length);
+        return out;
     }
 
+    /** name(id): the file name without its folders */
+    std::string name(FileId id) const
     {
-        std::lock_guard<std::mutex> lk(lineCountCacheMutex);
-        lineCountCache[filename] = count;
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return std::string(m_files[id].name, m_files[id].length);
     }
-    return count;
-}
+
+    /** directory(id): id of the folder holding the file */
+    uint32_t directory(FileId id) const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_files[id].parent;
+    }
+
+    std::vector<std::string> paths(const FileList& ids) const
+    {
+        std::vector<std::string> out;
+        out.reserve(ids.size());
+        for (FileId id : ids) out.push_back(path(id));
+        return out;
+    }
+
+private:
+    static constexpr uint32_t NO_PARENT = 0xFFFFFFFFu;
+    static constexpr uint32_t EMPTY_SLOT = 0xFFFFFFFFu;
+    static constexpr size_t ARENA_CHUNK = 256 * 1024;
+
+    struct Entry {
+        const char* name;
+        uint32_t length;
+        uint32_t parent;
+    };
+
+    static size_t entryHash(uint32_t parent, std::string_view name)
+    {
+        return std::hash<std::string_view>()(name) ^ ((size_t)parent * 0x9E3779B97F4A7C15ull);
+    }
+
+    /** internEntry(entries, slots, parent, name):
+     *   Open-addressing lookup of (parent, name); 'slots' holds
+     *   entry ids and is kept at most half full.
+     */
+    uint32_t internEntry(std::vector<Entry>& entries, std::vector<uint32_t>& slots,
+        uint32_t parent, std::string_view name)
+    {
+        size_t mask = slots.size() - 1;
+        size_t pos = entryHash(parent, name) & mask;
+        for (; slots[pos] != EMPTY_SLOT; pos = (pos + 1) & mask) {
+            const Entry& e = entries[slots[pos]];
+            if (e.parent == parent && std::string_view(e.name, e.length) == name) return slots[pos];
+        }
+
+        uint32_t id = (uint32_t)entries.size();
+        entries.push_back({ storeName(name), (uint32_t)name.size(), parent });
+        slots[pos] = id;
+        if (entries.size() * 2 > slots.size()) {
+            std::vector<uint32_t> grown(slots.size() * 2, EMPTY_SLOT);
+            size_t growMask = grown.size() - 1;
+            for (uint32_t s : slots) {
+                if (s == EMPTY_SLOT) continue;
+                const Entry& e = entries[s];
+                size_t p = entryHash(e.parent, std::string_view(e.name, e.length)) & growMask;
+                while (grown[p] != EMPTY_SLOT) p = (p + 1) & growMask;
+                grown[p] = s;
+            }
+            slots.swap(grown);
+        }
+        return id;
+    }
+
+    const char* storeName(std::string_view name)
+    {
+        if (name.size() > ARENA_CHUNK / 4) {
+            m_arena.emplace_back(new char[name.size()]);
+            std::memcpy(m_arena.back().get(), name.data(), name.size());
+            return m_arena.back().get();
+        }
+        if (m_chunk == nullptr || m_arenaUsed + name.size() > ARENA_CHUNK) {
+            m_arena.emplace_back(new char[ARENA_CHUNK]);
+            m_arenaUsed = 0;
+            m_chunk = m_arena.back().get();
+        }
+        char* out = m_chunk + m_arenaUsed;
+        std::memcpy(out, name.data(), name.size());
+        m_arenaUsed += name.size();
+        return out;
+    }
+
+    mutable std::shared_mutex m_mutex;
+    std::vector<Entry> m_dirs;
+    std::vector<Entry> m_files;
+    std::vector<uint32_t> m_dirSlots;
+    std::vector<uint32_t> m_fileSlots;
+    std::vector<std::unique_ptr<char[]>> m_arena;
+    char* m_chunk = nullptr;
+    size_t m_arenaUsed = 0;
+    std::string m_lastDirPath;
+    uint32_t m_lastDir = 0;
+};
+
+static FileTable g_files;
 
 /*******************************************************
- * getTotalLineCount(files):
- *   Returns sum of line counts for all given files
+ * Data Structures
  *******************************************************/
-size_t getTotalLineCount(const std::vector<std::string>& files)
-{
-    size_t total = 0;
-    for (auto& f : files) {
-        total += getFileLineCount(f);
-    }
-    return total;
-}
+struct CodeBlock {
+    FileId file = 0;
+    size_t line = 0;        // 1-based first line of 'content'
+    size_t context = 0;     // leading context lines in 'content'
+    std::string content;
+};
 
 /*******************************************************
- * REGEX-based detection for #if <DEFINE> and function heads (C++)
+ * REGEX-based detection for #if <DEFINE> (C++)
  *******************************************************/
 static const std::regex endifRegex(R"(^\s*#\s*endif\b)",
     std::regex_constants::ECMAScript | std::regex_constants::optimize);
 static const std::regex anyIfStartRegex(R"(^\s*#\s*(if|ifdef|ifndef)\b)",
     std::regex_constants::ECMAScript | std::regex_constants::optimize);
 
-/** createConditionalRegex(define):
- *   Build a combined regex that matches #ifdef <define>,
- *   #if <define>, etc.
- */
-std::regex createConditionalRegex(const std::string& define) {
-    std::ostringstream pattern;
-    pattern
-        << R"((^\s*#(ifdef|ifndef)\s+)" << define << R"(\b))"
-        << R"(|)"
-        << R"((^\s*#(if|elif)\s+defined\s*\(\s*)" << define << R"(\s*\)))"
-        << R"(|)"
-        << R"((^\s*#(if|elif)\s+defined\s+)" << define << R"())"
-        << R"(|)"
-        << R"((^\s*#(if|elif)\s+\(?\s*)" << define << R"(\s*\)?))";
-    return std::regex(pattern.str(),
-        std::regex_constants::ECMAScript | std::regex_constants::optimize);
-}
-
-/** Regex that detects a typical C++ function header. (heuristic) */
-static const std::regex functionHeadRegex(
-    R"(^\s*(?:inline\s+|static\s+|virtual\s+|constexpr\s+|friend\s+|typename\s+|[\w:\*&<>]+\s+)*[\w:\*&<>]+\s+\w[\w:\*&<>]*\s*\([^)]*\)\s*(\{|;|$))",
-    std::regex_constants::ECMAScript | std::regex_constants::optimize
-);
-
-/*******************************************************
- * writeOutputPerFile()
- * Writes the collected CodeBlocks per source file
- * into individual files. E.g. in:
- * Output/CLIENT_<DEFINE>_DEFINE_by_file/foo.cpp.txt
- *******************************************************/
-void writeOutputPerFile(const std::string& prefix,
-    const std::string& defineName,
-    const std::vector<CodeBlock>& blocks)
-{
-    fs::create_directory("Output");
-
-    std::string outDir = "Output/" + prefix + "_" + defineName + "_files";
-    fs::create_directory(outDir);
+static inline bool isWordChar(char c) {
+    return std::isalnum((unsigned char)c) || c == '_';
+}
 
-    std::map<std::string, std::vector<std::string>> fileToContents;
-    for (const auto& block : blocks) {
-        fileToContents[block.filename].push_back(block.content);
-    }
+static inline bool isSpaceChar(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+}
 
-    for (const auto& kv : fileToContents) {
-        const std::string& srcFile = kv.first;
-        const auto& textBlocks = kv.second;
+/** ConditionalRef:
+ *   One identifier referenced by a #if/#ifdef/#ifndef/#elif line.
+ *   'prefixMatch' marks the forms that also accept longer
+ *   identifiers (e.g. "#if FOO" matches the define "FO").
+ */
+struct ConditionalRef {
+    size_t line = 0;
+    std::string ident;
+    bool prefixMatch = false;
+};
 
-        std::string baseName = fs::path(srcFile).filename().string();
+/** parseConditionalRefs(line, lineIndex, out):
+ *   Hand-written equivalent of the former per-define regex:
+ *     ^\s*#(ifdef|ifndef)\s+DEF\b
+ *     ^\s*#(if|elif)\s+defined\s*\(\s*DEF\s*\)
+ *     ^\s*#(if|elif)\s+defined\s+DEF
+ *     ^\s*#(if|elif)\s+\(?\s*DEF
+ *   Instead of testing one define, it records the identifiers
+ *   the line could match, so any number of defines can be
+ *   checked against a single classification.
+ */
+void parseConditionalRefs(const std::string& line, size_t lineIndex,
+    std::vector<ConditionalRef>& out)
+{
+    size_t p = 0;
+    while (p < line.size() && isSpaceChar(line[p])) p++;
+    if (p >= line.size() || line[p] != '#') return;
+    p++;
+
+    auto readIdent = [&](size_t from) {
+        size_t e = from;
+        while (e < line.size() && isWordChar(line[e])) e++;
+        return line.substr(from, e - from);
+    };
+    auto skipSpaces = [&](size_t from) {
+        while (from < line.size() && isSpaceChar(line[from])) from++;
+        return from;
+    };
 
-        std::string outFileName = outDir + "/" + baseName + ".txt";
-        std::ofstream ofs(outFileName, std::ios::app);
-        if (!ofs.is_open()) {
-            std::cerr << "Error when opening " << outFileName << "\n";
-            continue;
+    size_t kw = 0;
+    if (line.compare(p, 5, "ifdef") == 0) kw = 5;
+    else if (line.compare(p, 6, "ifndef") == 0) kw = 6;
+    if (kw != 0) {
+        size_t q = skipSpaces(p + kw);
+        if (q == p + kw) return;
+        std::string ident = readIdent(q);
+        if (!ident.empty()) {
+            out.push_back({ lineIndex, ident, false });
         }
+        return;
+    }
 
-        for (auto& content : textBlocks) {
-            ofs << content << "\n";
+    if (line.compare(p, 2, "if") == 0) kw = 2;
+    else if (line.compare(p, 4, "elif") == 0) kw = 4;
+    else return;
+
+    size_t q = skipSpaces(p + kw);
+    if (q == p + kw) return;
+
+    // defined(DEF) / defined DEF
+    if (line.compare(q, 7, "defined") == 0) {
+        size_t r = q + 7;
+        size_t r2 = skipSpaces(r);
+        if (r2 < line.size() && line[r2] == '(') {
+            size_t s = skipSpaces(r2 + 1);
+            std::string ident = readIdent(s);
+            size_t t = skipSpaces(s + ident.size());
+            if (!ident.empty() && t < line.size() && line[t] == ')') {
+                out.push_back({ lineIndex, ident, false });
+            }
+        }
+        else if (r2 > r) {
+            std::string ident = readIdent(r2);
+            if (!ident.empty()) {
+                out.push_back({ lineIndex, ident, true });
+            }
         }
-        ofs << "\n--- SUMMARY: " << textBlocks.size()
-            << " Block(s) in " << baseName << " ---\n\n";
     }
+
+    // (DEF / DEF
+    size_t r = q;
+    if (r < line.size() && line[r] == '(') r++;
+    r = skipSpaces(r);
+    std::string ident = readIdent(r);
+    if (!ident.empty()) {
+        out.push_back({ lineIndex, ident, true });
+    }
+}
+
+/** conditionalMatches(ref, define):
+ *   True if 'define' is referenced by the conditional.
+ */
+static inline bool conditionalMatches(const ConditionalRef& ref, const std::string& define) {
+    if (define.empty()) return false;
+    if (ref.prefixMatch) {
+        return ref.ident.size() >= define.size()
+            && ref.ident.compare(0, define.size(), define) == 0;
+    }
+    return ref.ident == define;
 }
 
 /*******************************************************
- * parseFileSinglePass():
- *   Parse a C++ file for:
- *     1) #if <DEFINE> blocks
- *     2) Functions containing the define
+ * Linear-time pattern engine
+ *
+ *  Custom search patterns are parsed into a small syntax
+ *  tree, compiled to a Thompson NFA and run as a lazily built
+ *  DFA. Nothing backtracks: once a DFA state exists, each
+ *  input byte costs one table lookup, and building a missing
+ *  state costs one pass over the NFA. A line of n bytes is
+ *  therefore matched in O(n * NFA size) at worst, whatever
+ *  the pattern looks like. The DFA cache is capped and simply
+ *  flushed when it fills up.
+ *
+ *  Syntax: literals, '.', [...] and [^...] with ranges, \w \W
+ *  \d \D \s \S, \b \B, ^ $, ( ) (?: ), |, * + ? {m} {m,}
+ *  {m,n} and the escapes \n \t \r \f \v \0 \xHH. Matching is a
+ *  search; anchor with ^...$ to match a whole string.
  *******************************************************/
-std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
-parseFileSinglePass(const std::string& filename,
-    const std::regex& startDefineRegex,
-    std::atomic<size_t>& processed,
-    size_t totalLines,
-    size_t& outLineCount)
-{
-    std::vector<std::string> lines;
-    readBufferedFile(filename, lines);
+static const size_t PATTERN_MAX_REPEAT = 1000;
+static const size_t PATTERN_MAX_NFA_STATES = 50000;
+static const size_t PATTERN_MAX_DFA_STATES = 2048;
+static const size_t PATTERN_UNBOUNDED = (size_t)-1;
+
+typedef std::bitset<256> ByteSet;
+
+enum PatternAssertion : uint8_t {
+    ASSERT_TEXT_START,
+    ASSERT_TEXT_END,
+    ASSERT_WORD_BOUNDARY,
+    ASSERT_NOT_WORD_BOUNDARY
+};
 
-    std::vector<CodeBlock> defineBlocks;
-    std::vector<CodeBlock> functionBlocks;
+struct PatternNode {
+    enum Kind : uint8_t { Bytes, Empty, Assertion, Concat, Alternate, Repeat } kind = Empty;
+    ByteSet bytes;
+    PatternAssertion assertion = ASSERT_TEXT_START;
+    size_t minCount = 0;
+    size_t maxCount = 0;            // PATTERN_UNBOUNDED for * and +
+    std::vector<size_t> children;   // indices into the node pool
+};
 
-    bool insideDefineBlock = false;
-    int  defineNesting = 0;
-    std::ostringstream currentDefineBlock;
+struct NfaState {
+    enum Kind : uint8_t { Bytes, Epsilon, Split, Assertion, Match } kind = Epsilon;
+    int out = -1;
+    int out1 = -1;                  // second branch of a Split
+    int byteSet = -1;               // index into CompiledPattern::byteSets
+    PatternAssertion assertion = ASSERT_TEXT_START;
+};
 
-    bool inFunction = false;
-    int  braceCount = 0;
-    bool functionRelevant = false;
-    std::ostringstream currentFunc;
+/** CompiledPattern:
+ *   Immutable NFA of one pattern, shared by all worker threads.
+ */
+struct CompiledPattern {
+    std::string source;
+    std::vector<NfaState> states;
+    std::vector<ByteSet> byteSets;
+    int start = -1;
+    bool usesWordBoundary = false;
+};
 
-    bool potentialFunctionHead = false;
-    std::ostringstream potentialHeadBuffer;
+static ByteSet wordBytes()
+{
+    ByteSet s;
+    for (int b = 0; b < 256; ++b) {
+        if (isWordChar((char)b) && b < 128) s.set(b);
+    }
+    return s;
+}
 
-    for (size_t i = 0; i < lines.size(); ++i)
-    {
-        const auto& line = lines[i];
-        outLineCount++;
+static ByteSet spaceBytes()
+{
+    ByteSet s;
+    for (char c : std::string(" \t\r\n\f\v")) s.set((unsigned char)c);
+    return s;
+}
 
-        {
-            thread_local size_t tls_counter = 0;
-            tls_counter++;
-            if (tls_counter % 500 == 0) {
-                processed.fetch_add(tls_counter, std::memory_order_relaxed);
-                tls_counter = 0;
-                printProgress(processed.load(), totalLines);
-            }
+class PatternParser {
+public:
+    explicit PatternParser(const std::string& text) : m_text(text) {}
+
+    /** Parses the pattern into 'nodes'; false (with 'error') on syntax errors. */
+    bool parse(std::vector<PatternNode>& nodes, size_t& root, std::string& error)
+    {
+        m_nodes = &nodes;
+        root = parseAlternation(0);
+        if (m_ok && m_pos < m_text.size()) fail("unmatched ')'");
+        if (!m_ok) {
+            error = m_error + " at offset " + std::to_string(m_errorPos);
         }
+        return m_ok;
+    }
 
-        if (!insideDefineBlock)
-        {
-            bool isIfLine = (line.find("#if ") != std::string::npos ||
-                line.find("#ifdef ") != std::string::npos ||
-                line.find("#ifndef ") != std::string::npos ||
-                line.find("#elif") != std::string::npos);
-            if (isIfLine && std::regex_search(line, startDefineRegex))
-            {
-                int snippetStart = std::max<int>((int)i - 2, 0);
+private:
+    size_t add(PatternNode node)
+    {
+        m_nodes->push_back(std::move(node));
+        return m_nodes->size() - 1;
+    }
 
-                currentDefineBlock.str("");
-                currentDefineBlock.clear();
+    void fail(const std::string& message)
+    {
+        if (!m_ok) return;
+        m_ok = false;
+        m_error = message;
+        m_errorPos = m_pos;
+    }
 
-                for (int s = snippetStart; s <= (int)i; ++s)
-                {
-                    currentDefineBlock << lines[s] << "\n";
-                }
+    bool more() const { return m_ok && m_pos < m_text.size(); }
 
-                insideDefineBlock = true;
-                defineNesting = 1;
-            }
+    size_t parseAlternation(int depth)
+    {
+        if (depth > 100) {
+            fail("groups nested too deeply");
+            return add(PatternNode());
         }
-        else
-        {
-            currentDefineBlock << line << "\n";
-
-            static const std::regex anyIfStartRegex(R"(^\s*#\s*(if|ifdef|ifndef)\b)",
-                std::regex_constants::ECMAScript | std::regex_constants::optimize);
-            if (std::regex_search(line, anyIfStartRegex)) {
-                defineNesting++;
-            }
-            else if (line.find("#endif") != std::string::npos) {
-                defineNesting--;
-                if (defineNesting <= 0) {
-                    CodeBlock cb;
-                    cb.filename = filename;
-                    cb.content = "##########\n" + filename + "\n##########\n"
-                        + currentDefineBlock.str();
-                    defineBlocks.push_back(cb);
+        PatternNode alt;
+        alt.kind = PatternNode::Alternate;
+        alt.children.push_back(parseConcat(depth));
+        while (more() && m_text[m_pos] == '|') {
+            m_pos++;
+            alt.children.push_back(parseConcat(depth));
+        }
+        if (alt.children.size() == 1) return alt.children[0];
+        return add(alt);
+    }
 
-                    insideDefineBlock = false;
-                    defineNesting = 0;
-                    currentDefineBlock.str("");
-                    currentDefineBlock.clear();
-                }
-            }
+    size_t parseConcat(int depth)
+    {
+        PatternNode cat;
+        cat.kind = PatternNode::Concat;
+        while (more() && m_text[m_pos] != '|' && m_text[m_pos] != ')') {
+            cat.children.push_back(parseRepeat(depth));
         }
+        if (cat.children.empty()) return add(PatternNode());
+        if (cat.children.size() == 1) return cat.children[0];
+        return add(cat);
+    }
 
-        bool lineHasBraceOrParen = (line.find('{') != std::string::npos ||
-            line.find('}') != std::string::npos ||
-            line.find('(') != std::string::npos);
-        bool lineMatchesDefine = std::regex_search(line, startDefineRegex);
+    size_t parseRepeat(int depth)
+    {
+        size_t atom = parseAtom(depth);
+        while (more()) {
+            char c = m_text[m_pos];
+            size_t lo = 0, hi = 0;
+            if (c == '*') { lo = 0; hi = PATTERN_UNBOUNDED; m_pos++; }
+            else if (c == '+') { lo = 1; hi = PATTERN_UNBOUNDED; m_pos++; }
+            else if (c == '?') { lo = 0; hi = 1; m_pos++; }
+            else if (c != '{' || !parseBraces(lo, hi)) break;
+            if (!m_ok) break;
+            // a lazy quantifier accepts the same strings; only the first match matters here
+            if (more() && m_text[m_pos] == '?') m_pos++;
+
+            PatternNode rep;
+            rep.kind = PatternNode::Repeat;
+            rep.minCount = lo;
+            rep.maxCount = hi;
+            rep.children.push_back(atom);
+            atom = add(rep);
+        }
+        return atom;
+    }
 
-        if (!inFunction)
-        {
-            if (potentialFunctionHead)
-            {
-                potentialHeadBuffer << "\n" << line;
-                bool hasOpenBrace = (line.find('{') != std::string::npos);
-                bool hasSemicolon = (line.find(';') != std::string::npos);
+    /** {m}, {m,} or {m,n}; false leaves '{' to be read as a literal. */
+    bool parseBraces(size_t& lo, size_t& hi)
+    {
+        size_t p = m_pos + 1;
+        auto readNumber = [&](size_t& value) {
+            size_t s = p;
+            value = 0;
+            while (p < m_text.size() && std::isdigit((unsigned char)m_text[p]) && p - s < 6) {
+                value = value * 10 + (size_t)(m_text[p] - '0');
+                p++;
+            }
+            return p > s;
+        };
+        if (!readNumber(lo)) return false;
+        hi = lo;
+        if (p < m_text.size() && m_text[p] == ',') {
+            p++;
+            if (!readNumber(hi)) hi = PATTERN_UNBOUNDED;
+        }
+        if (p >= m_text.size() || m_text[p] != '}') return false;
+        m_pos = p + 1;
+        if (hi < lo) fail("invalid repeat range");
+        else if (lo > PATTERN_MAX_REPEAT || (hi != PATTERN_UNBOUNDED && hi > PATTERN_MAX_REPEAT)) {
+            fail("repeat count above " + std::to_string(PATTERN_MAX_REPEAT));
+        }
+        return true;
+    }
 
-                if (hasOpenBrace) {
-                    inFunction = true;
-                    braceCount = 0;
-                    functionRelevant = false;
-                    currentFunc.str("");
-                    currentFunc.clear();
-                    currentFunc << potentialHeadBuffer.str() << "\n";
-
-                    for (char c : line) {
-                        if (c == '{') braceCount++;
-                        if (c == '}') braceCount--;
-                    }
-                    if (lineMatchesDefine) functionRelevant = true;
+    size_t parseAtom(int depth)
+    {
+        PatternNode node;
+        node.kind = PatternNode::Bytes;
+        char c = m_text[m_pos];
+        switch (c) {
+        case '(': {
+            m_pos++;
+            if (m_text.compare(m_pos, 2, "?:") == 0) m_pos += 2;
+            size_t inner = parseAlternation(depth + 1);
+            if (!more() || m_text[m_pos] != ')') {
+                fail("missing ')'");
+                return inner;
+            }
+            m_pos++;
+            return inner;
+        }
+        case '*': case '+': case '?':
+            fail("nothing to repeat");
+            return add(node);
+        case '.':
+            node.bytes.set();
+            node.bytes.reset((unsigned char)'\n');
+            m_pos++;
+            break;
+        case '^':
+        case '$':
+            node.kind = PatternNode::Assertion;
+            node.assertion = (c == '^') ? ASSERT_TEXT_START : ASSERT_TEXT_END;
+            m_pos++;
+            break;
+        case '[':
+            m_pos++;
+            parseClass(node.bytes);
+            break;
+        case '\\':
+            m_pos++;
+            parseEscape(node, false);
+            break;
+        default:
+            node.bytes.set((unsigned char)c);
+            m_pos++;
+            break;
+        }
+        return add(node);
+    }
 
-                    potentialFunctionHead = false;
-                    potentialHeadBuffer.str("");
-                    potentialHeadBuffer.clear();
-                }
-                else if (hasSemicolon) {
-                    potentialFunctionHead = false;
-                    potentialHeadBuffer.str("");
-                    potentialHeadBuffer.clear();
-                }
+    /** Reads the escape after a backslash into node.bytes (or an assertion). */
+    void parseEscape(PatternNode& node, bool inClass)
+    {
+        if (m_pos >= m_text.size()) {
+            fail("trailing '\\'");
+            return;
+        }
+        char c = m_text[m_pos++];
+        switch (c) {
+        case 'w': node.bytes |= wordBytes(); break;
+        case 'W': node.bytes |= ~wordBytes(); break;
+        case 's': node.bytes |= spaceBytes(); break;
+        case 'S': node.bytes |= ~spaceBytes(); break;
+        case 'd': for (char d = '0'; d <= '9'; ++d) node.bytes.set((unsigned char)d); break;
+        case 'D': for (int b = 0; b < 256; ++b) if (b < '0' || b > '9') node.bytes.set(b); break;
+        case 'n': node.bytes.set('\n'); break;
+        case 't': node.bytes.set('\t'); break;
+        case 'r': node.bytes.set('\r'); break;
+        case 'f': node.bytes.set('\f'); break;
+        case 'v': node.bytes.set('\v'); break;
+        case '0': node.bytes.set(0); break;
+        case 'b':
+        case 'B':
+            if (inClass) {
+                if (c == 'b') node.bytes.set('\b');
+                else fail("\\B inside a class");
             }
-            else
-            {
-                static const std::regex functionHeadRegex(
-                    R"(^\s*(?:inline\s+|static\s+|virtual\s+|constexpr\s+|friend\s+|typename\s+|[\w:\*&<>]+\s+)*[\w:\*&<>]+\s+\w[\w:\*&<>]*\s*\([^)]*\)\s*(\{|;|$))",
-                    std::regex_constants::ECMAScript | std::regex_constants::optimize
-                );
-
-                std::smatch match;
-                if (std::regex_search(line, match, functionHeadRegex)) {
-                    std::string trailingSymbol = match[1].str();
-                    if (trailingSymbol == "{") {
-                        inFunction = true;
-                        braceCount = 0;
-                        functionRelevant = false;
-                        currentFunc.str("");
-                        currentFunc.clear();
-                        currentFunc << line << "\n";
-
-                        for (char c : line) {
-                            if (c == '{') braceCount++;
-                            if (c == '}') braceCount--;
-                        }
-                        if (lineMatchesDefine) functionRelevant = true;
-                    }
-                    else if (trailingSymbol == ";") {
-                    }
-                    else {
-                        potentialFunctionHead = true;
-                        potentialHeadBuffer.str("");
-                        potentialHeadBuffer.clear();
-                        potentialHeadBuffer << line;
-                    }
+            else {
+                node.kind = PatternNode::Assertion;
+                node.assertion = (c == 'b') ? ASSERT_WORD_BOUNDARY : ASSERT_NOT_WORD_BOUNDARY;
+            }
+            break;
+        case 'x': {
+            int value = 0;
+            for (int k = 0; k < 2; ++k) {
+                char h = m_pos < m_text.size() ? m_text[m_pos] : '\0';
+                if (!std::isxdigit((unsigned char)h)) {
+                    fail("\\x needs two hex digits");
+                    return;
                 }
+                value = value * 16 + (std::isdigit((unsigned char)h) ? h - '0' : (std::tolower((unsigned char)h) - 'a' + 10));
+                m_pos++;
             }
+            node.bytes.set(value);
+            break;
         }
-        else
-        {
-            currentFunc << line << "\n";
-            if (lineMatchesDefine) {
-                functionRelevant = true;
+        default:
+            if (std::isalnum((unsigned char)c)) {
+                m_pos--;
+                fail(std::string("unknown escape '\\") + c + "'");
+                return;
             }
-            if (lineHasBraceOrParen) {
-                for (char c : line) {
-                    if (c == '{') braceCount++;
-                    if (c == '}') braceCount--;
-                }
+            node.bytes.set((unsigned char)c);
+            break;
+        }
+    }
+
+    /** One class member: a byte value, or -1 after adding a class escape to 'set'. */
+    int parseClassAtom(ByteSet& set)
+    {
+        char c = m_text[m_pos++];
+        if (c != '\\') return (unsigned char)c;
+        PatternNode tmp;
+        tmp.kind = PatternNode::Bytes;
+        parseEscape(tmp, true);
+        if (!m_ok) return -1;
+        if (tmp.bytes.count() == 1) {
+            for (int b = 0; b < 256; ++b) {
+                if (tmp.bytes[b]) return b;
             }
-            if (braceCount <= 0) {
-                if (functionRelevant) {
-                    CodeBlock cb;
-                    cb.filename = filename;
-                    cb.content = "##########\n" + filename + "\n##########\n"
-                        + currentFunc.str();
-                    functionBlocks.push_back(cb);
+        }
+        set |= tmp.bytes;
+        return -1;
+    }
+
+    void parseClass(ByteSet& set)
+    {
+        bool negate = false;
+        if (m_pos < m_text.size() && m_text[m_pos] == '^') {
+            negate = true;
+            m_pos++;
+        }
+        while (m_ok) {
+            if (m_pos >= m_text.size()) {
+                fail("missing ']'");
+                return;
+            }
+            if (m_text[m_pos] == ']') {
+                m_pos++;
+                break;
+            }
+            int lo = parseClassAtom(set);
+            if (lo < 0) continue;
+            if (m_pos + 1 < m_text.size() && m_text[m_pos] == '-' && m_text[m_pos + 1] != ']') {
+                m_pos++;
+                int hi = parseClassAtom(set);
+                if (hi < lo) {
+                    fail("invalid class range");
+                    return;
                 }
-                inFunction = false;
-                braceCount = 0;
-                currentFunc.str("");
-                currentFunc.clear();
-                functionRelevant = false;
+                for (int b = lo; b <= hi; ++b) set.set(b);
+            }
+            else {
+                set.set(lo);
             }
         }
+        if (negate) set.flip();
     }
 
-    return { defineBlocks, functionBlocks };
-}
+    const std::string& m_text;
+    std::vector<PatternNode>* m_nodes = nullptr;
+    size_t m_pos = 0;
+    bool m_ok = true;
+    std::string m_error;
+    size_t m_errorPos = 0;
+};
 
-/*******************************************************
- * Python scanning: if app.xyz + function blocks
- *******************************************************/
-static const std::regex pythonIfAppRegex(
-    R"((?:if|elif)\s*\(?\s*app\.(\w+))",
-    std::regex_constants::ECMAScript | std::regex_constants::optimize);
-static const std::regex defRegex(R"(^\s*def\s+[\w_]+)");
+/** Thompson construction over the syntax tree. */
+class PatternCompiler {
+public:
+    PatternCompiler(const std::vector<PatternNode>& nodes, CompiledPattern& out)
+        : m_nodes(nodes), m_out(out) {}
 
-int getIndent(const std::string& ln) {
-    return std::accumulate(ln.begin(), ln.end(), 0, [](int sum, char c) {
-        return sum + (c == ' ' ? 1 : (c == '\t' ? 4 : 0));
-        });
+    bool compile(size_t root, std::string& error)
+    {
+        Fragment f = build(root);
+        int match = addState(NfaState::Match);
+        if (m_tooLarge) {
+            error = "pattern expands to more than " + std::to_string(PATTERN_MAX_NFA_STATES) + " states";
+            return false;
+        }
+        patch(f.outs, match);
+        m_out.start = f.start;
+        return true;
+    }
+
+private:
+    /** Partial NFA: entry state plus the dangling (state, branch) exits. */
+    struct Fragment {
+        int start = -1;
+        std::vector<std::pair<int, int>> outs;
+    };
+
+    int addState(NfaState::Kind kind)
+    {
+        if (m_out.states.size() >= PATTERN_MAX_NFA_STATES) {
+            m_tooLarge = true;
+            return 0;
+        }
+        NfaState s;
+        s.kind = kind;
+        m_out.states.push_back(s);
+        return (int)m_out.states.size() - 1;
+    }
+
+    void patch(const std::vector<std::pair<int, int>>& outs, int target)
+    {
+        for (const auto& o : outs) {
+            NfaState& s = m_out.states[o.first];
+            (o.second == 0 ? s.out : s.out1) = target;
+        }
+    }
+
+    Fragment single(int state)
+    {
+        Fragment f;
+        f.start = state;
+        f.outs.push_back({ state, 0 });
+        return f;
+    }
+
+    void append(Fragment& f, const Fragment& g)
+    {
+        patch(f.outs, g.start);
+        f.outs = g.outs;
+    }
+
+    Fragment build(size_t index)
+    {
+        if (m_tooLarge) return single(0);
+        const PatternNode& node = m_nodes[index];
+        switch (node.kind) {
+        case PatternNode::Bytes: {
+            int s = addState(NfaState::Bytes);
+            if (m_tooLarge) return single(0);
+            m_out.byteSets.push_back(node.bytes);
+            m_out.states[s].byteSet = (int)m_out.byteSets.size() - 1;
+            return single(s);
+        }
+        case PatternNode::Empty:
+            return single(addState(NfaState::Epsilon));
+        case PatternNode::Assertion: {
+            int s = addState(NfaState::Assertion);
+            if (m_tooLarge) return single(0);
+            m_out.states[s].assertion = node.assertion;
+            if (node.assertion == ASSERT_WORD_BOUNDARY || node.assertion == ASSERT_NOT_WORD_BOUNDARY) {
+                m_out.usesWordBoundary = true;
+            }
+            return single(s);
+        }
+        case PatternNode::Concat: {
+            Fragment f = build(node.children[0]);
+            for (size_t i = 1; i < node.children.size() && !m_tooLarge; ++i) {
+                append(f, build(node.children[i]));
+            }
+            return f;
+        }
+        case PatternNode::Alternate: {
+            Fragment f = build(node.children[0]);
+            for (size_t i = 1; i < node.children.size() && !m_tooLarge; ++i) {
+                Fragment g = build(node.children[i]);
+                int s = addState(NfaState::Split);
+                if (m_tooLarge) break;
+                m_out.states[s].out = f.start;
+                m_out.states[s].out1 = g.start;
+                f.start = s;
+                f.outs.insert(f.outs.end(), g.outs.begin(), g.outs.end());
+            }
+            return f;
+        }
+        case PatternNode::Repeat: {
+            Fragment f = single(addState(NfaState::Epsilon));
+            for (size_t i = 0; i < node.minCount && !m_tooLarge; ++i) {
+                append(f, build(node.children[0]));
+            }
+            if (node.maxCount == PATTERN_UNBOUNDED) {
+                Fragment g = build(node.children[0]);
+                int s = addState(NfaState::Split);
+                if (m_tooLarge) return f;
+                m_out.states[s].out = g.start;
+                patch(g.outs, s);
+                Fragment loop;
+                loop.start = s;
+                loop.outs.push_back({ s, 1 });
+                append(f, loop);
+                return f;
+            }
+            for (size_t i = node.minCount; i < node.maxCount && !m_tooLarge; ++i) {
+                Fragment g = build(node.children[0]);
+                int s = addState(NfaState::Split);
+                if (m_tooLarge) return f;
+                m_out.states[s].out = g.start;
+                Fragment optional;
+                optional.start = s;
+                optional.outs = g.outs;
+                optional.outs.push_back({ s, 1 });
+                append(f, optional);
+            }
+            return f;
+        }
+        }
+        return single(addState(NfaState::Epsilon));
+    }
+
+    const std::vector<PatternNode>& m_nodes;
+    CompiledPattern& m_out;
+    bool m_tooLarge = false;
+};
+
+/** compilePattern(source, out, error):
+ *   Parses and compiles a pattern. On failure 'error'
+ *   describes the problem and its offset.
+ */
+bool compilePattern(const std::string& source, CompiledPattern& out, std::string& error)
+{
+    out = CompiledPattern();
+    out.source = source;
+    std::vector<PatternNode> nodes;
+    size_t root = 0;
+    PatternParser parser(source);
+    if (!parser.parse(nodes, root, error)) return false;
+    PatternCompiler compiler(nodes, out);
+    return compiler.compile(root, error);
 }
 
-/** parsePythonFileSinglePass():
- *   Looks for lines containing "if app.<param>" and collects
- *   the subsequent indented block. Also detects functions
- *   containing such an if-block.
+/** globToPattern(glob):
+ *   Identifier glob to an anchored pattern: '*' matches any run
+ *   of identifier characters, '?' exactly one.
  */
-std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
-parsePythonFileSinglePass(const std::string& filename,
-    const std::string& param,
-    std::atomic<size_t>& processed,
-    size_t totalLines,
-    size_t& outLineCount)
+static std::string globToPattern(const std::string& glob)
 {
-    std::vector<CodeBlock> ifBlocks;
-    std::vector<CodeBlock> funcBlocks;
+    std::string re = "^";
+    for (char c : glob) {
+        if (c == '*') re += "\\w*";
+        else if (c == '?') re += "\\w";
+        else if (isWordChar(c)) re += c;
+        else { re += '\\'; re += c; }
+    }
+    return re + "$";
+}
 
-    std::ifstream ifs(filename);
-    if (!ifs.is_open()) {
-        return { ifBlocks, funcBlocks };
+/** PatternMatcher:
+ *   Lazy DFA over a CompiledPattern. A DFA state is the set of
+ *   pending NFA states (byte tests, unresolved assertions and
+ *   the match state) plus the context the assertions need: at
+ *   text start, and whether the previous byte was a word byte.
+ *   Assertions are resolved when the next byte (or the end) is
+ *   known. Not thread-safe; every worker owns its own matcher.
+ */
+class PatternMatcher {
+public:
+    explicit PatternMatcher(const CompiledPattern* pattern) : m_pattern(pattern)
+    {
+        if (m_pattern) m_mark.assign(m_pattern->states.size(), 0);
     }
 
-    std::ostringstream oss;
-    oss << R"((?:if|elif)\s*\(?\s*app\.)" << param << R"(\b)";
-    std::regex ifParamRegex(oss.str(), std::regex_constants::ECMAScript | std::regex_constants::optimize);
+    /** True if the pattern matches anywhere in 'text'. */
+    bool search(const std::string& text)
+    {
+        if (!m_pattern || m_pattern->start < 0) return false;
+        if (m_startState < 0) m_startState = startState();
+        int s = m_startState;
+        for (char ch : text) {
+            unsigned char c = (unsigned char)ch;
+            int next = m_states[s].next[c];
+            if (next == NEXT_UNKNOWN) next = computeNext(s, c);
+            if (next == NEXT_MATCHED) return true;
+            s = next;
+        }
+        if (m_states[s].acceptsAtEnd < 0) {
+            m_states[s].acceptsAtEnd = resolves(m_states[s], END_OF_TEXT) ? 1 : 0;
+        }
+        return m_states[s].acceptsAtEnd == 1;
+    }
 
-    bool insideFunc = false;
-    int  funcIndent = 0;
-    bool functionRelevant = false;
-    std::ostringstream currentFunc;
+private:
+    static constexpr int NEXT_UNKNOWN = -1;
+    static constexpr int NEXT_MATCHED = -2;
+    static constexpr int END_OF_TEXT = 256;
+
+    struct DfaState {
+        std::vector<int> nfa;     // sorted pending NFA states
+        bool atStart = false;
+        bool prevWord = false;
+        int acceptsAtEnd = -1;
+        std::vector<int> next;    // per byte: state index, NEXT_UNKNOWN or NEXT_MATCHED
+    };
 
-    std::string line;
-    while (true) {
-        std::streampos currentPos = ifs.tellg();
-        if (!std::getline(ifs, line)) {
-            break;
+    bool assertionHolds(PatternAssertion a, const DfaState& d, int c) const
+    {
+        bool nextWord = c != END_OF_TEXT && c < 128 && isWordChar((char)c);
+        switch (a) {
+        case ASSERT_TEXT_START: return d.atStart;
+        case ASSERT_TEXT_END: return c == END_OF_TEXT;
+        case ASSERT_WORD_BOUNDARY: return d.prevWord != nextWord;
+        case ASSERT_NOT_WORD_BOUNDARY: return d.prevWord == nextWord;
         }
-        outLineCount++;
+        return false;
+    }
+
+    /** Follows epsilon edges from 'seeds'; with 'context' set, assertions that hold are followed too. */
+    void closure(const std::vector<int>& seeds, const DfaState* context, int c, std::vector<int>& out)
+    {
+        if (++m_generation == 0) {
+            std::fill(m_mark.begin(), m_mark.end(), 0);
+            m_generation = 1;
+        }
+        m_stack.assign(seeds.rbegin(), seeds.rend());
+        while (!m_stack.empty()) {
+            int x = m_stack.back();
+            m_stack.pop_back();
+            if (x < 0 || m_mark[x] == m_generation) continue;
+            m_mark[x] = m_generation;
+            const NfaState& st = m_pattern->states[x];
+            if (st.kind == NfaState::Epsilon) {
+                m_stack.push_back(st.out);
+            }
+            else if (st.kind == NfaState::Split) {
+                m_stack.push_back(st.out1);
+                m_stack.push_back(st.out);
+            }
+            else if (st.kind == NfaState::Assertion && context) {
+                if (assertionHolds(st.assertion, *context, c)) m_stack.push_back(st.out);
+            }
+            else {
+                out.push_back(x);
+            }
+        }
+    }
 
-        thread_local size_t tls_counter = 0;
-        tls_counter++;
-        if (tls_counter % 500 == 0) {
-            processed.fetch_add(tls_counter, std::memory_order_relaxed);
-            tls_counter = 0;
-            printProgress(processed.load(), totalLines);
+    /** Resolves the assertions of 'd' for the upcoming byte 'c'; true if that reaches a match. */
+    bool resolves(const DfaState& d, int c)
+    {
+        m_resolved.clear();
+        closure(d.nfa, &d, c, m_resolved);
+        for (int x : m_resolved) {
+            if (m_pattern->states[x].kind == NfaState::Match) return true;
         }
+        return false;
+    }
 
-        if (std::regex_search(line, defRegex)) {
-            if (insideFunc && functionRelevant) {
-                CodeBlock cb;
-                cb.filename = filename;
-                cb.content = "##########\n" + filename + "\n##########\n" +
-                    currentFunc.str();
-                funcBlocks.push_back(cb);
+    int internState(std::vector<int>&& nfa, bool atStart, bool prevWord)
+    {
+        std::sort(nfa.begin(), nfa.end());
+        if (!m_pattern->usesWordBoundary) prevWord = false;
+        std::vector<int> key = nfa;
+        key.push_back(atStart ? 1 : 0);
+        key.push_back(prevWord ? 1 : 0);
+        auto it = m_index.find(key);
+        if (it != m_index.end()) return it->second;
+
+        DfaState d;
+        d.nfa = std::move(nfa);
+        d.atStart = atStart;
+        d.prevWord = prevWord;
+        d.next.assign(256, NEXT_UNKNOWN);
+        m_states.push_back(std::move(d));
+        int id = (int)m_states.size() - 1;
+        m_index.emplace(std::move(key), id);
+        return id;
+    }
+
+    int startState()
+    {
+        std::vector<int> nfa;
+        closure({ m_pattern->start }, nullptr, 0, nfa);
+        return internState(std::move(nfa), true, false);
+    }
+
+    int computeNext(int s, unsigned char c)
+    {
+        if (m_states.size() >= PATTERN_MAX_DFA_STATES) {
+            // flush the cache, keeping only the state we are in
+            DfaState keep = std::move(m_states[s]);
+            m_states.clear();
+            m_index.clear();
+            m_startState = -1;
+            s = internState(std::move(keep.nfa), keep.atStart, keep.prevWord);
+        }
+
+        if (resolves(m_states[s], c)) {
+            m_states[s].next[c] = NEXT_MATCHED;
+            return NEXT_MATCHED;
+        }
+        std::vector<int> seeds;
+        for (int x : m_resolved) {
+            const NfaState& st = m_pattern->states[x];
+            if (st.kind == NfaState::Bytes && m_pattern->byteSets[st.byteSet][c]) {
+                seeds.push_back(st.out);
             }
-            insideFunc = true;
-            funcIndent = getIndent(line);
-            functionRelevant = false;
-            currentFunc.str("");
-            currentFunc.clear();
-            currentFunc << line << "\n";
-            continue;
         }
+        seeds.push_back(m_pattern->start); // unanchored search: a match may begin at every byte
+        std::vector<int> nfa;
+        closure(seeds, nullptr, 0, nfa);
+        int next = internState(std::move(nfa), false, c < 128 && isWordChar((char)c));
+        m_states[s].next[c] = next;
+        return next;
+    }
 
-        if (insideFunc) {
-            int currentIndent = getIndent(line);
-            bool nextDef = std::regex_search(line, defRegex);
-            if (!line.empty() && currentIndent <= funcIndent && !nextDef) {
-                if (functionRelevant) {
-                    CodeBlock cb;
-                    cb.filename = filename;
-                    cb.content = "##########\n" + filename + "\n##########\n" +
-                        currentFunc.str();
-                    funcBlocks.push_back(cb);
-                }
-                insideFunc = false;
-                currentFunc.str("");
-                currentFunc.clear();
-                functionRelevant = false;
+    const CompiledPattern* m_pattern;
+    std::vector<DfaState> m_states;
+    std::map<std::vector<int>, int> m_index;
+    int m_startState = -1;
+    std::vector<unsigned> m_mark;
+    unsigned m_generation = 0;
+    std::vector<int> m_stack;
+    std::vector<int> m_resolved;
+};
+
+/*******************************************************
+ * Hashing and JSON strings
+ *******************************************************/
+static inline uint64_t rotl64(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+/** hashBytes(data, size, seed):
+ *   XXH64 of a buffer (fast, well distributed; not for
+ *   anything adversarial).
+ */
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0)
+{
+    const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL,
+        P3 = 1609587929392839161ULL, P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+    auto read64 = [](const unsigned char* p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](const unsigned char* p) { uint32_t v; std::memcpy(&v, p, 4); return v; };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl64(acc + input * P2, 31) * P1; };
+
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        for (uint64_t v : { v1, v2, v3, v4 }) {
+            h = (h ^ round(0, v)) * P1 + P4;
+        }
+    }
+    else {
+        h = seed + P5;
+    }
+    h += (uint64_t)size;
+    for (; p + 8 <= end; p += 8) {
+        h = rotl64(h ^ round(0, read64(p)), 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h = rotl64(h ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h = rotl64(h ^ (*p * P5), 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void appendJsonString(std::string& out, const std::string& s)
+{
+    out += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        }
+        else if (c == '\n') {
+            out += "\\n";
+        }
+        else if (c == '\t') {
+            out += "\\t";
+        }
+        else if (c < 0x20) {
+            char esc[8];
+            std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        }
+        else {
+            out += (char)c;
+        }
+    }
+    out += '"';
+}
+
+/** writeFileAtomically(path, data):
+ *   Writes 'path.tmp' and renames it over 'path', so readers
+ *   never see a half-written file.
+ */
+bool writeFileAtomically(const std::string& path, const std::string& data)
+{
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), (std::streamsize)data.size());
+        if (!out) {
+            std::cerr << "Could not write " << tmp << ".\n";
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        std::cerr << "Could not replace " << path << ": " << ec.message() << "\n";
+        fs::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+/** writeFileIfChanged(path, data):
+ *   Atomically replaces 'path' unless it already holds 'data',
+ *   so unchanged outputs keep their timestamps. Returns true if
+ *   the file was written.
+ */
+bool writeFileIfChanged(const std::string& path, const std::string& data)
+{
+    std::error_code ec;
+    uintmax_t size = fs::file_size(path, ec);
+    if (!ec && size == data.size()) {
+        std::ifstream in(path, std::ios::in | std::ios::binary);
+        std::string old(data.size(), '\0');
+        if (in.read(&old[0], (std::streamsize)old.size()) && old == data) return false;
+    }
+    return writeFileAtomically(path, data);
+}
+
+/** formatBlockFile(label, textBlocks):
+ *   Contents of a per-source output file: the blocks of one
+ *   source file plus the summary line.
+ */
+std::string formatBlockFile(const std::string& label, const std::vector<std::string>& textBlocks)
+{
+    std::ostringstream out;
+    for (auto& content : textBlocks) {
+        out << content << "\n";
+    }
+    out << "\n--- SUMMARY: " << textBlocks.size()
+        << " Block(s) in " << label << " ---\n\n";
+    return out.str();
+}
+
+/** perFileOutputNames(sources):
+ *   Output file stem and summary label per source file. Both
+ *   are the file name, unless several sources share it; those
+ *   get as many parent folders as it takes to tell them apart
+ *   (stem "sys~time.h", label "sys/time.h").
+ */
+std::map<std::string, std::pair<std::string, std::string>>
+perFileOutputNames(const std::vector<std::string>& sources)
+{
+    std::map<std::string, std::vector<std::string>> byName;
+    for (const auto& src : sources) {
+        byName[fs::path(src).filename().string()].push_back(src);
+    }
+
+    std::map<std::string, std::pair<std::string, std::string>> names;
+    for (const auto& group : byName) {
+        if (group.second.size() == 1) {
+            names[group.second[0]] = { group.first, group.first };
+            continue;
+        }
+        std::vector<std::vector<std::string>> parts;
+        size_t longest = 0;
+        for (const auto& src : group.second) {
+            std::vector<std::string> comps;
+            for (const auto& c : fs::path(src).relative_path()) {
+                std::string s = c.string();
+                if (!s.empty() && s != ".") comps.push_back(s);
             }
-            else {
-                currentFunc << line << "\n";
+            longest = std::max(longest, comps.size());
+            parts.push_back(std::move(comps));
+        }
+        for (size_t depth = 2; depth <= longest + 1; ++depth) {
+            std::set<std::string> seen;
+            std::vector<std::pair<std::string, std::string>> candidate;
+            for (size_t k = 0; k < parts.size(); ++k) {
+                const auto& comps = parts[k];
+                size_t from = comps.size() > depth ? comps.size() - depth : 0;
+                std::string stem, label;
+                for (size_t c = from; c < comps.size(); ++c) {
+                    stem += (c > from ? "~" : "") + comps[c];
+                    label += (c > from ? "/" : "") + comps[c];
+                }
+                // identical components (e.g. "a//b" vs "a/b"): fall back to a counter
+                if (depth > longest) stem += "~" + std::to_string(k);
+                seen.insert(stem);
+                candidate.emplace_back(stem, label);
             }
+            if (seen.size() < parts.size()) continue;
+            for (size_t k = 0; k < parts.size(); ++k) names[group.second[k]] = candidate[k];
+            break;
         }
+    }
+    return names;
+}
 
-        if (std::regex_search(line, ifParamRegex)) {
-            int ifIndent = getIndent(line);
-            std::ostringstream blockContent;
-            blockContent << line << "\n";
+/*******************************************************
+ * Interrupting scans
+ *
+ *  A define, pattern or Python param scan can be stopped
+ *  early, by Ctrl-C (SIGINT) or when --time-budget <seconds>
+ *  runs out. Both only raise a flag: the readers start no new
+ *  files and the parsers take no new ones, so every file is
+ *  either scanned completely or not at all. The scan returns
+ *  what it has, g_lastScan lists the files it did not reach,
+ *  and the outputs get a _PARTIAL.txt note next to them. The
+ *  next run of the same search resumes from a checkpoint (see
+ *  "Scan checkpoints"). A second Ctrl-C ends the program; with
+ *  --trace the trace watcher writes the trace first.
+ *******************************************************/
+static std::atomic<bool> g_scanInterrupted{ false };
+static std::atomic<int64_t> g_scanDeadline{ 0 };   // steady_clock ticks, 0 = no budget
+static double g_timeBudgetSeconds = 0;              // --time-budget
+
+struct PartialScan {
+    std::string reason;
+    size_t totalFiles = 0;
+    FileList unscanned;     // empty: the scan was complete
+};
+static PartialScan g_lastScan;   // of the last define, pattern or Python scan
 
-            while (true) {
-                std::streampos pos = ifs.tellg();
-                std::string nextLine;
-                if (!std::getline(ifs, nextLine)) {
-                    break;
-                }
-                outLineCount++;
+static void onScanInterrupt(int)
+{
+    std::signal(SIGINT, onScanInterrupt);   // handlers may be reset on delivery
+    if (!g_scanInterrupted.exchange(true)) return;
+    if (g_tracing) {
+        g_traceExitRequested = true;
+        return;
+    }
+    std::signal(SIGINT, SIG_DFL);
+    std::raise(SIGINT);
+}
+
+/** scanCancelled(): true once the running scan should stop. */
+static bool scanCancelled()
+{
+    if (g_scanInterrupted.load(std::memory_order_relaxed)) return true;
+    int64_t deadline = g_scanDeadline.load(std::memory_order_relaxed);
+    return deadline != 0 && steady_clock::now().time_since_epoch().count() >= deadline;
+}
+
+/** InterruptibleScan:
+ *   Scope of one scan. Starts the time budget and routes Ctrl-C
+ *   to scanCancelled() until it ends; outside of it neither
+ *   stops anything.
+ */
+struct InterruptibleScan {
+    void (*previous)(int);
+
+    InterruptibleScan()
+    {
+        g_scanInterrupted = false;
+        g_lastScan = PartialScan();
+        int64_t deadline = 0;
+        if (g_timeBudgetSeconds > 0) {
+            auto budget = duration_cast<steady_clock::duration>(duration<double>(g_timeBudgetSeconds));
+            deadline = (steady_clock::now() + budget).time_since_epoch().count();
+        }
+        g_scanDeadline = deadline;
+        previous = std::signal(SIGINT, onScanInterrupt);
+    }
+    ~InterruptibleScan()
+    {
+        std::signal(SIGINT, previous == SIG_ERR ? SIG_DFL : previous);
+        g_scanDeadline = 0;
+        g_scanInterrupted = false;
+    }
+    static std::string reason()
+    {
+        if (g_scanInterrupted) return "interrupted (Ctrl-C)";
+        std::ostringstream out;
+        out << "time budget of " << g_timeBudgetSeconds << " s used up";
+        return out.str();
+    }
+};
+
+/** writePartialNote(path, partial):
+ *   Writes the note for outputs of an incomplete scan, or
+ *   removes a stale one. True if the file changed.
+ */
+static bool writePartialNote(const std::string& path, const PartialScan* partial)
+{
+    if (!partial || partial->unscanned.empty()) {
+        std::error_code ec;
+        return fs::remove(path, ec);
+    }
+    std::ostringstream out;
+    out << "PARTIAL RESULT - scan " << partial->reason << "\n"
+        << partial->unscanned.size() << " of " << partial->totalFiles
+        << " file(s) were not scanned; the outputs next to this note only cover the others.\n"
+        << "Repeat the search to resume from where it stopped.\n\n"
+        << "--- NOT SCANNED ---\n";
+    for (FileId f : partial->unscanned) out << g_files.path(f) << "\n";
+    return writeFileIfChanged(path, out.str());
+}
+
+/*******************************************************
+ * Shared blocks
+ *
+ *  Copy-pasted code makes the same #ifdef block or function
+ *  appear verbatim in many files. Block texts (without the file
+ *  banner and the leading context lines, which rarely match)
+ *  are stored once, keyed by their hash, together with every
+ *  location they occur at. A text found at least
+ *  SHARED_BLOCK_MIN_COPIES times is written once to
+ *  Output/<PREFIX>_<NAME>_shared.txt with all its locations;
+ *  the per-file outputs only refer to it by its id. With
+ *  --json the same grouping goes to Output/<PREFIX>_<NAME>.json.
+ *******************************************************/
+static const size_t SHARED_BLOCK_MIN_COPIES = 2;
+static bool g_jsonExport = false;              // --json
+
+struct StoredBlock {
+    uint64_t hash = 0;
+    std::string text;                               // without the file banner
+    std::vector<std::pair<FileId, size_t>> locations;   // file, 1-based line
+};
+
+/** splitBlock(block, head, text):
+ *   Splits a block's content into banner plus context lines
+ *   ('head') and the text that is shared.
+ */
+static void splitBlock(const CodeBlock& block, std::string& head, std::string& text)
+{
+    const std::string banner = "##########\n" + g_files.path(block.file) + "\n##########\n";
+    size_t cut = block.content.compare(0, banner.size(), banner) == 0 ? banner.size() : 0;
+    for (size_t k = 0; k < block.context && cut < block.content.size(); ++k) {
+        size_t nl = block.content.find('\n', cut);
+        cut = nl == std::string::npos ? block.content.size() : nl + 1;
+    }
+    head = block.content.substr(0, cut);
+    text = block.content.substr(cut);
+}
+
+static std::string blockId(uint64_t hash)
+{
+    char buf[20];
+    std::snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+    return buf;
+}
+
+/** storeBlocks(blocks, slots):
+ *   Distinct block texts in order of first occurrence; slots[i]
+ *   is the entry of blocks[i].
+ */
+std::vector<StoredBlock> storeBlocks(const std::vector<CodeBlock>& blocks, std::vector<size_t>& slots)
+{
+    std::vector<StoredBlock> store;
+    std::unordered_map<uint64_t, size_t> byHash;
+    slots.assign(blocks.size(), 0);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        std::string head, text;
+        splitBlock(blocks[i], head, text);
+        uint64_t hash = hashBytes(text.data(), text.size());
+        // a collision moves on to the next free hash
+        auto it = byHash.find(hash);
+        while (it != byHash.end() && store[it->second].text != text) it = byHash.find(++hash);
+        if (it == byHash.end()) {
+            it = byHash.emplace(hash, store.size()).first;
+            StoredBlock entry;
+            entry.hash = hash;
+            entry.text = std::move(text);
+            store.push_back(std::move(entry));
+        }
+        store[it->second].locations.emplace_back(blocks[i].file, blocks[i].line + blocks[i].context);
+        slots[i] = it->second;
+    }
+    return store;
+}
+
+static void appendBlockJson(std::string& out, const StoredBlock& entry)
+{
+    out += "    {\"id\": \"" + blockId(entry.hash) + "\", \"copies\": " + std::to_string(entry.locations.size())
+        + ", \"locations\": [";
+    for (size_t k = 0; k < entry.locations.size(); ++k) {
+        out += k ? ", {\"file\": " : "{\"file\": ";
+        appendJsonString(out, g_files.path(entry.locations[k].first));
+        out += ", \"line\": " + std::to_string(entry.locations[k].second) + "}";
+    }
+    out += "],\n     \"text\": ";
+    appendJsonString(out, entry.text);
+    out += "}";
+}
+
+/*******************************************************
+ * writeOutputPerFile()
+ * Writes the collected CodeBlocks per source file
+ * into individual files. E.g. in:
+ * Output/CLIENT_<DEFINE>_DEFINE_files/foo.cpp.txt
+ * Blocks with identical text in several places are written
+ * once to Output/CLIENT_<DEFINE>_DEFINE_shared.txt and only
+ * referenced from the per-file outputs. Results of an
+ * incomplete scan ('partial') get _PARTIAL.txt beside them.
+ * Files are only rewritten if their content changes;
+ * outputs of sources without blocks are removed. Returns
+ * the number of files written or removed.
+ *******************************************************/
+size_t writeOutputPerFile(const std::string& prefix,
+    const std::string& defineName,
+    const std::vector<CodeBlock>& blocks,
+    const PartialScan* partial = nullptr)
+{
+    TraceSpan span("write output");
+    fs::create_directory("Output");
+
+    const std::string base = "Output/" + prefix + "_" + defineName;
+    std::string outDir = base + "_files";
+    fs::create_directory(outDir);
+
+    std::vector<size_t> slots;
+    std::vector<StoredBlock> store = storeBlocks(blocks, slots);
+    const std::string sharedName = fs::path(base + "_shared.txt").filename().string();
+
+    std::map<FileId, std::vector<std::string>> byFile;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        const StoredBlock& entry = store[slots[i]];
+        if (entry.locations.size() < SHARED_BLOCK_MIN_COPIES) {
+            byFile[blocks[i].file].push_back(blocks[i].content);
+            continue;
+        }
+        std::string head, text;
+        splitBlock(blocks[i], head, text);
+        byFile[blocks[i].file].push_back(head + "(line " + std::to_string(blocks[i].line + blocks[i].context)
+            + ": shared block " + blockId(entry.hash) + ", " + std::to_string(entry.locations.size())
+            + " copies - see " + sharedName + ")\n");
+    }
+    std::map<std::string, std::vector<std::string>> fileToContents;
+    for (auto& kv : byFile) fileToContents[g_files.path(kv.first)] = std::move(kv.second);
+
+    std::vector<std::string> sources;
+    for (const auto& kv : fileToContents) sources.push_back(kv.first);
+    auto names = perFileOutputNames(sources);
+
+    size_t touched = 0;
+    std::set<std::string> wanted;
+    for (const auto& kv : fileToContents) {
+        const auto& name = names[kv.first];
+        wanted.insert(name.first + ".txt");
+        if (writeFileIfChanged(outDir + "/" + name.first + ".txt", formatBlockFile(name.second, kv.second))) touched++;
+    }
+
+    std::error_code ec;
+    std::vector<fs::path> stale;
+    for (fs::directory_iterator it(outDir, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string fname = it->path().filename().string();
+        if (it->path().extension() == ".txt" && !wanted.count(fname)) stale.push_back(it->path());
+    }
+    for (const auto& p : stale) {
+        if (fs::remove(p, ec)) touched++;
+    }
+
+    std::string shared;
+    size_t sharedBlocks = 0, sharedCopies = 0, savedBytes = 0;
+    for (const auto& entry : store) {
+        if (entry.locations.size() < SHARED_BLOCK_MIN_COPIES) continue;
+        sharedBlocks++;
+        sharedCopies += entry.locations.size();
+        savedBytes += (entry.locations.size() - 1) * entry.text.size();
+        shared += "########## " + blockId(entry.hash) + ": " + std::to_string(entry.locations.size()) + " copies\n";
+        for (const auto& loc : entry.locations) {
+            shared += g_files.path(loc.first) + ":" + std::to_string(loc.second) + "\n";
+        }
+        shared += "##########\n" + entry.text + "\n";
+    }
+    if (sharedBlocks > 0) {
+        shared += "\n--- SUMMARY: " + std::to_string(sharedBlocks) + " shared block(s) at "
+            + std::to_string(sharedCopies) + " location(s), " + std::to_string(savedBytes / 1024) + " KiB not repeated ---\n\n";
+        if (writeFileIfChanged(base + "_shared.txt", shared)) touched++;
+    }
+    else if (fs::remove(base + "_shared.txt", ec)) {
+        touched++;
+    }
+    if (writePartialNote(base + "_PARTIAL.txt", partial)) touched++;
+
+    if (g_jsonExport) {
+        std::string json = "{\"query\": ";
+        appendJsonString(json, prefix + "_" + defineName);
+        if (partial && !partial->unscanned.empty()) json += ", \"partial\": true";
+        json += ", \"occurrences\": " + std::to_string(blocks.size()) + ", \"blocks\": [\n";
+        for (size_t k = 0; k < store.size(); ++k) {
+            appendBlockJson(json, store[k]);
+            json += k + 1 < store.size() ? ",\n" : "\n";
+        }
+        json += "]}\n";
+        if (writeFileIfChanged(base + ".json", json)) touched++;
+    }
+    return touched;
+}
+
+/*******************************************************
+ * writePythonOutput(param, results, partial):
+ *   Writes Output/PYTHON_<param>_DEFINE.txt (if-blocks) and
+ *   Output/PYTHON_<param>_FUNC.txt (functions), plus
+ *   Output/PYTHON_<param>_PARTIAL.txt for an incomplete scan.
+ *******************************************************/
+void writePythonOutput(const std::string& param,
+    const std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>& pyResults,
+    const PartialScan* partial = nullptr)
+{
+    TraceSpan span("write output");
+    fs::create_directory("Output");
+    {
+        std::ostringstream out;
+        std::unordered_set<std::string> defFiles;
+        for (auto& b : pyResults.first) {
+            out << b.content << "\n";
+            defFiles.insert(g_files.path(b.file));
+        }
+        out << "\n--- SUMMARY (" << pyResults.first.size()
+            << " if-block(s)) in files: ---\n";
+        for (auto& fn : defFiles) {
+            out << fn << "\n";
+        }
+        writeFileIfChanged("Output/PYTHON_" + param + "_DEFINE.txt", out.str());
+    }
+    {
+        std::ostringstream out;
+        std::unordered_set<std::string> funcFiles;
+        for (auto& b : pyResults.second) {
+            out << b.content << "\n";
+            funcFiles.insert(g_files.path(b.file));
+        }
+        out << "\n--- SUMMARY (" << pyResults.second.size()
+            << " function block(s)) in files: ---\n";
+        for (auto& fn : funcFiles) {
+            out << fn << "\n";
+        }
+        writeFileIfChanged("Output/PYTHON_" + param + "_FUNC.txt", out.str());
+    }
+    writePartialNote("Output/PYTHON_" + param + "_PARTIAL.txt", partial);
+}
+
+/*******************************************************
+ * Concurrency limits and adaptive worker control
+ *
+ *  workerThreadLimit() caps every thread pool: the hardware
+ *  threads, reduced by --max-cpu <percent> and --threads <n>.
+ *
+ *  The scan pools also run under a ConcurrencyControl. All
+ *  workers are started, but only the first 'active' ones take
+ *  files and the rest stay parked. A sampling thread measures
+ *  bytes per second and how busy the active workers are (time
+ *  spent parsing vs. waiting for the readers). It then moves
+ *  'active' by one worker at a time:
+ *   - Mostly idle workers mean the scan is I/O-bound. One is
+ *     parked, which frees the CPU for other jobs and costs no
+ *     throughput.
+ *   - Busy workers get a helper, unless the previous grow step
+ *     did not raise the throughput. That step is then undone
+ *     and the size is held for a while.
+ *  A file still being parsed counts as busy time right away,
+ *  so a long file does not look like an idle worker.
+ *
+ *  The reader stage of the feed is steered the same way: busy
+ *  parsers mean the readers are ahead, so one plain reader is
+ *  parked (or the io_uring depth halved); idle parsers get the
+ *  reader back (or the depth doubled).
+ *******************************************************/
+static size_t g_maxThreads = 0;          // --threads, 0 = no limit
+static unsigned g_maxCpuPercent = 100;   // --max-cpu
+static bool g_pinThreads = false;        // --affinity
+
+static const std::chrono::milliseconds CONTROL_INTERVAL(100);
+static const double CONTROL_IDLE_UTILIZATION = 0.5;
+static const double CONTROL_BUSY_UTILIZATION = 0.85;
+static const double CONTROL_MIN_GAIN = 1.05;
+static const int CONTROL_HOLD_INTERVALS = 10;
+static const size_t CONTROL_MIN_DEPTH = 8;      // io_uring files in flight
+
+/** workerThreadLimit():
+ *   Upper bound for every worker pool.
+ */
+size_t workerThreadLimit()
+{
+    size_t hwThreads = std::thread::hardware_concurrency();
+    if (hwThreads == 0) hwThreads = 2;
+    size_t limit = std::max<size_t>(1, hwThreads * g_maxCpuPercent / 100);
+    if (g_maxThreads > 0) limit = std::min(limit, g_maxThreads);
+    return limit;
+}
+
+/** pinWorkerThread(worker):
+ *   With --affinity, binds the calling pool worker to one of
+ *   the CPUs the process may use (round robin).
+ */
+void pinWorkerThread(size_t worker)
+{
+    if (!g_pinThreads) return;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    int count = CPU_COUNT(&allowed);
+    if (count <= 0) return;
+    int target = (int)(worker % (size_t)count);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+        return;
+    }
+#elif defined(_WIN32)
+    DWORD_PTR processMask = 0, systemMask = 0;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) || processMask == 0) return;
+    size_t count = 0;
+    for (DWORD_PTR m = processMask; m; m &= m - 1) count++;
+    size_t target = worker % count;
+    for (unsigned bit = 0; bit < sizeof(DWORD_PTR) * 8; ++bit) {
+        DWORD_PTR mask = (DWORD_PTR)1 << bit;
+        if (!(processMask & mask) || target-- > 0) continue;
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+        return;
+    }
+#else
+    (void)worker;
+#endif
+}
+
+struct ConcurrencyControl {
+    size_t workers = 1;                     // threads started
+    std::atomic<size_t> active{ 1 };        // workers [0, active) take files
+    bool finished = false;
+    std::mutex mutex;
+    std::condition_variable wake;           // parked workers and the sampler wait here
+    std::atomic<uint64_t> bytes{ 0 };
+    std::unique_ptr<std::atomic<uint64_t>[]> busyNs;
+    std::unique_ptr<std::atomic<int64_t>[]> busySince;  // start of the current file, 0 = waiting
+    std::thread sampler;
+    size_t fewest = 1;                      // range of 'active' over the run
+    size_t most = 1;
+
+    // reader stage: plain readers [0, readers) read, or the io_uring
+    // reader keeps up to 'readers' files in flight; set by startFileFeed()
+    std::atomic<size_t> readerSlots{ 0 };   // 0 = no feed attached
+    std::atomic<size_t> readers{ 0 };
+    std::atomic<bool> readerDepth{ false }; // 'readers' is an io_uring depth
+    size_t fewestReaders = 0;
+    size_t mostReaders = 0;
+};
+
+static int64_t steadyNowNs()
+{
+    return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** adjustReaders(ctl, grow):
+ *   One step for the reader stage: a plain reader more or
+ *   less, or twice / half the io_uring depth.
+ */
+static void adjustReaders(ConcurrencyControl& ctl, bool grow)
+{
+    size_t slots = ctl.readerSlots.load();
+    if (slots == 0) return;
+    size_t cur = ctl.readers.load();
+    bool depth = ctl.readerDepth.load();
+    size_t next = cur;
+    if (grow) next = std::min(slots, depth ? cur * 2 : cur + 1);
+    else next = std::max<size_t>(depth ? std::min(slots, CONTROL_MIN_DEPTH) : 1, depth ? cur / 2 : cur - 1);
+    if (next == cur) return;
+    ctl.readers.store(next);
+    if (ctl.fewestReaders == 0) ctl.fewestReaders = ctl.mostReaders = cur;
+    ctl.fewestReaders = std::min(ctl.fewestReaders, next);
+    ctl.mostReaders = std::max(ctl.mostReaders, next);
+    if (grow) ctl.wake.notify_all();
+}
+
+static void concurrencySampler(ConcurrencyControl& ctl)
+{
+    traceThreadName("sampler");
+    auto last = std::chrono::steady_clock::now();
+    uint64_t lastBytes = 0;
+    std::vector<uint64_t> lastBusy(ctl.workers, 0);
+    double lastRate = 0;
+    bool lastGrew = false;
+    int hold = 0;
+
+    std::unique_lock<std::mutex> lock(ctl.mutex);
+    while (!ctl.wake.wait_for(lock, CONTROL_INTERVAL, [&] { return ctl.finished; })) {
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - last).count();
+        last = now;
+        uint64_t bytes = ctl.bytes.load(std::memory_order_relaxed);
+        double rate = (double)(bytes - lastBytes) / seconds;
+        lastBytes = bytes;
+        uint64_t busy = 0;
+        int64_t nowNs = steadyNowNs();
+        for (size_t w = 0; w < ctl.workers; ++w) {
+            // finished files plus the part of the current one parsed so far
+            int64_t since = ctl.busySince[w].load(std::memory_order_relaxed);
+            uint64_t v = ctl.busyNs[w].load(std::memory_order_relaxed);
+            if (since > 0 && nowNs > since) v += (uint64_t)(nowNs - since);
+            busy += v > lastBusy[w] ? v - lastBusy[w] : 0;
+            lastBusy[w] = std::max(lastBusy[w], v);
+        }
+
+        size_t active = ctl.active.load();
+        double utilization = (double)busy / (seconds * 1e9 * (double)active);
+        size_t next = active;
+        if (hold > 0) hold--;
+        if (lastGrew && rate < lastRate * CONTROL_MIN_GAIN && active > 1) {
+            next = active - 1;   // the extra worker did not pay off
+            hold = CONTROL_HOLD_INTERVALS;
+        }
+        else if (utilization < CONTROL_IDLE_UTILIZATION && active > 1) {
+            next = active - 1;
+        }
+        else if (utilization > CONTROL_BUSY_UTILIZATION && active < ctl.workers && hold == 0) {
+            next = active + 1;
+        }
+        if (utilization > CONTROL_BUSY_UTILIZATION) adjustReaders(ctl, false);
+        else if (utilization < CONTROL_IDLE_UTILIZATION) adjustReaders(ctl, true);
+        lastGrew = next > active;
+        lastRate = rate;
+        if (next != active) {
+            ctl.active.store(next);
+            ctl.fewest = std::min(ctl.fewest, next);
+            ctl.most = std::max(ctl.most, next);
+            if (next > active) ctl.wake.notify_all();
+        }
+    }
+}
+
+/** startConcurrencyControl(ctl, workers):
+ *   All 'workers' start active; the sampler trims from there.
+ */
+void startConcurrencyControl(ConcurrencyControl& ctl, size_t workers)
+{
+    ctl.workers = std::max<size_t>(1, workers);
+    ctl.active = ctl.workers;
+    ctl.fewest = ctl.most = ctl.workers;
+    ctl.busyNs.reset(new std::atomic<uint64_t>[ctl.workers]);
+    ctl.busySince.reset(new std::atomic<int64_t>[ctl.workers]);
+    for (size_t w = 0; w < ctl.workers; ++w) {
+        ctl.busyNs[w] = 0;
+        ctl.busySince[w] = 0;
+    }
+    if (ctl.workers > 1) {
+        ctl.sampler = std::thread(concurrencySampler, std::ref(ctl));
+    }
+}
+
+/** waitForTurn(ctl, worker):
+ *   Blocks while the worker is parked.
+ */
+void waitForTurn(ConcurrencyControl& ctl, size_t worker)
+{
+    if (worker < ctl.active.load(std::memory_order_relaxed)) return;
+    TraceSpan parked("parked");
+    std::unique_lock<std::mutex> lock(ctl.mutex);
+    ctl.wake.wait(lock, [&] { return ctl.finished || worker < ctl.active.load(); });
+}
+
+/** beginWork(ctl, worker):
+ *   The worker starts on a file; returns the start for reportWork().
+ */
+std::chrono::steady_clock::time_point beginWork(ConcurrencyControl& ctl, size_t worker)
+{
+    auto now = std::chrono::steady_clock::now();
+    ctl.busySince[worker].store(std::max<int64_t>(1, (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        now.time_since_epoch()).count()), std::memory_order_relaxed);
+    return now;
+}
+
+void reportWork(ConcurrencyControl& ctl, size_t worker, uintmax_t bytes,
+    std::chrono::steady_clock::duration busy)
+{
+    ctl.busySince[worker].store(0, std::memory_order_relaxed);
+    ctl.bytes.fetch_add((uint64_t)bytes, std::memory_order_relaxed);
+    ctl.busyNs[worker].fetch_add(
+        (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count(),
+        std::memory_order_relaxed);
+}
+
+/** workersFinished(ctl):
+ *   No work left: releases parked workers and the sampler.
+ */
+void workersFinished(ConcurrencyControl& ctl)
+{
+    {
+        std::lock_guard<std::mutex> lock(ctl.mutex);
+        ctl.finished = true;
+    }
+    ctl.wake.notify_all();
+}
+
+/** stopConcurrencyControl(ctl):
+ *   Joins the sampler after the workers have been joined.
+ */
+void stopConcurrencyControl(ConcurrencyControl& ctl)
+{
+    workersFinished(ctl);
+    if (ctl.sampler.joinable()) ctl.sampler.join();
+    if (ctl.fewest != ctl.most) {
+        std::cout << "Adaptive workers: " << ctl.fewest << "-" << ctl.most
+            << " of " << ctl.workers << " active\n";
+    }
+    if (ctl.fewestReaders != ctl.mostReaders) {
+        std::cout << "Adaptive " << (ctl.readerDepth ? "read depth: " : "readers: ") << ctl.fewestReaders
+            << "-" << ctl.mostReaders << " of " << ctl.readerSlots << "\n";
+    }
+}
+
+/*******************************************************
+ * Generic parallel loop
+ *   Runs fn(i) for i in [0, count) on a dynamic worker pool.
+ *******************************************************/
+void runParallel(size_t count, const std::function<void(size_t)>& fn)
+{
+    if (count == 0) return;
+    size_t numThreads = std::min<size_t>(workerThreadLimit(), count);
+
+    std::atomic<size_t> next{ 0 };
+    auto worker = [&]() {
+        while (true) {
+            size_t idx = next.fetch_add(1, std::memory_order_relaxed);
+            if (idx >= count) break;
+            fn(idx);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < numThreads; ++t) {
+        threads.emplace_back([&]() {
+            traceThreadName("pool");
+            worker();
+        });
+    }
+    worker();
+    for (auto& th : threads) {
+        th.join();
+    }
+}
+
+/*******************************************************
+ * C++ line classification
+ *
+ *  scanCppLines() walks a file once and records everything
+ *  the define extraction needs: directive flags, the
+ *  identifiers of every conditional and the function spans
+ *  found by the function-head heuristic. None of this depends
+ *  on the define being searched, so one scan can answer any
+ *  number of define queries. Callers that only need the
+ *  conditionals can skip the function-head heuristic.
+ *  PyModule_Add* bindings are recorded along the way.
+ *
+ *  The scan has two phases: classifyCppLines() looks at each
+ *  line in isolation, stitchCppScan() then runs the stateful
+ *  part (function braces, #if nesting for binding guards)
+ *  over the per-line results. Because only the first phase is
+ *  expensive and it has no cross-line state, very large files
+ *  classify disjoint chunks concurrently and stitch once.
+ *******************************************************/
+enum CppLineFlag : uint8_t {
+    LINE_IF_PREFILTER = 1 << 0, // contains "#if ", "#ifdef ", "#ifndef " or "#elif"
+    LINE_ANY_IF_START = 1 << 1, // ^\s*#\s*(if|ifdef|ifndef)\b
+    LINE_HAS_ENDIF    = 1 << 2, // contains "#endif"
+    LINE_DIRECTIVE    = 1 << 3, // first non-space character is '#'
+    LINE_OPEN_BRACE   = 1 << 4, // contains '{'
+    LINE_SEMICOLON    = 1 << 5  // contains ';'
+};
+
+/** Result of classifyFunctionHead() for one line */
+enum FunctionHeadKind : uint8_t {
+    HEAD_UNKNOWN = 0,   // not evaluated yet
+    HEAD_NONE,
+    HEAD_BRACE,         // head followed by '{'
+    HEAD_DECLARATION,   // head followed by ';'
+    HEAD_OPEN           // head at end of line, brace expected later
+};
+
+struct FunctionSpan {
+    size_t headLine = 0; // first line of the (possibly multi-line) head
+    size_t openLine = 0; // line that contains the opening brace
+    size_t endLine = 0;  // line on which the braces balance again
+};
+
+/** PythonBinding:
+ *   A PyModule_Add*(module, "NAME", ...) call that exposes a
+ *   value to Python as app.NAME, together with the #if/#elif/
+ *   #else lines that guard it (outermost first).
+ */
+struct PythonBinding {
+    size_t line = 0;
+    std::string pyName;
+    std::string api;                 // e.g. "IntConstant"
+    std::vector<size_t> guardLines;
+};
+
+struct CppFileScan {
+    std::vector<std::string> lines;
+    std::vector<uint8_t> flags;
+    std::vector<ConditionalRef> conditionals;
+    std::vector<FunctionSpan> functions;
+    std::vector<PythonBinding> bindings;
+};
+
+static inline int braceDelta(const std::string& line) {
+    int d = 0;
+    for (char c : line) {
+        if (c == '{') d++;
+        if (c == '}') d--;
+    }
+    return d;
+}
+
+/** classifyFunctionHead(line):
+ *   Recognizes a typical C++ function header (heuristic): at
+ *   least two whitespace-separated tokens of [\w:*&<>] before
+ *   the first '(', the last one starting with a word character,
+ *   then everything up to the first ')' and '{', ';' or the
+ *   end of the line. One linear pass; the std::regex this used
+ *   to be backtracked badly on long generated lines.
+ */
+static FunctionHeadKind classifyFunctionHead(const std::string& line)
+{
+    size_t open = line.find('(');
+    if (open == std::string::npos) return HEAD_NONE;
+
+    size_t tokens = 0;
+    char lastTokenStart = 0;
+    bool inToken = false;
+    for (size_t i = 0; i < open; ++i) {
+        char c = line[i];
+        if (isSpaceChar(c)) {
+            inToken = false;
+            continue;
+        }
+        if (!isWordChar(c) && c != ':' && c != '*' && c != '&' && c != '<' && c != '>') {
+            return HEAD_NONE;
+        }
+        if (!inToken) {
+            tokens++;
+            lastTokenStart = c;
+            inToken = true;
+        }
+    }
+    if (tokens < 2 || !isWordChar(lastTokenStart)) return HEAD_NONE;
+
+    size_t close = line.find(')', open + 1);
+    if (close == std::string::npos) return HEAD_NONE;
+    size_t k = close + 1;
+    while (k < line.size() && isSpaceChar(line[k])) k++;
+    if (k == line.size()) return HEAD_OPEN;
+    if (line[k] == '{') return HEAD_BRACE;
+    if (line[k] == ';') return HEAD_DECLARATION;
+    return HEAD_NONE;
+}
+
+/** directiveName(line):
+ *   Returns the preprocessor directive of a line ("if", "elif",
+ *   "endif", ...) or an empty string for ordinary lines.
+ */
+static std::string directiveName(const std::string& line)
+{
+    size_t p = line.find_first_not_of(" \t\r\n\f\v");
+    if (p == std::string::npos || line[p] != '#') return "";
+    p++;
+    while (p < line.size() && isSpaceChar(line[p])) p++;
+    size_t e = p;
+    while (e < line.size() && std::isalpha((unsigned char)line[e])) e++;
+    return line.substr(p, e - p);
+}
+
+/** parsePythonBinding(line, lineIndex, out):
+ *   Recognizes PyModule_Add<Api>(<module>, "NAME", ...). The
+ *   guard is filled in later by stitchCppScan().
+ */
+static void parsePythonBinding(const std::string& line, size_t lineIndex,
+    std::vector<PythonBinding>& out)
+{
+    size_t pos = line.find("PyModule_Add");
+    if (pos == std::string::npos) return;
+    size_t p = pos + 12;
+    size_t apiEnd = p;
+    while (apiEnd < line.size() && isWordChar(line[apiEnd])) apiEnd++;
+    size_t open = line.find_first_not_of(" \t", apiEnd);
+    if (open == std::string::npos || line[open] != '(') return;
+    size_t comma = line.find(',', open);
+    if (comma == std::string::npos) return;
+    size_t q = line.find_first_not_of(" \t", comma + 1);
+    if (q == std::string::npos || line[q] != '"') return;
+    size_t qEnd = line.find('"', q + 1);
+    if (qEnd == std::string::npos || qEnd == q + 1) return;
+
+    PythonBinding b;
+    b.line = lineIndex;
+    b.api = line.substr(p, apiEnd - p);
+    b.pyName = line.substr(q + 1, qEnd - q - 1);
+    out.push_back(std::move(b));
+}
+
+/** Per-line data that only the stitch phase needs */
+struct CppLineScratch {
+    std::vector<uint8_t> heads;
+    std::vector<int> braceDeltas;
+};
+
+/** classifyCppLines(scan, scratch, begin, end, ...):
+ *   Classifies lines [begin, end). Touches only those entries of
+ *   the per-line vectors and appends references to the given
+ *   output vectors, so disjoint ranges can run concurrently.
+ */
+static void classifyCppLines(const std::vector<std::string>& L,
+    size_t begin, size_t end,
+    bool precomputeHeads,
+    std::vector<uint8_t>& flags,
+    CppLineScratch& scratch,
+    std::vector<ConditionalRef>& conditionals,
+    std::vector<PythonBinding>& bindings)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        const auto& line = L[i];
+
+        uint8_t f = 0;
+        if (line.find("#if ") != std::string::npos ||
+            line.find("#ifdef ") != std::string::npos ||
+            line.find("#ifndef ") != std::string::npos ||
+            line.find("#elif") != std::string::npos) {
+            f |= LINE_IF_PREFILTER;
+        }
+        size_t firstNonSpace = line.find_first_not_of(" \t\r\n\f\v");
+        if (firstNonSpace != std::string::npos && line[firstNonSpace] == '#') {
+            f |= LINE_DIRECTIVE;
+            TraceLineTimer timer(i);
+            if (std::regex_search(line, anyIfStartRegex)) {
+                f |= LINE_ANY_IF_START;
+            }
+            parseConditionalRefs(line, i, conditionals);
+        }
+        else if (line.find("PyModule_Add") != std::string::npos) {
+            parsePythonBinding(line, i, bindings);
+        }
+        if (line.find("#endif") != std::string::npos) {
+            f |= LINE_HAS_ENDIF;
+        }
+        if (line.find('{') != std::string::npos) f |= LINE_OPEN_BRACE;
+        if (line.find(';') != std::string::npos) f |= LINE_SEMICOLON;
+        flags[i] = f;
+
+        scratch.braceDeltas[i] = braceDelta(line);
+        if (precomputeHeads) {
+            scratch.heads[i] = classifyFunctionHead(line);
+        }
+    }
+}
+
+/** stitchCppScan(scan, scratch, detectFunctions):
+ *   Sequential phase: assigns #if guards to the bindings and
+ *   segments functions with the brace heuristic.
+ */
+static void stitchCppScan(CppFileScan& scan, CppLineScratch& scratch, bool detectFunctions)
+{
+    const auto& L = scan.lines;
+
+    std::vector<std::vector<size_t>> guardStack; // #if chain lines per nesting level
+    size_t nextBinding = 0;
+    for (size_t i = 0; i < L.size() && nextBinding < scan.bindings.size(); ++i) {
+        if (scan.bindings[nextBinding].line == i) {
+            auto& b = scan.bindings[nextBinding++];
+            for (const auto& chain : guardStack) {
+                b.guardLines.insert(b.guardLines.end(), chain.begin(), chain.end());
+            }
+            continue;
+        }
+        if (!(scan.flags[i] & LINE_DIRECTIVE)) continue;
+        std::string dir = directiveName(L[i]);
+        if (dir == "if" || dir == "ifdef" || dir == "ifndef") {
+            guardStack.push_back({ i });
+        }
+        else if ((dir == "elif" || dir == "else") && !guardStack.empty()) {
+            guardStack.back().push_back(i);
+        }
+        else if (dir == "endif" && !guardStack.empty()) {
+            guardStack.pop_back();
+        }
+    }
+
+    if (!detectFunctions) return;
+
+    bool inFunction = false;
+    int  braceCount = 0;
+    bool potentialFunctionHead = false;
+    FunctionSpan current;
+
+    for (size_t i = 0; i < L.size(); ++i)
+    {
+        if (!inFunction)
+        {
+            if (potentialFunctionHead)
+            {
+                if (scan.flags[i] & LINE_OPEN_BRACE) {
+                    inFunction = true;
+                    current.openLine = i;
+                    braceCount = scratch.braceDeltas[i];
+                    potentialFunctionHead = false;
+                }
+                else if (scan.flags[i] & LINE_SEMICOLON) {
+                    potentialFunctionHead = false;
+                }
+            }
+            else
+            {
+                if (scratch.heads[i] == HEAD_UNKNOWN) {
+                    scratch.heads[i] = classifyFunctionHead(L[i]);
+                }
+                switch (scratch.heads[i]) {
+                case HEAD_BRACE:
+                    inFunction = true;
+                    current.headLine = i;
+                    current.openLine = i;
+                    braceCount = scratch.braceDeltas[i];
+                    break;
+                case HEAD_OPEN:
+                    potentialFunctionHead = true;
+                    current.headLine = i;
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+        else
+        {
+            braceCount += scratch.braceDeltas[i];
+            // a function closes at the earliest on the line after its opening brace
+            if (braceCount <= 0) {
+                current.endLine = i;
+                scan.functions.push_back(current);
+                inFunction = false;
+                braceCount = 0;
+            }
+        }
+    }
+}
+
+CppFileScan scanCppLines(std::vector<std::string> lines, bool detectFunctions = true)
+{
+    CppFileScan scan;
+    scan.lines = std::move(lines);
+    size_t n = scan.lines.size();
+    scan.flags.assign(n, 0);
+
+    CppLineScratch scratch;
+    scratch.heads.assign(n, HEAD_UNKNOWN);
+    scratch.braceDeltas.assign(n, 0);
+
+    classifyCppLines(scan.lines, 0, n, false, scan.flags, scratch,
+        scan.conditionals, scan.bindings);
+    stitchCppScan(scan, scratch, detectFunctions);
+    return scan;
+}
+
+/*******************************************************
+ * Intra-file parallelism for very large sources
+ *******************************************************/
+static const uintmax_t LARGE_FILE_BYTES = 2u << 20;   // files above this are split
+static const size_t    CHUNK_BYTES = 256u << 10;      // target chunk size
+
+/** readLinesChunkedParallel(filename, lines):
+ *   Reads the whole file and splits it into lines on several
+ *   threads, using chunks that end on a newline.
+ */
+void readLinesChunkedParallel(const std::string& filename, std::vector<std::string>& lines)
+{
+    std::string data;
+    if (auto member = archiveMember(filename)) {
+        data = member->data;
+    }
+    else {
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Error: Unable to open file: " << filename << "\n";
+            return;
+        }
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    decodeSourceText(data);
+
+    std::vector<size_t> bounds = { 0 };
+    while (bounds.back() < data.size()) {
+        size_t next = bounds.back() + CHUNK_BYTES;
+        if (next >= data.size()) {
+            next = data.size();
+        }
+        else {
+            size_t nl = data.find('\n', next);
+            next = (nl == std::string::npos) ? data.size() : nl + 1;
+        }
+        bounds.push_back(next);
+    }
+
+    size_t chunks = bounds.size() - 1;
+    std::vector<std::vector<std::string>> parts(chunks);
+    runParallel(chunks, [&](size_t c) {
+        splitLinesInto(data.data() + bounds[c], bounds[c + 1] - bounds[c], parts[c]);
+    });
+
+    size_t total = 0;
+    for (const auto& part : parts) total += part.size();
+    lines.reserve(lines.size() + total);
+    for (auto& part : parts) {
+        std::move(part.begin(), part.end(), std::back_inserter(lines));
+    }
+}
+
+/** scanCppLinesParallel(lines, detectFunctions):
+ *   Output-identical to scanCppLines(): line ranges are
+ *   classified concurrently (function heads included), the
+ *   per-chunk references are concatenated in order and the
+ *   sequential stitch phase reconciles brace and #if state
+ *   across the chunk boundaries.
+ */
+CppFileScan scanCppLinesParallel(std::vector<std::string> lines, bool detectFunctions = true)
+{
+    CppFileScan scan;
+    scan.lines = std::move(lines);
+    size_t n = scan.lines.size();
+    scan.flags.assign(n, 0);
+
+    CppLineScratch scratch;
+    scratch.heads.assign(n, HEAD_UNKNOWN);
+    scratch.braceDeltas.assign(n, 0);
+
+    const size_t linesPerChunk = 8192;
+    size_t chunks = (n + linesPerChunk - 1) / linesPerChunk;
+    std::vector<std::vector<ConditionalRef>> conds(chunks);
+    std::vector<std::vector<PythonBinding>> binds(chunks);
+    runParallel(chunks, [&](size_t c) {
+        size_t begin = c * linesPerChunk;
+        size_t end = std::min(n, begin + linesPerChunk);
+        classifyCppLines(scan.lines, begin, end, detectFunctions, scan.flags, scratch,
+            conds[c], binds[c]);
+    });
+    for (size_t c = 0; c < chunks; ++c) {
+        std::move(conds[c].begin(), conds[c].end(), std::back_inserter(scan.conditionals));
+        std::move(binds[c].begin(), binds[c].end(), std::back_inserter(scan.bindings));
+    }
+
+    stitchCppScan(scan, scratch, detectFunctions);
+    return scan;
+}
+
+/** isLargeSourceFile(filename):
+ *   True for files that are worth splitting across threads.
+ */
+static bool isLargeSourceFile(const std::string& filename)
+{
+    std::error_code ec;
+    uintmax_t size = fs::file_size(filename, ec);
+    return !ec && size >= LARGE_FILE_BYTES;
+}
+
+/** makeBlockContent(filename, lines, first, last):
+ *   Formats lines [first, last] with the usual file banner.
+ */
+static std::string makeBlockContent(const std::string& filename,
+    const std::vector<std::string>& lines, size_t first, size_t last)
+{
+    std::string content = "##########\n" + filename + "\n##########\n";
+    for (size_t s = first; s <= last; ++s) {
+        content += lines[s];
+        content += "\n";
+    }
+    return content;
+}
+
+/** ScanQuery:
+ *   What a C++ scan looks for: a define (see conditionalMatches)
+ *   or a compiled pattern. A pattern is tried on each identifier
+ *   a conditional references or, with 'matchLines' set, searched
+ *   in the whole text of every #if/#ifdef/#ifndef/#elif line.
+ */
+struct ScanQuery {
+    std::string define;
+    const CompiledPattern* pattern = nullptr;
+    bool matchLines = false;
+};
+
+/** linesContain(lines, needle):
+ *   Prefilter: a file can only match a define or Python param
+ *   it mentions literally. True for an empty needle.
+ */
+static bool linesContain(const std::vector<std::string>& lines, const std::string& needle)
+{
+    if (needle.empty()) return true;
+    for (const auto& line : lines) {
+        if (line.find(needle) != std::string::npos) return true;
+    }
+    return false;
+}
+
+static std::string describeQuery(const ScanQuery& query)
+{
+    if (query.pattern) return "pattern '" + query.pattern->source + "'";
+    return "define '" + query.define + "'";
+}
+
+/** conditionIdentifiers(line, out):
+ *   Every identifier of an #if/#elif expression, bare or not
+ *   ('#if A && LOCALE_X >= 2' gives A and LOCALE_X), or the
+ *   name of an #ifdef/#ifndef. The 'defined' operator, number
+ *   suffixes and comments are skipped. Empty for other lines.
+ */
+static void conditionIdentifiers(const std::string& line, std::vector<std::string>& out)
+{
+    out.clear();
+    std::string name = directiveName(line);
+    bool single = name == "ifdef" || name == "ifndef";
+    if (!single && name != "if" && name != "elif") return;
+    size_t p = line.find('#') + 1;
+    while (p < line.size() && isSpaceChar(line[p])) p++;
+    p += name.size();
+    while (p < line.size()) {
+        char c = line[p];
+        if (c == '/' && p + 1 < line.size() && line[p + 1] == '/') break;
+        if (c == '/' && p + 1 < line.size() && line[p + 1] == '*') {
+            size_t close = line.find("*/", p + 2);
+            if (close == std::string::npos) break;
+            p = close + 2;
+            continue;
+        }
+        if (!isWordChar(c)) {
+            p++;
+            continue;
+        }
+        size_t e = p;
+        while (e < line.size() && isWordChar(line[e])) e++;
+        if (!std::isdigit((unsigned char)c) && line.compare(p, e - p, "defined") != 0) {
+            out.push_back(line.substr(p, e - p));
+            if (single) return;
+        }
+        p = e;
+    }
+}
+
+/** collectQueryHits(scan, query, matcher):
+ *   Sorted, distinct lines of the conditionals that satisfy the
+ *   query. 'matcher' runs query.pattern (unused for defines):
+ *   a glob is tried on every identifier of the conditional.
+ */
+static std::vector<size_t> collectQueryHits(const CppFileScan& scan,
+    const ScanQuery& query, PatternMatcher& matcher)
+{
+    std::vector<size_t> hits;
+    if (query.pattern && query.matchLines) {
+        for (size_t i = 0; i < scan.lines.size(); ++i) {
+            if (!(scan.flags[i] & LINE_DIRECTIVE)) continue;
+            std::string name = directiveName(scan.lines[i]);
+            if (name != "if" && name != "ifdef" && name != "ifndef" && name != "elif") continue;
+            if (matcher.search(scan.lines[i])) hits.push_back(i);
+        }
+        return hits;
+    }
+    if (query.pattern) {
+        std::vector<std::string> idents;
+        for (size_t i = 0; i < scan.lines.size(); ++i) {
+            if (!(scan.flags[i] & LINE_DIRECTIVE)) continue;
+            conditionIdentifiers(scan.lines[i], idents);
+            if (std::any_of(idents.begin(), idents.end(),
+                [&](const std::string& ident) { return matcher.search(ident); })) {
+                hits.push_back(i);
+            }
+        }
+        return hits;
+    }
+    for (const auto& ref : scan.conditionals) {
+        if (!hits.empty() && hits.back() == ref.line) continue;
+        if (conditionalMatches(ref, query.define)) hits.push_back(ref.line);
+    }
+    return hits;
+}
+
+/** extractQueryResults(scan, file, query, matcher):
+ *   Returns the conditional blocks that satisfy the query (with
+ *   two lines of leading context) and the functions containing
+ *   such a conditional.
+ */
+std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
+extractQueryResults(const CppFileScan& scan,
+    FileId file,
+    const ScanQuery& query,
+    PatternMatcher& matcher)
+{
+    std::vector<CodeBlock> defineBlocks;
+    std::vector<CodeBlock> functionBlocks;
+
+    std::vector<size_t> hits = collectQueryHits(scan, query, matcher);
+    if (hits.empty()) {
+        return { defineBlocks, functionBlocks };
+    }
+    const std::string filename = g_files.path(file);
+
+    const auto& L = scan.lines;
+    size_t resumeAt = 0;
+    for (size_t h : hits) {
+        if (h < resumeAt || !(scan.flags[h] & LINE_IF_PREFILTER)) continue;
+
+        int defineNesting = 1;
+        size_t j = h + 1;
+        for (; j < L.size(); ++j) {
+            if (scan.flags[j] & LINE_ANY_IF_START) {
+                defineNesting++;
+            }
+            else if (scan.flags[j] & LINE_HAS_ENDIF) {
+                if (--defineNesting <= 0) break;
+            }
+        }
+        if (j >= L.size()) {
+            break; // unterminated block swallows the rest of the file
+        }
+
+        CodeBlock cb;
+        cb.file = file;
+        cb.line = (h >= 2 ? h - 2 : 0) + 1;
+        cb.context = h >= 2 ? 2 : h;
+        cb.content = makeBlockContent(filename, L, h >= 2 ? h - 2 : 0, j);
+        defineBlocks.push_back(cb);
+        resumeAt = j + 1;
+    }
+
+    size_t hi = 0;
+    for (const auto& fn : scan.functions) {
+        while (hi < hits.size() && hits[hi] < fn.openLine) hi++;
+        if (hi < hits.size() && hits[hi] <= fn.endLine) {
+            CodeBlock cb;
+            cb.file = file;
+            cb.line = fn.headLine + 1;
+            cb.content = makeBlockContent(filename, L, fn.headLine, fn.endLine);
+            functionBlocks.push_back(cb);
+        }
+    }
+
+    return { defineBlocks, functionBlocks };
+}
+
+/** extractDefineResults(scan, file, define):
+ *   extractQueryResults() for a plain define.
+ */
+std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
+extractDefineResults(const CppFileScan& scan,
+    FileId file,
+    const std::string& define)
+{
+    ScanQuery query;
+    query.define = define;
+    PatternMatcher unused(nullptr);
+    return extractQueryResults(scan, file, query, unused);
+}
+
+/** parseLargeFileParallel(file, query, outLineCount):
+ *   Parses one C++ file for the query's #if blocks and the
+ *   functions containing them, reading and classifying it on
+ *   all cores. Meant for the few huge (generated) sources that
+ *   would otherwise keep one worker busy long after the others
+ *   have finished.
+ */
+std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
+parseLargeFileParallel(FileId file,
+    const ScanQuery& query,
+    size_t& outLineCount)
+{
+    TraceSpan parse("parse large file", file);
+    std::vector<std::string> lines;
+    readLinesChunkedParallel(g_files.path(file), lines);
+    outLineCount += lines.size();
+    if (!query.pattern && !linesContain(lines, query.define)) return {};
+
+    CppFileScan scan = scanCppLinesParallel(std::move(lines));
+    PatternMatcher matcher(query.pattern);
+    return extractQueryResults(scan, file, query, matcher);
+}
+
+/*******************************************************
+ * Python scanning: if app.xyz + function blocks
+ *******************************************************/
+static const std::regex pythonIfAppRegex(
+    R"((?:if|elif)\s*\(?\s*app\.(\w+))",
+    std::regex_constants::ECMAScript | std::regex_constants::optimize);
+static const std::regex defRegex(R"(^\s*def\s+[\w_]+)");
+
+/** app.<XYZ> names that are runtime helpers, not feature flags */
+static const std::unordered_set<std::string> pythonParamBlacklist = {
+    "loggined", "VK_UP", "VK_RIGHT", "VK_LEFT", "VK_HOME", "VK_END",
+    "VK_DOWN", "VK_DELETE", "TARGET", "SELL", "BUY", "DIK_DOWN",
+    "DIK_F1", "DIK_F2", "DIK_F3", "DIK_F4", "DIK_H", "DIK_LALT",
+    "DIK_LCONTROL", "DIK_RETURN", "DIK_SYSRQ", "DIK_UP", "DIK_V",
+    "GetGlobalTime","GetTime","IsDevStage","IsEnableTestServerFlag",
+    "IsExistFile","IsPressed","IsWebPageMode",
+};
+
+int getIndent(const std::string& ln) {
+    return std::accumulate(ln.begin(), ln.end(), 0, [](int sum, char c) {
+        return sum + (c == ' ' ? 1 : (c == '\t' ? 4 : 0));
+        });
+}
+
+/** PythonAppRef:
+ *   One "if app.<param>" / "elif app.<param>" occurrence.
+ */
+struct PythonAppRef {
+    size_t line = 0;
+    std::string param;
+};
+
+struct PythonFileScan {
+    std::vector<std::string> lines;
+    std::vector<int> indent;
+    std::vector<uint8_t> isDef;
+    std::vector<PythonAppRef> appRefs;
+};
+
+/** parsePythonAppRefs(line, lineIndex, out):
+ *   Records every parameter matched by (?:if|elif)\s*\(?\s*app\.(\w+)
+ */
+void parsePythonAppRefs(const std::string& line, size_t lineIndex,
+    std::vector<PythonAppRef>& out)
+{
+    size_t pos = 0;
+    while ((pos = line.find("if", pos)) != std::string::npos) {
+        size_t p = pos + 2;
+        pos += 2;
+        while (p < line.size() && isSpaceChar(line[p])) p++;
+        if (p < line.size() && line[p] == '(') p++;
+        while (p < line.size() && isSpaceChar(line[p])) p++;
+        if (line.compare(p, 4, "app.") != 0) continue;
+        p += 4;
+        size_t e = p;
+        while (e < line.size() && isWordChar(line[e])) e++;
+        if (e > p) {
+            out.push_back({ lineIndex, line.substr(p, e - p) });
+        }
+    }
+}
+
+/** scanPythonLines(lines):
+ *   Classifies a Python file once (indentation, def lines and
+ *   app.<param> conditions) for any number of param queries.
+ *   Trailing '\r' is dropped so CRLF files behave like they
+ *   do with std::getline in text mode.
+ */
+PythonFileScan scanPythonLines(std::vector<std::string> lines)
+{
+    PythonFileScan scan;
+    scan.lines = std::move(lines);
+    scan.indent.resize(scan.lines.size());
+    scan.isDef.resize(scan.lines.size());
+
+    for (size_t i = 0; i < scan.lines.size(); ++i) {
+        auto& line = scan.lines[i];
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        scan.indent[i] = getIndent(line);
+        if (line.find("def") != std::string::npos) {
+            TraceLineTimer timer(i);
+            scan.isDef[i] = std::regex_search(line, defRegex) ? 1 : 0;
+        }
+        if (line.find("app.") != std::string::npos) {
+            TraceLineTimer timer(i);
+            parsePythonAppRefs(line, i, scan.appRefs);
+        }
+    }
+    return scan;
+}
+
+/** extractPythonParamResults(scan, filename, param):
+ *   Looks for lines containing "if app.<param>" and collects
+ *   the subsequent indented block. Also detects functions
+ *   containing such an if-block.
+ */
+std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
+extractPythonParamResults(const PythonFileScan& scan,
+    FileId file,
+    const std::string& param)
+{
+    std::vector<CodeBlock> ifBlocks;
+    std::vector<CodeBlock> funcBlocks;
+
+    const auto& L = scan.lines;
+    std::vector<uint8_t> matches(L.size(), 0);
+    bool any = false;
+    for (const auto& ref : scan.appRefs) {
+        if (ref.param == param) {
+            matches[ref.line] = 1;
+            any = true;
+        }
+    }
+    if (!any) {
+        return { ifBlocks, funcBlocks };
+    }
+
+    const std::string banner = "##########\n" + g_files.path(file) + "\n##########\n";
+
+    bool insideFunc = false;
+    int  funcIndent = 0;
+    bool functionRelevant = false;
+    size_t funcLine = 0;
+    std::string currentFunc;
+
+    size_t i = 0;
+    while (i < L.size()) {
+        const auto& line = L[i];
+
+        if (scan.isDef[i]) {
+            if (insideFunc && functionRelevant) {
+                CodeBlock cb;
+                cb.file = file;
+                cb.line = funcLine + 1;
+                cb.content = banner + currentFunc;
+                funcBlocks.push_back(cb);
+            }
+            insideFunc = true;
+            funcIndent = scan.indent[i];
+            funcLine = i;
+            functionRelevant = false;
+            currentFunc = line + "\n";
+            ++i;
+            continue;
+        }
+
+        if (insideFunc) {
+            if (!line.empty() && scan.indent[i] <= funcIndent) {
+                if (functionRelevant) {
+                    CodeBlock cb;
+                    cb.file = file;
+                    cb.line = funcLine + 1;
+                    cb.content = banner + currentFunc;
+                    funcBlocks.push_back(cb);
+                }
+                insideFunc = false;
+                currentFunc.clear();
+                functionRelevant = false;
+            }
+            else {
+                currentFunc += line;
+                currentFunc += "\n";
+            }
+        }
+
+        if (matches[i]) {
+            int ifIndent = scan.indent[i];
+            std::string blockContent = line + "\n";
+
+            // the if-body is consumed here, just like the old stream-based reader did
+            size_t j = i + 1;
+            for (; j < L.size(); ++j) {
+                if (!L[j].empty() && scan.indent[j] <= ifIndent) {
+                    break;
+                }
+                blockContent += L[j];
+                blockContent += "\n";
+            }
+
+            CodeBlock cb;
+            cb.file = file;
+            cb.line = i + 1;
+            cb.content = banner + blockContent;
+            ifBlocks.push_back(cb);
+
+            if (insideFunc) {
+                functionRelevant = true;
+            }
+            i = j;
+            continue;
+        }
+        ++i;
+    }
+
+    if (insideFunc && functionRelevant) {
+        CodeBlock cb;
+        cb.file = file;
+        cb.line = funcLine + 1;
+        cb.content = banner + currentFunc;
+        funcBlocks.push_back(cb);
+    }
+
+    return { ifBlocks, funcBlocks };
+}
+
+
+/*******************************************************
+ * collectPythonParameters():
+ *   Scans all .py files for lines: if app.<XYZ>
+ *   Gathers unique "XYZ" parameters
+ *******************************************************/
+std::unordered_set<std::string> collectPythonParameters(const FileList& pyFiles) {
+    std::unordered_set<std::string> params;
+    const auto& blacklist = pythonParamBlacklist;
+
+    for (FileId f : pyFiles) {
+        auto ifs = openSourceStream(g_files.path(f));
+        if (!*ifs) continue;
+
+        std::string line;
+        while (std::getline(*ifs, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            std::smatch m;
+            size_t pos = line.find("if app.");
+            if (pos != std::string::npos) {
+                size_t start = pos + 7;
+                size_t end = line.find_first_of(" ():", start);
+                std::string param = line.substr(start, end - start);
+                if (!param.empty() && blacklist.find(param) == blacklist.end()) {
+                    params.insert(param);
+                }
+            }
+            else if (std::regex_search(line, pythonIfAppRegex)) {
+                std::smatch m;
+                if (std::regex_search(line, m, pythonIfAppRegex) && m.size() > 1) {
+                    std::string param = m[1].str();
+                    if (blacklist.find(param) == blacklist.end()) {
+                        params.insert(param);
+                    }
+                }
+            }
+        }
+    }
+    return params;
+}
+
+/*******************************************************
+ * Per-file result slots
+ *
+ *  Every worker writes the blocks of file i into slot i and
+ *  nowhere else, so collecting results needs no lock. With the
+ *  file list sorted by path and the blocks of one file already
+ *  in line order, joining the slots front to back yields the
+ *  same (path, line) order on every run.
+ *******************************************************/
+typedef std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>> FileBlocks;
+
+/** sortedFileList(files):
+ *   Copy of 'files' ordered by path; index = slot.
+ */
+FileList sortedFileList(const FileList& files)
+{
+    std::vector<std::pair<std::string, FileId>> keyed;
+    keyed.reserve(files.size());
+    for (FileId f : files) keyed.emplace_back(g_files.path(f), f);
+    std::sort(keyed.begin(), keyed.end());
+    FileList sorted;
+    sorted.reserve(keyed.size());
+    for (const auto& k : keyed) sorted.push_back(k.second);
+    return sorted;
+}
+
+/** joinFileSlots(slots):
+ *   Concatenates the per-file results in file id order.
+ */
+FileBlocks joinFileSlots(std::vector<FileBlocks>& slots)
+{
+    TraceSpan merge("merge");
+    size_t firstCount = 0;
+    size_t secondCount = 0;
+    for (const auto& slot : slots) {
+        firstCount += slot.first.size();
+        secondCount += slot.second.size();
+    }
+    FileBlocks all;
+    all.first.reserve(firstCount);
+    all.second.reserve(secondCount);
+    for (auto& slot : slots) {
+        std::move(slot.first.begin(), slot.first.end(), std::back_inserter(all.first));
+        std::move(slot.second.begin(), slot.second.end(), std::back_inserter(all.second));
+    }
+    return all;
+}
+
+/*******************************************************
+ * File feed: reader stage -> bounded queue -> parser stage
+ *
+ *  A few reader threads prefetch whole files into a queue
+ *  capped at PREFETCH_BYTES; the parser workers take buffers
+ *  from it, so reading and parsing overlap and each stage has
+ *  its own thread count. Files are read grouped by directory
+ *  and in inode order there, which keeps disk readahead
+ *  useful; results still land in the per-file slots.
+ *
+ *  On Linux a single io_uring reader replaces the reader
+ *  threads: it keeps openat, statx and read requests for
+ *  many files in flight at once, so the disk / NFS latency of
+ *  one file overlaps with the others. The rings are driven
+ *  with the raw syscalls; if the kernel lacks io_uring or one
+ *  of the opcodes, the reader threads are used.
+ *******************************************************/
+static bool g_useUring = true;                      // --reader plain|uring
+static const size_t PREFETCH_BYTES = 64u << 20;     // queued file data
+static const size_t PREFETCH_FILES = 4096;          // queued files
+static const size_t PLAIN_READER_THREADS = 4;
+static const unsigned URING_QUEUE_DEPTH = 64;       // files in flight
+
+/** Size, inode and modification time of one file; inode stays 0 where unknown */
+struct FileStat {
+    uintmax_t size = 0;
+    uint64_t inode = 0;
+    int64_t mtime = 0;   // nanoseconds where available, otherwise seconds
+};
+
+/** statFiles(files):
+ *   Stats all files concurrently (cheap compared to reading,
+ *   but still a round trip per file on network mounts).
+ */
+std::vector<FileStat> statFiles(const FileList& files)
+{
+    TraceSpan span("stat");
+    std::vector<FileStat> stats(files.size());
+    runParallel(files.size(), [&](size_t i) {
+        const std::string path = g_files.path(files[i]);
+        if (auto member = archiveMember(path)) {
+            stats[i].size = member->data.size();
+            stats[i].mtime = member->mtime;
+            return;
+        }
+#ifdef _WIN32
+        std::error_code ec;
+        uintmax_t size = fs::file_size(path, ec);
+        if (!ec) stats[i].size = size;
+        auto mtime = fs::last_write_time(path, ec);
+        if (!ec) stats[i].mtime = (int64_t)mtime.time_since_epoch().count();
+#else
+        struct stat st;
+        if (::stat(path.c_str(), &st) == 0) {
+            stats[i].size = (uintmax_t)st.st_size;
+            stats[i].inode = (uint64_t)st.st_ino;
+#ifdef __linux__
+            stats[i].mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+            stats[i].mtime = (int64_t)st.st_mtime;
+#endif
+        }
+#endif
+    });
+    return stats;
+}
+
+/** localityOrder(files, stats, pending, likely):
+ *   'pending' reordered by directory, then inode, then name.
+ *   Files flagged in 'likely' (if given) come first.
+ */
+static std::vector<size_t> localityOrder(const FileList& files,
+    const std::vector<FileStat>& stats,
+    const std::vector<size_t>& pending,
+    const std::vector<uint8_t>& likely)
+{
+    std::vector<std::pair<uint32_t, size_t>> keyed;
+    keyed.reserve(pending.size());
+    for (size_t idx : pending) {
+        keyed.emplace_back(g_files.directory(files[idx]), idx);
+    }
+    std::sort(keyed.begin(), keyed.end(), [&](const auto& a, const auto& b) {
+        if (!likely.empty() && likely[a.second] != likely[b.second]) return likely[a.second] > likely[b.second];
+        if (a.first != b.first) return a.first < b.first;
+        if (stats[a.second].inode != stats[b.second].inode) return stats[a.second].inode < stats[b.second].inode;
+        return a.second < b.second;
+    });
+    std::vector<size_t> order;
+    order.reserve(keyed.size());
+    for (const auto& k : keyed) order.push_back(k.second);
+    return order;
+}
+
+#ifdef HAVE_IO_URING
+struct UringRing {
+    int fd = -1;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqEntries = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    void* sqPtr = MAP_FAILED;
+    size_t sqLen = 0;
+    void* cqPtr = MAP_FAILED;
+    size_t cqLen = 0;
+    size_t sqesLen = 0;
+    unsigned toSubmit = 0;
+};
+
+static void uringExit(UringRing& r)
+{
+    if (r.sqes) munmap(r.sqes, r.sqesLen);
+    if (r.cqPtr != MAP_FAILED && r.cqPtr != r.sqPtr) munmap(r.cqPtr, r.cqLen);
+    if (r.sqPtr != MAP_FAILED) munmap(r.sqPtr, r.sqLen);
+    if (r.fd >= 0) close(r.fd);
+    r = UringRing();
+}
+
+/** uringInit(r, entries):
+ *   Sets up and maps the rings; false if io_uring or one of
+ *   the opcodes the reader needs is not available.
+ */
+static bool uringInit(UringRing& r, unsigned entries)
+{
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    r.fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r.fd < 0) {
+        r.fd = -1;
+        return false;
+    }
+
+    r.sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r.cqLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMmap) {
+        r.sqLen = r.cqLen = std::max(r.sqLen, r.cqLen);
+    }
+    r.sqPtr = mmap(nullptr, r.sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+    if (r.sqPtr == MAP_FAILED) { uringExit(r); return false; }
+    r.cqPtr = singleMmap ? r.sqPtr
+        : mmap(nullptr, r.cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+    if (r.cqPtr == MAP_FAILED) { uringExit(r); return false; }
+    r.sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, r.sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) { uringExit(r); return false; }
+    r.sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)r.sqPtr;
+    r.sqHead = (unsigned*)(sq + p.sq_off.head);
+    r.sqTail = (unsigned*)(sq + p.sq_off.tail);
+    r.sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r.sqArray = (unsigned*)(sq + p.sq_off.array);
+    r.sqEntries = p.sq_entries;
+    char* cq = (char*)r.cqPtr;
+    r.cqHead = (unsigned*)(cq + p.cq_off.head);
+    r.cqTail = (unsigned*)(cq + p.cq_off.tail);
+    r.cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r.cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // openat / statx / read arrived together with the probe interface (5.6)
+    std::vector<char> probeBuf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    auto* probe = (io_uring_probe*)probeBuf.data();
+    if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        uringExit(r);
+        return false;
+    }
+    for (int op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ }) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            uringExit(r);
+            return false;
+        }
+    }
+    return true;
+}
+
+/** uringGetSqe(r): next free submission entry (zeroed) or nullptr */
+static io_uring_sqe* uringGetSqe(UringRing& r)
+{
+    unsigned head = __atomic_load_n(r.sqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *r.sqTail;
+    if (tail - head >= r.sqEntries) return nullptr;
+    unsigned index = tail & *r.sqMask;
+    io_uring_sqe* sqe = &r.sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    r.sqArray[index] = index;
+    __atomic_store_n(r.sqTail, tail + 1, __ATOMIC_RELEASE);
+    r.toSubmit++;
+    return sqe;
+}
+
+/** uringSubmitAndWait(r): submits queued entries, waits for one completion */
+static bool uringSubmitAndWait(UringRing& r)
+{
+    while (true) {
+        long rc = syscall(__NR_io_uring_enter, r.fd, r.toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (rc >= 0) {
+            r.toSubmit -= std::min<unsigned>(r.toSubmit, (unsigned)rc);
+            return true;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+    }
+}
+
+/** uringWait(r): waits for one completion, submits nothing */
+static bool uringWait(UringRing& r)
+{
+    while (true) {
+        long rc = syscall(__NR_io_uring_enter, r.fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (rc >= 0) return true;
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+    }
+}
+
+static bool uringAvailable()
+{
+    static int available = -1;
+    if (available < 0) {
+        UringRing r;
+        available = uringInit(r, 4) ? 1 : 0;
+        uringExit(r);
+    }
+    return available == 1;
+}
+#endif
+
+struct FeedItem {
+    size_t index = 0;
+    std::string data;
+    bool needsRead = false; // reader gave up on it: the worker reads it itself
+};
+
+struct FileFeed {
+    const FileList* files = nullptr;
+    std::vector<FileStat> stats;
+    std::vector<size_t> order;          // read order (locality)
+    std::atomic<size_t> nextRead{ 0 };
+
+    std::mutex queueMutex;
+    std::condition_variable itemReady;  // parsers wait here
+    std::condition_variable spaceFree;  // readers wait here
+    std::deque<FeedItem> ready;
+    size_t queuedBytes = 0;
+    size_t readersRunning = 0;
+    bool stopped = false;               // scan cancelled: readers just wind down
+    std::vector<std::thread> readers;
+    ConcurrencyControl* control = nullptr;  // optional, steers the reader stage
+};
+
+/** waitForQueueSpace(feed, bytes):
+ *   Blocks a reader until 'bytes' more fit below the cap. An
+ *   empty queue always accepts, so oversized files cannot
+ *   stall the pipeline.
+ */
+static void waitForQueueSpace(FileFeed& feed, size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(feed.queueMutex);
+    auto fits = [&] {
+        return feed.stopped || feed.ready.empty() ||
+            (feed.queuedBytes + bytes <= PREFETCH_BYTES && feed.ready.size() < PREFETCH_FILES);
+    };
+    if (fits()) return;
+    TraceSpan wait("wait queue space");
+    feed.spaceFree.wait(lock, fits);
+}
+
+static void pushFeedItem(FileFeed& feed, FeedItem&& item)
+{
+    {
+        std::lock_guard<std::mutex> lock(feed.queueMutex);
+        feed.queuedBytes += item.data.size();
+        feed.ready.push_back(std::move(item));
+    }
+    feed.itemReady.notify_one();
+}
+
+static void readerFinished(FileFeed& feed)
+{
+    std::lock_guard<std::mutex> lock(feed.queueMutex);
+    feed.readersRunning--;
+    feed.itemReady.notify_all();
+}
+
+/** readWholeFile(filename, expectedSize, data):
+ *   Reads a file into one buffer; tolerates size changes.
+ */
+static bool readWholeFile(const std::string& filename, uintmax_t expectedSize, std::string& data)
+{
+    if (auto member = archiveMember(filename)) {
+        data = member->data;
+        return true;
+    }
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if (!file.is_open()) return false;
+    data.resize((size_t)expectedSize);
+    file.read(&data[0], (std::streamsize)data.size());
+    data.resize((size_t)file.gcount());
+    if (file) {
+        std::vector<char> buffer(BUFFER_SIZE);
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+            data.append(buffer.data(), (size_t)file.gcount());
+        }
+    }
+    return true;
+}
+
+/** waitForReaderTurn(feed, reader):
+ *   Blocks while the controller has parked this plain reader.
+ *   Parked readers also leave once the other readers have
+ *   claimed every file.
+ */
+static void waitForReaderTurn(FileFeed& feed, size_t reader)
+{
+    ConcurrencyControl* ctl = feed.control;
+    if (!ctl || reader < ctl->readers.load(std::memory_order_relaxed)) return;
+    TraceSpan parked("reader parked");
+    std::unique_lock<std::mutex> lock(ctl->mutex);
+    ctl->wake.wait(lock, [&] {
+        return ctl->finished || reader < ctl->readers.load() ||
+            feed.nextRead.load(std::memory_order_relaxed) >= feed.order.size();
+    });
+}
+
+/** plainReaderThread(feed, reader):
+ *   Claims files in read order, waits for queue space, reads.
+ */
+static void plainReaderThread(FileFeed& feed, size_t reader)
+{
+    traceThreadName("reader");
+    while (true) {
+        waitForReaderTurn(feed, reader);
+        size_t next = feed.nextRead.fetch_add(1, std::memory_order_relaxed);
+        if (next >= feed.order.size()) break;
+        size_t idx = feed.order[next];
+
+        waitForQueueSpace(feed, (size_t)feed.stats[idx].size);
+        FeedItem item;
+        item.index = idx;
+        const std::string path = g_files.path((*feed.files)[idx]);
+        TraceSpan read("read", (*feed.files)[idx]);
+        if (!readWholeFile(path, feed.stats[idx].size, item.data)) {
+            std::cerr << "Error: Unable to open file: " << path << "\n";
+        }
+        pushFeedItem(feed, std::move(item));
+    }
+    if (feed.control) {
+        // release parked readers, there is nothing left to claim
+        std::lock_guard<std::mutex> lock(feed.control->mutex);
+        feed.control->wake.notify_all();
+    }
+    readerFinished(feed);
+}
+
+#ifdef HAVE_IO_URING
+/** uringReaderThread(feed):
+ *   Keeps up to QUEUE_DEPTH files in flight (fewer while the
+ *   feed's controller lowers the depth). Each file issues
+ *   openat + statx together, then reads stx_size bytes (more
+ *   reads if short, stops early at EOF) and is queued. New
+ *   files are only started while the queue is below its cap.
+ */
+static void uringReaderThread(FileFeed& feed)
+{
+    traceThreadName("uring reader");
+    const std::vector<size_t>& order = feed.order;
+    const unsigned QUEUE_DEPTH = URING_QUEUE_DEPTH;
+
+    enum : uint64_t { OP_OPEN = 0, OP_STAT = 1, OP_READ = 2 };
+    struct Slot {
+        bool busy = false;
+        size_t index = 0;
+        int fd = -1;
+        int outstanding = 0;
+        bool failed = false;
+        bool opened = false;
+        bool statted = false;
+        struct statx stx;
+        std::string path;       // referenced by the openat / statx requests
+        std::string data;
+        size_t filled = 0;
+    };
+
+    size_t nextOrder = 0;
+    UringRing ring;
+    bool ringBroken = !uringInit(ring, QUEUE_DEPTH * 2);
+
+    std::vector<Slot> slots(QUEUE_DEPTH);
+    size_t inFlight = 0;
+    size_t inFlightBytes = 0;
+
+    auto finish = [&](size_t s) {
+        Slot& slot = slots[s];
+        if (slot.fd >= 0) close(slot.fd);
+        FeedItem item;
+        item.index = slot.index;
+        if (slot.failed) {
+            std::cerr << "Error: Unable to open file: " << slot.path << "\n";
+        }
+        else {
+            slot.data.resize(slot.filled);
+            item.data = std::move(slot.data);
+        }
+        inFlightBytes -= (size_t)feed.stats[slot.index].size;
+        pushFeedItem(feed, std::move(item));
+        slot = Slot();
+        inFlight--;
+    };
+    auto submitRead = [&](size_t s) {
+        Slot& slot = slots[s];
+        io_uring_sqe* sqe = uringGetSqe(ring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = slot.fd;
+        sqe->addr = (uint64_t)(uintptr_t)(&slot.data[0] + slot.filled);
+        sqe->len = (unsigned)std::min<size_t>(slot.data.size() - slot.filled, 1u << 30);
+        sqe->off = slot.filled;
+        sqe->user_data = (s << 2) | OP_READ;
+        slot.outstanding++;
+    };
+
+    while (!ringBroken && (nextOrder < order.size() || inFlight > 0)) {
+        if (scanCancelled()) nextOrder = order.size();   // finish the files in flight, start no more
+        if (inFlight == 0) {
+            if (nextOrder >= order.size()) break;
+            waitForQueueSpace(feed, (size_t)feed.stats[order[nextOrder]].size);
+        }
+        size_t queued;
+        {
+            std::lock_guard<std::mutex> lock(feed.queueMutex);
+            queued = feed.queuedBytes;
+        }
+
+        // refill: two entries per new file, the ring holds 2 * QUEUE_DEPTH
+        size_t depth = feed.control ? std::max<size_t>(1, feed.control->readers.load(std::memory_order_relaxed))
+            : slots.size();
+        for (size_t s = 0; s < slots.size() && nextOrder < order.size() && inFlight < depth; ++s) {
+            if (slots[s].busy) continue;
+            size_t idx = order[nextOrder];
+            size_t bytes = (size_t)feed.stats[idx].size;
+            if (inFlight > 0 && queued + inFlightBytes + bytes > PREFETCH_BYTES) break;
+
+            Slot& slot = slots[s];
+            slot.busy = true;
+            slot.index = idx;
+            nextOrder++;
+            inFlight++;
+            inFlightBytes += bytes;
+            slot.path = g_files.path((*feed.files)[idx]);
+            const char* path = slot.path.c_str();
+
+            io_uring_sqe* open = uringGetSqe(ring);
+            open->opcode = IORING_OP_OPENAT;
+            open->fd = AT_FDCWD;
+            open->addr = (uint64_t)(uintptr_t)path;
+            open->open_flags = O_RDONLY | O_CLOEXEC;
+            open->user_data = (s << 2) | OP_OPEN;
+
+            io_uring_sqe* stat = uringGetSqe(ring);
+            stat->opcode = IORING_OP_STATX;
+            stat->fd = AT_FDCWD;
+            stat->addr = (uint64_t)(uintptr_t)path;
+            stat->len = STATX_SIZE;
+            stat->statx_flags = AT_STATX_SYNC_AS_STAT;
+            stat->off = (uint64_t)(uintptr_t)&slot.stx;
+            stat->user_data = (s << 2) | OP_STAT;
+
+            slot.outstanding = 2;
+        }
+
+        bool submitted;
+        {
+            TraceSpan wait("uring wait");
+            submitted = uringSubmitAndWait(ring);
+        }
+        if (!submitted) {
+            ringBroken = true;
+            break;
+        }
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = ring.cqes[head & *ring.cqMask];
+            size_t s = (size_t)(cqe.user_data >> 2);
+            uint64_t op = cqe.user_data & 3;
+            int res = cqe.res;
+            Slot& slot = slots[s];
+            slot.outstanding--;
+
+            if (op == OP_OPEN) {
+                if (res < 0) slot.failed = true;
+                else slot.fd = res;
+                slot.opened = true;
+            }
+            else if (op == OP_STAT) {
+                if (res < 0) slot.failed = true;
+                else slot.data.resize((size_t)slot.stx.stx_size);
+                slot.statted = true;
+            }
+            else {
+                if (res < 0) {
+                    slot.failed = true;
+                }
+                else if (res == 0) {
+                    slot.data.resize(slot.filled); // file shrank
+                }
+                else {
+                    slot.filled += (size_t)res;
+                }
+            }
+
+            if (slot.outstanding > 0) continue;
+            bool complete = slot.failed || slot.filled >= slot.data.size() || (op == OP_READ && res == 0);
+            if (slot.opened && slot.statted && !complete) {
+                submitRead(s);
+            }
+            else {
+                finish(s);
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    bool ringDrained = true;
+    if (ringBroken && ring.fd >= 0) {
+        // The kernel may still own requests pointing into the slots (path,
+        // stx, data): reap them all before any fd is closed or slot freed.
+        // Entries it never consumed stay put, nothing submits them anymore.
+        unsigned consumed = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+        size_t pending = 0;
+        for (const auto& slot : slots) pending += (size_t)slot.outstanding;
+        pending -= std::min<size_t>(pending, *ring.sqTail - consumed);
+        while (pending > 0) {
+            unsigned head = *ring.cqHead;
+            unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail && pending > 0; ++head, --pending) {
+                const io_uring_cqe& cqe = ring.cqes[head & *ring.cqMask];
+                Slot& slot = slots[(size_t)(cqe.user_data >> 2)];
+                slot.outstanding--;
+                if ((cqe.user_data & 3) == OP_OPEN && cqe.res >= 0) slot.fd = cqe.res;
+            }
+            __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+            if (pending > 0 && !uringWait(ring)) {
+                ringDrained = false;
+                break;
+            }
+        }
+    }
+    if (ringBroken) {
+        // hand everything not yet delivered to the parsers
+        for (auto& slot : slots) {
+            if (!slot.busy) continue;
+            if (slot.fd >= 0 && ringDrained) close(slot.fd);
+            FeedItem item;
+            item.index = slot.index;
+            item.needsRead = true;
+            pushFeedItem(feed, std::move(item));
+        }
+        for (; nextOrder < order.size(); ++nextOrder) {
+            FeedItem item;
+            item.index = order[nextOrder];
+            item.needsRead = true;
+            pushFeedItem(feed, std::move(item));
+        }
+    }
+    if (ringDrained) {
+        uringExit(ring);
+    }
+    else {
+        // requests we could not reap may still write into the slots:
+        // leave them and the ring alive rather than risk freed memory
+        (void)new std::vector<Slot>(std::move(slots));
+    }
+    readerFinished(feed);
+}
+#endif
+
+/** startFileFeed(feed, files, stats, pending, likely):
+ *   Starts the reader stage for files[pending[i]] ('stats' from
+ *   statFiles(), indexed like 'files'). Files flagged in the
+ *   optional 'likely' are read first. With feed.control set,
+ *   the readers are registered with that controller.
+ */
+void startFileFeed(FileFeed& feed, const FileList& files,
+    std::vector<FileStat> stats, const std::vector<size_t>& pending,
+    const std::vector<uint8_t>& likely = std::vector<uint8_t>())
+{
+    feed.files = &files;
+    feed.stats = std::move(stats);
+    feed.order = localityOrder(files, feed.stats, pending, likely);
+    if (feed.order.empty()) return;
+
+#ifdef HAVE_IO_URING
+    // io_uring reads real files; archive members come from memory
+    bool archived = false;
+    if (g_archivesMounted.load(std::memory_order_acquire)) {
+        for (size_t idx : feed.order) {
+            if (archiveMember(g_files.path(files[idx]))) { archived = true; break; }
+        }
+    }
+    if (g_useUring && !archived && feed.order.size() > 1 && uringAvailable()) {
+        if (feed.control) {
+            feed.control->readerDepth = true;
+            feed.control->readers = URING_QUEUE_DEPTH;
+            feed.control->readerSlots = URING_QUEUE_DEPTH;
+        }
+        feed.readersRunning = 1;
+        feed.readers.emplace_back(uringReaderThread, std::ref(feed));
+        return;
+    }
+#endif
+    size_t numReaders = std::min({ PLAIN_READER_THREADS, workerThreadLimit(), feed.order.size() });
+    if (feed.control) {
+        feed.control->readers = numReaders;
+        feed.control->readerSlots = numReaders;
+    }
+    feed.readersRunning = numReaders;
+    for (size_t t = 0; t < numReaders; ++t) {
+        feed.readers.emplace_back(plainReaderThread, std::ref(feed), t);
+    }
+}
+
+/** nextFeedFile(feed, index, lines):
+ *   Gives the calling parser its next file as lines (same line
+ *   splitting as readBufferedFile). False when all are done.
+ */
+bool nextFeedFile(FileFeed& feed, size_t& index, std::vector<std::string>& lines)
+{
+    lines.clear();
+    FeedItem item;
+    {
+        std::unique_lock<std::mutex> lock(feed.queueMutex);
+        auto available = [&] { return !feed.ready.empty() || feed.readersRunning == 0; };
+        if (!available()) {
+            TraceSpan wait("wait for file");
+            feed.itemReady.wait(lock, available);
+        }
+        if (feed.ready.empty()) return false;
+        item = std::move(feed.ready.front());
+        feed.ready.pop_front();
+        feed.queuedBytes -= item.data.size();
+    }
+    feed.spaceFree.notify_all();
+
+    index = item.index;
+    if (item.needsRead) {
+        TraceSpan read("read", (*feed.files)[index]);
+        readBufferedFile(g_files.path((*feed.files)[index]), lines);
+    }
+    else {
+        TraceSpan split("split lines", (*feed.files)[index]);
+        decodeSourceText(item.data);
+        splitLinesInto(item.data.data(), item.data.size(), lines);
+    }
+    return true;
+}
+
+/** stopFileFeed(feed):
+ *   After scanCancelled(): the readers start no new files, the
+ *   queued ones are dropped and blocked readers are released.
+ */
+static void stopFileFeed(FileFeed& feed)
+{
+    feed.nextRead.store(feed.order.size(), std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(feed.queueMutex);
+        feed.stopped = true;
+        feed.ready.clear();
+        feed.queuedBytes = 0;
+    }
+    feed.spaceFree.notify_all();
+}
+
+/** nextControlledFile(feed, ctl, worker, index, lines):
+ *   nextFeedFile() for a worker under a ConcurrencyControl:
+ *   waits while the worker is parked and releases the others
+ *   once the feed runs dry or the scan is cancelled.
+ */
+bool nextControlledFile(FileFeed& feed, ConcurrencyControl& ctl, size_t worker,
+    size_t& index, std::vector<std::string>& lines)
+{
+    waitForTurn(ctl, worker);
+    if (scanCancelled()) stopFileFeed(feed);
+    else if (nextFeedFile(feed, index, lines)) return true;
+    workersFinished(ctl);
+    return false;
+}
+
+/** ScanProgress:
+ *   Progress in bytes (known from the stat pass, so no extra
+ *   read is needed up front) plus the number of parsed lines.
+ */
+struct ScanProgress {
+    size_t totalBytes = 0;
+    std::atomic<size_t> bytes{ 0 };
+    std::atomic<size_t> lines{ 0 };
+    std::atomic<size_t> hitFiles{ 0 };
+    std::vector<uint8_t> scanned;       // per file, for interruptible scans
+    steady_clock::time_point started = steady_clock::now();
+};
+
+static void reportParsed(ScanProgress& progress, uintmax_t bytes, size_t lines)
+{
+    progress.lines.fetch_add(lines, std::memory_order_relaxed);
+    size_t done = progress.bytes.fetch_add((size_t)bytes, std::memory_order_relaxed) + (size_t)bytes;
+    printProgress(done, progress.totalBytes);
+}
+
+static size_t totalSize(const std::vector<FileStat>& stats)
+{
+    size_t total = 0;
+    for (const auto& st : stats) total += (size_t)st.size;
+    return total;
+}
+
+void finishFileFeed(FileFeed& feed)
+{
+    for (auto& th : feed.readers) {
+        th.join();
+    }
+}
+
+/*******************************************************
+ * Result cache
+ *
+ *  The blocks found by a define, pattern or Python param
+ *  search are stored in Output/RESULT_CACHE/<key>.bin. The key
+ *  hashes the query, SCANNER_VERSION and the path and content
+ *  hash of every input file, so repeating a search over
+ *  unchanged sources needs no parsing at all.
+ *
+ *  Content hashes are remembered per path together with size
+ *  and modification time (FILE_HASHES.bin); only new or touched
+ *  files are read and hashed again. The least recently used
+ *  entries are dropped beyond RESULT_CACHE_MAX_ENTRIES.
+ *  --no-cache bypasses the cache.
+ *******************************************************/
+static const uint32_t SCANNER_VERSION = 4;   // bump whenever a scanner change alters results
+static const char RESULT_CACHE_MAGIC[8] = { 'D', 'E', 'X', 'R', 'E', 'S', '\r', '\n' };
+static const char* const RESULT_CACHE_DIR = "Output/RESULT_CACHE";
+static const char* const FILE_HASHES_FILE = "Output/RESULT_CACHE/FILE_HASHES.bin";
+static const size_t RESULT_CACHE_MAX_ENTRIES = 256;
+static bool g_useResultCache = true;          // --no-cache
+
+static void putCacheU64(std::string& out, uint64_t v)
+{
+    out.append((const char*)&v, sizeof(v));
+}
+
+static void putCacheString(std::string& out, const std::string& s)
+{
+    putCacheU64(out, s.size());
+    out += s;
+}
+
+static bool getCacheU64(const char*& p, const char* end, uint64_t& v)
+{
+    if ((size_t)(end - p) < sizeof(v)) return false;
+    std::memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return true;
+}
+
+static bool getCacheString(const char*& p, const char* end, std::string& s)
+{
+    uint64_t n;
+    if (!getCacheU64(p, end, n) || (uint64_t)(end - p) < n) return false;
+    s.assign(p, (size_t)n);
+    p += n;
+    return true;
+}
+
+struct FileHashEntry {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+};
+
+static std::unordered_map<std::string, FileHashEntry> loadFileHashes()
+{
+    std::unordered_map<std::string, FileHashEntry> table;
+    std::string data;
+    std::error_code ec;
+    uintmax_t size = fs::file_size(FILE_HASHES_FILE, ec);
+    if (ec || !readWholeFile(FILE_HASHES_FILE, size, data)) return table;
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    uint64_t version, count;
+    if (!getCacheU64(p, end, version) || version != SCANNER_VERSION || !getCacheU64(p, end, count)) return table;
+    std::string path;
+    for (uint64_t i = 0; i < count; ++i) {
+        FileHashEntry e;
+        uint64_t mtime;
+        if (!getCacheString(p, end, path) || !getCacheU64(p, end, e.size) ||
+            !getCacheU64(p, end, mtime) || !getCacheU64(p, end, e.hash)) {
+            table.clear();
+            break;
+        }
+        e.mtime = (int64_t)mtime;
+        table[path] = e;
+    }
+    return table;
+}
+
+static void saveFileHashes(const std::unordered_map<std::string, FileHashEntry>& table)
+{
+    std::string data;
+    putCacheU64(data, SCANNER_VERSION);
+    putCacheU64(data, table.size());
+    for (const auto& kv : table) {
+        putCacheString(data, kv.first);
+        putCacheU64(data, kv.second.size);
+        putCacheU64(data, (uint64_t)kv.second.mtime);
+        putCacheU64(data, kv.second.hash);
+    }
+    writeFileAtomically(FILE_HASHES_FILE, data);
+}
+
+/** contentHashes(files, stats, hashes, all):
+ *   XXH64 of each file's content. Without 'all' only files
+ *   whose size another file shares are hashed - the rest
+ *   cannot have an identical copy. Hashes in FILE_HASHES.bin
+ *   are reused while size and modification time match (only
+ *   with the cache enabled). Files left out or unreadable get
+ *   0; false if a file that should be hashed was unreadable.
+ */
+bool contentHashes(const FileList& fileIds,
+    const std::vector<FileStat>& stats,
+    std::vector<uint64_t>& hashes,
+    bool all)
+{
+    TraceSpan span("hash");
+    hashes.assign(fileIds.size(), 0);
+    std::vector<size_t> wanted;
+    if (all) {
+        wanted.resize(fileIds.size());
+        std::iota(wanted.begin(), wanted.end(), 0);
+    }
+    else {
+        std::unordered_map<uintmax_t, size_t> sizeCount;
+        for (const auto& st : stats) sizeCount[st.size]++;
+        for (size_t i = 0; i < fileIds.size(); ++i) {
+            if (sizeCount[stats[i].size] > 1) wanted.push_back(i);
+        }
+    }
+    if (wanted.empty()) return true;
+
+    std::unordered_map<std::string, FileHashEntry> table;
+    if (g_useResultCache) {
+        std::error_code ec;
+        fs::create_directories(RESULT_CACHE_DIR, ec);
+        table = loadFileHashes();
+    }
+    std::vector<std::string> paths(fileIds.size());
+    std::vector<size_t> stale;
+    for (size_t i : wanted) {
+        paths[i] = g_files.path(fileIds[i]);
+        auto it = table.find(paths[i]);
+        if (it != table.end() && stats[i].mtime != 0 &&
+            it->second.size == stats[i].size && it->second.mtime == stats[i].mtime) {
+            hashes[i] = it->second.hash;
+        }
+        else {
+            stale.push_back(i);
+        }
+    }
+
+    std::atomic<bool> readable{ true };
+    runParallel(stale.size(), [&](size_t k) {
+        size_t i = stale[k];
+        std::string data;
+        if (!readWholeFile(paths[i], stats[i].size, data)) {
+            readable = false;
+            return;
+        }
+        hashes[i] = hashBytes(data.data(), data.size());
+    });
+    if (g_useResultCache && !stale.empty()) {
+        for (size_t i : stale) {
+            if (hashes[i] != 0) table[paths[i]] = { (uint64_t)stats[i].size, stats[i].mtime, hashes[i] };
+        }
+        saveFileHashes(table);
+    }
+    return readable;
+}
+
+/** resultCacheFile(query, files, hashes):
+ *   Path of the cache entry for 'query' (any string that fully
+ *   identifies the search) over 'files' with the content
+ *   'hashes' (all of them, see contentHashes()). Empty if the
+ *   cache is off.
+ */
+std::string resultCacheFile(const std::string& query,
+    const FileList& files,
+    const std::vector<uint64_t>& hashes)
+{
+    if (!g_useResultCache) return std::string();
+    std::string keyData;
+    putCacheU64(keyData, SCANNER_VERSION);
+    putCacheString(keyData, query);
+    for (size_t i = 0; i < files.size(); ++i) {
+        putCacheString(keyData, g_files.path(files[i]));
+        putCacheU64(keyData, hashes[i]);
+    }
+    std::ostringstream name;
+    name << RESULT_CACHE_DIR << "/" << std::hex << std::setw(16) << std::setfill('0')
+        << hashBytes(keyData.data(), keyData.size()) << ".bin";
+    return name.str();
+}
+
+/** loadCachedResults(cacheFile, results):
+ *   Reads a cache entry; marks it as recently used.
+ */
+bool loadCachedResults(const std::string& cacheFile, FileBlocks& results)
+{
+    TraceSpan span("cache lookup");
+    if (cacheFile.empty()) return false;
+    std::error_code ec;
+    uintmax_t size = fs::file_size(cacheFile, ec);
+    std::string data;
+    if (ec || !readWholeFile(cacheFile, size, data)) return false;
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    if (data.size() < sizeof(RESULT_CACHE_MAGIC) ||
+        std::memcmp(p, RESULT_CACHE_MAGIC, sizeof(RESULT_CACHE_MAGIC)) != 0) return false;
+    p += sizeof(RESULT_CACHE_MAGIC);
+
+    FileBlocks loaded;
+    for (auto* list : { &loaded.first, &loaded.second }) {
+        uint64_t count;
+        if (!getCacheU64(p, end, count)) return false;
+        for (uint64_t i = 0; i < count; ++i) {
+            CodeBlock b;
+            std::string path;
+            uint64_t line, context;
+            if (!getCacheString(p, end, path) || !getCacheU64(p, end, line) || !getCacheU64(p, end, context) ||
+                !getCacheString(p, end, b.content)) return false;
+            b.file = g_files.intern(path);
+            b.line = (size_t)line;
+            b.context = (size_t)context;
+            list->push_back(std::move(b));
+        }
+    }
+    if (p != end) return false;
+
+    results = std::move(loaded);
+    fs::last_write_time(cacheFile, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+/** storeCachedResults(cacheFile, files, stats, results):
+ *   Writes a cache entry - unless an input changed while it was
+ *   parsed - and evicts the least recently used entries beyond
+ *   RESULT_CACHE_MAX_ENTRIES.
+ */
+void storeCachedResults(const std::string& cacheFile,
+    const FileList& files,
+    const std::vector<FileStat>& stats,
+    const FileBlocks& results)
+{
+    TraceSpan span("cache store");
+    if (cacheFile.empty()) return;
+    std::vector<FileStat> now = statFiles(files);
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (now[i].size != stats[i].size || now[i].mtime != stats[i].mtime) return;
+    }
+    std::string data(RESULT_CACHE_MAGIC, sizeof(RESULT_CACHE_MAGIC));
+    for (const auto* list : { &results.first, &results.second }) {
+        putCacheU64(data, list->size());
+        for (const auto& b : *list) {
+            putCacheString(data, g_files.path(b.file));
+            putCacheU64(data, b.line);
+            putCacheU64(data, b.context);
+            putCacheString(data, b.content);
+        }
+    }
+    if (!writeFileAtomically(cacheFile, data)) return;
+
+    std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+    std::error_code ec;
+    for (fs::directory_iterator it(RESULT_CACHE_DIR, ec), endIt; !ec && it != endIt; it.increment(ec)) {
+        const fs::path& p = it->path();
+        if (p.extension() != ".bin" || p.filename() == fs::path(FILE_HASHES_FILE).filename() ||
+            p.filename() == "HIT_HISTORY.bin" || p.filename() == "MACRO_TABLE.bin") continue;
+        entries.emplace_back(fs::last_write_time(p, ec), p);
+    }
+    if (entries.size() <= RESULT_CACHE_MAX_ENTRIES) return;
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i + RESULT_CACHE_MAX_ENTRIES < entries.size(); ++i) {
+        fs::remove(entries[i].second, ec);
+    }
+}
+
+/*******************************************************
+ * First results
+ *
+ *  In interactive use the time to the first hit matters more
+ *  than the total time. Three things bring it forward:
+ *   - files that had hits for the same query in an earlier
+ *     run (HIT_HISTORY.bin) are read and parsed first,
+ *   - files that do not even contain the searched name are
+ *     not classified at all (see linesContain()),
+ *   - every file with hits is announced as soon as its parser
+ *     is done, long before the output files are written.
+ *******************************************************/
+static const char* const HIT_HISTORY_FILE = "Output/RESULT_CACHE/HIT_HISTORY.bin";
+static const size_t HIT_HISTORY_MAX_QUERIES = 64;
+static const size_t STREAMED_HITS_MAX = 40;   // further files with hits are only counted
+
+/** HitHistory: query hash -> paths with hits, most recent query first */
+typedef std::vector<std::pair<uint64_t, std::vector<std::string>>> HitHistory;
+
+static HitHistory loadHitHistory()
+{
+    HitHistory history;
+    std::string data;
+    std::error_code ec;
+    uintmax_t size = fs::file_size(HIT_HISTORY_FILE, ec);
+    if (ec || !readWholeFile(HIT_HISTORY_FILE, size, data)) return history;
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    uint64_t version, queries;
+    if (!getCacheU64(p, end, version) || version != SCANNER_VERSION || !getCacheU64(p, end, queries)) return history;
+    for (uint64_t q = 0; q < queries; ++q) {
+        uint64_t key, count;
+        if (!getCacheU64(p, end, key) || !getCacheU64(p, end, count)) return HitHistory();
+        std::vector<std::string> paths;
+        for (uint64_t i = 0; i < count; ++i) {
+            std::string path;
+            if (!getCacheString(p, end, path)) return HitHistory();
+            paths.push_back(std::move(path));
+        }
+        history.emplace_back(key, std::move(paths));
+    }
+    return history;
+}
+
+/** likelyHits(queries, files):
+ *   likely[i] = 1 if files[i] had hits for any of 'queries' last
+ *   time. Empty without the cache or without history for them.
+ */
+std::vector<uint8_t> likelyHits(const std::vector<std::string>& queries, const FileList& files)
+{
+    std::vector<uint8_t> likely;
+    if (!g_useResultCache) return likely;
+    std::unordered_set<uint64_t> keys;
+    for (const auto& query : queries) keys.insert(hashBytes(query.data(), query.size()));
+    std::unordered_set<std::string> hit;
+    bool known = false;
+    for (const auto& entry : loadHitHistory()) {
+        if (!keys.count(entry.first)) continue;
+        hit.insert(entry.second.begin(), entry.second.end());
+        known = true;
+    }
+    if (!known) return likely;
+    likely.assign(files.size(), 0);
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (hit.count(g_files.path(files[i]))) likely[i] = 1;
+    }
+    return likely;
+}
+
+std::vector<uint8_t> likelyHits(const std::string& query, const FileList& files)
+{
+    return likelyHits(std::vector<std::string>{ query }, files);
+}
+
+/** rememberHits(query, files, slots):
+ *   Records which files had hits for 'query'; the file is only
+ *   rewritten when that set changed or the query moves up.
+ */
+void rememberHits(const std::string& query, const FileList& files, const std::vector<FileBlocks>& slots)
+{
+    if (!g_useResultCache) return;
+    uint64_t key = hashBytes(query.data(), query.size());
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!slots[i].first.empty() || !slots[i].second.empty()) paths.push_back(g_files.path(files[i]));
+    }
+
+    HitHistory history = loadHitHistory();
+    if (!history.empty() && history.front().first == key && history.front().second == paths) return;
+    history.erase(std::remove_if(history.begin(), history.end(),
+        [&](const auto& entry) { return entry.first == key; }), history.end());
+    history.emplace(history.begin(), key, std::move(paths));
+    if (history.size() > HIT_HISTORY_MAX_QUERIES) history.resize(HIT_HISTORY_MAX_QUERIES);
+
+    std::string data;
+    putCacheU64(data, SCANNER_VERSION);
+    putCacheU64(data, history.size());
+    for (const auto& entry : history) {
+        putCacheU64(data, entry.first);
+        putCacheU64(data, entry.second.size());
+        for (const auto& path : entry.second) putCacheString(data, path);
+    }
+    std::error_code ec;
+    fs::create_directories(RESULT_CACHE_DIR, ec);
+    writeFileAtomically(HIT_HISTORY_FILE, data);
+}
+
+/** reportHits(progress, file, blocks):
+ *   Prints a file with hits right away, over the progress bar.
+ */
+static void reportHits(ScanProgress& progress, FileId file, const FileBlocks& blocks)
+{
+    if (blocks.first.empty() && blocks.second.empty()) return;
+    size_t n = progress.hitFiles.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (n > STREAMED_HITS_MAX) return;
+    auto ms = duration_cast<milliseconds>(steady_clock::now() - progress.started).count();
+
+    std::ostringstream line;
+    line << "  [" << ms << " ms] " << g_files.path(file) << ": " << blocks.first.size()
+        << " block(s), " << blocks.second.size() << " function(s)";
+    std::string text = line.str();
+    if (text.size() < 60) text.resize(60, ' ');   // covers the progress bar
+
+    std::unique_lock<std::mutex> lock(consoleMutex, std::defer_lock);
+    if (!lock.try_lock()) {
+        TraceSpan wait("wait consoleMutex");
+        lock.lock();
+    }
+    std::cout << "\r" << text << "\n";
+    if (n == STREAMED_HITS_MAX) {
+        std::cout << "  ... more files with hits, see the output files\n";
+    }
+    std::cout << std::flush;
+}
+
+/*******************************************************
+ * Duplicate files
+ *
+ *  Side-by-side branches and vendored copies share most of
+ *  their files byte for byte. Files with equal size and
+ *  content hash (see contentHashes()) are parsed once; the
+ *  other copies are left out of the feed and get the results
+ *  of the first one afterwards, with the path banner of each
+ *  block rewritten.
+ *******************************************************/
+struct DuplicateFiles {
+    std::vector<size_t> source;   // source[i]: file whose results file i reuses (i if parsed itself)
+    size_t count = 0;
+    uintmax_t bytes = 0;
+};
+
+/** findDuplicateFiles(stats, hashes, kinds):
+ *   Maps every file to the first file with the same size and
+ *   hash (0 = not hashed, never a duplicate). Optional 'kinds'
+ *   keeps files apart that are scanned differently.
+ */
+DuplicateFiles findDuplicateFiles(const std::vector<FileStat>& stats,
+    const std::vector<uint64_t>& hashes,
+    const std::vector<uint8_t>* kinds = nullptr)
+{
+    DuplicateFiles dups;
+    dups.source.resize(stats.size());
+    std::map<std::tuple<uintmax_t, uint64_t, uint8_t>, size_t> first;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        dups.source[i] = i;
+        if (hashes[i] == 0) continue;
+        auto key = std::make_tuple(stats[i].size, hashes[i], kinds ? (*kinds)[i] : (uint8_t)0);
+        auto it = first.emplace(key, i).first;
+        if (it->second == i) continue;
+        dups.source[i] = it->second;
+        dups.count++;
+        dups.bytes += stats[i].size;
+    }
+    return dups;
+}
+
+/** retargetBlocks(blocks, from, to):
+ *   Copies of blocks found in 'from' as if found in 'to'.
+ */
+std::vector<CodeBlock> retargetBlocks(const std::vector<CodeBlock>& blocks, FileId from, FileId to)
+{
+    const std::string oldBanner = "##########\n" + g_files.path(from) + "\n##########\n";
+    const std::string newBanner = "##########\n" + g_files.path(to) + "\n##########\n";
+    std::vector<CodeBlock> out;
+    out.reserve(blocks.size());
+    for (const auto& b : blocks) {
+        CodeBlock cb;
+        cb.file = to;
+        cb.line = b.line;
+        cb.context = b.context;
+        if (b.content.compare(0, oldBanner.size(), oldBanner) == 0) {
+            cb.content = newBanner + b.content.substr(oldBanner.size());
+        }
+        else {
+            cb.content = b.content;
+        }
+        out.push_back(std::move(cb));
+    }
+    return out;
+}
+
+/** fanOutDuplicates(slots, files, dups):
+ *   Fills the slots of skipped copies from their source.
+ */
+void fanOutDuplicates(std::vector<FileBlocks>& slots, const FileList& files, const DuplicateFiles& dups)
+{
+    TraceSpan merge("merge duplicates");
+    if (dups.count == 0) return;
+    for (size_t i = 0; i < slots.size(); ++i) {
+        size_t src = dups.source[i];
+        if (src == i) continue;
+        slots[i].first = retargetBlocks(slots[src].first, files[src], files[i]);
+        slots[i].second = retargetBlocks(slots[src].second, files[src], files[i]);
+    }
+}
+
+static void reportDuplicates(const DuplicateFiles& dups)
+{
+    if (dups.count == 0) return;
+    std::cout << dups.count << " duplicate file(s) (" << (dups.bytes >> 10)
+        << " KiB) reuse the results of an identical copy\n";
+}
+
+/*******************************************************
+ * Scan checkpoints
+ *
+ *  An interrupted scan (see "Interrupting scans") keeps the
+ *  results of the files it finished in
+ *  Output/RESULT_CACHE/<key>.ckpt, keyed by the query and the
+ *  file list. The next run of the same search takes over every
+ *  file whose size and modification time still match and only
+ *  parses the rest; a complete scan deletes the checkpoint.
+ *  --no-cache ignores checkpoints like the result cache.
+ *******************************************************/
+static const char CHECKPOINT_MAGIC[8] = { 'D', 'E', 'X', 'C', 'K', 'P', '\r', '\n' };
+
+static std::string checkpointFile(const std::string& query, const FileList& files)
+{
+    if (!g_useResultCache) return std::string();
+    std::string keyData;
+    putCacheU64(keyData, SCANNER_VERSION);
+    putCacheString(keyData, query);
+    for (FileId f : files) putCacheString(keyData, g_files.path(f));
+    std::ostringstream name;
+    name << RESULT_CACHE_DIR << "/" << std::hex << std::setw(16) << std::setfill('0')
+        << hashBytes(keyData.data(), keyData.size()) << ".ckpt";
+    return name.str();
+}
+
+/** loadCheckpoint(checkpoint, files, stats, slots, scanned):
+ *   Fills 'slots' and 'scanned' for the checkpointed files that
+ *   are unchanged. Returns their number.
+ */
+size_t loadCheckpoint(const std::string& checkpoint,
+    const FileList& files,
+    const std::vector<FileStat>& stats,
+    std::vector<FileBlocks>& slots,
+    std::vector<uint8_t>& scanned)
+{
+    if (checkpoint.empty()) return 0;
+    std::error_code ec;
+    uintmax_t size = fs::file_size(checkpoint, ec);
+    std::string data;
+    if (ec || !readWholeFile(checkpoint, size, data)) return 0;
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    if (data.size() < sizeof(CHECKPOINT_MAGIC) ||
+        std::memcmp(p, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) return 0;
+    p += sizeof(CHECKPOINT_MAGIC);
+
+    std::unordered_map<std::string, size_t> byPath;
+    for (size_t i = 0; i < files.size(); ++i) byPath[g_files.path(files[i])] = i;
+
+    std::vector<std::pair<size_t, FileBlocks>> loaded;
+    uint64_t count;
+    if (!getCacheU64(p, end, count)) return 0;
+    for (uint64_t n = 0; n < count; ++n) {
+        std::string path;
+        uint64_t fileSize, mtime;
+        if (!getCacheString(p, end, path) || !getCacheU64(p, end, fileSize) || !getCacheU64(p, end, mtime)) return 0;
+        auto it = byPath.find(path);
+        bool unchanged = it != byPath.end() && stats[it->second].mtime != 0 &&
+            stats[it->second].size == fileSize && stats[it->second].mtime == (int64_t)mtime;
+        FileBlocks blocks;
+        for (auto* list : { &blocks.first, &blocks.second }) {
+            uint64_t blockCount;
+            if (!getCacheU64(p, end, blockCount)) return 0;
+            for (uint64_t k = 0; k < blockCount; ++k) {
+                CodeBlock b;
+                uint64_t line, context;
+                if (!getCacheU64(p, end, line) || !getCacheU64(p, end, context) ||
+                    !getCacheString(p, end, b.content)) return 0;
+                b.file = unchanged ? files[it->second] : FileId();
+                b.line = (size_t)line;
+                b.context = (size_t)context;
+                list->push_back(std::move(b));
+            }
+        }
+        if (unchanged) loaded.emplace_back(it->second, std::move(blocks));
+    }
+    if (p != end) return 0;
+
+    for (auto& entry : loaded) {
+        slots[entry.first] = std::move(entry.second);
+        scanned[entry.first] = 1;
+    }
+    return loaded.size();
+}
+
+/** saveCheckpoint(checkpoint, files, stats, slots, scanned):
+ *   Stores the results of the scanned files.
+ */
+void saveCheckpoint(const std::string& checkpoint,
+    const FileList& files,
+    const std::vector<FileStat>& stats,
+    const std::vector<FileBlocks>& slots,
+    const std::vector<uint8_t>& scanned)
+{
+    if (checkpoint.empty()) return;
+    std::string data(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    putCacheU64(data, (uint64_t)std::count(scanned.begin(), scanned.end(), (uint8_t)1));
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!scanned[i]) continue;
+        putCacheString(data, g_files.path(files[i]));
+        putCacheU64(data, stats[i].size);
+        putCacheU64(data, (uint64_t)stats[i].mtime);
+        for (const auto* list : { &slots[i].first, &slots[i].second }) {
+            putCacheU64(data, list->size());
+            for (const auto& b : *list) {
+                putCacheU64(data, b.line);
+                putCacheU64(data, b.context);
+                putCacheString(data, b.content);
+            }
+        }
+    }
+    std::error_code ec;
+    fs::create_directories(RESULT_CACHE_DIR, ec);
+    writeFileAtomically(checkpoint, data);
+}
+
+/** resumeCheckpoint(checkpoint, files, stats, dups, slots, progress):
+ *   Sizes progress.scanned and takes over the checkpoint, if
+ *   any; the files it covers drop out of the byte total.
+ */
+void resumeCheckpoint(const std::string& checkpoint,
+    const FileList& files,
+    const std::vector<FileStat>& stats,
+    const DuplicateFiles& dups,
+    std::vector<FileBlocks>& slots,
+    ScanProgress& progress)
+{
+    progress.scanned.assign(files.size(), 0);
+    size_t resumed = loadCheckpoint(checkpoint, files, stats, slots, progress.scanned);
+    if (resumed == 0) return;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (progress.scanned[i] && dups.source[i] == i) progress.totalBytes -= (size_t)stats[i].size;
+    }
+    std::cout << "Resuming an interrupted scan: " << resumed << " file(s) taken from the checkpoint\n";
+}
+
+/** concludeScan(files, dups, scanned):
+ *   After the workers are done: lists the files not reached in
+ *   g_lastScan and reports them. True if the scan was complete.
+ */
+bool concludeScan(const FileList& files, const DuplicateFiles& dups, const std::vector<uint8_t>& scanned)
+{
+    g_lastScan = PartialScan();
+    g_lastScan.totalFiles = files.size();
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!scanned[dups.source[i]]) g_lastScan.unscanned.push_back(files[i]);
+    }
+    if (g_lastScan.unscanned.empty()) return true;
+    g_lastScan.reason = InterruptibleScan::reason();
+    std::cout << "Scan " << g_lastScan.reason << " - " << g_lastScan.unscanned.size() << " of "
+        << files.size() << " file(s) not scanned, the results are partial.\n";
+    if (g_useResultCache) std::cout << "Repeat the search to resume from here.\n";
+    return false;
+}
+
+/** updateCheckpoint(checkpoint, complete, files, stats, slots, scanned):
+ *   Drops the checkpoint of a complete scan, saves one otherwise.
+ */
+void updateCheckpoint(const std::string& checkpoint, bool complete,
+    const FileList& files,
+    const std::vector<FileStat>& stats,
+    const std::vector<FileBlocks>& slots,
+    const std::vector<uint8_t>& scanned)
+{
+    if (checkpoint.empty()) return;
+    std::error_code ec;
+    if (complete) fs::remove(checkpoint, ec);
+    else saveCheckpoint(checkpoint, files, stats, slots, scanned);
+}
+
+/*******************************************************
+ * Scan worker pool
+ *   The parser stage shared by the define, batch and Python
+ *   scans. Each worker gets its own per-file callback from
+ *   'makeScanner' (so per-worker state such as a warm DFA
+ *   cache lives in it) and runs it on every file it takes.
+ *******************************************************/
+typedef std::function<void(size_t index, std::vector<std::string>& lines)> ScanFileFn;
+
+/** runScanPool(files, stats, pending, likely, numThreads, progress, makeScanner):
+ *   Feeds files[pending[i]] (those flagged in 'likely' first)
+ *   to up to 'numThreads' workers under a ConcurrencyControl
+ *   until the feed runs dry or the scan is cancelled. Marks the
+ *   files scanned and reports progress.
+ */
+void runScanPool(const FileList& files,
+    const std::vector<FileStat>& stats,
+    const std::vector<size_t>& pending,
+    const std::vector<uint8_t>& likely,
+    size_t numThreads,
+    ScanProgress& progress,
+    const std::function<ScanFileFn()>& makeScanner)
+{
+    numThreads = std::min<size_t>(numThreads, pending.size());
+    ConcurrencyControl ctl;
+    startConcurrencyControl(ctl, numThreads);
+    FileFeed feed;
+    feed.control = &ctl;
+    startFileFeed(feed, files, stats, pending, likely);
+
+    auto worker = [&](size_t w) {
+        pinWorkerThread(w);
+        traceThreadName("parser");
+        ScanFileFn scanFile = makeScanner();
+        size_t idx = 0;
+        std::vector<std::string> lines;
+        while (nextControlledFile(feed, ctl, w, idx, lines)) {
+            TraceSpan parse("parse", files[idx]);
+            auto busyFrom = beginWork(ctl, w);
+            size_t lineCountThisFile = lines.size();
+            scanFile(idx, lines);
+            progress.scanned[idx] = 1;
+            reportParsed(progress, stats[idx].size, lineCountThisFile);
+            reportWork(ctl, w, stats[idx].size, std::chrono::steady_clock::now() - busyFrom);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back(worker, t);
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    finishFileFeed(feed);
+
+    printProgress(scanCancelled() ? progress.bytes.load() : progress.totalBytes, progress.totalBytes);
+    std::cout << "\n";
+    stopConcurrencyControl(ctl);
+}
+
+/*******************************************************
+ * Multi-threaded parsing (C++) to find #if <define> blocks + relevant functions
+ *******************************************************/
+
+/** cacheQueryOf(query): identifies a C++ query in the result cache */
+static std::string cacheQueryOf(const ScanQuery& query)
+{
+    return "cpp\n" + query.define + "\n" + (query.pattern ? query.pattern->source : std::string()) + "\n" +
+        (query.matchLines ? "lines" : "blocks");
+}
+
+/** parseAllFilesMultiThread(files, query):
+ *   Spawns threads, reads all .h/.cpp in 'files' and returns
+ *   the matched #if blocks + function blocks. If the scan is
+ *   interrupted, of the files scanned so far (see g_lastScan).
+ */
+std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
+parseAllFilesMultiThread(const FileList& inputFiles, const ScanQuery& query)
+{
+    const FileList files = sortedFileList(inputFiles);
+    InterruptibleScan interruptible;
+
+    auto startTime = high_resolution_clock::now();
+    std::vector<FileStat> stats = statFiles(files);
+    ScanProgress progress;
+    progress.totalBytes = totalSize(stats);
+    std::cout << "Total size: " << (progress.totalBytes >> 10) << " KiB in "
+        << files.size() << " file(s)\n";
+
+    const std::string cacheQuery = cacheQueryOf(query);
+    std::vector<uint64_t> hashes;
+    bool hashed = contentHashes(files, stats, hashes, g_useResultCache);
+    std::string cacheFile = hashed ? resultCacheFile(cacheQuery, files, hashes) : std::string();
+    FileBlocks cached;
+    if (loadCachedResults(cacheFile, cached)) {
+        auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+        std::cout << "Inputs unchanged - " << describeQuery(query) << " taken from the result cache in "
+            << ms << " ms\n";
+        return cached;
+    }
+    DuplicateFiles dups = findDuplicateFiles(stats, hashes);
+    reportDuplicates(dups);
+    progress.totalBytes -= (size_t)dups.bytes;
+
+    size_t numThreads = std::min<size_t>(workerThreadLimit(), files.size());
+    std::cout << "Starting " << numThreads << " thread(s)...\n";
+
+    std::vector<FileBlocks> slots(files.size());
+    const std::string checkpoint = checkpointFile(cacheQuery, files);
+    resumeCheckpoint(checkpoint, files, stats, dups, slots, progress);
+
+    // huge files first, each one spread over all cores
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (dups.source[i] != i || progress.scanned[i]) continue;
+        if (stats[i].size < LARGE_FILE_BYTES) {
+            pending.push_back(i);
+            continue;
+        }
+        if (scanCancelled()) continue;
+        size_t lineCountThisFile = 0;
+        slots[i] = parseLargeFileParallel(files[i], query, lineCountThisFile);
+        progress.scanned[i] = 1;
+        reportHits(progress, files[i], slots[i]);
+        reportParsed(progress, stats[i].size, lineCountThisFile);
+    }
+
+    const std::string needle = query.pattern ? std::string() : query.define;
+    runScanPool(files, stats, pending, likelyHits(cacheQuery, files), numThreads, progress, [&]() -> ScanFileFn {
+        // the DFA cache stays warm across this worker's files
+        auto matcher = std::make_shared<PatternMatcher>(query.pattern);
+        return [&, matcher](size_t idx, std::vector<std::string>& lines) {
+            if (!linesContain(lines, needle)) return;
+            CppFileScan scan = scanCppLines(std::move(lines));
+            slots[idx] = extractQueryResults(scan, files[idx], query, *matcher);
+            reportHits(progress, files[idx], slots[idx]);
+        };
+    });
+
+    auto endTime = high_resolution_clock::now();
+    auto ms = duration_cast<milliseconds>(endTime - startTime).count();
+    std::cout << "Parsing " << describeQuery(query) << " finished in " << ms << " ms ("
+        << progress.lines.load() << " lines)\n";
+
+    bool complete = concludeScan(files, dups, progress.scanned);
+    updateCheckpoint(checkpoint, complete, files, stats, slots, progress.scanned);
+    fanOutDuplicates(slots, files, dups);
+    FileBlocks results = joinFileSlots(slots);
+    if (complete) {
+        rememberHits(cacheQuery, files, slots);
+        storeCachedResults(cacheFile, files, stats, results);
+    }
+    return results;
+}
+
+std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
+parseAllFilesMultiThread(const FileList& inputFiles, const std::string& define)
+{
+    ScanQuery query;
+    query.define = define;
+    return parseAllFilesMultiThread(inputFiles, query);
+}
+
+/*******************************************************
+ * Batched define scans
+ *
+ *  Several defines picked together are answered in one pass:
+ *  each file is read and classified once (scanCppLines() does
+ *  not depend on the define) and the blocks of every define
+ *  are extracted from that scan. Defines found in the result
+ *  cache stay out of the pass; the others get their own cache
+ *  entry, hit history and checkpoint, as if scanned alone.
+ *******************************************************/
+typedef std::vector<std::vector<FileBlocks>> BatchSlots;   // [query][file]
+
+/** extractDefineBatch(lines, file, idx, queries, large, progress, slots):
+ *   Classifies one file once for all queries that it mentions.
+ */
+static void extractDefineBatch(std::vector<std::string>&& lines, FileId file, size_t idx,
+    const std::vector<ScanQuery>& queries, bool large, ScanProgress& progress, BatchSlots& slots)
+{
+    std::vector<size_t> wanted;
+    for (size_t q = 0; q < queries.size(); ++q) {
+        if (linesContain(lines, queries[q].define)) wanted.push_back(q);
+    }
+    if (wanted.empty()) return;
+    CppFileScan scan = large ? scanCppLinesParallel(std::move(lines)) : scanCppLines(std::move(lines));
+    PatternMatcher matcher(nullptr);
+    for (size_t q : wanted) {
+        slots[q][idx] = extractQueryResults(scan, file, queries[q], matcher);
+        reportHits(progress, file, slots[q][idx]);
+    }
+}
+
+/** parseDefinesMultiThread(files, defines, complete):
+ *   parseAllFilesMultiThread() for several defines at once;
+ *   result k belongs to defines[k]. complete[k] is 0 if the
+ *   pass was interrupted before define k was fully answered
+ *   (see g_lastScan).
+ */
+std::vector<FileBlocks> parseDefinesMultiThread(const FileList& inputFiles,
+    const std::vector<std::string>& defines,
+    std::vector<uint8_t>& complete)
+{
+    if (defines.size() == 1) {
+        std::vector<FileBlocks> results{ parseAllFilesMultiThread(inputFiles, defines[0]) };
+        complete.assign(1, g_lastScan.unscanned.empty() ? 1 : 0);
+        return results;
+    }
+    const FileList files = sortedFileList(inputFiles);
+    InterruptibleScan interruptible;
+
+    auto startTime = high_resolution_clock::now();
+    std::vector<FileStat> stats = statFiles(files);
+    ScanProgress progress;
+    progress.totalBytes = totalSize(stats);
+    std::cout << "Total size: " << (progress.totalBytes >> 10) << " KiB in "
+        << files.size() << " file(s), " << defines.size() << " define(s)\n";
+
+    std::vector<uint64_t> hashes;
+    bool hashed = contentHashes(files, stats, hashes, g_useResultCache);
+    std::vector<FileBlocks> results(defines.size());
+    complete.assign(defines.size(), 1);
+    std::vector<size_t> open;                 // defines the pass has to answer
+    std::vector<ScanQuery> queries;
+    std::vector<std::string> cacheQueries, cacheFiles;
+    for (size_t k = 0; k < defines.size(); ++k) {
+        ScanQuery query;
+        query.define = defines[k];
+        std::string cacheQuery = cacheQueryOf(query);
+        std::string cacheFile = hashed ? resultCacheFile(cacheQuery, files, hashes) : std::string();
+        if (loadCachedResults(cacheFile, results[k])) continue;
+        open.push_back(k);
+        queries.push_back(query);
+        cacheQueries.push_back(cacheQuery);
+        cacheFiles.push_back(cacheFile);
+    }
+    if (open.size() < defines.size()) {
+        std::cout << (defines.size() - open.size()) << " of " << defines.size()
+            << " define(s) taken from the result cache\n";
+    }
+    if (open.empty()) return results;
+
+    DuplicateFiles dups = findDuplicateFiles(stats, hashes);
+    reportDuplicates(dups);
+    progress.totalBytes -= (size_t)dups.bytes;
+
+    // a file is only skipped if every open define's checkpoint has it
+    BatchSlots slots(queries.size(), std::vector<FileBlocks>(files.size()));
+    std::vector<std::string> checkpoints;
+    progress.scanned.assign(files.size(), 1);
+    for (size_t q = 0; q < queries.size(); ++q) {
+        checkpoints.push_back(checkpointFile(cacheQueries[q], files));
+        std::vector<uint8_t> scanned(files.size(), 0);
+        loadCheckpoint(checkpoints[q], files, stats, slots[q], scanned);
+        for (size_t i = 0; i < files.size(); ++i) progress.scanned[i] &= scanned[i];
+    }
+    size_t resumed = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!progress.scanned[i]) {
+            for (auto& perQuery : slots) perQuery[i] = FileBlocks();
+            continue;
+        }
+        resumed++;
+        if (dups.source[i] == i) progress.totalBytes -= (size_t)stats[i].size;
+    }
+    if (resumed > 0) {
+        std::cout << "Resuming an interrupted scan: " << resumed << " file(s) taken from the checkpoint\n";
+    }
+
+    size_t numThreads = std::min<size_t>(workerThreadLimit(), files.size());
+    std::cout << "Starting " << numThreads << " thread(s)...\n";
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (dups.source[i] != i || progress.scanned[i]) continue;
+        if (stats[i].size < LARGE_FILE_BYTES) {
+            pending.push_back(i);
+            continue;
+        }
+        if (scanCancelled()) continue;
+        TraceSpan parse("parse large file", files[i]);
+        std::vector<std::string> lines;
+        readLinesChunkedParallel(g_files.path(files[i]), lines);
+        size_t lineCountThisFile = lines.size();
+        extractDefineBatch(std::move(lines), files[i], i, queries, true, progress, slots);
+        progress.scanned[i] = 1;
+        reportParsed(progress, stats[i].size, lineCountThisFile);
+    }
+
+    // files that had hits for any of the defines are read first
+    runScanPool(files, stats, pending, likelyHits(cacheQueries, files), numThreads, progress, [&]() -> ScanFileFn {
+        return [&](size_t idx, std::vector<std::string>& lines) {
+            extractDefineBatch(std::move(lines), files[idx], idx, queries, false, progress, slots);
+        };
+    });
+
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+    std::cout << "Parsing " << queries.size() << " define(s) finished in " << ms << " ms ("
+        << progress.lines.load() << " lines)\n";
+
+    bool whole = concludeScan(files, dups, progress.scanned);
+    for (size_t q = 0; q < queries.size(); ++q) {
+        updateCheckpoint(checkpoints[q], whole, files, stats, slots[q], progress.scanned);
+        fanOutDuplicates(slots[q], files, dups);
+        FileBlocks& result = results[open[q]];
+        result = joinFileSlots(slots[q]);
+        complete[open[q]] = whole ? 1 : 0;
+        if (whole) {
+            rememberHits(cacheQueries[q], files, slots[q]);
+            storeCachedResults(cacheFiles[q], files, stats, result);
+        }
+    }
+    return results;
+}
+
+/*******************************************************
+ * Multi-threaded parsing (Python)
+ *******************************************************/
+/** parsePythonAllFilesMultiThread(pyFiles, param):
+ *   Spawns threads to parse all .py files
+ *   searching for if app.<param> + relevant functions
+ */
+std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
+parsePythonAllFilesMultiThread(const FileList& inputFiles, const std::string& param)
+{
+    const FileList pyFiles = sortedFileList(inputFiles);
+    InterruptibleScan interruptible;
+
+    auto startTime = high_resolution_clock::now();
+    std::vector<FileStat> stats = statFiles(pyFiles);
+    ScanProgress progress;
+    progress.totalBytes = totalSize(stats);
+    std::cout << "Total Python size: " << (progress.totalBytes >> 10) << " KiB in "
+        << pyFiles.size() << " file(s)\n";
+
+    const std::string cacheQuery = "python\n" + param;
+    std::vector<uint64_t> hashes;
+    bool hashed = contentHashes(pyFiles, stats, hashes, g_useResultCache);
+    std::string cacheFile = hashed ? resultCacheFile(cacheQuery, pyFiles, hashes) : std::string();
+    FileBlocks cached;
+    if (loadCachedResults(cacheFile, cached)) {
+        auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+        std::cout << "Inputs unchanged - app." << param << " taken from the result cache in "
+            << ms << " ms\n";
+        return cached;
+    }
+    DuplicateFiles dups = findDuplicateFiles(stats, hashes);
+    reportDuplicates(dups);
+    progress.totalBytes -= (size_t)dups.bytes;
+
+    size_t numThreads = std::min<size_t>(workerThreadLimit(), pyFiles.size());
+    std::cout << "Starting " << numThreads << " thread(s) for Python...\n";
+
+    std::vector<FileBlocks> slots(pyFiles.size());
+    const std::string checkpoint = checkpointFile(cacheQuery, pyFiles);
+    resumeCheckpoint(checkpoint, pyFiles, stats, dups, slots, progress);
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < pyFiles.size(); ++i) {
+        if (dups.source[i] == i && !progress.scanned[i]) pending.push_back(i);
+    }
+
+    const std::string needle = "app." + param;
+    runScanPool(pyFiles, stats, pending, likelyHits(cacheQuery, pyFiles), numThreads, progress, [&]() -> ScanFileFn {
+        return [&](size_t idx, std::vector<std::string>& lines) {
+            if (!linesContain(lines, needle)) return;
+            PythonFileScan scan = scanPythonLines(std::move(lines));
+            slots[idx] = extractPythonParamResults(scan, pyFiles[idx], param);
+            reportHits(progress, pyFiles[idx], slots[idx]);
+        };
+    });
+
+    auto endTime = high_resolution_clock::now();
+    auto ms = duration_cast<milliseconds>(endTime - startTime).count();
+    std::cout << "Parsing (app." << param << ") finished in " << ms << " ms ("
+        << progress.lines.load() << " lines)\n";
+
+    bool complete = concludeScan(pyFiles, dups, progress.scanned);
+    updateCheckpoint(checkpoint, complete, pyFiles, stats, slots, progress.scanned);
+    fanOutDuplicates(slots, pyFiles, dups);
+    FileBlocks results = joinFileSlots(slots);
+    if (complete) {
+        rememberHits(cacheQuery, pyFiles, slots);
+        storeCachedResults(cacheFile, pyFiles, stats, results);
+    }
+    return results;
+}
+
+/*******************************************************
+ * Source archives
+ *
+ *  A .tar, .tar.gz/.tgz or .zip file can be picked as a root
+ *  like a directory. On first use it is decoded once with the
+ *  built-in readers below (tar, gzip, zip and a DEFLATE
+ *  inflater; no external tool), and only its .h/.cpp/.py
+ *  members are kept, in memory (see "Archive members"). Other
+ *  members are skipped as they stream past. The archive is
+ *  decoded again only when its size or time stamp changes.
+ *******************************************************/
+static const size_t INFLATE_WINDOW = 32768;        // DEFLATE back-reference limit
+static const size_t INFLATE_OUTPUT = 1u << 20;     // output handed to the sink at once
+static const size_t ARCHIVE_READ_BYTES = 1u << 20;
+static const size_t TAR_BLOCK = 512;
+
+/** crc32Update(crc, data, size): CRC-32 as used by gzip and zip */
+static uint32_t crc32Update(uint32_t crc, const char* data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t readLE16(const char* p) { return (unsigned char)p[0] | ((unsigned char)p[1] << 8); }
+static uint32_t readLE32(const char* p) { return readLE16(p) | (readLE16(p + 2) << 16); }
+static uint64_t readLE64(const char* p) { return readLE32(p) | ((uint64_t)readLE32(p + 4) << 32); }
+
+/** ArchiveInput:
+ *   Compressed input, from memory or pulled from a source in
+ *   ARCHIVE_READ_BYTES pieces; read bitwise (LSB first, as
+ *   DEFLATE packs it) or bytewise after alignToByte().
+ */
+class ArchiveInput {
+public:
+    typedef std::function<size_t(char*, size_t)> Source;   // 0 at the end
+
+    ArchiveInput(const char* data, size_t size) : m_data(data), m_end(size) {}
+    explicit ArchiveInput(Source source)
+        : m_source(std::move(source)), m_storage(ARCHIVE_READ_BYTES) {}
+
+    /** bits(n, value): next n (<= 32) bits; false past the end */
+    bool bits(unsigned n, uint32_t& value)
+    {
+        if (!fill(n)) return false;
+        value = (uint32_t)(m_bits & ((1ull << n) - 1));
+        m_bits >>= n;
+        m_count -= n;
+        return true;
+    }
+
+    /** peek(n): next n bits without consuming them, zero past the end */
+    uint32_t peek(unsigned n)
+    {
+        fill(n);
+        return (uint32_t)(m_bits & ((1ull << n) - 1));
+    }
+
+    /** skip(n): drops n bits already peeked */
+    bool skip(unsigned n)
+    {
+        if (n > m_count) return false;
+        m_bits >>= n;
+        m_count -= n;
+        return true;
+    }
+
+    void alignToByte()
+    {
+        m_bits >>= (m_count & 7);
+        m_count -= (m_count & 7);
+    }
+
+    /** readBytes(out, n): aligned bytes; false if the input ends first */
+    bool readBytes(char* out, size_t n)
+    {
+        while (n > 0 && m_count >= 8) {
+            *out++ = (char)(m_bits & 0xFF);
+            m_bits >>= 8;
+            m_count -= 8;
+            --n;
+        }
+        while (n > 0) {
+            if (m_pos == m_end && !refill()) return false;
+            size_t take = std::min(n, m_end - m_pos);
+            std::memcpy(out, m_data + m_pos, take);
+            m_pos += take;
+            out += take;
+            n -= take;
+        }
+        return true;
+    }
+
+    bool skipBytes(size_t n)
+    {
+        char scratch[256];
+        while (n > 0) {
+            size_t take = std::min(n, sizeof(scratch));
+            if (!readBytes(scratch, take)) return false;
+            n -= take;
+        }
+        return true;
+    }
+
+private:
+    /** fill(n): tops the bit buffer up to 57+ bits; false if fewer than n remain */
+    bool fill(unsigned n)
+    {
+        if (m_count >= n) return true;
+        while (m_count <= 56) {
+            if (m_pos == m_end && !refill()) break;
+            m_bits |= (uint64_t)(unsigned char)m_data[m_pos++] << m_count;
+            m_count += 8;
+        }
+        return m_count >= n;
+    }
+
+    bool refill()
+    {
+        if (!m_source) return false;
+        m_end = m_source(m_storage.data(), m_storage.size());
+        m_data = m_storage.data();
+        m_pos = 0;
+        return m_end > 0;
+    }
+
+    Source m_source;
+    std::vector<char> m_storage;
+    const char* m_data = nullptr;
+    size_t m_pos = 0;
+    size_t m_end = 0;
+    uint64_t m_bits = 0;
+    unsigned m_count = 0;
+};
+
+/** Inflater:
+ *   Raw DEFLATE decoder (RFC 1951: stored, fixed and dynamic
+ *   Huffman blocks). Symbols are looked up in one table per code
+ *   indexed by the next 'bits' input bits; each entry holds
+ *   symbol << 4 | code length. Output collects in a buffer that
+ *   keeps the last INFLATE_WINDOW bytes for back-references and
+ *   goes to the sink in pieces of about INFLATE_OUTPUT bytes.
+ *   One Inflater can decode any number of streams.
+ */
+class Inflater {
+public:
+    typedef std::function<bool(const char*, size_t)> Sink;   // false stops decoding
+
+    Inflater() : m_out(INFLATE_OUTPUT + INFLATE_WINDOW) {}
+
+    /** run(in, sink): decodes one stream; false on damaged or truncated data */
+    bool run(ArchiveInput& in, const Sink& sink)
+    {
+        m_in = &in;
+        m_sink = &sink;
+        m_pos = 0;
+        m_flushed = 0;
+        uint32_t last = 0, type = 0;
+        do {
+            if (!in.bits(1, last) || !in.bits(2, type)) return false;
+            bool ok = false;
+            if (type == 0) {
+                ok = storedBlock();
+            }
+            else if (type == 1) {
+                static const std::pair<Huffman, Huffman> fixed = fixedTables();
+                ok = codes(fixed.first, fixed.second);
+            }
+            else if (type == 2) {
+                Huffman lit, dist;
+                ok = dynamicTables(lit, dist) && codes(lit, dist);
+            }
+            if (!ok) return false;
+        } while (!last);
+        return m_pos == m_flushed || sink(&m_out[m_flushed], m_pos - m_flushed);
+    }
+
+private:
+    struct Huffman {
+        std::vector<uint16_t> entries;
+        unsigned bits = 1;
+    };
+
+    static bool build(const uint8_t* lengths, size_t count, Huffman& h)
+    {
+        unsigned counts[16] = { 0 };
+        unsigned maxLen = 0;
+        for (size_t i = 0; i < count; ++i) {
+            counts[lengths[i]]++;
+            maxLen = std::max<unsigned>(maxLen, lengths[i]);
+        }
+        h.bits = std::max(maxLen, 1u);
+        h.entries.assign(size_t(1) << h.bits, 0);
+        counts[0] = 0;
+        int left = 1;
+        for (unsigned len = 1; len < 16; ++len) {
+            left = (left << 1) - (int)counts[len];
+            if (left < 0) return false;   // over-subscribed
+        }
+        unsigned next[16] = { 0 };
+        unsigned code = 0;
+        for (unsigned len = 1; len < 16; ++len) {
+            code = (code + counts[len - 1]) << 1;
+            next[len] = code;
+        }
+        for (size_t sym = 0; sym < count; ++sym) {
+            unsigned len = lengths[sym];
+            if (len == 0) continue;
+            unsigned c = next[len]++;
+            unsigned reversed = 0;
+            for (unsigned k = 0; k < len; ++k) {
+                reversed = (reversed << 1) | ((c >> k) & 1);
+            }
+            for (size_t i = reversed; i < h.entries.size(); i += size_t(1) << len) {
+                h.entries[i] = (uint16_t)(sym << 4 | len);
+            }
+        }
+        return true;
+    }
+
+    static std::pair<Huffman, Huffman> fixedTables()
+    {
+        uint8_t lengths[288];
+        for (int i = 0; i < 288; ++i) {
+            lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        }
+        std::pair<Huffman, Huffman> tables;
+        build(lengths, 288, tables.first);
+        std::fill(lengths, lengths + 30, 5);
+        build(lengths, 30, tables.second);
+        return tables;
+    }
+
+    bool decode(const Huffman& h, unsigned& symbol)
+    {
+        uint16_t e = h.entries[m_in->peek(h.bits)];
+        if ((e & 15) == 0 || !m_in->skip(e & 15)) return false;
+        symbol = e >> 4;
+        return true;
+    }
+
+    bool dynamicTables(Huffman& lit, Huffman& dist)
+    {
+        static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+        uint32_t hlit, hdist, hclen;
+        if (!m_in->bits(5, hlit) || !m_in->bits(5, hdist) || !m_in->bits(4, hclen)) return false;
+        hlit += 257;
+        hdist += 1;
+        hclen += 4;
+        if (hlit > 286 || hdist > 30) return false;
+
+        uint8_t codeLengths[19] = { 0 };
+        for (uint32_t i = 0; i < hclen; ++i) {
+            uint32_t v;
+            if (!m_in->bits(3, v)) return false;
+            codeLengths[order[i]] = (uint8_t)v;
+        }
+        Huffman lengthCode;
+        if (!build(codeLengths, 19, lengthCode)) return false;
+
+        uint8_t lengths[286 + 30] = { 0 };
+        uint32_t n = 0;
+        while (n < hlit + hdist) {
+            unsigned sym;
+            if (!decode(lengthCode, sym)) return false;
+            if (sym < 16) {
+                lengths[n++] = (uint8_t)sym;
+                continue;
+            }
+            uint32_t repeat = 0;
+            uint8_t value = 0;
+            if (sym == 16) {
+                if (n == 0 || !m_in->bits(2, repeat)) return false;
+                value = lengths[n - 1];
+                repeat += 3;
+            }
+            else if (sym == 17) {
+                if (!m_in->bits(3, repeat)) return false;
+                repeat += 3;
+            }
+            else {
+                if (!m_in->bits(7, repeat)) return false;
+                repeat += 11;
+            }
+            if (n + repeat > hlit + hdist) return false;
+            while (repeat--) lengths[n++] = value;
+        }
+        if (lengths[256] == 0) return false;   // no end-of-block code
+        return build(lengths, hlit, lit) && build(lengths + hlit, hdist, dist);
+    }
+
+    /** reserve(): room for one maximal match, flushing if needed */
+    bool reserve()
+    {
+        if (m_pos + 258 <= m_out.size()) return true;
+        if (!(*m_sink)(&m_out[m_flushed], m_pos - m_flushed)) return false;
+        std::memmove(&m_out[0], &m_out[m_pos - INFLATE_WINDOW], INFLATE_WINDOW);
+        m_pos = m_flushed = INFLATE_WINDOW;
+        return true;
+    }
+
+    bool storedBlock()
+    {
+        char header[4];
+        m_in->alignToByte();
+        if (!m_in->readBytes(header, 4)) return false;
+        size_t len = readLE16(header);
+        if ((len ^ readLE16(header + 2)) != 0xFFFF) return false;
+        while (len > 0) {
+            if (!reserve()) return false;
+            size_t take = std::min(len, m_out.size() - m_pos);
+            if (!m_in->readBytes(&m_out[m_pos], take)) return false;
+            m_pos += take;
+            len -= take;
+        }
+        return true;
+    }
+
+    bool codes(const Huffman& lit, const Huffman& dist)
+    {
+        static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+        while (true) {
+            unsigned sym;
+            if (!decode(lit, sym)) return false;
+            if (sym < 256) {
+                if (!reserve()) return false;
+                m_out[m_pos++] = (char)sym;
+                continue;
+            }
+            if (sym == 256) return true;
+            sym -= 257;
+            if (sym >= 29) return false;
+            uint32_t extra;
+            if (!m_in->bits(lengthExtra[sym], extra)) return false;
+            size_t len = lengthBase[sym] + extra;
+            unsigned d;
+            if (!decode(dist, d) || d >= 30 || !m_in->bits(distExtra[d], extra)) return false;
+            size_t distance = distBase[d] + extra;
+            if (!reserve() || distance > m_pos) return false;
+            char* out = &m_out[m_pos];
+            const char* from = out - distance;
+            for (size_t i = 0; i < len; ++i) out[i] = from[i];   // may overlap
+            m_pos += len;
+        }
+    }
+
+    std::vector<char> m_out;
+    size_t m_pos = 0;
+    size_t m_flushed = 0;
+    ArchiveInput* m_in = nullptr;
+    const Sink* m_sink = nullptr;
+};
+
+/** gunzip(in, sink, error):
+ *   Inflates every member of a gzip stream and checks their
+ *   CRC and length. Trailing bytes that are no gzip header
+ *   (e.g. zero padding) end the stream, as with gzip itself.
+ */
+static bool gunzip(ArchiveInput& in, const Inflater::Sink& sink, std::string& error)
+{
+    Inflater inflater;
+    for (bool first = true; ; first = false) {
+        error = "damaged or truncated gzip data";
+        char header[10];
+        if (!in.readBytes(header, 10) || (unsigned char)header[0] != 0x1F || (unsigned char)header[1] != 0x8B) {
+            if (first) error = "not a gzip file";
+            return !first;
+        }
+        if (header[2] != 8) {
+            error = "unknown gzip compression method";
+            return false;
+        }
+        unsigned flags = (unsigned char)header[3];
+        char field[2];
+        if ((flags & 4) && (!in.readBytes(field, 2) || !in.skipBytes(readLE16(field)))) return false;
+        for (unsigned flag : { 8u, 16u }) {   // file name, comment
+            if (!(flags & flag)) continue;
+            do {
+                if (!in.readBytes(field, 1)) return false;
+            } while (field[0] != 0);
+        }
+        if ((flags & 2) && !in.skipBytes(2)) return false;
+
+        uint32_t crc = 0;
+        uint64_t size = 0;
+        bool sinkStopped = false;
+        bool ok = inflater.run(in, [&](const char* data, size_t n) {
+            crc = crc32Update(crc, data, n);
+            size += n;
+            sinkStopped = !sink(data, n);
+            return !sinkStopped;
+        });
+        if (sinkStopped) return false;
+        char trailer[8];
+        in.alignToByte();
+        if (!ok || !in.readBytes(trailer, 8)) return false;
+        if (readLE32(trailer) != crc || readLE32(trailer + 4) != (uint32_t)size) {
+            error = "gzip checksum mismatch";
+            return false;
+        }
+    }
+}
+
+/** isSourceMemberName(name): .h, .cpp or .py, case-insensitive */
+static bool isSourceMemberName(const std::string& name)
+{
+    size_t dot = name.find_last_of("./");
+    if (dot == std::string::npos || name[dot] != '.') return false;
+    std::string ext = name.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".h" || ext == ".cpp" || ext == ".py";
+}
+
+/** normalizeMemberName(name): without leading "./" and "/"; empty for directories */
+static std::string normalizeMemberName(std::string name)
+{
+    size_t start = 0;
+    while (true) {
+        if (name.compare(start, 2, "./") == 0) start += 2;
+        else if (start < name.size() && name[start] == '/') start += 1;
+        else break;
+    }
+    name.erase(0, start);
+    if (!name.empty() && name.back() == '/') name.clear();
+    return name;
+}
+
+/** TarReader:
+ *   tar parser fed in pieces of any size (ustar with name
+ *   prefix, GNU long names, pax path/size records). Regular
+ *   files whose name passes isSourceMemberName() are collected
+ *   into 'members'; later copies of a name replace earlier ones,
+ *   as extracting would.
+ */
+class TarReader {
+public:
+    explicit TarReader(std::map<std::string, std::string>& members) : m_members(members) {}
+
+    /** feed(data, size): false on a damaged header */
+    bool feed(const char* data, size_t size)
+    {
+        while (size > 0 && !m_done) {
+            if (m_remaining > 0) {
+                size_t take = (size_t)std::min<uint64_t>(size, m_remaining);
+                if (m_collect) m_collect->append(data, take);
+                data += take;
+                size -= take;
+                m_remaining -= take;
+                if (m_remaining == 0) finishEntry();
+                continue;
+            }
+            if (m_padding > 0) {
+                size_t take = std::min(size, m_padding);
+                data += take;
+                size -= take;
+                m_padding -= take;
+                continue;
+            }
+            size_t take = std::min(size, TAR_BLOCK - m_header.size());
+            m_header.append(data, take);
+            data += take;
+            size -= take;
+            if (m_header.size() == TAR_BLOCK) {
+                bool ok = parseHeader();
+                m_header.clear();
+                if (!ok) return false;
+            }
+        }
+        return true;
+    }
+
+    /** complete(): ended on an entry boundary */
+    bool complete() const { return m_done || (m_remaining == 0 && m_padding == 0 && m_header.empty()); }
+
+    /** discardPartial(): drops a member cut off by the end of the input */
+    void discardPartial()
+    {
+        if (m_kind == Kind::Member && m_remaining > 0) m_members.erase(m_memberName);
+    }
+
+private:
+    enum class Kind { Skip, Member, LongName, Pax };
+
+    static uint64_t number(const char* field, size_t size)
+    {
+        uint64_t value = 0;
+        if ((unsigned char)field[0] & 0x80) {   // GNU base-256
+            value = (unsigned char)field[0] & 0x3F;
+            for (size_t i = 1; i < size; ++i) value = (value << 8) | (unsigned char)field[i];
+            return value;
+        }
+        size_t i = 0;
+        while (i < size && (field[i] == ' ' || field[i] == '\0')) ++i;
+        for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) value = value * 8 + (field[i] - '0');
+        return value;
+    }
+
+    static std::string text(const char* field, size_t size)
+    {
+        return std::string(field, strnlen(field, size));
+    }
+
+    bool parseHeader()
+    {
+        const char* h = m_header.data();
+        if (std::all_of(h, h + TAR_BLOCK, [](char c) { return c == 0; })) {
+            m_done = ++m_zeroBlocks >= 2;
+            return true;
+        }
+        m_zeroBlocks = 0;
+        uint64_t sum = 8 * ' ';
+        for (size_t i = 0; i < TAR_BLOCK; ++i) {
+            if (i < 148 || i >= 156) sum += (unsigned char)h[i];
+        }
+        if (sum != number(h + 148, 8)) return false;
+
+        char type = h[156];
+        uint64_t size = number(h + 124, 12);
+        m_kind = Kind::Skip;
+        m_collect = nullptr;
+        if (type == 'L') {
+            m_kind = Kind::LongName;
+            m_buffer.clear();
+            m_collect = &m_buffer;
+        }
+        else if (type == 'x') {
+            m_kind = Kind::Pax;
+            m_buffer.clear();
+            m_collect = &m_buffer;
+        }
+        else if (type != 'g' && type != 'K') {
+            std::string name = text(h, 100);
+            if (std::memcmp(h + 257, "ustar", 5) == 0 && h[345] != 0) {
+                name = text(h + 345, 155) + "/" + name;
+            }
+            if (!m_nextName.empty()) name = m_nextName;
+            if (m_nextSize != UINT64_MAX) size = m_nextSize;
+            m_nextName.clear();
+            m_nextSize = UINT64_MAX;
+            name = normalizeMemberName(name);
+            if ((type == '0' || type == '\0' || type == '7') && !name.empty() && isSourceMemberName(name)) {
+                m_kind = Kind::Member;
+                m_memberName = name;
+                m_collect = &m_members[name];
+                m_collect->clear();
+                m_collect->reserve((size_t)std::min<uint64_t>(size, 64u << 20));
+            }
+        }
+        m_remaining = size;
+        m_padding = (size_t)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+        if (size == 0) finishEntry();
+        return true;
+    }
+
+    void finishEntry()
+    {
+        if (m_kind == Kind::LongName) {
+            m_nextName = text(m_buffer.data(), m_buffer.size());
+        }
+        else if (m_kind == Kind::Pax) {
+            // records: "<length> <key>=<value>\n"
+            size_t pos = 0;
+            while (pos < m_buffer.size()) {
+                size_t space = m_buffer.find(' ', pos);
+                if (space == std::string::npos) break;
+                size_t len = (size_t)std::strtoull(m_buffer.c_str() + pos, nullptr, 10);
+                if (len <= space - pos || pos + len > m_buffer.size()) break;
+                std::string record = m_buffer.substr(space + 1, pos + len - space - 2);
+                size_t eq = record.find('=');
+                if (eq != std::string::npos) {
+                    std::string key = record.substr(0, eq);
+                    if (key == "path") m_nextName = record.substr(eq + 1);
+                    else if (key == "size") m_nextSize = std::strtoull(record.c_str() + eq + 1, nullptr, 10);
+                }
+                pos += len;
+            }
+        }
+        m_kind = Kind::Skip;
+        m_collect = nullptr;
+    }
+
+    std::map<std::string, std::string>& m_members;
+    std::string m_header;
+    std::string m_buffer;
+    std::string* m_collect = nullptr;
+    Kind m_kind = Kind::Skip;
+    std::string m_memberName;
+    uint64_t m_remaining = 0;
+    size_t m_padding = 0;
+    std::string m_nextName;
+    uint64_t m_nextSize = UINT64_MAX;
+    int m_zeroBlocks = 0;
+    bool m_done = false;
+};
+
+/** readZip(archive, members, error):
+ *   Walks the central directory (zip64 included) and reads only
+ *   the source members, stored or deflated. Encrypted members or
+ *   other methods are skipped with a warning; a member whose CRC
+ *   does not match or whose sizes reach past the end of the file
+ *   is skipped as well.
+ */
+static bool readZip(const fs::path& archive, std::map<std::string, std::string>& members, std::string& error)
+{
+    std::ifstream file(archive, std::ios::in | std::ios::binary);
+    std::error_code ec;
+    uint64_t fileSize = fs::file_size(archive, ec);
+    if (!file.is_open() || ec) {
+        error = "cannot open the file";
+        return false;
+    }
+    auto readAt = [&](uint64_t offset, size_t size, std::string& out) {
+        out.resize(size);
+        file.clear();
+        file.seekg((std::streamoff)offset);
+        return size == 0 || (file.read(&out[0], (std::streamsize)size) && (size_t)file.gcount() == size);
+    };
+
+    // end of central directory: 22 bytes plus a comment of up to 64 KB
+    std::string tail;
+    size_t tailSize = (size_t)std::min<uint64_t>(fileSize, 22 + 65535 + 20);
+    if (!readAt(fileSize - tailSize, tailSize, tail)) {
+        error = "cannot read the file";
+        return false;
+    }
+    size_t eocd = std::string::npos;
+    for (size_t i = tail.size() >= 22 ? tail.size() - 22 + 1 : 0; i-- > 0; ) {
+        if (readLE32(&tail[i]) == 0x06054b50) { eocd = i; break; }
+    }
+    if (eocd == std::string::npos) {
+        error = "not a zip file";
+        return false;
+    }
+    uint64_t cdSize = readLE32(&tail[eocd + 12]);
+    uint64_t cdOffset = readLE32(&tail[eocd + 16]);
+    if ((cdSize == 0xFFFFFFFF || cdOffset == 0xFFFFFFFF) && eocd >= 20 && readLE32(&tail[eocd - 20]) == 0x07064b50) {
+        std::string record;
+        if (!readAt(readLE64(&tail[eocd - 20 + 8]), 56, record) || readLE32(&record[0]) != 0x06064b50) {
+            error = "damaged zip64 directory";
+            return false;
+        }
+        cdSize = readLE64(&record[40]);
+        cdOffset = readLE64(&record[48]);
+    }
+    std::string directory;
+    if (cdOffset > fileSize || cdSize > fileSize - cdOffset || !readAt(cdOffset, (size_t)cdSize, directory)) {
+        error = "damaged central directory";
+        return false;
+    }
+
+    Inflater inflater;
+    std::string compressed;
+    size_t pos = 0;
+    while (pos + 46 <= directory.size() && readLE32(&directory[pos]) == 0x02014b50) {
+        const char* e = &directory[pos];
+        uint32_t flags = readLE16(e + 8), method = readLE16(e + 10), crc = readLE32(e + 16);
+        uint64_t packed = readLE32(e + 20), size = readLE32(e + 24), offset = readLE32(e + 42);
+        size_t nameLen = readLE16(e + 28), extraLen = readLE16(e + 30), commentLen = readLE16(e + 32);
+        if (pos + 46 + nameLen + extraLen > directory.size()) break;
+        std::string name = normalizeMemberName(std::string(e + 46, nameLen));
+        for (size_t x = 0; x + 4 <= extraLen; ) {   // zip64 sizes and offset
+            const char* field = e + 46 + nameLen + x;
+            size_t fieldLen = readLE16(field + 2);
+            if (readLE16(field) == 0x0001) {
+                size_t at = 4;
+                for (uint64_t* value : { &size, &packed, &offset }) {
+                    if (*value != 0xFFFFFFFF) continue;
+                    if (at + 8 > 4 + fieldLen || x + at + 8 > extraLen) break;
+                    *value = readLE64(field + at);
+                    at += 8;
+                }
+            }
+            x += 4 + fieldLen;
+        }
+        pos += 46 + nameLen + extraLen + commentLen;
+        if (name.empty() || !isSourceMemberName(name)) continue;
+        if (e[5] == 3 && ((readLE32(e + 38) >> 16) & 0170000) == 0120000) continue;   // Unix symlink, skipped like on disk
+
+        if ((flags & 1) || (method != 0 && method != 8)) {
+            std::cerr << "Warning: " << archive.string() << ": skipped " << name
+                << ((flags & 1) ? " (encrypted)" : " (unsupported compression)") << "\n";
+            continue;
+        }
+        std::string local;
+        uint64_t dataOffset = 0;
+        bool readable = offset <= fileSize && fileSize - offset >= 30 && readAt(offset, 30, local) &&
+            readLE32(&local[0]) == 0x04034b50;
+        if (readable) {
+            dataOffset = offset + 30 + readLE16(&local[26]) + readLE16(&local[28]);
+            readable = dataOffset <= fileSize && packed <= fileSize - dataOffset &&
+                readAt(dataOffset, (size_t)packed, compressed);
+        }
+        if (!readable) {
+            std::cerr << "Warning: " << archive.string() << ": skipped " << name << " (unreadable)\n";
+            continue;
+        }
+        std::string data;
+        bool ok = true;
+        if (method == 0) {
+            data.swap(compressed);
+        }
+        else {
+            data.reserve((size_t)std::min<uint64_t>(size, 64u << 20));
+            ArchiveInput in(compressed.data(), compressed.size());
+            ok = inflater.run(in, [&](const char* d, size_t n) { data.append(d, n); return true; });
+        }
+        if (!ok || data.size() != size || crc32Update(0, data.data(), data.size()) != crc) {
+            std::cerr << "Warning: " << archive.string() << ": skipped " << name << " (damaged)\n";
+            continue;
+        }
+        members[name] = std::move(data);
+    }
+    return true;
+}
+
+/** decodeArchive(archive, members, error):
+ *   Source members of a .zip, .tar.gz/.tgz or .tar. On error
+ *   'members' holds what was read before the damage.
+ */
+static bool decodeArchive(const fs::path& archive, std::map<std::string, std::string>& members, std::string& error)
+{
+    std::string name = archive.filename().string();
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    auto endsWith = [&](const std::string& suffix) {
+        return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    if (endsWith(".zip")) return readZip(archive, members, error);
+
+    std::ifstream file(archive, std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+        error = "cannot open the file";
+        return false;
+    }
+    TarReader tar(members);
+    bool tarOk = true;
+    if (endsWith(".tar.gz") || endsWith(".tgz")) {
+        ArchiveInput in([&](char* buffer, size_t size) {
+            file.read(buffer, (std::streamsize)size);
+            return (size_t)file.gcount();
+        });
+        bool ok = gunzip(in, [&](const char* data, size_t size) { return tarOk = tar.feed(data, size); }, error);
+        if (!ok && tarOk) {
+            tar.discardPartial();
+            return false;
+        }
+    }
+    else {
+        std::vector<char> buffer(ARCHIVE_READ_BYTES);
+        while (tarOk && (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)) {
+            tarOk = tar.feed(buffer.data(), (size_t)file.gcount());
+        }
+    }
+    if (!tarOk) {
+        error = "damaged tar header";
+        return false;
+    }
+    if (!tar.complete()) {
+        tar.discardPartial();
+        error = "truncated tar archive";
+        return false;
+    }
+    return true;
+}
+
+/** isArchivePath(path): an existing .tar, .tar.gz, .tgz or .zip file */
+static bool isArchivePath(const fs::path& path)
+{
+    std::string name = path.filename().string();
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    bool archive = false;
+    for (const char* suffix : { ".tar", ".tar.gz", ".tgz", ".zip" }) {
+        size_t len = std::strlen(suffix);
+        if (name.size() > len && name.compare(name.size() - len, len, suffix) == 0) archive = true;
+    }
+    std::error_code ec;
+    return archive && fs::is_regular_file(path, ec);
+}
+
+/** Source members of one mounted archive, by virtual path */
+struct MountedArchive {
+    uintmax_t size = 0;
+    int64_t mtime = 0;
+    std::vector<std::string> paths;
+};
+static std::map<std::string, MountedArchive> g_mountedArchives;   // by archive path, under g_archiveMutex
+
+/** mountArchive(root, paths):
+ *   Decodes the archive 'root' (again only if it changed since)
+ *   and lists its source members as virtual paths, sorted.
+ */
+static void mountArchive(const fs::path& root, std::vector<std::string>& paths)
+{
+    const std::string key = root.string();
+    std::error_code ec;
+    uintmax_t size = fs::file_size(root, ec);
+    int64_t mtime = (int64_t)fs::last_write_time(root, ec).time_since_epoch().count();
+    {
+        std::shared_lock<std::shared_mutex> lock(g_archiveMutex);
+        auto it = g_mountedArchives.find(key);
+        if (it != g_mountedArchives.end() && it->second.size == size && it->second.mtime == mtime) {
+            paths = it->second.paths;
+            return;
+        }
+    }
+
+    TraceSpan span("mount archive");
+    auto start = std::chrono::steady_clock::now();
+    std::map<std::string, std::string> members;
+    std::string error;
+    if (!decodeArchive(root, members, error)) {
+        std::cerr << "Error: " << key << ": " << error;
+        if (!members.empty()) std::cerr << " (using the " << members.size() << " file(s) read before)";
+        std::cerr << "\n";
+    }
+
+    MountedArchive mounted;
+    mounted.size = size;
+    mounted.mtime = mtime;
+    uintmax_t bytes = 0;
+    {
+        std::unique_lock<std::shared_mutex> lock(g_archiveMutex);
+        auto old = g_mountedArchives.find(key);
+        if (old != g_mountedArchives.end()) {
+            for (const auto& path : old->second.paths) g_archiveMembers.erase(path);
+        }
+        for (auto& m : members) {
+            auto member = std::make_shared<ArchiveMember>();
+            member->data = std::move(m.second);
+            member->mtime = mtime;
+            bytes += member->data.size();
+            std::string path = key + "/" + m.first;
+            g_archiveMembers[path] = std::move(member);
+            mounted.paths.push_back(std::move(path));
+        }
+        paths = mounted.paths;
+        g_mountedArchives[key] = std::move(mounted);
+        g_archivesMounted.store(true, std::memory_order_release);
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Archive " << root.filename().string() << ": " << paths.size() << " source file(s), "
+        << (bytes + 1023) / 1024 << " KB, read in " << ms << " ms\n";
+}
+
+/** archiveFiles(root, paths):
+ *   False if 'root' is neither an archive nor a folder inside
+ *   one. Otherwise the source members below 'root' as virtual
+ *   paths, sorted, with the archive mounted on first use.
+ */
+static bool archiveFiles(const fs::path& root, std::vector<std::string>& paths)
+{
+    fs::path archive = root;
+    while (!isArchivePath(archive)) {
+        if (archive.empty() || archive.parent_path() == archive) return false;
+        archive = archive.parent_path();
+    }
+    mountArchive(archive, paths);
+    if (archive != root) {
+        const std::string prefix = root.string() + "/";
+        paths.erase(std::remove_if(paths.begin(), paths.end(), [&](const std::string& path) {
+            return path.compare(0, prefix.size(), prefix) != 0;
+        }), paths.end());
+    }
+    return true;
+}
+
+/** archiveFolders(root, folders):
+ *   The top-level folders of an archive 'root' as virtual paths;
+ *   false if 'root' is no archive.
+ */
+static bool archiveFolders(const fs::path& root, std::vector<std::string>& folders)
+{
+    if (!isArchivePath(root)) return false;
+    std::vector<std::string> paths;
+    mountArchive(root, paths);
+    const size_t skip = root.string().size() + 1;
+    for (const auto& path : paths) {
+        size_t slash = path.find('/', skip);
+        if (slash == std::string::npos) continue;
+        std::string folder = path.substr(0, slash);
+        if (folders.empty() || folders.back() != folder) folders.push_back(folder);
+    }
+    return true;
+}
+
+/** findArchiveHeader(root, folderPart, names, found, headerName):
+ *   The header searches below for an archive root: the first
+ *   member whose path contains 'folderPart' and whose file name
+ *   is one of 'names' (both compared in lower case). False if
+ *   'root' is no archive.
+ */
+static bool findArchiveHeader(const fs::path& root, const char* folderPart,
+    std::initializer_list<const char*> names, bool& found, std::string& headerName)
+{
+    std::vector<std::string> paths;
+    if (!archiveFiles(root, paths)) return false;
+    for (const auto& path : paths) {
+        std::string lower = path;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (lower.find(folderPart) == std::string::npos) continue;
+        std::string fn = lower.substr(lower.find_last_of('/') + 1);
+        for (const char* name : names) {
+            if (fn == name) {
+                found = true;
+                headerName = path;
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+/*******************************************************
+ * findClientHeaderInUserInterface():
+ *   Recursively scans the given path for "locale_inc.h"
+ *   in any subdirectory that includes "UserInterface" in its path
+ *******************************************************/
+void findClientHeaderInUserInterface(const fs::path& startPath,
+    bool& hasClientHeader,
+    std::string& clientHeaderName)
+{
+    hasClientHeader = false;
+    clientHeaderName.clear();
+    if (findArchiveHeader(startPath, "userinterface", { "locale_inc.h" }, hasClientHeader, clientHeaderName)) {
+        return;
+    }
+
+    try {
+        for (auto& p : fs::recursive_directory_iterator(startPath,
+            fs::directory_options::skip_permission_denied))
+        {
+            try {
+                if (fs::is_symlink(p.path())) continue;
+                auto st = p.status();
+                if (!fs::is_regular_file(st)) continue;
+
+                auto rel = p.path().string();
+                std::string lowerRel;
+                lowerRel.reserve(rel.size());
+                for (char c : rel) {
+                    lowerRel.push_back(std::tolower((unsigned char)c));
+                }
+                if (lowerRel.find("userinterface") == std::string::npos) {
+                    continue;
+                }
+                auto fn = p.path().filename().string();
+                std::string lowerFn;
+                for (char c : fn) {
+                    lowerFn.push_back(std::tolower((unsigned char)c));
+                }
+                if (lowerFn == "locale_inc.h") {
+                    hasClientHeader = true;
+                    clientHeaderName = p.path().string();
+                    return;
+                }
+            }
+            catch (...) { continue; }
+        }
+    }
+    catch (...) {}
+}
+
+/*******************************************************
+ * findServerHeaderInCommon():
+ *   Recursively scans for "service.h" or "commondefines.h"
+ *   in a path containing "common" in its folder name
+ *******************************************************/
+void findServerHeaderInCommon(const fs::path& startPath,
+    bool& hasServerHeader,
+    std::string& serverHeaderName)
+{
+    hasServerHeader = false;
+    serverHeaderName.clear();
+    if (findArchiveHeader(startPath, "common", { "service.h", "commondefines.h" }, hasServerHeader, serverHeaderName)) {
+        return;
+    }
+
+    try {
+        for (auto& p : fs::recursive_directory_iterator(startPath,
+            fs::directory_options::skip_permission_denied))
+        {
+            try {
+                if (fs::is_symlink(p.path())) continue;
+                auto st = p.status();
+                if (!fs::is_regular_file(st)) continue;
+
+                auto rel = p.path().string();
+                std::string lowerRel;
+                lowerRel.reserve(rel.size());
+                for (char c : rel) {
+                    lowerRel.push_back(std::tolower((unsigned char)c));
+                }
+                if (lowerRel.find("common") == std::string::npos) {
+                    continue;
+                }
+                auto fn = p.path().filename().string();
+                std::string lowerFn;
+                for (char c : fn) {
+                    lowerFn.push_back(std::tolower((unsigned char)c));
+                }
+                if (lowerFn == "service.h" || lowerFn == "commondefines.h") {
+                    hasServerHeader = true;
+                    serverHeaderName = p.path().string();
+                    return;
+                }
+            }
+            catch (...) { continue; }
+        }
+    }
+    catch (...) {}
+}
+
+/*******************************************************
+ * findPythonRoots():
+ *   Lists subfolders named exactly "root" (not recursing).
+ *   You could adjust to do a deeper search if needed.
+ *******************************************************/
+void findPythonRoots(const fs::path& startPath,
+    std::vector<std::string>& pythonRoots)
+{
+    pythonRoots.clear();
+    std::vector<std::string> folders;
+    if (archiveFolders(startPath, folders)) {
+        for (const auto& folder : folders) {
+            std::string name = folder.substr(folder.find_last_of('/') + 1);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            if (name == "root") pythonRoots.push_back(folder);
+        }
+        return;
+    }
+    try {
+        for (auto& p : fs::directory_iterator(startPath,
+            fs::directory_options::skip_permission_denied))
+        {
+            try {
+                if (!fs::is_directory(p.path())) continue;
+                auto wdir = p.path().filename().wstring();
+                std::wstring lowerW;
+                lowerW.reserve(wdir.size());
+                for (wchar_t wc : wdir) {
+                    lowerW.push_back(std::tolower(wc));
+                }
+                if (lowerW == L"root") {
+                    pythonRoots.push_back(p.path().string());
+                }
+            }
+            catch (...) { continue; }
+        }
+    }
+    catch (...) {}
+}
+
+/*******************************************************
+ * findSourceFiles(path):
+ *   Recursively collects all .h / .cpp files from startRoot
+ *******************************************************/
+FileList findSourceFiles(const fs::path& startRoot)
+{
+    TraceSpan span("find files");
+    FileList result;
+    static const std::unordered_set<std::string> validExtensions = { ".cpp", ".h" };
+
+    std::vector<std::string> members;
+    if (archiveFiles(startRoot, members)) {
+        for (const auto& path : members) {
+            std::string ext = fs::path(path).extension().string();
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            if (validExtensions.count(ext)) {
+                result.push_back(g_files.intern(path));
+            }
+        }
+        return result;
+    }
+
+    try {
+        for (auto& p : fs::recursive_directory_iterator(startRoot, fs::directory_options::skip_permission_denied))
+        {
+            try {
+                if (fs::is_symlink(p.path())) continue;
+                if (fs::is_regular_file(p.path())) {
+                    std::string ext = p.path().extension().string();
+                    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+                    if (validExtensions.count(ext)) {
+                        result.push_back(g_files.intern(p.path().string()));
+                    }
+                }
+            }
+            catch (...) { continue; }
+        }
+    }
+    catch (...) {}
+
+    return result;
+}
+
+/** isPythonExtension(path): .py in any case, like archive members */
+static bool isPythonExtension(const fs::path& path)
+{
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".py";
+}
+
+/*******************************************************
+ * findPythonFiles(root):
+ *   Recursively collects all .py files below the Python root
+ *******************************************************/
+FileList findPythonFiles(const fs::path& root)
+{
+    TraceSpan span("find files");
+    FileList pyFiles;
+    std::vector<std::string> members;
+    if (archiveFiles(root, members)) {
+        for (const auto& path : members) {
+            if (isPythonExtension(fs::path(path))) {
+                pyFiles.push_back(g_files.intern(path));
+            }
+        }
+        return pyFiles;
+    }
+    try {
+        for (auto& p : fs::recursive_directory_iterator(root,
+            fs::directory_options::skip_permission_denied))
+        {
+            if (fs::is_symlink(p.path())) continue;
+            if (fs::is_regular_file(p.path()) && isPythonExtension(p.path())) {
+                pyFiles.push_back(g_files.intern(p.path().string()));
+            }
+        }
+    }
+    catch (...) {}
+    return pyFiles;
+}
+
+/** headerDefinesFromLines(header, lines):
+ *   The defines of 'header', in symbol table order, from lines
+ *   already read. Declared ahead: the table follows the
+ *   directive scanner further down.
+ */
+std::vector<std::string> headerDefinesFromLines(FileId header, std::vector<std::string> lines);
+
+/*******************************************************
+ * Concurrent multi-root scan
+ *
+ *  Client, server and Python files are put into one task
+ *  list and scanned on a single worker pool. Every file is
+ *  read and classified exactly once; the combined modes
+ *  (cross-reference, binding map) then answer their queries
+ *  from the stored scans, so no root is read twice.
+ *******************************************************/
+enum class ScanSide { Client = 0, Server = 1, Python = 2 };
+static const char* const scanSideNames[] = { "CLIENT", "SERVER", "PYTHON" };
+
+struct SourceScanTask {
+    ScanSide side = ScanSide::Client;
+    FileId file = 0;
+    bool keepLines = false;     // lines survive the scan even without keepLines (the header)
+};
+
+/** Per-file result; each slot is written by exactly one worker */
+struct SourceScanResult {
+    CppFileScan cpp;                                 // client/server files
+    PythonFileScan py;                               // Python files
+    std::unordered_map<size_t, std::string> refText; // trimmed text of referenced lines
+};
+
+static std::string trimCopy(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos) return "";
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+/** scanSourceLines(task, lines, res, keepLines, large):
+ *   Scans the lines of one file into its result slot. Large C++
+ *   files are classified with the intra-file parallel path.
+ */
+void scanSourceLines(const SourceScanTask& task, std::vector<std::string>& lines,
+    SourceScanResult& res, bool keepLines, bool large)
+{
+    keepLines = keepLines || task.keepLines;
+    std::vector<std::string>* scannedLines = nullptr;
+    if (task.side == ScanSide::Python) {
+        res.py = scanPythonLines(std::move(lines));
+        for (const auto& ref : res.py.appRefs) {
+            res.refText.emplace(ref.line, trimCopy(res.py.lines[ref.line]));
+        }
+        scannedLines = &res.py.lines;
+    }
+    else {
+        // function spans are only needed when blocks get extracted later
+        res.cpp = large ? scanCppLinesParallel(std::move(lines), keepLines)
+                        : scanCppLines(std::move(lines), keepLines);
+        for (const auto& ref : res.cpp.conditionals) {
+            res.refText.emplace(ref.line, trimCopy(res.cpp.lines[ref.line]));
+        }
+        for (const auto& b : res.cpp.bindings) {
+            res.refText.emplace(b.line, trimCopy(res.cpp.lines[b.line]));
+        }
+        scannedLines = &res.cpp.lines;
+    }
+    if (!keepLines) {
+        std::vector<std::string>().swap(*scannedLines);
+    }
+}
+
+/** scanSourceTask(task, res, keepLines, large):
+ *   Reads and scans one file into its result slot.
+ */
+void scanSourceTask(const SourceScanTask& task, SourceScanResult& res, bool keepLines, bool large)
+{
+    TraceSpan parse("parse", task.file);
+    std::vector<std::string> lines;
+    if (large) {
+        readLinesChunkedParallel(g_files.path(task.file), lines);
+    }
+    else {
+        readBufferedFile(g_files.path(task.file), lines);
+    }
+    scanSourceLines(task, lines, res, keepLines, large);
+}
+
+void sourceScanWorker(FileFeed& feed,
+    ConcurrencyControl& ctl,
+    size_t worker,
+    const std::vector<SourceScanTask>& tasks,
+    std::vector<SourceScanResult>& results,
+    bool keepLines,
+    std::atomic<size_t>& doneFiles)
+{
+    pinWorkerThread(worker);
+    traceThreadName("parser");
+    size_t idx = 0;
+    std::vector<std::string> lines;
+    while (nextControlledFile(feed, ctl, worker, idx, lines)) {
+        TraceSpan parse("parse", (*feed.files)[idx]);
+        auto busyFrom = beginWork(ctl, worker);
+        scanSourceLines(tasks[idx], lines, results[idx], keepLines, false);
+        reportWork(ctl, worker, feed.stats[idx].size, std::chrono::steady_clock::now() - busyFrom);
+
+        size_t done = doneFiles.fetch_add(1, std::memory_order_relaxed) + 1;
+        printProgress(done, tasks.size());
+    }
+}
+
+/** addScanTasks(tasks, side, files):
+ *   Appends the files of one root in sorted order.
+ */
+void addScanTasks(std::vector<SourceScanTask>& tasks, ScanSide side, const FileList& files)
+{
+    for (FileId f : sortedFileList(files)) {
+        tasks.push_back({ side, f });
+    }
+}
+
+/** keepHeaderLines(tasks, header):
+ *   Lets the task of 'header' keep its lines, so its defines can
+ *   be taken from the shared scan (see scannedHeaderDefines).
+ */
+void keepHeaderLines(std::vector<SourceScanTask>& tasks, const std::string& header)
+{
+    FileId id = g_files.intern(header);
+    for (auto& task : tasks) {
+        if (task.file == id && task.side != ScanSide::Python) task.keepLines = true;
+    }
+}
+
+/** scanSourcesMultiThread(tasks, keepLines):
+ *   Runs all tasks on one worker pool. With keepLines=false only
+ *   the references (and their line text) survive the scan.
+ */
+std::vector<SourceScanResult>
+scanSourcesMultiThread(const std::vector<SourceScanTask>& tasks, bool keepLines)
+{
+    size_t numThreads = std::min<size_t>(workerThreadLimit(), tasks.size());
+    std::cout << "Scanning " << tasks.size() << " file(s) with "
+        << numThreads << " thread(s)...\n";
+
+    std::vector<SourceScanResult> results(tasks.size());
+    std::atomic<size_t> doneFiles{ 0 };
+    FileList names;
+    names.reserve(tasks.size());
+    for (const auto& task : tasks) names.push_back(task.file);
+    std::vector<FileStat> stats = statFiles(names);
+
+    // identical copies are scanned once; Python and C++ scans differ
+    std::vector<uint64_t> hashes;
+    contentHashes(names, stats, hashes, false);
+    std::vector<uint8_t> kinds(tasks.size());
+    for (size_t i = 0; i < tasks.size(); ++i) kinds[i] = tasks[i].side == ScanSide::Python;
+    DuplicateFiles dups = findDuplicateFiles(stats, hashes, &kinds);
+    reportDuplicates(dups);
+    doneFiles += dups.count;
+
+    // huge C++ files first, each one spread over all cores
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (dups.source[i] != i) continue;
+        if (tasks[i].side != ScanSide::Python && stats[i].size >= LARGE_FILE_BYTES) {
+            scanSourceTask(tasks[i], results[i], keepLines, true);
+            size_t done = doneFiles.fetch_add(1, std::memory_order_relaxed) + 1;
+            printProgress(done, tasks.size());
+        }
+        else {
+            pending.push_back(i);
+        }
+    }
+
+    numThreads = std::min<size_t>(numThreads, pending.size());
+    ConcurrencyControl ctl;
+    startConcurrencyControl(ctl, numThreads);
+    FileFeed feed;
+    feed.control = &ctl;
+    startFileFeed(feed, names, std::move(stats), pending);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back(sourceScanWorker,
+            std::ref(feed),
+            std::ref(ctl),
+            t,
+            std::cref(tasks),
+            std::ref(results),
+            keepLines,
+            std::ref(doneFiles));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    finishFileFeed(feed);
+    printProgress(tasks.size(), tasks.size());
+    std::cout << "\n";
+    stopConcurrencyControl(ctl);
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (dups.source[i] != i) results[i] = results[dups.source[i]];
+    }
+    return results;
+}
+
+/** scannedHeaderDefines(tasks, results, header):
+ *   The defines of 'header' from the lines its task kept (see
+ *   keepHeaderLines). Only a header outside the scanned root,
+ *   or a duplicate whose copy was scanned instead, is read.
+ */
+std::vector<std::string> scannedHeaderDefines(const std::vector<SourceScanTask>& tasks,
+    const std::vector<SourceScanResult>& results, const std::string& header)
+{
+    FileId id = g_files.intern(header);
+    std::vector<std::string> lines;
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        if (tasks[t].file == id && tasks[t].side != ScanSide::Python) {
+            lines = results[t].cpp.lines;
+            break;
+        }
+    }
+    if (lines.empty()) readBufferedFile(header, lines);
+    return headerDefinesFromLines(id, std::move(lines));
+}
+
+/*******************************************************
+ * Cross-reference report (Client + Server + Python)
+ *******************************************************/
+struct FeatureHit {
+    size_t task = 0;
+    size_t line = 0;
+};
+
+/** runCrossReferenceScan():
+ *   Scans the given roots (empty = not configured) and writes
+ *   Output/CROSSREF_REPORT.txt. Features are the union of the
+ *   client/server header defines and the Python app.<param>
+ *   names; features with hits on only one side are flagged.
+ */
+void runCrossReferenceScan(const fs::path& clientPath,
+    const std::string& clientHeaderName,
+    const fs::path& serverPath,
+    const std::string& serverHeaderName,
+    const std::string& pythonRoot)
+{
+    bool sideEnabled[3] = { !clientHeaderName.empty(), !serverHeaderName.empty(), !pythonRoot.empty() };
+
+    std::vector<SourceScanTask> tasks;
+    if (sideEnabled[0]) addScanTasks(tasks, ScanSide::Client, findSourceFiles(clientPath));
+    if (sideEnabled[1]) addScanTasks(tasks, ScanSide::Server, findSourceFiles(serverPath));
+    if (sideEnabled[2]) addScanTasks(tasks, ScanSide::Python, findPythonFiles(pythonRoot));
+    if (sideEnabled[0]) keepHeaderLines(tasks, clientHeaderName);
+    if (sideEnabled[1]) keepHeaderLines(tasks, serverHeaderName);
+
+    if (tasks.empty()) {
+        std::cerr << "No files to scan.\n";
+        return;
+    }
+
+    auto startTime = high_resolution_clock::now();
+    auto results = scanSourcesMultiThread(tasks, false);
+
+    // feature universe: header defines (from the scan above) + Python params
+    std::set<std::string> clientDefs, serverDefs;
+    if (sideEnabled[0]) {
+        auto d = scannedHeaderDefines(tasks, results, clientHeaderName);
+        clientDefs.insert(d.begin(), d.end());
+    }
+    if (sideEnabled[1]) {
+        auto d = scannedHeaderDefines(tasks, results, serverHeaderName);
+        serverDefs.insert(d.begin(), d.end());
+    }
+    std::map<std::string, std::array<std::vector<FeatureHit>, 3>> features;
+    for (auto& d : clientDefs) features[d];
+    for (auto& d : serverDefs) features[d];
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        for (const auto& ref : results[t].py.appRefs) {
+            if (!pythonParamBlacklist.count(ref.param)) {
+                features[ref.param];
+            }
+        }
+    }
+
+    auto addHit = [](std::vector<FeatureHit>& hits, size_t task, size_t line) {
+        if (!hits.empty() && hits.back().task == task && hits.back().line == line) return;
+        hits.push_back({ task, line });
+    };
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        int side = (int)tasks[t].side;
+        // whole identifiers only: ENABLE_DRAGON_SOUL is no hit for ENABLE_DRAGON
+        for (const auto& ref : results[t].cpp.conditionals) {
+            auto it = features.find(ref.ident);
+            if (it != features.end()) addHit(it->second[side], t, ref.line);
+        }
+        for (const auto& ref : results[t].py.appRefs) {
+            auto it = features.find(ref.param);
+            if (it != features.end()) addHit(it->second[side], t, ref.line);
+        }
+    }
+
+    auto endTime = high_resolution_clock::now();
+    auto ms = duration_cast<milliseconds>(endTime - startTime).count();
+
+    fs::create_directory("Output");
+    std::string outFileName = "Output/CROSSREF_REPORT.txt";
+    std::ofstream out(outFileName);
+    if (!out.is_open()) {
+        std::cerr << "Error when opening " << outFileName << "\n";
+        return;
+    }
+
+    out << "=== CROSS-REFERENCE: CLIENT / SERVER / PYTHON ===\n";
+    out << "Client root: " << (sideEnabled[0] ? clientPath.string() : "(not set)") << "\n";
+    out << "Server root: " << (sideEnabled[1] ? serverPath.string() : "(not set)") << "\n";
+    out << "Python root: " << (sideEnabled[2] ? pythonRoot : "(not set)") << "\n\n";
+
+    size_t oneSided = 0, noHits = 0;
+    std::map<std::string, std::string> notes;
+    for (const auto& kv : features) {
+        int present = 0, lastSide = 0;
+        for (int s = 0; s < 3; ++s) {
+            if (!kv.second[s].empty()) { present++; lastSide = s; }
+        }
+        std::string note;
+        if (present == 0) {
+            note = "NO HITS";
+            noHits++;
+        }
+        else if (present == 1) {
+            note = std::string(scanSideNames[lastSide]) + " ONLY";
+            oneSided++;
+        }
+        notes[kv.first] = note;
+    }
+
+    out << std::left << std::setw(40) << "FEATURE" << std::right
+        << std::setw(8) << "CLIENT" << std::setw(8) << "SERVER" << std::setw(8) << "PYTHON"
+        << "  DEF  NOTE\n";
+    for (const auto& kv : features) {
+        std::string def;
+        if (clientDefs.count(kv.first)) def += "C";
+        if (serverDefs.count(kv.first)) def += "S";
+        if (def.empty()) def = "-";
+        out << std::left << std::setw(40) << kv.first << std::right;
+        for (int s = 0; s < 3; ++s) {
+            if (sideEnabled[s]) out << std::setw(8) << kv.second[s].size();
+            else                out << std::setw(8) << "n/a";
+        }
+        out << "  " << std::left << std::setw(4) << def << " " << notes[kv.first] << std::right << "\n";
+    }
+    out << "\n";
+
+    for (const auto& kv : features) {
+        out << "##########\n" << kv.first;
+        if (!notes[kv.first].empty()) out << "  [" << notes[kv.first] << "]";
+        out << "\n##########\n";
+        for (int s = 0; s < 3; ++s) {
+            if (!sideEnabled[s]) continue;
+            out << "[" << scanSideNames[s] << "] " << kv.second[s].size() << " hit(s)\n";
+            for (const auto& hit : kv.second[s]) {
+                const auto& res = results[hit.task];
+                auto it = res.refText.find(hit.line);
+                out << "  " << g_files.path(tasks[hit.task].file) << ":" << (hit.line + 1)
+                    << ": " << (it != res.refText.end() ? it->second : "") << "\n";
+            }
+        }
+        out << "\n";
+    }
+    out << "--- SUMMARY: " << features.size() << " feature(s), "
+        << oneSided << " present on one side only, "
+        << noHits << " without hits ---\n";
+
+    std::cout << "Cross-reference of " << features.size() << " feature(s) finished in "
+        << ms << " ms (" << oneSided << " one-sided, " << noHits << " without hits)\n";
+}
+
+/*******************************************************
+ * C++ -> Python binding map (Client + Python)
+ *
+ *  The client tree and the Python root are scanned once
+ *  together and kept in memory. PyModule_Add* calls found in
+ *  the client link a define to its app.<NAME> usages, so a
+ *  single query returns the C++ blocks, the binding sites and
+ *  the Python if-blocks without any further file access.
+ *******************************************************/
+struct BindingIndex {
+    std::vector<SourceScanTask> tasks;
+    std::vector<SourceScanResult> results;
+};
+
+/** guardText(scan, binding):
+ *   Joins the guarding directives, e.g. "#ifdef A / #else".
+ */
+static std::string guardText(const CppFileScan& scan, const PythonBinding& b)
+{
+    std::string text;
+    for (size_t g : b.guardLines) {
+        if (!text.empty()) text += " / ";
+        text += trimCopy(scan.lines[g]);
+    }
+    return text.empty() ? "(unguarded)" : text;
+}
+
+/** bindingMatchesDefine(scan, binding, define):
+ *   A binding belongs to a define if it is exported under that
+ *   name or if one of its guarding conditionals references it
+ *   (whole identifier, so ENABLE_X does not claim ENABLE_X_EXTRA).
+ */
+static bool bindingMatchesDefine(const CppFileScan& scan, const PythonBinding& b, const std::string& define)
+{
+    if (b.pyName == define) return true;
+    for (size_t g : b.guardLines) {
+        auto it = std::lower_bound(scan.conditionals.begin(), scan.conditionals.end(), g,
+            [](const ConditionalRef& ref, size_t line) { return ref.line < line; });
+        for (; it != scan.conditionals.end() && it->line == g; ++it) {
+            if (it->ident == define) return true;
+        }
+    }
+    return false;
+}
+
+/** writeBindingMap(index):
+ *   Output/BINDING_MAP.txt - every binding site with its guard
+ *   and the number of Python if-blocks using app.<NAME>.
+ */
+void writeBindingMap(const BindingIndex& index)
+{
+    std::map<std::string, size_t> pyUsage;
+    for (size_t t = 0; t < index.tasks.size(); ++t) {
+        if (index.tasks[t].side != ScanSide::Python) continue;
+        for (const auto& ref : index.results[t].py.appRefs) {
+            pyUsage[ref.param]++;
+        }
+    }
+
+    fs::create_directory("Output");
+    std::ofstream out("Output/BINDING_MAP.txt");
+    if (!out.is_open()) {
+        std::cerr << "Error when opening Output/BINDING_MAP.txt\n";
+        return;
+    }
+
+    size_t total = 0;
+    for (size_t t = 0; t < index.tasks.size(); ++t) {
+        if (index.tasks[t].side != ScanSide::Client) continue;
+        const auto& scan = index.results[t].cpp;
+        for (const auto& b : scan.bindings) {
+            auto it = pyUsage.find(b.pyName);
+            out << "app." << b.pyName << "  <-  " << g_files.path(index.tasks[t].file) << ":" << (b.line + 1)
+                << "  [PyModule_Add" << b.api << "]\n"
+                << "    guard: " << guardText(scan, b) << "\n"
+                << "    python: " << (it != pyUsage.end() ? it->second : 0) << " if-line(s)\n";
+            total++;
+        }
+    }
+    out << "\n--- SUMMARY: " << total << " binding(s) ---\n";
+}
+
+/** queryBinding(index, define):
+ *   Writes Output/BINDING_<define>.txt and returns the number of
+ *   binding sites found for the define.
+ */
+size_t queryBinding(const BindingIndex& index, const std::string& define)
+{
+    std::vector<CodeBlock> cppBlocks, cppFuncs, pyBlocks, pyFuncs;
+    std::vector<std::string> sites;
+    std::set<std::string> pyNames = { define };
+
+    for (size_t t = 0; t < index.tasks.size(); ++t) {
+        if (index.tasks[t].side != ScanSide::Client) continue;
+        const auto& scan = index.results[t].cpp;
+        const std::string filename = g_files.path(index.tasks[t].file);
+
+        auto pr = extractDefineResults(scan, index.tasks[t].file, define);
+        cppBlocks.insert(cppBlocks.end(), pr.first.begin(), pr.first.end());
+        cppFuncs.insert(cppFuncs.end(), pr.second.begin(), pr.second.end());
+
+        for (const auto& b : scan.bindings) {
+            if (!bindingMatchesDefine(scan, b, define)) continue;
+            pyNames.insert(b.pyName);
+            sites.push_back(filename + ":" + std::to_string(b.line + 1) + ": "
+                + trimCopy(scan.lines[b.line]) + "\n    guard: " + guardText(scan, b));
+        }
+    }
+
+    for (size_t t = 0; t < index.tasks.size(); ++t) {
+        if (index.tasks[t].side != ScanSide::Python) continue;
+        for (const auto& name : pyNames) {
+            auto pr = extractPythonParamResults(index.results[t].py, index.tasks[t].file, name);
+            pyBlocks.insert(pyBlocks.end(), pr.first.begin(), pr.first.end());
+            pyFuncs.insert(pyFuncs.end(), pr.second.begin(), pr.second.end());
+        }
+    }
+
+    fs::create_directory("Output");
+    std::string outFileName = "Output/BINDING_" + define + ".txt";
+    std::ofstream out(outFileName);
+    if (!out.is_open()) {
+        std::cerr << "Error when opening " << outFileName << "\n";
+        return sites.size();
+    }
+
+    out << "=== DEFINE " << define << " ===\n\n";
+    out << "--- C++ BLOCKS (" << cppBlocks.size() << ") ---\n";
+    for (const auto& b : cppBlocks) out << b.content << "\n";
+    out << "--- C++ FUNCTIONS (" << cppFuncs.size() << ") ---\n";
+    for (const auto& b : cppFuncs) out << b.content << "\n";
+    out << "--- BINDING SITES (" << sites.size() << ") ---\n";
+    for (const auto& site : sites) out << site << "\n";
+    out << "\n--- PYTHON USAGES:";
+    for (const auto& name : pyNames) out << " app." << name;
+    out << " (" << pyBlocks.size() << " if-block(s)) ---\n";
+    for (const auto& b : pyBlocks) out << b.content << "\n";
+    out << "--- PYTHON FUNCTIONS (" << pyFuncs.size() << ") ---\n";
+    for (const auto& b : pyFuncs) out << b.content << "\n";
+
+    std::cout << define << ": " << cppBlocks.size() << " C++ block(s), "
+        << sites.size() << " binding site(s), " << pyBlocks.size() << " Python if-block(s)\n";
+    return sites.size();
+}
+
+/** runBindingMapMode():
+ *   Scans client + Python once, writes the binding map and then
+ *   answers define queries from memory.
+ */
+void runBindingMapMode(const fs::path& clientPath,
+    const std::string& clientHeaderName,
+    const std::string& pythonRoot)
+{
+    BindingIndex index;
+    addScanTasks(index.tasks, ScanSide::Client, findSourceFiles(clientPath));
+    addScanTasks(index.tasks, ScanSide::Python, findPythonFiles(pythonRoot));
+    if (index.tasks.empty()) {
+        std::cerr << "No files to scan.\n";
+        return;
+    }
+
+    auto startTime = high_resolution_clock::now();
+    index.results = scanSourcesMultiThread(index.tasks, true);
+    auto defines = scannedHeaderDefines(index.tasks, index.results, clientHeaderName);
+    if (defines.empty()) {
+        std::cerr << "No #define entries in " << clientHeaderName << ".\n";
+        return;
+    }
+    writeBindingMap(index);
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+    std::cout << "Binding index built in " << ms << " ms - see 'Output/BINDING_MAP.txt'\n";
+
+    std::map<std::string, std::set<std::string>> exportedAs;
+    for (size_t t = 0; t < index.tasks.size(); ++t) {
+        if (index.tasks[t].side != ScanSide::Client) continue;
+        const auto& scan = index.results[t].cpp;
+        for (const auto& def : defines) {
+            for (const auto& b : scan.bindings) {
+                if (bindingMatchesDefine(scan, b, def)) exportedAs[def].insert(b.pyName);
+            }
+        }
+    }
+
+    std::cout << "Press ENTER...\n";
+    std::cin.ignore(10000, '\n');
+
+    while (true) {
+        clearConsole();
+        std::cout << "CLIENT defines in " << clientHeaderName << ":\n";
+        for (size_t i = 0; i < defines.size(); ++i) {
+            std::cout << (i + 1) << ") " << defines[i];
+            auto it = exportedAs.find(defines[i]);
+            if (it != exportedAs.end()) {
+                setColor(10);
+                for (const auto& name : it->second) std::cout << "  -> app." << name;
+                setColor(7);
+            }
+            std::cout << "\n";
+        }
+        std::cout << "0) Back\nChoice: ";
+        int dchoice;
+        std::cin >> dchoice;
+        std::cin.ignore(10000, '\n');
+        if (!std::cin || dchoice == 0) {
+            std::cin.clear();
+            break;
+        }
+        if (dchoice < 1 || dchoice >(int)defines.size()) {
+            std::cerr << "Invalid choice!\n";
+            continue;
+        }
+        const std::string& def = defines[dchoice - 1];
+        queryBinding(index, def);
+
+        setColor(10);
+        std::cout << "Done for define '" << def << "' - see 'Output/BINDING_" << def << ".txt'...\n";
+        setColor(7);
+        std::cout << "Press ENTER...\n";
+        std::cin.ignore(10000, '\n');
+    }
+}
+
+/*******************************************************
+ * Watch mode
+ *
+ *  Keeps the scan of every file of the configured roots in
+ *  memory and re-scans only the files that change. The blocks
+ *  of the pinned defines / params are kept per file as well,
+ *  so an edit rewrites just the Output/ files whose blocks
+ *  actually changed. On Linux changes arrive through inotify,
+ *  elsewhere (or if inotify is unavailable) the roots are
+ *  polled for size / timestamp changes.
+ *******************************************************/
+struct WatchedRoot {
+    ScanSide side = ScanSide::Client;
+    fs::path root;
+    std::map<std::string, SourceScanResult> files;                   // path -> scan
+    std::map<std::string, std::map<std::string, FileBlocks>> blocks; // pinned name -> path -> blocks (hits only)
+};
+
+static bool isWatchedFile(ScanSide side, const std::string& filename)
+{
+    std::string ext = fs::path(filename).extension().string();
+    if (side == ScanSide::Python) return ext == ".py";
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".cpp" || ext == ".h";
+}
+
+static bool isBelowRoot(const fs::path& root, const std::string& filename)
+{
+    std::string r = root.string();
+    if (filename.size() <= r.size() || filename.compare(0, r.size(), r) != 0) return false;
+    char sep = r.empty() ? '/' : r.back();
+    return sep == '/' || sep == '\\' || filename[r.size()] == '/' || filename[r.size()] == '\\';
+}
+
+static FileBlocks extractWatchBlocks(const WatchedRoot& wr, const std::string& filename,
+    const SourceScanResult& res, const std::string& name)
+{
+    FileId file = g_files.intern(filename);
+    if (wr.side == ScanSide::Python) return extractPythonParamResults(res.py, file, name);
+    return extractDefineResults(res.cpp, file, name);
+}
+
+static bool sameBlocks(const std::vector<CodeBlock>& a, const std::vector<CodeBlock>& b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].line != b[i].line || a[i].context != b[i].context || a[i].content != b[i].content) return false;
+    }
+    return true;
+}
+
+/** rewriteWatchOutput(wr, name):
+ *   Rewrites the outputs of one pinned define through
+ *   writeOutputPerFile(), whose shared blocks may change with
+ *   any file. Returns the number of files written or removed.
+ */
+static size_t rewriteWatchOutput(const WatchedRoot& wr, const std::string& name)
+{
+    FileBlocks all;
+    auto it = wr.blocks.find(name);
+    if (it != wr.blocks.end()) {
+        for (const auto& kv : it->second) {
+            all.first.insert(all.first.end(), kv.second.first.begin(), kv.second.first.end());
+            all.second.insert(all.second.end(), kv.second.second.begin(), kv.second.second.end());
+        }
+    }
+    const std::string prefix = scanSideNames[(int)wr.side];
+    return writeOutputPerFile(prefix, name + "_DEFINE", all.first) + writeOutputPerFile(prefix, name + "_FUNC", all.second);
+}
+
+/** rewritePythonWatchOutput(wr, name):
+ *   Rewrites both Output/PYTHON_<name>_*.txt files.
+ */
+static size_t rewritePythonWatchOutput(const WatchedRoot& wr, const std::string& name)
+{
+    FileBlocks all;
+    auto it = wr.blocks.find(name);
+    if (it != wr.blocks.end()) {
+        for (const auto& kv : it->second) {
+            all.first.insert(all.first.end(), kv.second.first.begin(), kv.second.first.end());
+            all.second.insert(all.second.end(), kv.second.second.begin(), kv.second.second.end());
+        }
+    }
+    writePythonOutput(name, all);
+    return 2;
+}
+
+/** writeAllWatchOutputs(roots, pinned):
+ *   Initial full write; stale per-file outputs of earlier runs
+ *   for the pinned names are removed first.
+ */
+static void writeAllWatchOutputs(const std::vector<WatchedRoot>& roots, const std::vector<std::string>& pinned)
+{
+    fs::create_directory("Output");
+    for (const auto& wr : roots) {
+        for (const auto& name : pinned) {
+            if (wr.side == ScanSide::Python) {
+                // pinned names are shared by all roots; skip params without hits
+                if (wr.blocks.count(name)) rewritePythonWatchOutput(wr, name);
+                continue;
+            }
+            std::error_code ec;
+            std::string prefix = std::string("Output/") + scanSideNames[(int)wr.side] + "_" + name;
+            fs::remove_all(prefix + "_DEFINE_files", ec);
+            fs::remove_all(prefix + "_FUNC_files", ec);
+            fs::remove(prefix + "_DEFINE_shared.txt", ec);
+            fs::remove(prefix + "_FUNC_shared.txt", ec);
+
+            if (wr.blocks.count(name)) rewriteWatchOutput(wr, name);
+        }
+    }
+}
+
+/** applyWatchChanges(roots, pinned, changed):
+ *   Re-scans (or forgets) the changed files and rewrites the
+ *   outputs whose blocks differ from the previous scan.
+ */
+static void applyWatchChanges(std::vector<WatchedRoot>& roots,
+    const std::vector<std::string>& pinned,
+    const std::set<std::string>& changed)
+{
+    auto startTime = high_resolution_clock::now();
+    size_t rescanned = 0;
+    size_t removed = 0;
+    size_t written = 0;
+
+    for (auto& wr : roots) {
+        std::set<std::string> affected;
+
+        for (const auto& filename : changed) {
+            if (!isBelowRoot(wr.root, filename) || !isWatchedFile(wr.side, filename)) continue;
+
+            std::error_code ec;
+            bool exists = fs::is_regular_file(filename, ec) && !fs::is_symlink(filename, ec);
+
+            if (!exists) {
+                if (!wr.files.erase(filename)) continue;
+                removed++;
+                for (const auto& name : pinned) {
+                    if (wr.blocks[name].erase(filename)) affected.insert(name);
+                }
+                continue;
+            }
+
+            SourceScanResult& res = wr.files[filename];
+            res = SourceScanResult();
+            scanSourceTask({ wr.side, g_files.intern(filename) }, res, true, isLargeSourceFile(filename));
+            rescanned++;
+
+            for (const auto& name : pinned) {
+                FileBlocks fresh = extractWatchBlocks(wr, filename, res, name);
+                auto& perFile = wr.blocks[name];
+                auto old = perFile.find(filename);
+                bool hadBlocks = (old != perFile.end());
+                bool hasBlocks = !fresh.first.empty() || !fresh.second.empty();
+                if (!hadBlocks && !hasBlocks) continue;
+                if (hadBlocks && hasBlocks &&
+                    sameBlocks(old->second.first, fresh.first) &&
+                    sameBlocks(old->second.second, fresh.second)) {
+                    continue;
+                }
+                if (hasBlocks) perFile[filename] = std::move(fresh);
+                else perFile.erase(old);
+                affected.insert(name);
+            }
+        }
+
+        for (const auto& name : affected) {
+            written += wr.side == ScanSide::Python ? rewritePythonWatchOutput(wr, name) : rewriteWatchOutput(wr, name);
+        }
+    }
+
+    auto us = duration_cast<microseconds>(high_resolution_clock::now() - startTime).count();
+    std::unique_lock<std::mutex> lock(consoleMutex, std::defer_lock);
+    if (!lock.try_lock()) {
+        TraceSpan wait("wait consoleMutex");
+        lock.lock();
+    }
+    for (const auto& filename : changed) {
+        std::cout << "  changed: " << filename << "\n";
+    }
+    if (written > 0) setColor(10);
+    std::cout << rescanned << " file(s) re-scanned, " << removed << " removed, "
+        << written << " output file(s) rewritten in " << (us / 1000.0) << " ms\n";
+    setColor(7);
+}
+
+/** Size and timestamp of every watched file (polling fallback) */
+typedef std::map<std::string, std::pair<uintmax_t, fs::file_time_type>> WatchSnapshot;
+
+static WatchSnapshot snapshotWatchedRoots(const std::vector<WatchedRoot>& roots)
+{
+    WatchSnapshot snap;
+    for (const auto& wr : roots) {
+        auto files = (wr.side == ScanSide::Python) ? findPythonFiles(wr.root) : findSourceFiles(wr.root);
+        for (const auto& f : g_files.paths(files)) {
+            std::error_code ec;
+            uintmax_t size = fs::file_size(f, ec);
+            if (ec) continue;
+            auto time = fs::last_write_time(f, ec);
+            if (ec) continue;
+            snap[f] = { size, time };
+        }
+    }
+    return snap;
+}
+
+static void watchLoopPolling(std::vector<WatchedRoot>& roots,
+    const std::vector<std::string>& pinned,
+    std::atomic<bool>& stop)
+{
+    WatchSnapshot previous = snapshotWatchedRoots(roots);
+    while (!stop) {
+        for (int i = 0; i < 10 && !stop; ++i) {
+            std::this_thread::sleep_for(milliseconds(50));
+        }
+        if (stop) break;
+
+        WatchSnapshot current = snapshotWatchedRoots(roots);
+        std::set<std::string> changed;
+        for (const auto& kv : current) {
+            auto it = previous.find(kv.first);
+            if (it == previous.end() || it->second != kv.second) changed.insert(kv.first);
+        }
+        for (const auto& kv : previous) {
+            if (!current.count(kv.first)) changed.insert(kv.first);
+        }
+        if (!changed.empty()) applyWatchChanges(roots, pinned, changed);
+        previous.swap(current);
+    }
+}
+
+#ifdef __linux__
+static void addInotifyWatches(int fd, const fs::path& dir, std::unordered_map<int, fs::path>& watches)
+{
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE;
+    auto add = [&](const fs::path& d) {
+        int wd = inotify_add_watch(fd, d.string().c_str(), mask);
+        if (wd >= 0) watches[wd] = d;
+    };
+    add(dir);
+    try {
+        for (auto& p : fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied)) {
+            try {
+                if (!fs::is_symlink(p.path()) && fs::is_directory(p.path())) add(p.path());
+            }
+            catch (...) { continue; }
+        }
+    }
+    catch (...) {}
+}
+
+/** watchLoopInotify(roots, pinned, stop):
+ *   One watch per directory (inotify is not recursive). Events
+ *   of a burst (editors often write a temp file and rename it)
+ *   are coalesced for ~15 ms before the changes are applied.
+ */
+static void watchLoopInotify(std::vector<WatchedRoot>& roots,
+    const std::vector<std::string>& pinned,
+    std::atomic<bool>& stop)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "inotify unavailable, polling instead.\n";
+        watchLoopPolling(roots, pinned, stop);
+        return;
+    }
+    std::unordered_map<int, fs::path> watches;
+    for (const auto& wr : roots) {
+        addInotifyWatches(fd, wr.root, watches);
+    }
+
+    std::set<std::string> changed;
+    auto burstStart = steady_clock::now();
+    alignas(struct inotify_event) char buf[64 * 1024];
+
+    while (!stop) {
+        pollfd pfd{ fd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, changed.empty() ? 200 : 15);
+        if (rc > 0) {
+            if (changed.empty()) burstStart = steady_clock::now();
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                for (char* p = buf; p < buf + n; ) {
+                    auto* ev = reinterpret_cast<struct inotify_event*>(p);
+                    p += sizeof(struct inotify_event) + ev->len;
+                    if (ev->mask & IN_IGNORED) {
+                        watches.erase(ev->wd);
+                        continue;
+                    }
+                    auto it = watches.find(ev->wd);
+                    if (it == watches.end() || ev->len == 0) continue;
+                    fs::path full = it->second / ev->name;
+
+                    if (ev->mask & IN_ISDIR) {
+                        std::string dir = full.string();
+                        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                            // files may have landed before the new watch existed
+                            addInotifyWatches(fd, full, watches);
+                            for (const auto& wr : roots) {
+                                auto files = (wr.side == ScanSide::Python) ? findPythonFiles(full) : findSourceFiles(full);
+                                for (const auto& f : g_files.paths(files)) changed.insert(f);
+                            }
+                        }
+                        else {
+                            for (const auto& wr : roots) {
+                                for (const auto& kv : wr.files) {
+                                    if (isBelowRoot(dir, kv.first)) changed.insert(kv.first);
+                                }
+                            }
+                        }
+                        continue;
+                    }
+                    changed.insert(full.string());
+                }
+            }
+        }
+        bool quiet = (rc == 0);
+        bool burstTooLong = duration_cast<milliseconds>(steady_clock::now() - burstStart).count() > 250;
+        if (!changed.empty() && (quiet || burstTooLong)) {
+            applyWatchChanges(roots, pinned, changed);
+            changed.clear();
+        }
+    }
+    close(fd);
+}
+#endif
+
+/** runWatchMode(...):
+ *   Asks for the pinned names, scans all configured roots once,
+ *   writes the outputs and then keeps them up to date until
+ *   ENTER is pressed. Empty header / root names = not set.
+ */
+void runWatchMode(const fs::path& clientPath,
+    const std::string& clientHeaderName,
+    const fs::path& serverPath,
+    const std::string& serverHeaderName,
+    const std::string& pythonRoot)
+{
+    std::vector<WatchedRoot> roots;
+    if (!clientHeaderName.empty()) {
+        roots.emplace_back();
+        roots.back().side = ScanSide::Client;
+        roots.back().root = clientPath;
+    }
+    if (!serverHeaderName.empty()) {
+        roots.emplace_back();
+        roots.back().side = ScanSide::Server;
+        roots.back().root = serverPath;
+    }
+    if (!pythonRoot.empty()) {
+        roots.emplace_back();
+        roots.back().side = ScanSide::Python;
+        roots.back().root = pythonRoot;
+    }
+
+    std::cout << "Pinned defines / app params (separated by spaces): ";
+    std::string input;
+    std::getline(std::cin, input);
+    std::replace(input.begin(), input.end(), ',', ' ');
+    std::vector<std::string> pinned;
+    {
+        std::istringstream iss(input);
+        std::string name;
+        while (iss >> name) {
+            if (name.compare(0, 4, "app.") == 0) name.erase(0, 4);
+            if (!name.empty() && std::find(pinned.begin(), pinned.end(), name) == pinned.end()) {
+                pinned.push_back(name);
+            }
+        }
+    }
+    if (pinned.empty()) {
+        std::cerr << "Nothing pinned.\n";
+        return;
+    }
+
+    std::vector<SourceScanTask> tasks;
+    std::vector<size_t> taskRoot;
+    for (size_t r = 0; r < roots.size(); ++r) {
+        const auto& wr = roots[r];
+        addScanTasks(tasks, wr.side,
+            (wr.side == ScanSide::Python) ? findPythonFiles(wr.root) : findSourceFiles(wr.root));
+        taskRoot.resize(tasks.size(), r);
+    }
+
+    auto startTime = high_resolution_clock::now();
+    auto results = scanSourcesMultiThread(tasks, true);
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        auto& wr = roots[taskRoot[t]];
+        const std::string filename = g_files.path(tasks[t].file);
+        SourceScanResult& res = wr.files[filename];
+        res = std::move(results[t]);
+        for (const auto& name : pinned) {
+            FileBlocks fb = extractWatchBlocks(wr, filename, res, name);
+            if (!fb.first.empty() || !fb.second.empty()) {
+                wr.blocks[name][filename] = std::move(fb);
+            }
+        }
+    }
+    results.clear();
+    writeAllWatchOutputs(roots, pinned);
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+
+    setColor(10);
+    std::cout << "Watching " << tasks.size() << " file(s), initial outputs written in " << ms << " ms.\n";
+    setColor(7);
+    std::cout << "Edits are picked up automatically. Press ENTER to stop...\n";
+
+    std::atomic<bool> stop{ false };
+#ifdef __linux__
+    std::thread watcher(watchLoopInotify, std::ref(roots), std::cref(pinned), std::ref(stop));
+#else
+    std::thread watcher(watchLoopPolling, std::ref(roots), std::cref(pinned), std::ref(stop));
+#endif
+    std::cin.ignore(10000, '\n');
+    stop = true;
+    watcher.join();
+}
+
+/*******************************************************
+ * Preprocessor expression evaluation
+ *
+ *  Evaluates #if expressions: defined(), !, ~, unary +/-,
+ *  arithmetic, shifts, comparisons, bit operators, &&, ||
+ *  and ?:. Identifiers expand to their macro bodies
+ *  (recursively). A macro defined without a body counts as 1.
+ *
+ *  As in C, a value is unsigned if it comes from a u-suffixed
+ *  (or too large) literal, and a binary operator with one
+ *  unsigned operand works unsigned, so '-1 < 0u' is false.
+ *
+ *  Values are tri-state: with 'unknownIsZero' set (full
+ *  configuration) every undefined name is 0 as in C. Without
+ *  it, only names listed as undefined are 0 and all others
+ *  stay unknown, which lets callers resolve only the parts of
+ *  an expression that depend on the forced defines.
+ *******************************************************/
+struct MacroTable {
+    std::unordered_map<std::string, std::string> defined;   // name -> body
+    std::unordered_set<std::string> functionLike;
+    std::unordered_set<std::string> undefined;              // explicitly off
+};
+
+struct PPValue {
+    bool known = false;
+    bool isUnsigned = false;
+    long long v = 0;
+};
+
+struct PPToken {
+    enum Type { Num, Ident, Op, End } type = End;
+    long long num = 0;
+    bool isUnsigned = false;
+    std::string text;
+    size_t begin = 0, end = 0;  // source range in the expression
+};
+
+static std::vector<PPToken> tokenizePPExpression(const std::string& expr, bool& ok)
+{
+    std::vector<PPToken> toks;
+    size_t i = 0;
+    while (i < expr.size()) {
+        char c = expr[i];
+        if (isSpaceChar(c)) { i++; continue; }
+        if (std::isdigit((unsigned char)c)) {
+            size_t e = i;
+            while (e < expr.size() && (std::isalnum((unsigned char)expr[e]) || expr[e] == '\'')) e++;
+            std::string lit = expr.substr(i, e - i);
+            lit.erase(std::remove(lit.begin(), lit.end(), '\''), lit.end());
+            PPToken t;
+            t.type = PPToken::Num;
+            while (!lit.empty() && (lit.back() == 'u' || lit.back() == 'U' || lit.back() == 'l' || lit.back() == 'L')) {
+                if (lit.back() == 'u' || lit.back() == 'U') t.isUnsigned = true;
+                lit.pop_back();
+            }
+            try {
+                size_t used = 0;
+                unsigned long long n = std::stoull(lit, &used, 0);
+                if (used != lit.size()) ok = false;
+                // a literal that does not fit intmax_t is uintmax_t
+                if (n > (unsigned long long)LLONG_MAX) t.isUnsigned = true;
+                t.num = (long long)n;
+            }
+            catch (...) { ok = false; }
+            t.begin = i;
+            t.end = e;
+            toks.push_back(t);
+            i = e;
+            continue;
+        }
+        if (isWordChar(c)) {
+            size_t e = i;
+            while (e < expr.size() && isWordChar(expr[e])) e++;
+            PPToken t;
+            t.type = PPToken::Ident;
+            t.text = expr.substr(i, e - i);
+            t.begin = i;
+            t.end = e;
+            toks.push_back(t);
+            i = e;
+            continue;
+        }
+        if (c == '\'') {
+            // character literal, simple escapes only
+            size_t e = i + 1;
+            long long v = 0;
+            if (e < expr.size() && expr[e] == '\\' && e + 1 < expr.size()) {
+                char esc = expr[e + 1];
+                v = (esc == 'n') ? '\n' : (esc == 't') ? '\t' : (esc == '0') ? 0 : esc;
+                e += 2;
+            }
+            else if (e < expr.size()) {
+                v = (unsigned char)expr[e];
+                e++;
+            }
+            if (e >= expr.size() || expr[e] != '\'') { ok = false; return toks; }
+            PPToken t;
+            t.type = PPToken::Num;
+            t.num = v;
+            t.begin = i;
+            t.end = e + 1;
+            toks.push_back(t);
+            i = e + 1;
+            continue;
+        }
+        static const char* const ops[] = {
+            "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+            "(", ")", "!", "~", "+", "-", "*", "/", "%", "<", ">", "&", "^", "|", "?", ":", ","
+        };
+        bool matched = false;
+        for (const char* op : ops) {
+            size_t n = std::strlen(op);
+            if (expr.compare(i, n, op) == 0) {
+                PPToken t;
+                t.type = PPToken::Op;
+                t.text = op;
+                t.begin = i;
+                t.end = i + n;
+                toks.push_back(t);
+                i += n;
+                matched = true;
+                break;
+            }
+        }
+        if (!matched) {
+            ok = false;
+            return toks;
+        }
+    }
+    PPToken end;
+    end.begin = end.end = expr.size();
+    toks.push_back(end);
+    return toks;
+}
+
+class PPExpressionEvaluator {
+public:
+    PPExpressionEvaluator(const std::string& expr, const MacroTable& macros,
+        bool unknownIsZero, int depth = 0)
+        : m_macros(macros), m_unknownIsZero(unknownIsZero), m_depth(depth)
+    {
+        m_tokens = tokenizePPExpression(expr, m_ok);
+    }
+
+    /** Returns the value; 'ok' is false on syntax errors. A
+     *  division by zero is no syntax error, it just makes the
+     *  value unknown. */
+    PPValue evaluate(bool& ok)
+    {
+        PPValue v;
+        if (m_ok) {
+            v = parseTernary();
+            if (peek().type != PPToken::End) m_ok = false;
+        }
+        ok = m_ok;
+        return v;
+    }
+
+private:
+    const PPToken& peek() const { return m_tokens[std::min(m_pos, m_tokens.size() - 1)]; }
+    bool isOp(const char* op) const { return peek().type == PPToken::Op && peek().text == op; }
+    void advance() { if (m_pos < m_tokens.size() - 1) m_pos++; }
+
+    PPValue unknownOrZero() const {
+        PPValue v;
+        v.known = m_unknownIsZero;
+        return v;
+    }
+
+    PPValue parseTernary()
+    {
+        PPValue c = parseBinary(1);
+        if (!isOp("?")) return c;
+        advance();
+        PPValue a = parseTernary();
+        if (!isOp(":")) { m_ok = false; return PPValue(); }
+        advance();
+        PPValue b = parseTernary();
+        // both arms take the common type
+        a.isUnsigned = b.isUnsigned = a.isUnsigned || b.isUnsigned;
+        if (!c.known) {
+            if (a.known && b.known && a.v == b.v) return a;
+            return PPValue();
+        }
+        return c.v ? a : b;
+    }
+
+    static int precedence(const std::string& op)
+    {
+        if (op == "||") return 1;
+        if (op == "&&") return 2;
+        if (op == "|") return 3;
+        if (op == "^") return 4;
+        if (op == "&") return 5;
+        if (op == "==" || op == "!=") return 6;
+        if (op == "<" || op == ">" || op == "<=" || op == ">=") return 7;
+        if (op == "<<" || op == ">>") return 8;
+        if (op == "+" || op == "-") return 9;
+        if (op == "*" || op == "/" || op == "%") return 10;
+        return 0;
+    }
+
+    PPValue parseBinary(int minPrec)
+    {
+        PPValue lhs = parseUnary();
+        while (m_ok && peek().type == PPToken::Op) {
+            std::string op = peek().text;
+            int prec = precedence(op);
+            if (prec == 0 || prec < minPrec) break;
+            advance();
+            PPValue rhs = parseBinary(prec + 1);
+            lhs = applyBinary(op, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    PPValue applyBinary(const std::string& op, PPValue a, PPValue b)
+    {
+        PPValue r;
+        if (op == "||") {
+            if ((a.known && a.v) || (b.known && b.v)) { r.known = true; r.v = 1; }
+            else if (a.known && b.known) { r.known = true; r.v = 0; }
+            return r;
+        }
+        if (op == "&&") {
+            if ((a.known && !a.v) || (b.known && !b.v)) { r.known = true; r.v = 0; }
+            else if (a.known && b.known) { r.known = true; r.v = 1; }
+            return r;
+        }
+        if (!a.known || !b.known) return r;
+        long long x = a.v, y = b.v;
+        unsigned long long ux = (unsigned long long)x, uy = (unsigned long long)y;
+        if (op == "<<" || op == ">>") {
+            // shifts keep the type of the left operand
+            r.known = true;
+            r.isUnsigned = a.isUnsigned;
+            bool inRange = (b.isUnsigned || y >= 0) && uy < 64;
+            if (op == "<<") r.v = inRange ? (long long)(ux << uy) : 0;
+            else if (!inRange) r.v = (a.isUnsigned || x >= 0) ? 0 : -1;
+            else r.v = a.isUnsigned ? (long long)(ux >> uy) : (x >> uy);
+            return r;
+        }
+        // usual arithmetic conversions: one unsigned operand makes both unsigned
+        bool uns = a.isUnsigned || b.isUnsigned;
+        if (op == "/" || op == "%") {
+            if (y == 0) return r;
+            if (!uns && x == LLONG_MIN && y == -1) return r;
+        }
+        r.known = true;
+        if (op == "==" || op == "!=" || op == "<" || op == ">" || op == "<=" || op == ">=") {
+            bool lt = uns ? ux < uy : x < y;
+            bool gt = uns ? ux > uy : x > y;
+            if (op == "==") r.v = !lt && !gt;
+            else if (op == "!=") r.v = lt || gt;
+            else if (op == "<") r.v = lt;
+            else if (op == ">") r.v = gt;
+            else if (op == "<=") r.v = !gt;
+            else r.v = !lt;
+            return r;
+        }
+        r.isUnsigned = uns;
+        if (op == "|") r.v = x | y;
+        else if (op == "^") r.v = x ^ y;
+        else if (op == "&") r.v = x & y;
+        else if (op == "+") r.v = (long long)(ux + uy);
+        else if (op == "-") r.v = (long long)(ux - uy);
+        else if (op == "*") r.v = (long long)(ux * uy);
+        else if (op == "/") r.v = uns ? (long long)(ux / uy) : x / y;
+        else if (op == "%") r.v = uns ? (long long)(ux % uy) : x % y;
+        return r;
+    }
+
+    PPValue parseUnary()
+    {
+        if (peek().type == PPToken::Op) {
+            std::string op = peek().text;
+            if (op == "!" || op == "~" || op == "-" || op == "+") {
+                advance();
+                PPValue v = parseUnary();
+                if (!v.known) return v;
+                if (op == "!") { v.v = !v.v; v.isUnsigned = false; }
+                else if (op == "~") v.v = ~v.v;
+                else if (op == "-") v.v = (long long)(0 - (unsigned long long)v.v);
+                return v;
+            }
+        }
+        return parsePrimary();
+    }
+
+    PPValue parsePrimary()
+    {
+        const PPToken& t = peek();
+        if (t.type == PPToken::Num) {
+            PPValue v;
+            v.known = true;
+            v.isUnsigned = t.isUnsigned;
+            v.v = t.num;
+            advance();
+            return v;
+        }
+        if (t.type == PPToken::Op && t.text == "(") {
+            advance();
+            PPValue v = parseTernary();
+            if (!isOp(")")) { m_ok = false; return PPValue(); }
+            advance();
+            return v;
+        }
+        if (t.type == PPToken::Ident) {
+            std::string name = t.text;
+            advance();
+            if (name == "defined") return parseDefined();
+            if (name == "true" || name == "false") {
+                PPValue v;
+                v.known = true;
+                v.v = (name == "true");
+                return v;
+            }
+            if (isOp("(")) {
+                // function-like macro invocation: arguments are skipped
+                int depth = 0;
+                do {
+                    if (isOp("(")) depth++;
+                    else if (isOp(")")) depth--;
+                    if (peek().type == PPToken::End) { m_ok = false; return PPValue(); }
+                    advance();
+                } while (depth > 0);
+                if (m_macros.undefined.count(name)) { PPValue v; v.known = true; return v; }
+                return unknownOrZero();
+            }
+            return identifierValue(name);
+        }
+        m_ok = false;
+        return PPValue();
+    }
+
+    PPValue parseDefined()
+    {
+        bool paren = isOp("(");
+        if (paren) advance();
+        if (peek().type != PPToken::Ident) { m_ok = false; return PPValue(); }
+        std::string name = peek().text;
+        advance();
+        if (paren) {
+            if (!isOp(")")) { m_ok = false; return PPValue(); }
+            advance();
+        }
+        PPValue v;
+        if (m_macros.defined.count(name)) { v.known = true; v.v = 1; }
+        else if (m_macros.undefined.count(name) || m_unknownIsZero) { v.known = true; v.v = 0; }
+        return v;
+    }
+
+    PPValue identifierValue(const std::string& name)
+    {
+        auto it = m_macros.defined.find(name);
+        if (it == m_macros.defined.end()) {
+            if (m_macros.undefined.count(name)) { PPValue v; v.known = true; return v; }
+            return unknownOrZero();
+        }
+        if (m_macros.functionLike.count(name)) return unknownOrZero();
+        if (trimCopy(it->second).empty()) {
+            PPValue v;
+            v.known = true;
+            v.v = 1;
+            return v;
+        }
+        if (m_depth > 32) { m_ok = false; return PPValue(); }
+        PPExpressionEvaluator inner(it->second, m_macros, m_unknownIsZero, m_depth + 1);
+        bool ok = true;
+        PPValue v = inner.evaluate(ok);
+        if (!ok) m_ok = false;
+        return v;
+    }
+
+    const MacroTable& m_macros;
+    bool m_unknownIsZero;
+    int m_depth;
+    bool m_ok = true;
+    std::vector<PPToken> m_tokens;
+    size_t m_pos = 0;
+};
+
+/*******************************************************
+ * Directive scan
+ *   Extracts all preprocessor directives of a file (with
+ *   line continuations joined and comments stripped) and the
+ *   branch regions they form. The region structure does not
+ *   depend on any configuration.
+ *******************************************************/
+enum class PPKind : uint8_t { If, Ifdef, Ifndef, Elif, Else, Endif, Define, Undef };
+
+struct PPDirective {
+    size_t line = 0;        // first line (0-based)
+    size_t lastLine = 0;    // last line incl. continuations
+    PPKind kind = PPKind::If;
+    std::string arg;        // expression, macro name or "NAME body"
+    size_t region = std::string::npos;  // branch region opened by #if/#elif/#else
+};
+
+struct PPRegion {
+    size_t directive = 0;   // index of the opening #if/#elif/#else
+    size_t chainStart = 0;  // index of the #if starting the chain
+    size_t beginLine = 0;   // directive line opening the branch
+    size_t endLine = 0;     // next directive of the chain (lines.size() if open)
+    size_t parent = std::string::npos;
+};
+
+struct DirectiveScan {
+    std::vector<std::string> lines;     // may be released after the scan
+    size_t lineCount = 0;
+    std::vector<PPDirective> directives;
+    std::vector<PPRegion> regions;
+};
+
+/** stripComments(text):
+ *   Removes // and block comments from a directive argument.
+ */
+static std::string stripComments(const std::string& text)
+{
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '/' && i + 1 < text.size() && text[i + 1] == '/') break;
+        if (text[i] == '/' && i + 1 < text.size() && text[i + 1] == '*') {
+            size_t e = text.find("*/", i + 2);
+            if (e == std::string::npos) break;
+            out += ' ';
+            i = e + 1;
+            continue;
+        }
+        out += text[i];
+    }
+    return trimCopy(out);
+}
+
+DirectiveScan scanPreprocessorDirectives(std::vector<std::string> lines)
+{
+    DirectiveScan scan;
+    scan.lines = std::move(lines);
+    scan.lineCount = scan.lines.size();
+    const auto& L = scan.lines;
+
+    std::vector<size_t> openChains; // region index of the current branch per level
+    for (size_t i = 0; i < L.size(); ++i) {
+        std::string dir = directiveName(L[i]);
+        if (dir.empty()) continue;
+
+        // join continuation lines
+        std::string text = L[i];
+        size_t last = i;
+        auto endsWithBackslash = [](const std::string& s) {
+            size_t e = s.find_last_not_of("\r");
+            return e != std::string::npos && s[e] == '\\';
+        };
+        while (endsWithBackslash(text) && last + 1 < L.size()) {
+            text.erase(text.find_last_not_of("\r"));
+            text += " " + L[++last];
+        }
+
+        PPDirective d;
+        d.line = i;
+        d.lastLine = last;
+        size_t hashPos = text.find('#');
+        size_t argPos = text.find(dir, hashPos) + dir.size();
+        d.arg = stripComments(text.substr(argPos));
+
+        if (dir == "if") d.kind = PPKind::If;
+        else if (dir == "ifdef") d.kind = PPKind::Ifdef;
+        else if (dir == "ifndef") d.kind = PPKind::Ifndef;
+        else if (dir == "elif") d.kind = PPKind::Elif;
+        else if (dir == "else") d.kind = PPKind::Else;
+        else if (dir == "endif") d.kind = PPKind::Endif;
+        else if (dir == "define") d.kind = PPKind::Define;
+        else if (dir == "undef") d.kind = PPKind::Undef;
+        else { i = last; continue; }
+
+        size_t di = scan.directives.size();
+        if (d.kind == PPKind::If || d.kind == PPKind::Ifdef || d.kind == PPKind::Ifndef) {
+            PPRegion r;
+            r.directive = di;
+            r.chainStart = di;
+            r.beginLine = i;
+            r.endLine = L.size();
+            r.parent = openChains.empty() ? std::string::npos : openChains.back();
+            d.region = scan.regions.size();
+            openChains.push_back(d.region);
+            scan.regions.push_back(r);
+        }
+        else if ((d.kind == PPKind::Elif || d.kind == PPKind::Else) && !openChains.empty()) {
+            PPRegion& prev = scan.regions[openChains.back()];
+            prev.endLine = i;
+            PPRegion r;
+            r.directive = di;
+            r.chainStart = prev.chainStart;
+            r.beginLine = i;
+            r.endLine = L.size();
+            r.parent = prev.parent;
+            d.region = scan.regions.size();
+            openChains.back() = d.region;
+            scan.regions.push_back(r);
+        }
+        else if (d.kind == PPKind::Endif && !openChains.empty()) {
+            scan.regions[openChains.back()].endLine = i;
+            openChains.pop_back();
+        }
+        scan.directives.push_back(std::move(d));
+        i = last;
+    }
+    return scan;
+}
+
+/** applyDefineDirective(table, arg):
+ *   Adds "#define NAME body" / "#define NAME(args) body".
+ */
+static void applyDefineDirective(MacroTable& table, const std::string& arg)
+{
+    size_t e = 0;
+    while (e < arg.size() && isWordChar(arg[e])) e++;
+    if (e == 0) return;
+    std::string name = arg.substr(0, e);
+    table.undefined.erase(name);
+    if (e < arg.size() && arg[e] == '(') {
+        size_t close = arg.find(')', e);
+        table.defined[name] = close == std::string::npos ? "" : trimCopy(arg.substr(close + 1));
+        table.functionLike.insert(name);
+    }
+    else {
+        table.defined[name] = trimCopy(arg.substr(e));
+        table.functionLike.erase(name);
+    }
+}
+
+static std::string firstIdent(const std::string& arg)
+{
+    size_t e = 0;
+    while (e < arg.size() && isWordChar(arg[e])) e++;
+    return arg.substr(0, e);
+}
+
+/** State of a branch region under one configuration */
+enum RegionState : uint8_t {
+    REGION_DEAD = 0,
+    REGION_ACTIVE,
+    REGION_UNKNOWN      // condition (or an enclosing one) not evaluable
+};
+
+/** evaluateRegions(scan, table, pinned, warnings, finalTable):
+ *   Walks the directives under a full configuration and returns
+ *   a RegionState per region. A condition that cannot be
+ *   evaluated (syntax error, division by zero) leaves its region,
+ *   the following branches and everything nested UNKNOWN rather
+ *   than dead. #define/#undef in active code update a file-local
+ *   copy of the table, except for names in 'pinned' (values
+ *   forced by the configuration). The resulting table can be
+ *   handed back through 'finalTable'.
+ */
+std::vector<uint8_t> evaluateRegions(const DirectiveScan& scan,
+    MacroTable table,
+    const std::unordered_set<std::string>& pinned,
+    std::vector<size_t>* warnings,
+    MacroTable* finalTable = nullptr)
+{
+    std::vector<uint8_t> active(scan.regions.size(), REGION_DEAD);
+
+    // 'taken': an earlier branch of the chain won (REGION_UNKNOWN: maybe)
+    struct Frame { RegionState parent; RegionState taken; };
+    std::vector<Frame> stack;
+    RegionState cur = REGION_ACTIVE;
+
+    auto condition = [&](const PPDirective& d) -> RegionState {
+        if (d.kind == PPKind::Ifdef) return table.defined.count(firstIdent(d.arg)) ? REGION_ACTIVE : REGION_DEAD;
+        if (d.kind == PPKind::Ifndef) return table.defined.count(firstIdent(d.arg)) ? REGION_DEAD : REGION_ACTIVE;
+        bool ok = true;
+        PPExpressionEvaluator ev(d.arg, table, true);
+        PPValue v = ev.evaluate(ok);
+        if (!ok || !v.known) {
+            if (warnings) warnings->push_back(d.line);
+            return REGION_UNKNOWN;
+        }
+        return v.v != 0 ? REGION_ACTIVE : REGION_DEAD;
+    };
+    // next branch of the chain; 'cond' is only evaluated if it can matter
+    auto branch = [&](Frame& f, const PPDirective* d) -> RegionState {
+        if (f.parent == REGION_DEAD || f.taken == REGION_ACTIVE) return REGION_DEAD;
+        RegionState cond = d ? condition(*d) : REGION_ACTIVE;
+        RegionState local = cond == REGION_DEAD ? REGION_DEAD
+            : f.taken == REGION_DEAD ? cond : REGION_UNKNOWN;
+        if (cond == REGION_ACTIVE) f.taken = REGION_ACTIVE;
+        else if (cond == REGION_UNKNOWN && f.taken == REGION_DEAD) f.taken = REGION_UNKNOWN;
+        if (local == REGION_DEAD || f.parent == REGION_ACTIVE) return local;
+        return REGION_UNKNOWN;
+    };
+
+    for (const auto& d : scan.directives) {
+        switch (d.kind) {
+        case PPKind::If:
+        case PPKind::Ifdef:
+        case PPKind::Ifndef: {
+            stack.push_back({ cur, REGION_DEAD });
+            cur = branch(stack.back(), &d);
+            active[d.region] = cur;
+            break;
+        }
+        case PPKind::Elif: {
+            if (stack.empty() || d.region == std::string::npos) break;
+            cur = branch(stack.back(), &d);
+            active[d.region] = cur;
+            break;
+        }
+        case PPKind::Else: {
+            if (stack.empty() || d.region == std::string::npos) break;
+            cur = branch(stack.back(), nullptr);
+            active[d.region] = cur;
+            break;
+        }
+        case PPKind::Endif:
+            if (stack.empty()) break;
+            cur = stack.back().parent;
+            stack.pop_back();
+            break;
+        case PPKind::Define:
+            if (cur == REGION_ACTIVE && !pinned.count(firstIdent(d.arg))) applyDefineDirective(table, d.arg);
+            break;
+        case PPKind::Undef:
+            if (cur == REGION_ACTIVE && !pinned.count(firstIdent(d.arg))) {
+                std::string name = firstIdent(d.arg);
+                table.defined.erase(name);
+                table.functionLike.erase(name);
+            }
+            break;
+        }
+    }
+    if (finalTable) {
+        *finalTable = std::move(table);
+    }
+    return active;
+}
+
+/*******************************************************
+ * Macro symbol table
+ *
+ *  One parallel pass over all headers (.h) of a tree records
+ *  every #define and #undef with its guard, i.e. the enclosing
+ *  #if chain (a file's include guard left out). Defines
+ *  commented out with // are kept as sites of their own, as
+ *  locale_inc.h / service.h switch features off that way.
+ *  Sites are cached per header in MACRO_TABLE.bin and reused
+ *  while size and modification time match. Values (bodies that
+ *  evaluate to a constant) and conflicts (different bodies
+ *  under the same guard) are derived after merging.
+ *
+ *  The table decides which defines the menus and combined
+ *  modes offer. The scans themselves still read every source
+ *  file: uses of a define are in .cpp files the table does
+ *  not cover.
+ *******************************************************/
+static const char* const MACRO_TABLE_FILE = "Output/RESULT_CACHE/MACRO_TABLE.bin";
+
+enum class MacroSiteKind : uint8_t { Define, Undef, Commented };
+
+struct MacroSite {
+    FileId file = 0;
+    uint32_t line = 0;              // 1-based
+    MacroSiteKind kind = MacroSiteKind::Define;
+    std::string params;             // "(a, b)" for function-like macros
+    std::string body;
+    std::string guard;              // enclosing conditions, empty at file level
+    bool hasValue = false;          // body evaluates to a constant
+    long long value = 0;
+};
+
+struct MacroSymbol {
+    std::vector<MacroSite> sites;   // by file path, then line
+    bool conflict = false;
+    bool unguardedOverride = false; // guarded define redefined at file level with another body
+};
+
+struct MacroSymbolTable {
+    std::map<std::string, MacroSymbol> macros;
+    size_t headers = 0;
+    size_t rescanned = 0;           // headers read this time (not cached)
+};
+
+typedef std::vector<std::pair<std::string, MacroSite>> NamedMacroSites;
+
+/** splitDefineArg(arg, name, params, body): "NAME(params) body" */
+static bool splitDefineArg(const std::string& arg, std::string& name, std::string& params, std::string& body)
+{
+    size_t e = 0;
+    while (e < arg.size() && isWordChar(arg[e])) e++;
+    if (e == 0) return false;
+    name = arg.substr(0, e);
+    params.clear();
+    if (e < arg.size() && arg[e] == '(') {
+        size_t close = arg.find(')', e);
+        if (close == std::string::npos) close = arg.size() - 1;
+        params = arg.substr(e, close - e + 1);
+        e = close + 1;
+    }
+    body = trimCopy(arg.substr(e));
+    return true;
+}
+
+static bool simpleCondition(const std::string& c)
+{
+    return std::all_of(c.begin(), c.end(), [](char ch) { return isWordChar(ch) || ch == '(' || ch == ')' || ch == '!'; });
+}
+
+static std::string negateCondition(const std::string& c)
+{
+    if (c.size() > 1 && c[0] == '!' && simpleCondition(c)) return c.substr(1);
+    return simpleCondition(c) ? "!" + c : "!(" + c + ")";
+}
+
+/** scanMacroSites(file, lines): all macro sites of one header */
+static NamedMacroSites scanMacroSites(FileId file, std::vector<std::string> lines)
+{
+    NamedMacroSites sites;
+    std::vector<std::pair<size_t, std::string>> commented;   // line, "NAME body"
+    for (size_t i = 0; i < lines.size(); ++i) {
+        const std::string& l = lines[i];
+        size_t p = l.find_first_not_of(" \t");
+        if (p == std::string::npos || l.compare(p, 2, "//") != 0) continue;
+        p = l.find_first_not_of("/ \t", p);
+        if (p == std::string::npos || l[p] != '#') continue;
+        p = l.find_first_not_of(" \t", p + 1);
+        if (p == std::string::npos || l.compare(p, 6, "define") != 0 || p + 6 >= l.size() || !isSpaceChar(l[p + 6])) continue;
+        commented.emplace_back(i, trimCopy(l.substr(p + 6)));
+    }
+
+    DirectiveScan scan = scanPreprocessorDirectives(std::move(lines));
+    const auto& D = scan.directives;
+    bool includeGuard = D.size() >= 3 && D[0].kind == PPKind::Ifndef && D[1].kind == PPKind::Define
+        && firstIdent(D[1].arg) == firstIdent(D[0].arg) && D.back().kind == PPKind::Endif
+        && scan.regions[D[0].region].endLine == D.back().line;
+
+    struct Level {
+        std::vector<std::string> previous;   // conditions of the earlier branches
+        std::string current;                 // empty in #else
+        bool includeGuard = false;
+    };
+    std::vector<Level> stack;
+    auto guardText = [&]() {
+        std::string text;
+        auto add = [&](const std::string& part) {
+            if (!text.empty()) text += " && ";
+            text += part;
+        };
+        for (const auto& level : stack) {
+            if (level.includeGuard) continue;
+            for (const auto& c : level.previous) {
+                if (!c.empty()) add(negateCondition(c));
+            }
+            if (!level.current.empty()) add(simpleCondition(level.current) ? level.current : "(" + level.current + ")");
+        }
+        return text;
+    };
+    auto condition = [](const PPDirective& d) {
+        if (d.kind == PPKind::Ifdef) return "defined(" + firstIdent(d.arg) + ")";
+        if (d.kind == PPKind::Ifndef) return "!defined(" + firstIdent(d.arg) + ")";
+        return d.arg;
+    };
+    auto addSite = [&](const std::string& arg, size_t line, MacroSiteKind kind) {
+        MacroSite site;
+        std::string name;
+        if (!splitDefineArg(arg, name, site.params, site.body)) return;
+        if (kind == MacroSiteKind::Undef) {
+            site.params.clear();
+            site.body.clear();
+        }
+        site.file = file;
+        site.line = (uint32_t)line + 1;
+        site.kind = kind;
+        site.guard = guardText();
+        sites.emplace_back(std::move(name), std::move(site));
+    };
+
+    size_t next = 0;
+    auto flushCommented = [&](size_t beforeLine) {
+        for (; next < commented.size() && commented[next].first < beforeLine; ++next) {
+            addSite(commented[next].second, commented[next].first, MacroSiteKind::Commented);
+        }
+    };
+    for (size_t i = 0; i < D.size(); ++i) {
+        const PPDirective& d = D[i];
+        flushCommented(d.line);
+        switch (d.kind) {
+        case PPKind::If:
+        case PPKind::Ifdef:
+        case PPKind::Ifndef: {
+            Level level;
+            level.current = condition(d);
+            level.includeGuard = includeGuard && i == 0;
+            stack.push_back(std::move(level));
+            break;
+        }
+        case PPKind::Elif:
+        case PPKind::Else:
+            if (stack.empty()) break;
+            stack.back().previous.push_back(stack.back().current);
+            stack.back().current = d.kind == PPKind::Elif ? condition(d) : std::string();
+            break;
+        case PPKind::Endif:
+            if (!stack.empty()) stack.pop_back();
+            break;
+        case PPKind::Define:
+            if (!(includeGuard && i == 1)) addSite(d.arg, d.line, MacroSiteKind::Define);
+            break;
+        case PPKind::Undef:
+            addSite(d.arg, d.line, MacroSiteKind::Undef);
+            break;
+        }
+    }
+    flushCommented(SIZE_MAX);
+    return sites;
+}
+
+struct MacroCacheEntry {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    NamedMacroSites sites;
+};
+
+static std::unordered_map<std::string, MacroCacheEntry> loadMacroCache()
+{
+    std::unordered_map<std::string, MacroCacheEntry> cache;
+    std::string data;
+    std::error_code ec;
+    uintmax_t size = fs::file_size(MACRO_TABLE_FILE, ec);
+    if (ec || !readWholeFile(MACRO_TABLE_FILE, size, data)) return cache;
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    uint64_t version, files;
+    if (!getCacheU64(p, end, version) || version != SCANNER_VERSION || !getCacheU64(p, end, files)) return cache;
+    for (uint64_t f = 0; f < files; ++f) {
+        std::string path;
+        MacroCacheEntry entry;
+        uint64_t mtime, count;
+        if (!getCacheString(p, end, path) || !getCacheU64(p, end, entry.size) ||
+            !getCacheU64(p, end, mtime) || !getCacheU64(p, end, count)) {
+            cache.clear();
+            break;
+        }
+        entry.mtime = (int64_t)mtime;
+        bool ok = true;
+        for (uint64_t i = 0; i < count && ok; ++i) {
+            std::string name;
+            MacroSite site;
+            uint64_t kind = 0, line = 0;
+            ok = getCacheString(p, end, name) && getCacheU64(p, end, kind) && getCacheU64(p, end, line) &&
+                getCacheString(p, end, site.params) && getCacheString(p, end, site.body) &&
+                getCacheString(p, end, site.guard) && kind <= (uint64_t)MacroSiteKind::Commented;
+            site.kind = (MacroSiteKind)kind;
+            site.line = (uint32_t)line;
+            entry.sites.emplace_back(std::move(name), std::move(site));
+        }
+        if (!ok) {
+            cache.clear();
+            break;
+        }
+        cache[path] = std::move(entry);
+    }
+    return cache;
+}
+
+static void saveMacroCache(const std::unordered_map<std::string, MacroCacheEntry>& cache)
+{
+    std::string data;
+    putCacheU64(data, SCANNER_VERSION);
+    putCacheU64(data, cache.size());
+    for (const auto& kv : cache) {
+        putCacheString(data, kv.first);
+        putCacheU64(data, kv.second.size);
+        putCacheU64(data, (uint64_t)kv.second.mtime);
+        putCacheU64(data, kv.second.sites.size());
+        for (const auto& ns : kv.second.sites) {
+            putCacheString(data, ns.first);
+            putCacheU64(data, (uint64_t)ns.second.kind);
+            putCacheU64(data, ns.second.line);
+            putCacheString(data, ns.second.params);
+            putCacheString(data, ns.second.body);
+            putCacheString(data, ns.second.guard);
+        }
+    }
+    writeFileAtomically(MACRO_TABLE_FILE, data);
+}
+
+/** resolveMacroValues(table):
+ *   Evaluates each object-like body with the definitions of its
+ *   own header first and the first definition elsewhere for the
+ *   rest, and flags macros defined twice with different bodies
+ *   under the same guard. A guarded define (say an #ifndef
+ *   default) that a file redefines unguarded with another body
+ *   is flagged too: which one wins depends on the include order.
+ */
+static void resolveMacroValues(MacroSymbolTable& table)
+{
+    MacroTable bodies;
+    std::map<FileId, std::vector<std::pair<const std::string*, MacroSite*>>> byFile;
+    for (auto& kv : table.macros) {
+        std::map<std::string, std::string> byGuard;
+        for (auto& site : kv.second.sites) {
+            if (site.kind != MacroSiteKind::Define) continue;
+            if (bodies.defined.emplace(kv.first, site.body).second && !site.params.empty()) {
+                bodies.functionLike.insert(kv.first);
+            }
+            byFile[site.file].emplace_back(&kv.first, &site);
+
+            std::string definition = site.params + " " + site.body;
+            definition.erase(std::unique(definition.begin(), definition.end(),
+                [](char a, char b) { return isSpaceChar(a) && isSpaceChar(b); }), definition.end());
+            auto seen = byGuard.emplace(site.guard, definition);
+            if (!seen.second && seen.first->second != definition) kv.second.conflict = true;
+        }
+        auto fileLevel = byGuard.find(std::string());
+        if (fileLevel != byGuard.end()) {
+            for (const auto& g : byGuard) {
+                if (!g.first.empty() && g.second != fileLevel->second) kv.second.unguardedOverride = true;
+            }
+        }
+    }
+    for (auto& file : byFile) {
+        // let this header's own definitions win while evaluating it
+        std::vector<std::pair<const std::string*, std::string>> saved;
+        std::set<const std::string*> own;
+        for (auto& ns : file.second) {
+            if (!ns.second->params.empty() || !own.insert(ns.first).second) continue;
+            std::string& body = bodies.defined[*ns.first];
+            saved.emplace_back(ns.first, std::move(body));
+            body = ns.second->body;
+        }
+        for (auto& ns : file.second) {
+            MacroSite& site = *ns.second;
+            if (!site.params.empty() || site.body.empty()) continue;
+            bool ok = true;
+            PPExpressionEvaluator ev(site.body, bodies, false);
+            PPValue v = ev.evaluate(ok);
+            site.hasValue = ok && v.known;
+            site.value = v.v;
+        }
+        for (auto& sv : saved) bodies.defined[*sv.first] = std::move(sv.second);
+    }
+}
+
+/** buildMacroSymbolTable(root, header):
+ *   Symbol table of all headers below 'root' (plus 'header',
+ *   should it lie elsewhere). Headers whose cached sites are
+ *   still current are not read.
+ */
+MacroSymbolTable buildMacroSymbolTable(const fs::path& root, const std::string& header = std::string())
+{
+    TraceSpan span("macro table");
+    FileList headers;
+    for (FileId f : findSourceFiles(root)) {
+        std::string ext = fs::path(g_files.path(f)).extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (ext == ".h") headers.push_back(f);
+    }
+    if (!header.empty()) {
+        FileId id = g_files.intern(header);
+        if (std::find(headers.begin(), headers.end(), id) == headers.end()) headers.push_back(id);
+    }
+    std::vector<std::string> paths(headers.size());
+    for (size_t i = 0; i < headers.size(); ++i) paths[i] = g_files.path(headers[i]);
+    std::vector<FileStat> stats = statFiles(headers);
+
+    std::unordered_map<std::string, MacroCacheEntry> cache;
+    if (g_useResultCache) {
+        std::error_code ec;
+        fs::create_directories(RESULT_CACHE_DIR, ec);
+        cache = loadMacroCache();
+    }
+    std::vector<NamedMacroSites> perFile(headers.size());
+    std::vector<size_t> stale;
+    for (size_t i = 0; i < headers.size(); ++i) {
+        auto it = cache.find(paths[i]);
+        if (it != cache.end() && stats[i].mtime != 0 &&
+            it->second.size == stats[i].size && it->second.mtime == stats[i].mtime) {
+            perFile[i] = it->second.sites;
+            for (auto& ns : perFile[i]) ns.second.file = headers[i];
+        }
+        else {
+            stale.push_back(i);
+        }
+    }
+    runParallel(stale.size(), [&](size_t k) {
+        size_t i = stale[k];
+        std::vector<std::string> lines;
+        readBufferedFile(paths[i], lines);
+        perFile[i] = scanMacroSites(headers[i], std::move(lines));
+    });
+
+    if (g_useResultCache) {
+        // forget headers below this root that are gone (by path
+        // component: root 'Client' leaves 'Client2' alone)
+        std::unordered_set<std::string> present(paths.begin(), paths.end());
+        size_t before = cache.size();
+        for (auto it = cache.begin(); it != cache.end(); ) {
+            bool gone = isBelowRoot(root, it->first) && !present.count(it->first);
+            it = gone ? cache.erase(it) : std::next(it);
+        }
+        if (!stale.empty() || cache.size() != before) {
+            for (size_t i : stale) {
+                MacroCacheEntry& entry = cache[paths[i]];
+                entry.size = stats[i].size;
+                entry.mtime = stats[i].mtime;
+                entry.sites = perFile[i];
+            }
+            saveMacroCache(cache);
+        }
+    }
+
+    std::vector<size_t> order(headers.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return paths[a] < paths[b]; });
+    MacroSymbolTable table;
+    for (size_t i : order) {
+        for (auto& ns : perFile[i]) {
+            table.macros[ns.first].sites.push_back(std::move(ns.second));
+        }
+    }
+    resolveMacroValues(table);
+    table.headers = headers.size();
+    table.rescanned = stale.size();
+    return table;
+}
+
+/** headerDefines(table, header):
+ *   The macros defined or commented out in 'header', in the
+ *   order they first appear there - the define menu and the
+ *   feature lists of the combined modes.
+ */
+std::vector<std::string> headerDefines(const MacroSymbolTable& table, const std::string& header)
+{
+    FileId id = g_files.intern(header);
+    std::vector<std::pair<uint32_t, std::string>> found;
+    for (const auto& kv : table.macros) {
+        for (const auto& site : kv.second.sites) {
+            if (site.file == id && site.kind != MacroSiteKind::Undef) {
+                found.emplace_back(site.line, kv.first);
+                break;
+            }
+        }
+    }
+    std::sort(found.begin(), found.end());
+    std::vector<std::string> names;
+    names.reserve(found.size());
+    for (auto& f : found) names.push_back(std::move(f.second));
+    return names;
+}
+
+/** describeMacro(symbol, header):
+ *   One-line summary for the define menu, from the view of
+ *   'header': its value there, whether it is switched off and
+ *   how it fares elsewhere in the tree.
+ */
+std::string describeMacro(const MacroSymbol& symbol, const std::string& header)
+{
+    FileId id = g_files.intern(header);
+    std::string text;
+    std::set<long long> values;
+    size_t elsewhere = 0, undefs = 0;
+    bool commentedOnly = true;
+    for (const auto& site : symbol.sites) {
+        if (site.kind == MacroSiteKind::Undef) undefs++;
+        else if (site.file != id) elsewhere++;
+        if (site.kind == MacroSiteKind::Define) {
+            if (site.file == id) commentedOnly = false;
+            if (site.hasValue) values.insert(site.value);
+        }
+    }
+    for (const auto& site : symbol.sites) {
+        if (site.file == id && site.kind == MacroSiteKind::Define && site.hasValue && !site.body.empty()) {
+            text += " = " + std::to_string(site.value);
+            break;
+        }
+    }
+    if (commentedOnly) text += " (commented out)";
+    if (values.size() > 1) text += " [" + std::to_string(values.size()) + " values]";
+    if (elsewhere > 0) text += " [+" + std::to_string(elsewhere) + " elsewhere]";
+    if (undefs > 0) text += " [#undef x" + std::to_string(undefs) + "]";
+    if (symbol.conflict) text += " [conflict]";
+    if (symbol.unguardedOverride) text += " [redefined unguarded]";
+    return text;
+}
+
+/** writeMacroReport(label, table):
+ *   Output/<label>_MACROS.txt: every macro with its sites,
+ *   values, guards, undefs and conflicts.
+ */
+void writeMacroReport(const std::string& label, const MacroSymbolTable& table)
+{
+    TraceSpan span("write output");
+    std::string out;
+    out += "Macro table: " + std::to_string(table.macros.size()) + " macro(s) from "
+        + std::to_string(table.headers) + " header(s)\n\n";
+    for (const auto& kv : table.macros) {
+        out += kv.first;
+        if (kv.second.conflict) out += "    [conflicting redefinition]";
+        if (kv.second.unguardedOverride) out += "    [guarded define redefined unguarded]";
+        out += "\n";
+        for (const auto& site : kv.second.sites) {
+            out += site.kind == MacroSiteKind::Define ? "  #define  "
+                : site.kind == MacroSiteKind::Undef ? "  #undef   " : "  //define ";
+            out += g_files.path(site.file) + ":" + std::to_string(site.line);
+            if (!site.params.empty() || !site.body.empty()) out += "  " + kv.first + site.params + " " + site.body;
+            if (site.hasValue && site.body != std::to_string(site.value)) out += "  (= " + std::to_string(site.value) + ")";
+            if (!site.guard.empty()) out += "  [if " + site.guard + "]";
+            out += "\n";
+        }
+        out += "\n";
+    }
+    std::error_code ec;
+    fs::create_directories("Output", ec);
+    writeFileIfChanged("Output/" + label + "_MACROS.txt", out);
+}
+
+/** loadHeaderDefines(label, root, header, table):
+ *   Builds the symbol table for 'root', reports it and returns
+ *   the defines of 'header' for the menus.
+ */
+std::vector<std::string> loadHeaderDefines(const std::string& label, const fs::path& root,
+    const std::string& header, MacroSymbolTable& table)
+{
+    auto startTime = high_resolution_clock::now();
+    table = buildMacroSymbolTable(root, header);
+    writeMacroReport(label, table);
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+    std::cout << "Macro table: " << table.macros.size() << " macro(s) from " << table.headers << " header(s) ("
+        << table.rescanned << " read) in " << ms << " ms - see 'Output/" << label << "_MACROS.txt'\n";
+    return headerDefines(table, header);
+}
+
+std::vector<std::string> headerDefinesFromLines(FileId header, std::vector<std::string> lines)
+{
+    MacroSymbolTable table;
+    for (auto& ns : scanMacroSites(header, std::move(lines))) {
+        table.macros[ns.first].sites.push_back(std::move(ns.second));
+    }
+    return headerDefines(table, g_files.path(header));
+}
+
+/*******************************************************
+ * Configuration evaluator
+ *
+ *  A configuration assigns on/off/<value> to defines. The
+ *  header (service.h / locale_inc.h) is evaluated under the
+ *  assignment first to obtain the macro table, then every
+ *  source file's directives are walked to find its active
+ *  and dead line ranges. All files are read once, in
+ *  parallel; any number of configurations and queries are
+ *  then evaluated from memory.
+ *******************************************************/
+struct PPConfiguration {
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> assignments; // NAME -> on | off | value
+};
+
+/** parseAssignment(text, cfg):
+ *   Accepts NAME, NAME=on, NAME=off, NAME=<value> and
+ *   -DNAME[=value] / -UNAME.
+ */
+bool parseAssignment(std::string text, PPConfiguration& cfg)
+{
+    text = trimCopy(text);
+    if (text.empty()) return true;
+    std::string forced;
+    if (text.compare(0, 2, "-D") == 0) text = text.substr(2);
+    else if (text.compare(0, 2, "-U") == 0) { text = text.substr(2); forced = "off"; }
+
+    size_t eq = text.find('=');
+    std::string name = trimCopy(text.substr(0, eq));
+    std::string value = eq == std::string::npos ? "on" : trimCopy(text.substr(eq + 1));
+    if (!forced.empty()) value = forced;
+    if (name.empty() || !std::all_of(name.begin(), name.end(), isWordChar)) {
+        return false;
+    }
+    std::string lower = value;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (lower == "on" || lower == "off") value = lower;
+    cfg.assignments.push_back({ name, value });
+    return true;
+}
+
+/** loadConfigurationFile(path, cfg):
+ *   One assignment per line (or several separated by blanks),
+ *   '#' starts a comment.
+ */
+bool loadConfigurationFile(const std::string& path, PPConfiguration& cfg)
+{
+    std::ifstream ifs(path);
+    if (!ifs.is_open()) {
+        std::cerr << "Could not open " << path << "!\n";
+        return false;
+    }
+    cfg.name = fs::path(path).stem().string();
+    std::string line;
+    size_t lineNo = 0;
+    while (std::getline(ifs, line)) {
+        lineNo++;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::istringstream iss(line);
+        std::string tok;
+        while (iss >> tok) {
+            if (!parseAssignment(tok, cfg)) {
+                std::cerr << path << ":" << lineNo << ": invalid assignment '" << tok << "'\n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static std::string describeConfiguration(const PPConfiguration& cfg)
+{
+    std::string text;
+    for (const auto& a : cfg.assignments) {
+        if (!text.empty()) text += ", ";
+        text += a.first + "=" + a.second;
+    }
+    return text.empty() ? "(header defaults)" : text;
+}
+
+/** buildMacroTable(header, cfg, pinned):
+ *   Evaluates the header under the assignment and returns the
+ *   resulting macros. Assigned names are pinned so neither the
+ *   header nor the sources can override them.
+ */
+MacroTable buildMacroTable(const DirectiveScan* header,
+    const PPConfiguration& cfg,
+    std::unordered_set<std::string>& pinned)
+{
+    MacroTable table;
+    pinned.clear();
+    for (const auto& a : cfg.assignments) {
+        if (a.second == "off") {
+            table.defined.erase(a.first);
+            table.undefined.insert(a.first);
+            pinned.insert(a.first);
+        }
+        else if (a.second == "on") {
+            table.undefined.erase(a.first);
+            table.defined.emplace(a.first, "");
+        }
+        else {
+            table.undefined.erase(a.first);
+            table.defined[a.first] = a.second;
+            pinned.insert(a.first);
+        }
+    }
+    if (header) {
+        MacroTable finalTable;
+        evaluateRegions(*header, table, pinned, nullptr, &finalTable);
+        table = std::move(finalTable);
+    }
+    // "on" keeps a header value but must stay defined
+    for (const auto& a : cfg.assignments) {
+        if (a.second == "on") {
+            table.defined.emplace(a.first, "");
+            pinned.insert(a.first);
+        }
+    }
+    return table;
+}
+
+static std::string sanitizeFileName(const std::string& text)
+{
+    std::string out;
+    for (char c : text) {
+        out += isWordChar(c) ? c : '_';
+    }
+    return out.empty() ? "_" : out;
+}
+
+/** lineRangeText(ranges):
+ *   "1-10, 15-20" from 0-based inclusive ranges.
+ */
+static std::string lineRangeText(const std::vector<std::pair<size_t, size_t>>& ranges)
+{
+    std::string text;
+    for (const auto& r : ranges) {
+        if (!text.empty()) text += ", ";
+        text += std::to_string(r.first + 1);
+        if (r.second != r.first) text += "-" + std::to_string(r.second + 1);
+    }
+    return text.empty() ? "-" : text;
+}
+
+/** writeConfigurationReport():
+ *   Output/EVAL_<config>.txt - per file the active, dead and
+ *   undetermined line ranges (files without conditionals are
+ *   only counted).
+ */
+void writeConfigurationReport(const FileList& files,
+    const std::vector<DirectiveScan>& scans,
+    const DirectiveScan* header,
+    const std::string& headerName,
+    const PPConfiguration& cfg)
+{
+    std::unordered_set<std::string> pinned;
+    MacroTable table = buildMacroTable(header, cfg, pinned);
+
+    std::vector<std::vector<uint8_t>> active(files.size());
+    std::vector<std::vector<size_t>> warnings(files.size());
+    runParallel(files.size(), [&](size_t i) {
+        active[i] = evaluateRegions(scans[i], table, pinned, &warnings[i]);
+    });
+
+    fs::create_directory("Output");
+    std::string outFileName = "Output/EVAL_" + sanitizeFileName(cfg.name) + ".txt";
+    std::ofstream out(outFileName);
+    if (!out.is_open()) {
+        std::cerr << "Error when opening " << outFileName << "\n";
+        return;
+    }
+    out << "=== CONFIGURATION: " << cfg.name << " ===\n";
+    out << "Header: " << (headerName.empty() ? "(none)" : headerName) << "\n";
+    out << "Assignments: " << describeConfiguration(cfg) << "\n\n";
+
+    size_t totalActive = 0, totalDead = 0, totalUnknown = 0, totalWarnings = 0, filesWithDead = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const auto& scan = scans[i];
+        // maximal dead / undetermined regions: the parent (if any) is active
+        std::vector<std::pair<size_t, size_t>> dead, unknown;
+        std::vector<size_t> deadDirective, unknownDirective;
+        for (size_t r = 0; r < scan.regions.size(); ++r) {
+            const auto& reg = scan.regions[r];
+            bool parentActive = reg.parent == std::string::npos || active[i][reg.parent] == REGION_ACTIVE;
+            if (active[i][r] == REGION_ACTIVE || !parentActive) continue;
+            if (reg.beginLine + 1 >= reg.endLine) continue;
+            bool isDead = active[i][r] == REGION_DEAD;
+            (isDead ? dead : unknown).push_back({ reg.beginLine + 1, reg.endLine - 1 });
+            (isDead ? deadDirective : unknownDirective).push_back(scan.directives[reg.directive].line);
+        }
+        size_t deadLines = 0, unknownLines = 0;
+        for (const auto& d : dead) deadLines += d.second - d.first + 1;
+        for (const auto& u : unknown) unknownLines += u.second - u.first + 1;
+        totalDead += deadLines;
+        totalUnknown += unknownLines;
+        totalActive += scan.lineCount - deadLines - unknownLines;
+        totalWarnings += warnings[i].size();
+        if (scan.regions.empty() && warnings[i].empty()) continue;
+
+        std::vector<std::pair<size_t, size_t>> act;
+        size_t cursor = 0;
+        auto sorted = dead;
+        sorted.insert(sorted.end(), unknown.begin(), unknown.end());
+        std::sort(sorted.begin(), sorted.end());
+        for (const auto& d : sorted) {
+            if (d.first > cursor) act.push_back({ cursor, d.first - 1 });
+            cursor = std::max(cursor, d.second + 1);
+        }
+        if (cursor < scan.lineCount) act.push_back({ cursor, scan.lineCount - 1 });
+        if (!dead.empty()) filesWithDead++;
+
+        out << "##########\n" << g_files.path(files[i]) << "\n##########\n";
+        out << "ACTIVE: " << lineRangeText(act) << "\n";
+        for (size_t d = 0; d < dead.size(); ++d) {
+            out << "DEAD:   " << lineRangeText({ dead[d] }) << "  (line " << (deadDirective[d] + 1) << ")\n";
+        }
+        for (size_t u = 0; u < unknown.size(); ++u) {
+            out << "UNKNOWN: " << lineRangeText({ unknown[u] }) << "  (line " << (unknownDirective[u] + 1) << ")\n";
+        }
+        for (size_t w : warnings[i]) {
+            out << "WARNING: line " << (w + 1) << ": cannot evaluate condition\n";
+        }
+        out << "\n";
+    }
+    out << "--- SUMMARY: " << files.size() << " file(s), " << filesWithDead << " with dead code, "
+        << totalActive << " active line(s), " << totalDead << " dead line(s), "
+        << totalUnknown << " undetermined line(s), " << totalWarnings << " warning(s) ---\n";
+
+    std::cout << "Configuration '" << cfg.name << "': " << totalDead << " dead line(s) in "
+        << filesWithDead << " file(s), " << totalWarnings << " warning(s) - see '" << outFileName << "'\n";
+}
+
+/** writeQueryReport():
+ *   Output/QUERY_<expr>.txt - the blocks compiled only under the
+ *   boolean query: every on/off combination of the query's names
+ *   is evaluated (on top of 'base'); a region is reported if it
+ *   is compiled for some combination satisfying the query and for
+ *   none that does not. Returns false on an invalid query.
+ */
+bool writeQueryReport(const FileList& files,
+    const std::vector<DirectiveScan>& scans,
+    const DirectiveScan* header,
+    const PPConfiguration& base,
+    const std::string& query)
+{
+    bool ok = true;
+    auto toks = tokenizePPExpression(query, ok);
+    std::vector<std::string> vars;
+    for (const auto& t : toks) {
+        if (t.type == PPToken::Ident && t.text != "defined" && t.text != "true" && t.text != "false"
+            && std::find(vars.begin(), vars.end(), t.text) == vars.end()) {
+            vars.push_back(t.text);
+        }
+    }
+    if (!ok || vars.empty() || vars.size() > 12) {
+        std::cerr << "Invalid query '" << query << "' (1 to 12 names expected).\n";
+        return false;
+    }
+
+    std::vector<std::vector<uint8_t>> inSat(files.size()), inUnsat(files.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        inSat[i].assign(scans[i].regions.size(), 0);
+        inUnsat[i].assign(scans[i].regions.size(), 0);
+    }
+
+    size_t satisfying = 0;
+    for (size_t mask = 0; mask < (size_t(1) << vars.size()); ++mask) {
+        PPConfiguration cfg = base;
+        for (size_t v = 0; v < vars.size(); ++v) {
+            cfg.assignments.push_back({ vars[v], (mask >> v) & 1 ? "on" : "off" });
+        }
+        std::unordered_set<std::string> pinned;
+        MacroTable table = buildMacroTable(header, cfg, pinned);
+
+        bool qok = true;
+        PPExpressionEvaluator ev(query, table, true);
+        PPValue qv = ev.evaluate(qok);
+        if (!qok || !qv.known) {
+            std::cerr << "Invalid query '" << query << "'.\n";
+            return false;
+        }
+        bool sat = qv.v != 0;
+        if (sat) satisfying++;
+
+        // an undetermined region may be compiled: it never counts
+        // for a satisfying combination but always against one
+        runParallel(files.size(), [&](size_t i) {
+            auto act = evaluateRegions(scans[i], table, pinned, nullptr);
+            auto& acc = sat ? inSat[i] : inUnsat[i];
+            for (size_t r = 0; r < act.size(); ++r) {
+                acc[r] |= sat ? act[r] == REGION_ACTIVE : act[r] != REGION_DEAD;
+            }
+        });
+    }
+    if (satisfying == 0) {
+        std::cerr << "Query '" << query << "' can never be true.\n";
+    }
+
+    fs::create_directory("Output");
+    std::string outFileName = "Output/QUERY_" + sanitizeFileName(query) + ".txt";
+    std::ofstream out(outFileName);
+    if (!out.is_open()) {
+        std::cerr << "Error when opening " << outFileName << "\n";
+        return false;
+    }
+    out << "=== QUERY: " << query << " ===\n";
+    out << "Base: " << describeConfiguration(base) << "\n\n";
+
+    size_t blocks = 0, blockFiles = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const auto& scan = scans[i];
+        std::vector<uint8_t> reported(scan.regions.size(), 0);
+        bool any = false;
+        for (size_t r = 0; r < scan.regions.size(); ++r) {
+            const auto& reg = scan.regions[r];
+            bool only = inSat[i][r] && !inUnsat[i][r];
+            reported[r] = only || (reg.parent != std::string::npos && reported[reg.parent]);
+            if (!only || (reg.parent != std::string::npos && reported[reg.parent])) continue;
+
+            size_t last = std::min(reg.endLine, scan.lineCount - 1);
+            out << "##########\n" << g_files.path(files[i]) << ":" << (reg.beginLine + 1) << "-" << (last + 1)
+                << "\n##########\n";
+            for (size_t l = reg.beginLine; l <= last && l < scan.lines.size(); ++l) {
+                out << scan.lines[l] << "\n";
+            }
+            out << "\n";
+            blocks++;
+            any = true;
+        }
+        if (any) blockFiles++;
+    }
+    out << "--- SUMMARY: " << blocks << " block(s) in " << blockFiles << " file(s) ---\n";
+    std::cout << "Query '" << query << "': " << blocks << " block(s) in " << blockFiles
+        << " file(s) - see '" << outFileName << "'\n";
+    return true;
+}
+
+/** runConfigurationEvaluation():
+ *   Reads all .h/.cpp below 'root' once (in parallel) and writes a
+ *   report per configuration and per query. Returns false if a
+ *   query was invalid.
+ */
+bool runConfigurationEvaluation(const fs::path& root,
+    const std::string& headerName,
+    const std::vector<PPConfiguration>& configs,
+    const std::vector<std::string>& queries)
+{
+    const FileList files = sortedFileList(findSourceFiles(root));
+    if (files.empty()) {
+        std::cerr << "No .cpp/.h files found in " << root << ".\n";
+        return false;
+    }
+
+    auto startTime = high_resolution_clock::now();
+    std::cout << "Reading " << files.size() << " file(s)...\n";
+    std::vector<DirectiveScan> scans(files.size());
+    bool keepLines = !queries.empty();
+    runParallel(files.size(), [&](size_t i) {
+        std::vector<std::string> lines;
+        readBufferedFile(g_files.path(files[i]), lines);
+        scans[i] = scanPreprocessorDirectives(std::move(lines));
+        if (!keepLines) std::vector<std::string>().swap(scans[i].lines);
+    });
+
+    DirectiveScan headerScan;
+    bool hasHeader = !headerName.empty();
+    if (hasHeader) {
+        std::vector<std::string> lines;
+        readBufferedFile(headerName, lines);
+        headerScan = scanPreprocessorDirectives(std::move(lines));
+    }
+    const DirectiveScan* header = hasHeader ? &headerScan : nullptr;
+
+    for (const auto& cfg : configs) {
+        writeConfigurationReport(files, scans, header, headerName, cfg);
+    }
+    bool allOk = true;
+    for (const auto& q : queries) {
+        allOk &= writeQueryReport(files, scans, header, configs.empty() ? PPConfiguration() : configs.front(), q);
+    }
+
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+    std::cout << "Evaluation finished in " << ms << " ms\n";
+    return allOk;
+}
+
+/*******************************************************
+ * Conditional rewriter (unifdef)
+ *
+ *  Given defines forced on, off or to a value, rewrites a tree
+ *  the way unifdef does: a conditional whose outcome follows
+ *  from the forced defines is removed together with its dead
+ *  branches and the surviving branch is kept. Conditionals
+ *  that do not mention a forced define are left untouched,
+ *  even constant ones like #if 0. Partly decided ones lose
+ *  their decided && / || operands ('#if defined(A) && B' with
+ *  A on becomes '#if B'). In a chain that keeps some of its
+ *  directives, a kept #elif after removed branches becomes #if
+ *  and a branch known to win becomes #else.
+ *
+ *  Files are rewritten in parallel. The result is either a
+ *  copy of the tree (Output/UNIFDEF_<tree>/) in which every
+ *  unchanged file is a reflink or else a copy of the original
+ *  (a hard link only on request, see shareFile), or a unified
+ *  diff (Output/UNIFDEF_<tree>.diff).
+ *******************************************************/
+static const size_t DIFF_CONTEXT = 3;
+
+struct UnifdefResult {
+    bool changed = false;
+    bool malformed = false;     // unbalanced conditionals, file left alone
+    size_t resolved = 0;        // conditionals (chains) resolved
+    std::string text;           // rewritten content (changed files)
+    std::string diff;           // unified diff hunks (changed files)
+};
+
+/** rewriteDirectiveKeyword(line, keyword, keepRest):
+ *   "  #  elif X // c" -> "  #  if X // c" (or "  #  else"
+ *   without 'keepRest'; a trailing '\r' is preserved).
+ */
+static std::string rewriteDirectiveKeyword(const std::string& line, const char* keyword, bool keepRest)
+{
+    size_t p = line.find('#') + 1;
+    while (p < line.size() && isSpaceChar(line[p])) p++;
+    size_t e = p;
+    while (e < line.size() && std::isalpha((unsigned char)line[e])) e++;
+    std::string out = line.substr(0, p) + keyword;
+    if (keepRest) out += line.substr(e);
+    else if (!line.empty() && line.back() == '\r') out += '\r';
+    return out;
+}
+
+/** rewriteDirectiveExpression(line, keyword, expr):
+ *   "  #  elif A && B // c" -> "  #  if B" (a trailing '\r' is
+ *   preserved, comments go with the old expression).
+ */
+static std::string rewriteDirectiveExpression(const std::string& line, const char* keyword, const std::string& expr)
+{
+    std::string out = rewriteDirectiveKeyword(line, keyword, false);
+    bool cr = !out.empty() && out.back() == '\r';
+    if (cr) out.pop_back();
+    out += " " + expr;
+    if (cr) out += '\r';
+    return out;
+}
+
+/** simplifyCondition(expr, tokens, b, e, forced, text, dropped):
+ *   Partial evaluation of the && / || structure of tokens
+ *   [b, e): operands decided by the forced defines either
+ *   decide the whole expression (false under &&, true under
+ *   ||) or are dropped, counted in 'dropped'. If the value
+ *   stays unknown, 'text' is what remains, the operands in
+ *   their original spelling. Other operators are not looked
+ *   into, so 'A + B && C' only simplifies as a whole.
+ */
+static PPValue simplifyCondition(const std::string& expr, const std::vector<PPToken>& tokens,
+    size_t b, size_t e, const MacroTable& forced, std::string& text, size_t& dropped)
+{
+    auto isOp = [&](size_t k, const char* op) {
+        return tokens[k].type == PPToken::Op && tokens[k].text == op;
+    };
+    bool hasOr = false, hasAnd = false, hasOther = false;
+    size_t closing = e;     // partner of a '(' at b
+    int depth = 0;
+    for (size_t k = b; k < e; ++k) {
+        if (isOp(k, "(")) depth++;
+        else if (isOp(k, ")") && --depth == 0 && closing == e && isOp(b, "(")) closing = k;
+        else if (depth > 0) continue;
+        else if (isOp(k, "||")) hasOr = true;
+        else if (isOp(k, "&&")) hasAnd = true;
+        else if (isOp(k, "?") || isOp(k, ":") || isOp(k, ",")) hasOther = true;
+    }
+
+    if ((hasOr || hasAnd) && !hasOther) {
+        const char* sep = hasOr ? "||" : "&&";
+        std::vector<std::string> kept;
+        size_t partBegin = b;
+        depth = 0;
+        for (size_t k = b; k <= e; ++k) {
+            if (k < e) {
+                if (isOp(k, "(")) depth++;
+                else if (isOp(k, ")")) depth--;
+                if (depth != 0 || !isOp(k, sep)) continue;
+            }
+            std::string partText;
+            PPValue v = simplifyCondition(expr, tokens, partBegin, k, forced, partText, dropped);
+            partBegin = k + 1;
+            if (!v.known) {
+                kept.push_back(partText);
+                continue;
+            }
+            if ((v.v != 0) == hasOr) {
+                PPValue decided;
+                decided.known = true;
+                decided.v = hasOr;
+                return decided;
+            }
+            dropped++;
+        }
+        if (kept.empty()) {
+            PPValue decided;
+            decided.known = true;
+            decided.v = !hasOr;
+            return decided;
+        }
+        text.clear();
+        for (const auto& k : kept) {
+            if (!text.empty()) text += hasOr ? " || " : " && ";
+            text += k;
+        }
+        return PPValue();
+    }
+
+    if (closing == e - 1 && e - b > 2) {
+        std::string inner;
+        size_t before = dropped;
+        PPValue v = simplifyCondition(expr, tokens, b + 1, e - 1, forced, inner, dropped);
+        if (v.known) return v;
+        // "(B && defined(A))" left with a single operand: no parentheses needed
+        bool ok = true;
+        std::vector<PPToken> rest = tokenizePPExpression(inner, ok);
+        int level = 0;
+        bool single = ok && dropped > before;
+        for (const auto& t : rest) {
+            if (t.type != PPToken::Op) continue;
+            if (t.text == "(") level++;
+            else if (t.text == ")") level--;
+            else if (level == 0 && t.text != "!") single = false;
+        }
+        text = single ? inner : "(" + inner + ")";
+        return v;
+    }
+
+    if (b >= e) return PPValue();
+    text = expr.substr(tokens[b].begin, tokens[e - 1].end - tokens[b].begin);
+    bool ok = true;
+    PPExpressionEvaluator ev(text, forced, false);
+    PPValue v = ev.evaluate(ok);
+    if (!ok) v.known = false;
+    return v;
+}
+
+/** resolveConditional(d, forced, residual):
+ *   Value of an #if/#ifdef/#ifndef/#elif under the forced
+ *   defines. Unknown unless the directive mentions one of them;
+ *   an unknown #if/#elif whose && / || operands were partly
+ *   decided gets the rest of its expression in 'residual'.
+ */
+static PPValue resolveConditional(const PPDirective& d, const MacroTable& forced, std::string& residual)
+{
+    residual.clear();
+    auto isForced = [&](const std::string& name) {
+        return forced.defined.count(name) > 0 || forced.undefined.count(name) > 0;
+    };
+    PPValue v;
+    if (d.kind == PPKind::Ifdef || d.kind == PPKind::Ifndef) {
+        std::string name = firstIdent(d.arg);
+        if (!isForced(name)) return v;
+        v.known = true;
+        v.v = (forced.defined.count(name) > 0) == (d.kind == PPKind::Ifdef);
+        return v;
+    }
+    bool ok = true;
+    std::vector<PPToken> tokens = tokenizePPExpression(d.arg, ok);
+    if (!ok || std::none_of(tokens.begin(), tokens.end(),
+        [&](const PPToken& t) { return t.type == PPToken::Ident && isForced(t.text); })) {
+        return v;
+    }
+    PPExpressionEvaluator ev(d.arg, forced, false);
+    v = ev.evaluate(ok);
+    if (!ok) v.known = false;
+    if (ok && !v.known) {
+        size_t dropped = 0;
+        std::string rest;
+        PPValue partial = simplifyCondition(d.arg, tokens, 0, tokens.size() - 1, forced, rest, dropped);
+        if (!partial.known && dropped > 0) residual = rest;
+    }
+    return v;
+}
+
+/** unifdefLines(scan, forced, keep, replaced, resolved):
+ *   Decides per line whether it survives; rewritten directive
+ *   lines get their new text in 'replaced'. False if the
+ *   conditionals do not balance.
+ */
+static bool unifdefLines(const DirectiveScan& scan, const MacroTable& forced,
+    std::vector<uint8_t>& keep, std::map<size_t, std::string>& replaced, size_t& resolved)
+{
+    struct Chain {
+        bool parentVisible;
+        bool taken = false;          // a branch is known to win
+        bool keptDirective = false;  // some directive of the chain stays
+        bool touched = false;        // some branch was resolved
+    };
+    std::vector<Chain> stack;
+    const auto& L = scan.lines;
+    keep.assign(L.size(), 1);
+    bool visible = true;
+    size_t next = 0;
+
+    for (const auto& d : scan.directives) {
+        for (; next < d.line; ++next) keep[next] = visible;
+        next = d.lastLine + 1;
+
+        bool keepDirective = visible;
+        size_t keptUpTo = d.lastLine;
+        switch (d.kind) {
+        case PPKind::If:
+        case PPKind::Ifdef:
+        case PPKind::Ifndef: {
+            Chain c{ visible };
+            if (visible) {
+                std::string residual;
+                PPValue v = resolveConditional(d, forced, residual);
+                if (v.known) {
+                    c.touched = true;
+                    c.taken = v.v != 0;
+                    visible = c.taken;
+                    keepDirective = false;
+                }
+                else {
+                    c.keptDirective = true;
+                    if (!residual.empty()) {
+                        c.touched = true;
+                        replaced[d.line] = rewriteDirectiveExpression(L[d.line], "if", residual);
+                        keptUpTo = d.line;
+                    }
+                }
+            }
+            stack.push_back(c);
+            break;
+        }
+        case PPKind::Elif:
+        case PPKind::Else: {
+            if (stack.empty()) return false;
+            Chain& c = stack.back();
+            keepDirective = false;
+            visible = false;
+            if (!c.parentVisible || c.taken) break;
+            PPValue v;
+            std::string residual;
+            if (d.kind == PPKind::Else) {
+                v.known = true;
+                v.v = 1;
+            }
+            else {
+                v = resolveConditional(d, forced, residual);
+                if (v.known) c.touched = true;
+            }
+            visible = !v.known || v.v != 0;
+            if (!v.known) {
+                if (!residual.empty()) {
+                    c.touched = true;
+                    replaced[d.line] = rewriteDirectiveExpression(L[d.line], c.keptDirective ? "elif" : "if", residual);
+                    keptUpTo = d.line;
+                }
+                else if (!c.keptDirective) {
+                    replaced[d.line] = rewriteDirectiveKeyword(L[d.line], "if", true);
+                }
+                c.keptDirective = true;
+                keepDirective = true;
+            }
+            else if (v.v) {
+                c.taken = true;
+                if (c.keptDirective && d.kind == PPKind::Elif) {
+                    replaced[d.line] = rewriteDirectiveKeyword(L[d.line], "else", false);
+                    keptUpTo = d.line;   // continuation lines go with the expression
+                }
+                keepDirective = c.keptDirective;
+            }
+            break;
+        }
+        case PPKind::Endif: {
+            if (stack.empty()) return false;
+            Chain c = stack.back();
+            stack.pop_back();
+            visible = c.parentVisible;
+            keepDirective = visible && c.keptDirective;
+            if (c.touched) resolved++;
+            break;
+        }
+        default:
+            break;
+        }
+        for (size_t l = d.line; l <= d.lastLine; ++l) {
+            keep[l] = keepDirective && l <= keptUpTo;
+        }
+    }
+    for (; next < L.size(); ++next) keep[next] = visible;
+    return stack.empty();
+}
+
+/** appendUnifiedDiff(out, name, lines, finalNewline, keep, replaced):
+ *   Appends the diff between 'lines' and their rewrite as
+ *   unified diff hunks with DIFF_CONTEXT lines of context. No
+ *   line matching is needed: every line is either kept,
+ *   dropped or replaced.
+ */
+static void appendUnifiedDiff(std::string& out, const std::string& name,
+    const std::vector<std::string>& lines, bool finalNewline,
+    const std::vector<uint8_t>& keep, const std::map<size_t, std::string>& replaced)
+{
+    struct DiffOp {
+        char kind;              // ' ', '-' or '+'
+        const std::string* text;
+        bool lastOld;           // last line of the old file
+        bool lastNew;           // last line of the new file
+    };
+    std::vector<DiffOp> ops;
+    ops.reserve(lines.size() + replaced.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+        auto r = replaced.find(i);
+        bool lastOld = i + 1 == lines.size();
+        if (keep[i] && r == replaced.end()) {
+            ops.push_back({ ' ', &lines[i], lastOld, false });
+        }
+        else {
+            ops.push_back({ '-', &lines[i], lastOld, false });
+            if (keep[i]) ops.push_back({ '+', &r->second, false, false });
+        }
+    }
+    for (size_t k = ops.size(); k-- > 0;) {
+        if (ops[k].kind == '-') continue;
+        ops[k].lastNew = true;
+        if (!finalNewline && ops[k].kind == ' ' && !ops[k].lastOld) {
+            // gains "no newline" here: show as changed
+            ops[k].kind = '-';
+            ops[k].lastNew = false;
+            ops.insert(ops.begin() + k + 1, DiffOp{ '+', ops[k].text, false, true });
+        }
+        break;
+    }
+    // within a change, removed lines come first
+    for (size_t k = 0; k < ops.size();) {
+        size_t e = k;
+        while (e < ops.size() && ops[e].kind != ' ') e++;
+        std::stable_partition(ops.begin() + k, ops.begin() + e, [](const DiffOp& op) { return op.kind == '-'; });
+        k = e + 1;
+    }
+
+    std::vector<size_t> oldBefore(ops.size() + 1, 0), newBefore(ops.size() + 1, 0);
+    for (size_t k = 0; k < ops.size(); ++k) {
+        oldBefore[k + 1] = oldBefore[k] + (ops[k].kind != '+');
+        newBefore[k + 1] = newBefore[k] + (ops[k].kind != '-');
+    }
+
+    bool headerDone = false;
+    size_t doneUpTo = 0;
+    for (size_t k = 0; k < ops.size(); ++k) {
+        if (ops[k].kind == ' ') continue;
+        size_t begin = std::max(doneUpTo, k >= DIFF_CONTEXT ? k - DIFF_CONTEXT : 0);
+        size_t last = k;
+        size_t equalRun = 0;
+        for (size_t j = k + 1; j < ops.size(); ++j) {
+            if (ops[j].kind != ' ') {
+                last = j;
+                equalRun = 0;
+            }
+            else if (++equalRun > 2 * DIFF_CONTEXT) {
+                break;
+            }
+        }
+        size_t end = std::min(ops.size(), last + 1 + DIFF_CONTEXT);
+
+        if (!headerDone) {
+            out += "--- a/" + name + "\n+++ b/" + name + "\n";
+            headerDone = true;
+        }
+        size_t oldCount = oldBefore[end] - oldBefore[begin];
+        size_t newCount = newBefore[end] - newBefore[begin];
+        out += "@@ -" + std::to_string(oldBefore[begin] + (oldCount ? 1 : 0)) + "," + std::to_string(oldCount) +
+            " +" + std::to_string(newBefore[begin] + (newCount ? 1 : 0)) + "," + std::to_string(newCount) + " @@\n";
+        for (size_t j = begin; j < end; ++j) {
+            out += ops[j].kind;
+            out += *ops[j].text;
+            out += '\n';
+            bool noNewline = ops[j].kind == '+' ? ops[j].lastNew
+                : ops[j].kind == '-' ? ops[j].lastOld
+                : ops[j].lastOld && ops[j].lastNew;
+            if (!finalNewline && noNewline) out += "\\ No newline at end of file\n";
+        }
+        doneUpTo = end;
+        k = end - 1;
+    }
+}
+
+/** unifdefFile(path, name, forced, names, result):
+ *   Rewrites one source. Files that mention none of the forced
+ *   names are not scanned at all.
+ */
+void unifdefFile(const std::string& path, const std::string& name, const MacroTable& forced,
+    const std::vector<std::string>& names, UnifdefResult& result)
+{
+    std::string data;
+    std::error_code ec;
+    uintmax_t size = fs::file_size(path, ec);
+    if (ec || !readWholeFile(path, size, data)) return;
+    if (std::none_of(names.begin(), names.end(),
+        [&](const std::string& n) { return data.find(n) != std::string::npos; })) {
+        return;
+    }
+
+    std::vector<std::string> lines;
+    splitLinesInto(data.data(), data.size(), lines, true);
+    bool finalNewline = !data.empty() && data.back() == '\n';
+    std::string().swap(data);
+    DirectiveScan scan = scanPreprocessorDirectives(std::move(lines));
+
+    std::vector<uint8_t> keep;
+    std::map<size_t, std::string> replaced;
+    if (!unifdefLines(scan, forced, keep, replaced, result.resolved)) {
+        result.malformed = true;
+        result.resolved = 0;
+        return;
+    }
+    if (result.resolved == 0) return;
+
+    result.changed = true;
+    const auto& L = scan.lines;
+    bool first = true;
+    for (size_t i = 0; i < L.size(); ++i) {
+        if (!keep[i]) continue;
+        if (!first) result.text += '\n';
+        first = false;
+        auto r = replaced.find(i);
+        result.text += r == replaced.end() ? L[i] : r->second;
+    }
+    if (finalNewline && !first) result.text += '\n';
+    appendUnifiedDiff(result.diff, name, L, finalNewline, keep, replaced);
+}
+
+enum class ShareKind : uint8_t { Reflink, HardLink, Copy, Symlink, Failed };
+
+/** shareFile(from, to, hardLinks):
+ *   Puts an unchanged file into the output tree without
+ *   duplicating its data where possible: a reflink (copy on
+ *   write) if the file system supports it, else a plain copy.
+ *   With 'hardLinks' a hard link comes before the copy; it
+ *   shares the inode, so editing it in place edits the source.
+ */
+ShareKind shareFile(const fs::path& from, const fs::path& to, bool hardLinks)
+{
+#if defined(__linux__) && defined(FICLONE)
+    int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src >= 0) {
+        struct stat st;
+        int dst = fstat(src, &st) == 0
+            ? open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777) : -1;
+        bool cloned = dst >= 0 && ioctl(dst, FICLONE, src) == 0;
+        if (dst >= 0) close(dst);
+        close(src);
+        if (cloned) return ShareKind::Reflink;
+        if (dst >= 0) unlink(to.c_str());
+    }
+#endif
+    std::error_code ec;
+    if (hardLinks) {
+        fs::create_hard_link(from, to, ec);
+        if (!ec) return ShareKind::HardLink;
+        ec.clear();
+    }
+    fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+    return ec ? ShareKind::Failed : ShareKind::Copy;
+}
+
+/** runUnifdef(root, label, cfg, diffOnly, hardLinks):
+ *   Resolves the conditionals that depend on the defines of
+ *   'cfg' in every .cpp/.h below 'root'. Writes the rewritten
+ *   tree or, with 'diffOnly', a unified diff.
+ */
+bool runUnifdef(const fs::path& root, const std::string& label, const PPConfiguration& cfg, bool diffOnly,
+    bool hardLinks = false)
+{
+    if (cfg.assignments.empty()) {
+        std::cerr << "No defines given (e.g. -D ENABLE_X, -U ENABLE_Y, MAX_LEVEL=120).\n";
+        return false;
+    }
+    std::unordered_set<std::string> pinned;
+    MacroTable forced = buildMacroTable(nullptr, cfg, pinned);
+    std::vector<std::string> names;
+    for (const auto& a : cfg.assignments) names.push_back(a.first);
+
+    auto startTime = high_resolution_clock::now();
+    std::vector<fs::path> all;
+    std::vector<std::string> rel;          // relative to root, '/' separated
+    std::vector<uint8_t> kinds;            // 0 other, 1 source, 2 symlink
+    const std::string rootText = root.string();
+    try {
+        for (auto it = fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied);
+            it != fs::recursive_directory_iterator(); ++it)
+        {
+            const auto& p = *it;
+            try {
+                std::error_code sameEc;
+                if (p.is_directory() && fs::equivalent(p.path(), "Output", sameEc)) {
+                    it.disable_recursion_pending();   // our own output, when run inside the tree
+                    continue;
+                }
+                uint8_t kind = 0;
+                if (fs::is_symlink(p.path())) kind = 2;
+                else if (!fs::is_regular_file(p.path())) continue;
+                else {
+                    std::string ext = p.path().extension().string();
+                    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+                    if (ext == ".cpp" || ext == ".h") kind = 1;
+                }
+                std::string r = p.path().string().substr(rootText.size());
+                std::replace(r.begin(), r.end(), '\\', '/');
+                r.erase(0, r.find_first_not_of('/'));
+                all.push_back(p.path());
+                rel.push_back(r);
+                kinds.push_back(kind);
+            }
+            catch (...) { continue; }
+        }
+    }
+    catch (...) {}
+    std::error_code ec;
+
+    const std::string outName = "Output/UNIFDEF_" + sanitizeFileName(label);
+    const fs::path outDir = outName;
+    fs::create_directory("Output");
+    if (!diffOnly) {
+        fs::remove_all(outDir, ec);
+        std::set<fs::path> dirs;
+        for (const auto& r : rel) dirs.insert((outDir / r).parent_path());
+        for (const auto& d : dirs) fs::create_directories(d, ec);
+    }
+
+    std::cout << "Rewriting " << describeConfiguration(cfg) << " in " << all.size() << " file(s)...\n";
+    std::vector<UnifdefResult> results(all.size());
+    std::vector<ShareKind> shared(all.size(), ShareKind::Copy);
+    std::atomic<size_t> doneFiles{ 0 };
+    runParallel(all.size(), [&](size_t i) {
+        if (kinds[i] == 1) {
+            TraceSpan span("unifdef");
+            unifdefFile(all[i].string(), rel[i], forced, names, results[i]);
+        }
+        if (!diffOnly) {
+            const fs::path target = outDir / rel[i];
+            if (results[i].changed) {
+                if (!writeFileAtomically(target.string(), results[i].text)) shared[i] = ShareKind::Failed;
+                std::string().swap(results[i].text);
+            }
+            else if (kinds[i] == 2) {
+                std::error_code linkEc;
+                fs::copy_symlink(all[i], target, linkEc);
+                shared[i] = linkEc ? ShareKind::Failed : ShareKind::Symlink;
+            }
+            else {
+                shared[i] = shareFile(all[i], target, hardLinks);
+            }
+        }
+        printProgress(doneFiles.fetch_add(1, std::memory_order_relaxed) + 1, all.size());
+    });
+    printProgress(all.size(), all.size());
+    std::cout << "\n";
+
+    size_t changed = 0, resolved = 0;
+    size_t counts[5] = { 0, 0, 0, 0, 0 };
+    std::string diff;
+    for (size_t i = 0; i < all.size(); ++i) {
+        const auto& r = results[i];
+        if (r.malformed) {
+            std::cerr << "Warning: unbalanced conditionals, left unchanged: " << all[i].string() << "\n";
+        }
+        if (r.changed) {
+            changed++;
+            resolved += r.resolved;
+            diff += r.diff;
+        }
+        else if (!diffOnly) {
+            counts[(int)shared[i]]++;
+        }
+    }
+
+    if (diffOnly) {
+        if (!writeFileAtomically(outName + ".diff", diff)) {
+            std::cerr << "Error when writing " << outName << ".diff\n";
+            return false;
+        }
+    }
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+    std::cout << resolved << " conditional(s) resolved in " << changed << " file(s), " << ms << " ms\n";
+    if (diffOnly) {
+        std::cout << "Diff written to " << outName << ".diff\n";
+    }
+    else {
+        std::cout << "Tree written to " << outName << "/ (unchanged files: " << counts[(int)ShareKind::Reflink]
+            << " reflinked, ";
+        if (hardLinks) std::cout << counts[(int)ShareKind::HardLink] << " hard-linked, ";
+        std::cout << counts[(int)ShareKind::Copy] << " copied)\n";
+        if (counts[(int)ShareKind::Failed] > 0) {
+            std::cerr << counts[(int)ShareKind::Failed] << " file(s) could not be written.\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************
+ * Tree comparison
+ *
+ *  Compares the define usage of two trees (folders or source
+ *  archives, e.g. two releases or two `git archive` snapshots).
+ *  Files are paired by their path below the root. Pairs of
+ *  equal size are compared by content hash (FILE_HASHES.bin
+ *  spares re-reading files whose size and mtime are known), so
+ *  identical files are never parsed; only changed, added and
+ *  removed files are scanned, in parallel.
+ *
+ *  Each scanned file yields "units": the #if blocks of every
+ *  define and the functions containing them. A unit is keyed by
+ *  its define, the enclosing function and the text of its
+ *  opening directive (plus an occurrence number), not by line
+ *  numbers, so code moving around does not count as a change.
+ *  The hash of file and key is the unit's stable identifier.
+ *******************************************************/
+struct DefineUnit {
+    std::string define;
+    bool function = false;      // function containing a block of 'define'
+    std::string key;            // identity within file and define
+    std::string label;          // directive text or function name
+    size_t line = 0;            // 0-based
+    std::string text;
+};
+
+struct UnitChange {
+    char op = ' ';              // '+' added, '-' removed, '~' modified
+    std::string file;           // relative path
+    const DefineUnit* oldUnit = nullptr;
+    const DefineUnit* newUnit = nullptr;
+};
+
+/** functionName(head): "CItem::Use" for "bool CItem::Use(int x)" */
+static std::string functionName(const std::string& head)
+{
+    size_t open = head.find('(');
+    if (open == std::string::npos) return trimCopy(head);
+    size_t e = open;
+    while (e > 0 && isSpaceChar(head[e - 1])) e--;
+    size_t b = e;
+    while (b > 0 && (isWordChar(head[b - 1]) || head[b - 1] == ':' || head[b - 1] == '~')) b--;
+    return head.substr(b, e - b);
+}
+
+/** collectDefineUnits(scan):
+ *   All define blocks and their functions of one file. The
+ *   conditionals and the function spans are both in line
+ *   order, so the enclosing function is tracked with a moving
+ *   pointer and a stack of the spans still open.
+ */
+static std::vector<DefineUnit> collectDefineUnits(const CppFileScan& scan)
+{
+    std::vector<DefineUnit> units;
+    std::map<std::string, size_t> occurrences;
+    std::set<std::pair<std::string, size_t>> seenFunctions;   // define, function index
+    const auto& L = scan.lines;
+
+    auto addUnit = [&](DefineUnit u) {
+        std::string base = u.define + (u.function ? "\x01" : "\x02") + u.key;
+        u.key += "#" + std::to_string(occurrences[base]++);
+        units.push_back(std::move(u));
+    };
+    size_t previousLine = SIZE_MAX;
+    std::set<std::string> lineDefines;
+    size_t nextFunction = 0;
+    std::vector<size_t> openFunctions;      // spans containing the current line, innermost last
+    for (const auto& ref : scan.conditionals) {
+        if (ref.line != previousLine) {
+            previousLine = ref.line;
+            lineDefines.clear();
+        }
+        size_t h = ref.line;
+        if (ref.ident == "defined" || std::isdigit((unsigned char)ref.ident[0]) ||
+            !(scan.flags[h] & LINE_IF_PREFILTER) || !lineDefines.insert(ref.ident).second) continue;
+
+        int nesting = 1;
+        size_t j = h + 1;
+        for (; j < L.size(); ++j) {
+            if (scan.flags[j] & LINE_ANY_IF_START) nesting++;
+            else if ((scan.flags[j] & LINE_HAS_ENDIF) && --nesting <= 0) break;
+        }
+        if (j >= L.size()) continue;   // unterminated
+
+        for (; nextFunction < scan.functions.size() && scan.functions[nextFunction].openLine <= h; ++nextFunction) {
+            openFunctions.push_back(nextFunction);
+        }
+        while (!openFunctions.empty() && scan.functions[openFunctions.back()].endLine < h) openFunctions.pop_back();
+        size_t fn = openFunctions.empty() ? SIZE_MAX : openFunctions.back();
+        std::string scope = fn == SIZE_MAX ? std::string() : functionName(L[scan.functions[fn].headLine]);
+
+        DefineUnit block;
+        block.define = ref.ident;
+        block.label = trimCopy(L[h]);
+        block.key = scope + "\x01" + block.label;
+        block.line = h;
+        for (size_t s = h; s <= j; ++s) block.text += L[s] + "\n";
+        addUnit(std::move(block));
+
+        if (fn != SIZE_MAX && seenFunctions.insert({ ref.ident, fn }).second) {
+            const FunctionSpan& span = scan.functions[fn];
+            DefineUnit func;
+            func.define = ref.ident;
+            func.function = true;
+            func.label = scope;
+            func.key = scope;
+            func.line = span.headLine;
+            for (size_t s = span.headLine; s <= span.endLine; ++s) func.text += L[s] + "\n";
+            addUnit(std::move(func));
+        }
+    }
+    return units;
+}
+
+/** diffDefineUnits(file, before, after, changes):
+ *   Matches the units of both versions of a file by key.
+ */
+static void diffDefineUnits(const std::string& file, const std::vector<DefineUnit>& before,
+    const std::vector<DefineUnit>& after, std::vector<UnitChange>& changes)
+{
+    auto keyOf = [](const DefineUnit& u) { return u.define + (u.function ? "\x01" : "\x02") + u.key; };
+    std::unordered_map<std::string, const DefineUnit*> old;
+    for (const auto& u : before) old.emplace(keyOf(u), &u);
+    for (const auto& u : after) {
+        auto it = old.find(keyOf(u));
+        if (it == old.end()) {
+            changes.push_back({ '+', file, nullptr, &u });
+            continue;
+        }
+        if (it->second->text != u.text) changes.push_back({ '~', file, it->second, &u });
+        old.erase(it);
+    }
+    for (const auto& u : before) {
+        if (old.count(keyOf(u))) changes.push_back({ '-', file, &u, nullptr });
+    }
+}
+
+/** unitId(file, unit): stable identifier of a unit */
+static std::string unitId(const std::string& file, const DefineUnit& u)
+{
+    std::string key = file + '\0' + u.define + '\0' + u.key;
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%c%08llx", u.function ? 'F' : 'B',
+        (unsigned long long)(hashBytes(key.data(), key.size()) & 0xffffffffULL));
+    return buf;
+}
+
+/** treeFiles(root, rel): the sources of a tree with their relative paths */
+static FileList treeFiles(const fs::path& root, std::vector<std::string>& rel)
+{
+    FileList files = findSourceFiles(root);
+    const std::string rootText = root.string();
+    rel.clear();
+    for (FileId f : files) {
+        std::string r = g_files.path(f).substr(rootText.size());
+        std::replace(r.begin(), r.end(), '\\', '/');
+        r.erase(0, r.find_first_not_of('/'));
+        rel.push_back(std::move(r));
+    }
+    return files;
+}
+
+/** runTreeComparison(oldRoot, newRoot):
+ *   Writes Output/COMPARE_<old>_<new>.txt listing per define
+ *   the blocks and functions added, removed or modified.
+ */
+bool runTreeComparison(const fs::path& oldRoot, const fs::path& newRoot)
+{
+    auto startTime = high_resolution_clock::now();
+    std::vector<std::string> oldRel, newRel;
+    FileList oldFiles = treeFiles(oldRoot, oldRel);
+    FileList newFiles = treeFiles(newRoot, newRel);
+    if (oldFiles.empty() && newFiles.empty()) {
+        std::cerr << "No .cpp/.h files found in " << oldRoot.string() << " or " << newRoot.string() << ".\n";
+        return false;
+    }
+
+    // archives usually wrap the tree in one top folder ("client-1.2/...");
+    // drop such a folder on either side if that pairs more files
+    auto topFolderLength = [](const std::vector<std::string>& rel) -> size_t {
+        if (rel.empty()) return 0;
+        size_t slash = rel[0].find('/');
+        if (slash == std::string::npos) return 0;
+        for (const auto& r : rel) {
+            if (r.size() <= slash || r.compare(0, slash + 1, rel[0], 0, slash + 1) != 0) return 0;
+        }
+        return slash + 1;
+    };
+    size_t oldTop = topFolderLength(oldRel), newTop = topFolderLength(newRel);
+    size_t bestMatches = 0, bestCut[2] = { 0, 0 };
+    for (size_t oldCut : { (size_t)0, oldTop }) {
+        for (size_t newCut : { (size_t)0, newTop }) {
+            std::unordered_set<std::string> names;
+            for (const auto& r : oldRel) names.insert(r.substr(oldCut));
+            size_t matches = 0;
+            for (const auto& r : newRel) matches += names.count(r.substr(newCut));
+            if (matches > bestMatches) {
+                bestMatches = matches;
+                bestCut[0] = oldCut;
+                bestCut[1] = newCut;
+            }
+        }
+    }
+    for (auto& r : oldRel) r.erase(0, bestCut[0]);
+    for (auto& r : newRel) r.erase(0, bestCut[1]);
+
+    // pair by relative path
+    std::map<std::string, std::pair<size_t, size_t>> pairs;
+    for (size_t i = 0; i < oldFiles.size(); ++i) pairs[oldRel[i]] = { i, SIZE_MAX };
+    for (size_t i = 0; i < newFiles.size(); ++i) {
+        auto it = pairs.emplace(newRel[i], std::make_pair(SIZE_MAX, i)).first;
+        it->second.second = i;
+    }
+    std::vector<FileStat> oldStats = statFiles(oldFiles);
+    std::vector<FileStat> newStats = statFiles(newFiles);
+
+    // equal sizes: compare content hashes
+    FileList hashFiles;
+    std::vector<FileStat> hashStats;
+    for (const auto& p : pairs) {
+        size_t o = p.second.first, n = p.second.second;
+        if (o == SIZE_MAX || n == SIZE_MAX || oldStats[o].size != newStats[n].size) continue;
+        hashFiles.push_back(oldFiles[o]);
+        hashStats.push_back(oldStats[o]);
+        hashFiles.push_back(newFiles[n]);
+        hashStats.push_back(newStats[n]);
+    }
+    std::vector<uint64_t> hashes;
+    contentHashes(hashFiles, hashStats, hashes, true);
+    std::unordered_map<FileId, uint64_t> hashOf;
+    for (size_t i = 0; i < hashFiles.size(); ++i) hashOf[hashFiles[i]] = hashes[i];
+
+    size_t identical = 0, changedFiles = 0, added = 0, removed = 0;
+    std::vector<const std::string*> parseNames;   // relative path per pair to parse
+    std::vector<std::pair<size_t, size_t>> parsePairs;
+    for (const auto& p : pairs) {
+        size_t o = p.second.first, n = p.second.second;
+        if (o != SIZE_MAX && n != SIZE_MAX) {
+            auto ho = hashOf.find(oldFiles[o]);
+            auto hn = hashOf.find(newFiles[n]);
+            if (ho != hashOf.end() && hn != hashOf.end() && ho->second != 0 && ho->second == hn->second) {
+                identical++;
+                continue;
+            }
+            changedFiles++;
+        }
+        else if (o == SIZE_MAX) added++;
+        else removed++;
+        parseNames.push_back(&p.first);
+        parsePairs.push_back(p.second);
+    }
+
+    // scan only what differs
+    std::vector<FileId> toScan;
+    std::vector<std::pair<size_t, size_t>> slots(parsePairs.size(), { SIZE_MAX, SIZE_MAX });
+    for (size_t k = 0; k < parsePairs.size(); ++k) {
+        if (parsePairs[k].first != SIZE_MAX) {
+            slots[k].first = toScan.size();
+            toScan.push_back(oldFiles[parsePairs[k].first]);
+        }
+        if (parsePairs[k].second != SIZE_MAX) {
+            slots[k].second = toScan.size();
+            toScan.push_back(newFiles[parsePairs[k].second]);
+        }
+    }
+    std::cout << "Comparing " << pairs.size() << " file(s): " << identical << " identical, parsing "
+        << toScan.size() << "...\n";
+    std::vector<std::vector<DefineUnit>> units(toScan.size());
+    std::atomic<size_t> doneFiles{ 0 };
+    runParallel(toScan.size(), [&](size_t i) {
+        TraceSpan span("parse", toScan[i]);
+        std::vector<std::string> lines;
+        readBufferedFile(g_files.path(toScan[i]), lines);
+        units[i] = collectDefineUnits(scanCppLines(std::move(lines)));
+        printProgress(doneFiles.fetch_add(1, std::memory_order_relaxed) + 1, toScan.size());
+    });
+    if (!toScan.empty()) std::cout << "\n";
+
+    std::vector<UnitChange> changes;
+    const std::vector<DefineUnit> none;
+    for (size_t k = 0; k < parsePairs.size(); ++k) {
+        diffDefineUnits(*parseNames[k],
+            slots[k].first == SIZE_MAX ? none : units[slots[k].first],
+            slots[k].second == SIZE_MAX ? none : units[slots[k].second], changes);
+    }
+    std::stable_sort(changes.begin(), changes.end(), [](const UnitChange& a, const UnitChange& b) {
+        const DefineUnit& ua = a.newUnit ? *a.newUnit : *a.oldUnit;
+        const DefineUnit& ub = b.newUnit ? *b.newUnit : *b.oldUnit;
+        return ua.define < ub.define;
+    });
+
+    std::ostringstream out;
+    out << "Comparing " << oldRoot.string() << " -> " << newRoot.string() << "\n";
+    out << "--- SUMMARY: " << pairs.size() << " file(s), " << identical << " identical, " << changedFiles
+        << " changed, " << added << " added, " << removed << " removed; " << changes.size() << " unit change(s) ---\n";
+    for (size_t c = 0; c < changes.size(); ) {
+        const DefineUnit& first = changes[c].newUnit ? *changes[c].newUnit : *changes[c].oldUnit;
+        size_t e = c;
+        size_t counts[3] = { 0, 0, 0 };
+        for (; e < changes.size(); ++e) {
+            const DefineUnit& u = changes[e].newUnit ? *changes[e].newUnit : *changes[e].oldUnit;
+            if (u.define != first.define) break;
+            counts[changes[e].op == '+' ? 0 : changes[e].op == '-' ? 1 : 2]++;
+        }
+        out << "\n=== " << first.define << " (" << counts[0] << " added, " << counts[1] << " removed, "
+            << counts[2] << " modified) ===\n";
+        for (; c < e; ++c) {
+            const UnitChange& ch = changes[c];
+            const DefineUnit& u = ch.newUnit ? *ch.newUnit : *ch.oldUnit;
+            out << ch.op << " " << unitId(ch.file, u) << " " << (u.function ? "function " : "block    ")
+                << ch.file << ":";
+            if (ch.oldUnit && ch.newUnit && ch.oldUnit->line != ch.newUnit->line) {
+                out << (ch.oldUnit->line + 1) << "->";
+            }
+            out << (u.line + 1) << "  " << u.label << "\n";
+            if (!u.function) {
+                std::istringstream text(u.text);
+                std::string line;
+                while (std::getline(text, line)) out << "    " << line << "\n";
+            }
+        }
+    }
+
+    std::error_code ec;
+    fs::create_directories("Output", ec);
+    auto labelOf = [](const fs::path& root) {
+        std::string label = root.filename().string();
+        if (label.empty()) label = root.parent_path().filename().string();
+        return sanitizeFileName(label);
+    };
+    const std::string outName = "Output/COMPARE_" + labelOf(oldRoot) + "_" + labelOf(newRoot) + ".txt";
+    writeFileIfChanged(outName, out.str());
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+    std::cout << changedFiles << " changed, " << added << " added, " << removed << " removed file(s); "
+        << changes.size() << " block/function change(s) in " << ms << " ms - see '" << outName << "'\n";
+    return true;
+}
+
+/*******************************************************
+ * Identifier index
+ *
+ *  Every C++ and Python file of the configured roots is
+ *  tokenized once (comments skipped, string contents kept)
+ *  and each identifier maps to a posting list of (file, line,
+ *  enclosing function). The postings are varint/delta encoded
+ *  and stored next to a sorted, fixed-width identifier table
+ *  in Output/IDENTIFIER_INDEX.bin, together with the span and
+ *  name of every function. Queries map that file into memory
+ *  and binary-search it; nothing is loaded up front.
+ *
+ *  Rebuilds re-tokenize only files whose size or modification
+ *  time changed. The postings of all other files are copied
+ *  over from the previous index, and the index file is then
+ *  written anew: the packed, sorted layout has no room for
+ *  in-place updates.
+ *******************************************************/
+static const char INDEX_MAGIC[8] = { 'D', 'E', 'X', 'I', 'D', 'X', '\r', '\n' };
+static const uint32_t INDEX_VERSION = 2;
+static const char* const INDEX_FILE = "Output/IDENTIFIER_INDEX.bin";
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fileCount;
+    uint64_t identCount;
+    uint64_t filesOffset;
+    uint64_t identsOffset;
+    uint64_t namesOffset;
+    uint64_t postingsOffset;
+};
+
+/** One entry of the sorted identifier table */
+struct IndexIdent {
+    uint64_t postingsOffset;   // relative to IndexHeader::postingsOffset
+    uint32_t nameOffset;       // relative to IndexHeader::namesOffset
+    uint32_t nameLength;
+    uint32_t postingsBytes;
+    uint32_t postingCount;
+};
+
+struct IndexedFile {
+    ScanSide side = ScanSide::Client;
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> functions; // (head line, end line)
+    std::vector<std::string> functionNames;               // e.g. "CItem::Use"
+};
+
+struct IndexPosting {
+    uint32_t file = 0;
+    uint32_t line = 0;
+    uint32_t function = 0;     // 1-based into IndexedFile::functions, 0 = none
+};
+
+static void putVarint(std::string& out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static bool getVarint(const char*& p, const char* end, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = (uint8_t)*p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+/** MappedIndex:
+ *   Read-only view of the index file: mmap on Linux, a plain
+ *   read into memory elsewhere.
+ */
+class MappedIndex {
+public:
+    MappedIndex() = default;
+    MappedIndex(const MappedIndex&) = delete;
+    MappedIndex& operator=(const MappedIndex&) = delete;
+    ~MappedIndex() { close(); }
+
+    bool open(const std::string& path)
+    {
+        close();
+#ifdef __linux__
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                m_map = p;
+                m_data = (const char*)p;
+                m_size = (size_t)st.st_size;
+            }
+        }
+        ::close(fd);
+        return m_data != nullptr;
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+        m_buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+        return m_size > 0;
+#endif
+    }
+
+    void close()
+    {
+#ifdef __linux__
+        if (m_map) ::munmap(m_map, m_size);
+        m_map = nullptr;
+#endif
+        std::string().swap(m_buffer);
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    void* m_map = nullptr;
+    std::string m_buffer;
+};
+
+struct IdentifierIndex {
+    MappedIndex map;
+    IndexHeader header{};
+    std::vector<IndexedFile> files;
+};
+
+/** loadIdentifierIndex(path, index):
+ *   Maps the index and decodes its file table. False if the
+ *   file is missing, from another version or damaged.
+ */
+bool loadIdentifierIndex(const std::string& path, IdentifierIndex& index)
+{
+    index.files.clear();
+    if (!index.map.open(path)) return false;
+    const char* base = index.map.data();
+    size_t size = index.map.size();
+    IndexHeader& h = index.header;
+    if (size < sizeof(IndexHeader)) return false;
+    std::memcpy(&h, base, sizeof(IndexHeader));
+    if (std::memcmp(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || h.version != INDEX_VERSION) return false;
+    if (h.filesOffset > h.identsOffset || h.identsOffset > h.namesOffset
+        || h.namesOffset > h.postingsOffset || h.postingsOffset > size
+        || h.identCount > (h.namesOffset - h.identsOffset) / sizeof(IndexIdent)
+        || h.fileCount > (h.identsOffset - h.filesOffset) / 5) {   // 5 varints per file at least
+        return false;
+    }
+
+    const char* p = base + h.filesOffset;
+    const char* end = base + h.identsOffset;
+    index.files.resize(h.fileCount);
+    for (auto& f : index.files) {
+        uint64_t side, fsize, mtime, pathLength, functionCount;
+        if (!getVarint(p, end, side) || !getVarint(p, end, fsize) || !getVarint(p, end, mtime)
+            || !getVarint(p, end, pathLength) || pathLength > (uint64_t)(end - p)) {
+            return false;
+        }
+        f.side = (ScanSide)side;
+        f.size = fsize;
+        f.mtime = (int64_t)mtime;
+        f.path.assign(p, (size_t)pathLength);
+        p += pathLength;
+        if (!getVarint(p, end, functionCount) || functionCount > (uint64_t)(end - p)) return false;
+        uint64_t head = 0;
+        for (uint64_t k = 0; k < functionCount; ++k) {
+            uint64_t headDelta, length, nameLength;
+            if (!getVarint(p, end, headDelta) || !getVarint(p, end, length)
+                || !getVarint(p, end, nameLength) || nameLength > (uint64_t)(end - p)) {
+                return false;
+            }
+            head += headDelta;
+            f.functions.emplace_back((uint32_t)head, (uint32_t)(head + length));
+            f.functionNames.emplace_back(p, (size_t)nameLength);
+            p += nameLength;
+        }
+    }
+    return true;
+}
+
+static IndexIdent indexIdentAt(const IdentifierIndex& index, uint64_t i)
+{
+    IndexIdent e;
+    std::memcpy(&e, index.map.data() + index.header.identsOffset + i * sizeof(IndexIdent), sizeof(IndexIdent));
+    return e;
+}
+
+static std::string indexIdentName(const IdentifierIndex& index, const IndexIdent& e)
+{
+    const char* names = index.map.data() + index.header.namesOffset;
+    size_t limit = (size_t)(index.header.postingsOffset - index.header.namesOffset);
+    if ((size_t)e.nameOffset + e.nameLength > limit) return std::string();
+    return std::string(names + e.nameOffset, e.nameLength);
+}
+
+static bool decodePostings(const IdentifierIndex& index, const IndexIdent& e, std::vector<IndexPosting>& out)
+{
+    size_t limit = index.map.size() - (size_t)index.header.postingsOffset;
+    if (e.postingsOffset > limit || e.postingsBytes > limit - e.postingsOffset) return false;
+    const char* p = index.map.data() + index.header.postingsOffset + e.postingsOffset;
+    const char* end = p + e.postingsBytes;
+    uint64_t file = 0, line = 0;
+    for (uint32_t k = 0; k < e.postingCount; ++k) {
+        uint64_t fileDelta, lineDelta, function;
+        if (!getVarint(p, end, fileDelta) || !getVarint(p, end, lineDelta) || !getVarint(p, end, function)) {
+            return false;
+        }
+        if (fileDelta != 0) line = 0;
+        file += fileDelta;
+        line += lineDelta;
+        if (file >= index.files.size()) return false;
+        out.push_back({ (uint32_t)file, (uint32_t)line, (uint32_t)function });
+    }
+    return true;
+}
+
+/** lookupIdentifier(index, name, out):
+ *   Binary search over the mapped identifier table.
+ */
+bool lookupIdentifier(const IdentifierIndex& index, const std::string& name, std::vector<IndexPosting>& out)
+{
+    uint64_t lo = 0, hi = index.header.identCount;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        IndexIdent e = indexIdentAt(index, mid);
+        int cmp = indexIdentName(index, e).compare(name);
+        if (cmp == 0) return decodePostings(index, e, out);
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+/** Keywords that would only bloat the index */
+static const std::unordered_set<std::string> indexStopWords = {
+    "auto", "bool", "break", "case", "char", "class", "const", "continue", "default", "delete",
+    "do", "double", "else", "enum", "false", "float", "for", "if", "int", "long", "namespace",
+    "new", "nullptr", "private", "protected", "public", "return", "short", "signed", "sizeof",
+    "static", "struct", "switch", "this", "true", "typedef", "unsigned", "void", "while",
+    "and", "as", "def", "elif", "except", "import", "in", "is", "not", "or", "pass", "self",
+    "try", "None", "True", "False"
+};
+
+static void appendIdentifiers(const std::string& line, size_t begin, size_t end, std::vector<std::string>& out)
+{
+    size_t i = begin;
+    while (i < end) {
+        char c = line[i];
+        if (std::isdigit((unsigned char)c)) {
+            while (i < end && (isWordChar(line[i]) || line[i] == '.')) i++;
+        }
+        else if (isWordChar(c)) {
+            size_t s = i;
+            while (i < end && isWordChar(line[i])) i++;
+            out.emplace_back(line, s, i - s);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+struct TokenizerState {
+    bool inBlockComment = false;  // C++ /* ... */
+    char tripleQuote = 0;         // Python ''' or """
+};
+
+/** tokenizeSourceLine(line, python, state, out):
+ *   Appends the identifiers of one line. Comments are skipped,
+ *   string literals are tokenized too (bindings and quest code
+ *   name features in strings). 'state' carries block comments
+ *   and triple-quoted strings over to the next line.
+ */
+static void tokenizeSourceLine(const std::string& line, bool python,
+    TokenizerState& state, std::vector<std::string>& out)
+{
+    size_t i = 0, n = line.size();
+    while (i < n) {
+        if (state.inBlockComment) {
+            size_t e = line.find("*/", i);
+            if (e == std::string::npos) return;
+            state.inBlockComment = false;
+            i = e + 2;
+            continue;
+        }
+        if (state.tripleQuote) {
+            size_t e = line.find(std::string(3, state.tripleQuote), i);
+            appendIdentifiers(line, i, e == std::string::npos ? n : e, out);
+            if (e == std::string::npos) return;
+            state.tripleQuote = 0;
+            i = e + 3;
+            continue;
+        }
+
+        char c = line[i];
+        if (python ? c == '#' : (c == '/' && i + 1 < n && line[i + 1] == '/')) return;
+        if (!python && c == '/' && i + 1 < n && line[i + 1] == '*') {
+            state.inBlockComment = true;
+            i += 2;
+            continue;
+        }
+        if (c == '"' || c == '\'') {
+            if (python && line.compare(i, 3, std::string(3, c)) == 0) {
+                state.tripleQuote = c;
+                i += 3;
+                continue;
+            }
+            size_t j = i + 1;
+            while (j < n && line[j] != c) j += (line[j] == '\\') ? 2 : 1;
+            appendIdentifiers(line, i + 1, std::min(j, n), out);
+            i = j + 1;
+            continue;
+        }
+
+        size_t s = i;
+        while (i < n && line[i] != '"' && line[i] != '\'' && line[i] != '#' && line[i] != '/') i++;
+        if (i == s) i++;
+        appendIdentifiers(line, s, i, out);
+    }
+}
+
+/** Occurrences found in one (re-)tokenized file */
+struct FileIndexData {
+    std::vector<std::pair<uint32_t, uint32_t>> functions;
+    std::vector<std::string> functionNames;
+    std::vector<std::pair<std::string, IndexPosting>> occurrences; // posting.file is filled in later
+};
+
+/** pythonFunctionSpans(scan):
+ *   def lines and the last line of their indented body.
+ */
+static std::vector<std::pair<uint32_t, uint32_t>> pythonFunctionSpans(const PythonFileScan& scan)
+{
+    std::vector<std::pair<uint32_t, uint32_t>> spans;
+    const auto& L = scan.lines;
+    for (size_t i = 0; i < L.size(); ++i) {
+        if (!scan.isDef[i]) continue;
+        size_t last = i;
+        for (size_t j = i + 1; j < L.size(); ++j) {
+            if (trimCopy(L[j]).empty()) continue;
+            if (scan.indent[j] <= scan.indent[i]) break;
+            last = j;
+        }
+        spans.emplace_back((uint32_t)i, (uint32_t)last);
+    }
+    return spans;
+}
+
+/** indexSourceLines(task, lines, data, large):
+ *   Tokenizes one file and attributes each line to its
+ *   innermost enclosing function.
+ */
+void indexSourceLines(const SourceScanTask& task, std::vector<std::string>& lines,
+    FileIndexData& data, bool large)
+{
+    bool python = task.side == ScanSide::Python;
+    CppFileScan cpp;
+    PythonFileScan py;
+    const std::vector<std::string>* L;
+    if (python) {
+        py = scanPythonLines(std::move(lines));
+        data.functions = pythonFunctionSpans(py);
+        L = &py.lines;
+    }
+    else {
+        cpp = large ? scanCppLinesParallel(std::move(lines)) : scanCppLines(std::move(lines));
+        for (const auto& fn : cpp.functions) {
+            data.functions.emplace_back((uint32_t)fn.headLine, (uint32_t)fn.endLine);
+        }
+        L = &cpp.lines;
+    }
+    for (const auto& fn : data.functions) {
+        data.functionNames.push_back(fn.first < L->size() ? functionName((*L)[fn.first]) : std::string());
+    }
+
+    // later (inner) spans overwrite earlier ones
+    std::vector<uint32_t> lineFunction(L->size(), 0);
+    for (size_t k = 0; k < data.functions.size(); ++k) {
+        for (uint32_t l = data.functions[k].first; l <= data.functions[k].second && l < L->size(); ++l) {
+            lineFunction[l] = (uint32_t)(k + 1);
+        }
+    }
+
+    TokenizerState state;
+    std::vector<std::string> tokens;
+    for (size_t i = 0; i < L->size(); ++i) {
+        tokens.clear();
+        tokenizeSourceLine((*L)[i], python, state, tokens);
+        std::sort(tokens.begin(), tokens.end());
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+        for (auto& t : tokens) {
+            if (indexStopWords.count(t)) continue;
+            IndexPosting posting;
+            posting.line = (uint32_t)i;
+            posting.function = lineFunction[i];
+            data.occurrences.emplace_back(std::move(t), posting);
+        }
+    }
+}
+
+void indexWorker(FileFeed& feed,
+    ConcurrencyControl& ctl,
+    size_t worker,
+    const std::vector<SourceScanTask>& tasks,
+    std::vector<FileIndexData>& slots,
+    std::atomic<size_t>& doneFiles,
+    size_t totalFiles)
+{
+    pinWorkerThread(worker);
+    traceThreadName("parser");
+    size_t idx = 0;
+    std::vector<std::string> lines;
+    while (nextControlledFile(feed, ctl, worker, idx, lines)) {
+        TraceSpan parse("parse", (*feed.files)[idx]);
+        auto busyFrom = beginWork(ctl, worker);
+        indexSourceLines(tasks[idx], lines, slots[idx], false);
+        reportWork(ctl, worker, feed.stats[idx].size, std::chrono::steady_clock::now() - busyFrom);
+        size_t done = doneFiles.fetch_add(1, std::memory_order_relaxed) + 1;
+        printProgress(done, totalFiles);
+    }
+}
+
+/** writeIdentifierIndex(path, files, postings):
+ *   Serializes the index to 'path' via a temporary file, so a
+ *   reader never sees a half-written index.
+ */
+static bool writeIdentifierIndex(const std::string& path,
+    const std::vector<IndexedFile>& files,
+    std::vector<std::pair<std::string, std::vector<IndexPosting>>>& postings)
+{
+    std::string fileBlob;
+    for (const auto& f : files) {
+        putVarint(fileBlob, (uint64_t)f.side);
+        putVarint(fileBlob, f.size);
+        putVarint(fileBlob, (uint64_t)f.mtime);
+        putVarint(fileBlob, f.path.size());
+        fileBlob += f.path;
+        putVarint(fileBlob, f.functions.size());
+        uint32_t prevHead = 0;
+        for (size_t k = 0; k < f.functions.size(); ++k) {
+            const auto& fn = f.functions[k];
+            const std::string name = k < f.functionNames.size() ? f.functionNames[k] : std::string();
+            putVarint(fileBlob, fn.first - prevHead);
+            putVarint(fileBlob, fn.second - fn.first);
+            putVarint(fileBlob, name.size());
+            fileBlob += name;
+            prevHead = fn.first;
+        }
+    }
+    while (fileBlob.size() % 8) fileBlob.push_back('\0');
+
+    std::string identBlob, nameBlob, postingBlob;
+    identBlob.reserve(postings.size() * sizeof(IndexIdent));
+    for (auto& entry : postings) {
+        auto& list = entry.second;
+        std::sort(list.begin(), list.end(), [](const IndexPosting& a, const IndexPosting& b) {
+            return a.file != b.file ? a.file < b.file : a.line < b.line;
+        });
+        IndexIdent e;
+        e.postingsOffset = postingBlob.size();
+        e.nameOffset = (uint32_t)nameBlob.size();
+        e.nameLength = (uint32_t)entry.first.size();
+        e.postingCount = (uint32_t)list.size();
+        uint32_t file = 0, line = 0;
+        for (const auto& p : list) {
+            putVarint(postingBlob, p.file - file);
+            if (p.file != file) line = 0;
+            putVarint(postingBlob, p.line - line);
+            putVarint(postingBlob, p.function);
+            file = p.file;
+            line = p.line;
+        }
+        e.postingsBytes = (uint32_t)(postingBlob.size() - e.postingsOffset);
+        nameBlob += entry.first;
+        identBlob.append((const char*)&e, sizeof(IndexIdent));
+    }
+
+    IndexHeader h{};
+    std::memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    h.version = INDEX_VERSION;
+    h.fileCount = (uint32_t)files.size();
+    h.identCount = postings.size();
+    h.filesOffset = sizeof(IndexHeader);
+    h.identsOffset = h.filesOffset + fileBlob.size();
+    h.namesOffset = h.identsOffset + identBlob.size();
+    h.postingsOffset = h.namesOffset + nameBlob.size();
+
+    fs::create_directory("Output");
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write((const char*)&h, sizeof(h));
+        out << fileBlob << identBlob << nameBlob << postingBlob;
+        if (!out) {
+            std::cerr << "Could not write " << tmp << ".\n";
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        std::cerr << "Could not replace " << path << ": " << ec.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+/** buildIdentifierIndex(tasks):
+ *   Brings Output/IDENTIFIER_INDEX.bin up to date with the
+ *   given files, re-tokenizing only new or changed ones.
+ */
+bool buildIdentifierIndex(const std::vector<SourceScanTask>& tasks)
+{
+    auto startTime = high_resolution_clock::now();
+
+    FileList names;
+    names.reserve(tasks.size());
+    for (const auto& task : tasks) names.push_back(task.file);
+    std::vector<FileStat> stats = statFiles(names);
+
+    // file ids follow the (sorted) task order
+    std::vector<IndexedFile> files(tasks.size());
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        files[i].side = tasks[i].side;
+        files[i].path = g_files.path(tasks[i].file);
+        files[i].size = stats[i].size;
+        files[i].mtime = stats[i].mtime;
+    }
+
+    // carry unchanged files over from the previous index
+    std::unordered_map<std::string, std::vector<IndexPosting>> postings;
+    std::vector<char> reused(tasks.size(), 0);
+    {
+        IdentifierIndex old;
+        if (loadIdentifierIndex(INDEX_FILE, old)) {
+            std::unordered_map<std::string, size_t> byPath;
+            for (size_t i = 0; i < files.size(); ++i) byPath.emplace(files[i].path, i);
+            std::vector<int64_t> remap(old.files.size(), -1);
+            for (size_t k = 0; k < old.files.size(); ++k) {
+                auto it = byPath.find(old.files[k].path);
+                if (it == byPath.end()) continue;
+                IndexedFile& f = files[it->second];
+                if (old.files[k].size != f.size || old.files[k].mtime != f.mtime || old.files[k].side != f.side) continue;
+                f.functions = old.files[k].functions;
+                f.functionNames = old.files[k].functionNames;
+                remap[k] = (int64_t)it->second;
+                reused[it->second] = 1;
+            }
+            std::vector<IndexPosting> list;
+            for (uint64_t i = 0; i < old.header.identCount; ++i) {
+                IndexIdent e = indexIdentAt(old, i);
+                list.clear();
+                if (!decodePostings(old, e, list)) continue;
+                std::vector<IndexPosting>* target = nullptr;
+                for (auto p : list) {
+                    if (remap[p.file] < 0) continue;
+                    if (!target) target = &postings[indexIdentName(old, e)];
+                    p.file = (uint32_t)remap[p.file];
+                    target->push_back(p);
+                }
+            }
+        }
+    }
+
+    // identical copies among the changed files are tokenized once
+    FileList changedFiles;
+    std::vector<FileStat> changedStats;
+    std::vector<uint8_t> changedKinds;
+    std::vector<size_t> changedAt;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (reused[i]) continue;
+        changedFiles.push_back(names[i]);
+        changedStats.push_back(stats[i]);
+        changedKinds.push_back(tasks[i].side == ScanSide::Python);
+        changedAt.push_back(i);
+    }
+    std::vector<uint64_t> hashes;
+    contentHashes(changedFiles, changedStats, hashes, false);
+    DuplicateFiles dups = findDuplicateFiles(changedStats, hashes, &changedKinds);
+    reportDuplicates(dups);
+    std::vector<size_t> copyOf(tasks.size());
+    std::iota(copyOf.begin(), copyOf.end(), 0);
+    for (size_t k = 0; k < changedAt.size(); ++k) copyOf[changedAt[k]] = changedAt[dups.source[k]];
+
+    std::vector<size_t> pending;
+    std::vector<FileIndexData> slots(tasks.size());
+    std::atomic<size_t> doneFiles{ dups.count };
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (reused[i] || copyOf[i] != i) continue;
+        if (tasks[i].side != ScanSide::Python && stats[i].size >= LARGE_FILE_BYTES) {
+            std::vector<std::string> lines;
+            readLinesChunkedParallel(g_files.path(tasks[i].file), lines);
+            indexSourceLines(tasks[i], lines, slots[i], true);
+            doneFiles++;
+        }
+        else {
+            pending.push_back(i);
+        }
+    }
+    size_t changed = changedAt.size();
+    std::cout << "Indexing " << changed << " new or changed file(s), "
+        << (tasks.size() - changed) << " unchanged...\n";
+
+    size_t numThreads = std::min<size_t>(workerThreadLimit(), pending.size());
+    ConcurrencyControl ctl;
+    startConcurrencyControl(ctl, numThreads);
+    FileFeed feed;
+    feed.control = &ctl;
+    startFileFeed(feed, names, std::move(stats), pending);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back(indexWorker,
+            std::ref(feed),
+            std::ref(ctl),
+            t,
+            std::cref(tasks),
+            std::ref(slots),
+            std::ref(doneFiles),
+            changed);
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    finishFileFeed(feed);
+    if (changed > 0) {
+        printProgress(changed, changed);
+        std::cout << "\n";
+    }
+    stopConcurrencyControl(ctl);
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (copyOf[i] != i) slots[i] = slots[copyOf[i]];
+    }
+
+    size_t postingCount = 0;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (reused[i]) continue;
+        files[i].functions = std::move(slots[i].functions);
+        files[i].functionNames = std::move(slots[i].functionNames);
+        for (auto& occ : slots[i].occurrences) {
+            occ.second.file = (uint32_t)i;
+            postings[occ.first].push_back(occ.second);
+        }
+        std::vector<std::pair<std::string, IndexPosting>>().swap(slots[i].occurrences);
+    }
+
+    std::vector<std::pair<std::string, std::vector<IndexPosting>>> sorted;
+    sorted.reserve(postings.size());
+    for (auto& kv : postings) {
+        postingCount += kv.second.size();
+        sorted.emplace_back(kv.first, std::move(kv.second));
+    }
+    postings.clear();
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    if (!writeIdentifierIndex(INDEX_FILE, files, sorted)) return false;
+
+    std::error_code ec;
+    uintmax_t bytes = fs::file_size(INDEX_FILE, ec);
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+    std::cout << "Index: " << files.size() << " file(s), " << sorted.size() << " identifier(s), "
+        << postingCount << " posting(s), " << (bytes >> 10) << " KiB - built in " << ms << " ms\n";
+    return true;
+}
+
+/** isQualifiedUse(line, query):
+ *   True if 'line' spells out the qualified name 'query'
+ *   (A::B, blanks around :: allowed) as a whole identifier.
+ */
+static bool isQualifiedUse(const std::string& line, const std::string& query)
+{
+    std::string compact;
+    compact.reserve(line.size());
+    for (size_t i = 0; i < line.size(); ++i) {
+        if (isSpaceChar(line[i])) {
+            size_t j = line.find_first_not_of(" \t", i);
+            bool nearColon = (!compact.empty() && compact.back() == ':') || (j != std::string::npos && line[j] == ':');
+            if (nearColon) continue;
+        }
+        compact += line[i];
+    }
+    for (size_t pos = compact.find(query); pos != std::string::npos; pos = compact.find(query, pos + 1)) {
+        size_t end = pos + query.size();
+        if ((pos == 0 || !isWordChar(compact[pos - 1])) && (end == compact.size() || !isWordChar(compact[end]))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** queryIdentifierIndex(name):
+ *   Looks 'name' up and writes Output/SYMBOL_<name>.txt with
+ *   every hit and each enclosing function once. Qualified names
+ *   (A::B) are looked up by their last component; a hit is kept
+ *   if its line spells out A::B or it lies in a member function
+ *   of A, where B needs no qualification.
+ */
+bool queryIdentifierIndex(const std::string& query)
+{
+    IdentifierIndex index;
+    if (!loadIdentifierIndex(INDEX_FILE, index)) {
+        std::cerr << "No usable index in " << INDEX_FILE << " - build it first.\n";
+        return false;
+    }
+
+    std::string name = query;
+    std::string qualifier;
+    size_t colons = name.rfind("::");
+    if (colons != std::string::npos) {
+        qualifier = name.substr(0, colons);
+        name = name.substr(colons + 2);
+    }
+
+    auto startTime = high_resolution_clock::now();
+    std::vector<IndexPosting> hits;
+    lookupIdentifier(index, name, hits);
+    auto us = duration_cast<microseconds>(high_resolution_clock::now() - startTime).count();
+
+    // one group per file, with its current lines
+    struct HitFile {
+        uint32_t file = 0;
+        std::vector<std::string> lines;
+        std::vector<IndexPosting> hits;
+    };
+    std::vector<HitFile> groups;
+    size_t unqualified = hits.size();
+    for (size_t k = 0; k < hits.size(); ) {
+        HitFile g;
+        g.file = hits[k].file;
+        const IndexedFile& f = index.files[g.file];
+        readBufferedFile(f.path, g.lines);
+        for (; k < hits.size() && hits[k].file == g.file; ++k) {
+            const IndexPosting& p = hits[k];
+            if (!qualifier.empty()) {
+                bool member = p.function && p.function <= f.functionNames.size()
+                    && f.functionNames[p.function - 1].compare(0, qualifier.size() + 2, qualifier + "::") == 0;
+                if (!member && (p.line >= g.lines.size() || !isQualifiedUse(g.lines[p.line], query))) continue;
+            }
+            g.hits.push_back(p);
+        }
+        if (!g.hits.empty()) groups.push_back(std::move(g));
+    }
+    size_t hitCount = 0;
+    for (const auto& g : groups) hitCount += g.hits.size();
+
+    std::cout << "'" << query << "': " << hitCount << " hit(s) in " << groups.size()
+        << " file(s), lookup took " << us << " us";
+    if (!qualifier.empty()) std::cout << " (" << unqualified << " for '" << name << "')";
+    std::cout << "\n";
+    if (groups.empty()) return true;
+
+    fs::create_directory("Output");
+    std::string outName = "Output/SYMBOL_" + sanitizeFileName(query) + ".txt";
+    std::ofstream out(outName, std::ios::trunc);
+    out << "Identifier: " << query << "\n";
+    if (name != query) out << "Looked up as: " << name << " (" << unqualified << " hit(s), qualified ones kept)\n";
+    out << "Hits: " << hitCount << " in " << groups.size() << " file(s)\n\n";
+
+    FileList hitFiles;
+    for (const auto& g : groups) hitFiles.push_back(g_files.intern(index.files[g.file].path));
+    std::vector<FileStat> current = statFiles(hitFiles);
+
+    const size_t CONSOLE_HITS = 20;
+    size_t shown = 0;
+    for (size_t fileNo = 0; fileNo < groups.size(); ++fileNo) {
+        const HitFile& g = groups[fileNo];
+        const IndexedFile& f = index.files[g.file];
+        const auto& lines = g.lines;
+        bool stale = current[fileNo].size != f.size || current[fileNo].mtime != f.mtime;
+
+        out << "##########\n" << f.path << (stale ? "  (changed since indexing)" : "") << "\n##########\n";
+        std::vector<uint32_t> functionsHit;
+        for (const IndexPosting& p : g.hits) {
+            std::string text = p.line < lines.size() ? trimCopy(lines[p.line]) : std::string();
+            out << "  " << (p.line + 1) << ": " << text << "\n";
+            if (shown < CONSOLE_HITS) {
+                std::cout << "  " << f.path << ":" << (p.line + 1) << ": " << text << "\n";
+                shown++;
+            }
+            if (p.function) functionsHit.push_back(p.function);
+        }
+        // hits may alternate between a nested function and its outer one
+        std::sort(functionsHit.begin(), functionsHit.end());
+        functionsHit.erase(std::unique(functionsHit.begin(), functionsHit.end()), functionsHit.end());
+        out << "\n";
+        for (uint32_t fn : functionsHit) {
+            if (fn > f.functions.size()) continue;
+            auto span = f.functions[fn - 1];
+            if (span.second >= lines.size()) continue;
+            out << makeBlockContent(f.path, lines, span.first, span.second) << "\n";
+        }
+    }
+    if (hitCount > shown) {
+        std::cout << "  ... " << (hitCount - shown) << " more\n";
+    }
+    std::cout << "Written to " << outName << "\n";
+    return true;
+}
+
+/*******************************************************
+ * Call graph and define impact
+ *
+ *  An approximate call graph derived from the identifier
+ *  index: function B calls function A if A's name (its last
+ *  component, "Use" for CItem::Use) occurs inside B. Calls are
+ *  matched within one language only; same-named functions
+ *  (overloads, other classes) are all taken as callees. The
+ *  graph is built once per session and rebuilt only when the
+ *  index changes.
+ *
+ *  The impact of a define are the functions that test it in a
+ *  conditional (#if / if app.X) and their callers, followed up
+ *  to a given depth.
+ *******************************************************/
+static const size_t DEFAULT_IMPACT_DEPTH = 3;
+
+struct GraphFunction {
+    uint32_t file = 0;          // into IdentifierIndex::files
+    uint32_t headLine = 0;      // 0-based
+    std::string name;
+};
+
+struct CallGraph {
+    uint64_t indexSize = 0;     // index file this graph was built from
+    int64_t indexMtime = 0;
+    std::vector<IndexedFile> files;
+    std::vector<GraphFunction> functions;
+    std::vector<size_t> firstFunction;             // per file: id of its first function
+    std::vector<std::vector<uint32_t>> callers;    // per function, sorted
+    size_t edges = 0;
+};
+
+static CallGraph g_callGraph;
+
+/** buildCallGraph(index, graph):
+ *   One index lookup per distinct function name, in parallel.
+ */
+static void buildCallGraph(const IdentifierIndex& index, CallGraph& graph)
+{
+    TraceSpan span("call graph");
+    graph.files = index.files;
+    graph.functions.clear();
+    graph.firstFunction.assign(index.files.size(), 0);
+    std::map<std::string, std::vector<uint32_t>> byName;
+    for (size_t f = 0; f < index.files.size(); ++f) {
+        const IndexedFile& file = index.files[f];
+        graph.firstFunction[f] = graph.functions.size();
+        for (size_t k = 0; k < file.functions.size(); ++k) {
+            GraphFunction fn;
+            fn.file = (uint32_t)f;
+            fn.headLine = file.functions[k].first;
+            fn.name = k < file.functionNames.size() ? file.functionNames[k] : std::string();
+            std::string key = fn.name.substr(fn.name.rfind(':') == std::string::npos ? 0 : fn.name.rfind(':') + 1);
+            if (!key.empty() && !indexStopWords.count(key)) byName[key].push_back((uint32_t)graph.functions.size());
+            graph.functions.push_back(std::move(fn));
+        }
+    }
+
+    std::vector<const std::pair<const std::string, std::vector<uint32_t>>*> names;
+    for (const auto& kv : byName) names.push_back(&kv);
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> found(names.size());   // callee, caller
+    runParallel(names.size(), [&](size_t n) {
+        std::vector<IndexPosting> hits;
+        if (!lookupIdentifier(index, names[n]->first, hits)) return;
+        for (const auto& p : hits) {
+            if (p.function == 0) continue;
+            uint32_t caller = (uint32_t)(graph.firstFunction[p.file] + p.function - 1);
+            bool python = index.files[p.file].side == ScanSide::Python;
+            for (uint32_t callee : names[n]->second) {
+                if (callee == caller || (index.files[graph.functions[callee].file].side == ScanSide::Python) != python) {
+                    continue;
+                }
+                found[n].emplace_back(callee, caller);
+            }
+        }
+    });
+
+    graph.callers.assign(graph.functions.size(), {});
+    for (const auto& list : found) {
+        for (const auto& e : list) graph.callers[e.first].push_back(e.second);
+    }
+    graph.edges = 0;
+    for (auto& list : graph.callers) {
+        std::sort(list.begin(), list.end());
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+        graph.edges += list.size();
+    }
+}
+
+/** currentCallGraph(index):
+ *   The session's call graph, rebuilt if the index changed.
+ */
+static const CallGraph& currentCallGraph(const IdentifierIndex& index)
+{
+    FileStat st = statFiles({ g_files.intern(INDEX_FILE) })[0];
+    if (!g_callGraph.files.empty() && g_callGraph.indexSize == st.size && g_callGraph.indexMtime == st.mtime) {
+        return g_callGraph;
+    }
+    auto startTime = high_resolution_clock::now();
+    buildCallGraph(index, g_callGraph);
+    g_callGraph.indexSize = st.size;
+    g_callGraph.indexMtime = st.mtime;
+    auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - startTime).count();
+    std::cout << "Call graph: " << g_callGraph.functions.size() << " function(s), " << g_callGraph.edges
+        << " call edge(s) - built in " << ms << " ms\n";
+    return g_callGraph;
+}
+
+/** isConditionalUse(line, define, python):
+ *   True if the line tests 'define' - a #if/#ifdef/#ifndef/#elif
+ *   in C++, an app.<define> reference in Python.
+ */
+static bool isConditionalUse(const std::string& line, const std::string& define, bool python)
+{
+    if (python) return line.find("app." + define) != std::string::npos;
+    std::string name = directiveName(line);
+    return name == "if" || name == "ifdef" || name == "ifndef" || name == "elif";
+}
 
-                size_t oldVal2 = processed.fetch_add(1, std::memory_order_relaxed);
-                if ((oldVal2 + 1) % 200 == 0) {
-                    printProgress(oldVal2 + 1, totalLines);
-                }
+/** queryDefineImpact(define, depth):
+ *   Writes Output/IMPACT_<define>.txt: the functions testing
+ *   the define and their callers up to 'depth' levels.
+ */
+bool queryDefineImpact(const std::string& define, size_t depth)
+{
+    IdentifierIndex index;
+    if (!loadIdentifierIndex(INDEX_FILE, index)) {
+        std::cerr << "No usable index in " << INDEX_FILE << " - build it first.\n";
+        return false;
+    }
+    const CallGraph& graph = currentCallGraph(index);
+    auto startTime = high_resolution_clock::now();
 
-                int indentJ = getIndent(nextLine);
-                if (!nextLine.empty() && indentJ <= ifIndent) {
-                    ifs.seekg(pos);
-                    break;
-                }
-                blockContent << nextLine << "\n";
+    std::vector<IndexPosting> hits;
+    lookupIdentifier(index, define, hits);
+    size_t blocks = 0, fileLevel = 0;
+    std::vector<int> level(graph.functions.size(), -1);
+    std::vector<uint32_t> via(graph.functions.size(), 0);
+    std::vector<uint32_t> frontier;
+    for (size_t k = 0; k < hits.size(); ) {
+        size_t kEnd = k;
+        while (kEnd < hits.size() && hits[kEnd].file == hits[k].file) kEnd++;
+        const IndexedFile& f = index.files[hits[k].file];
+        std::vector<std::string> lines;
+        readBufferedFile(f.path, lines);
+        for (; k < kEnd; ++k) {
+            const IndexPosting& p = hits[k];
+            if (p.line >= lines.size() || !isConditionalUse(lines[p.line], define, f.side == ScanSide::Python)) continue;
+            blocks++;
+            if (p.function == 0) {
+                fileLevel++;
+                continue;
             }
+            uint32_t id = (uint32_t)(graph.firstFunction[p.file] + p.function - 1);
+            if (level[id] < 0) {
+                level[id] = 0;
+                frontier.push_back(id);
+            }
+        }
+    }
 
-            CodeBlock cb;
-            cb.filename = filename;
-            cb.content = "##########\n" + filename + "\n##########\n" +
-                blockContent.str();
-            ifBlocks.push_back(cb);
-
-            if (insideFunc) {
-                functionRelevant = true;
+    std::vector<std::vector<uint32_t>> byLevel = { frontier };
+    for (size_t d = 1; d <= depth && !frontier.empty(); ++d) {
+        std::vector<uint32_t> next;
+        for (uint32_t callee : frontier) {
+            for (uint32_t caller : graph.callers[callee]) {
+                if (level[caller] >= 0) continue;
+                level[caller] = (int)d;
+                via[caller] = callee;
+                next.push_back(caller);
             }
         }
+        if (!next.empty()) byLevel.push_back(next);
+        frontier = std::move(next);
     }
+    auto us = duration_cast<microseconds>(high_resolution_clock::now() - startTime).count();
 
-    if (insideFunc && functionRelevant) {
-        CodeBlock cb;
-        cb.filename = filename;
-        cb.content = "##########\n" + filename + "\n##########\n" +
-            currentFunc.str();
-        funcBlocks.push_back(cb);
+    std::ostringstream out;
+    out << "Define: " << define << " (callers followed up to depth " << depth << ")\n";
+    out << "Conditionals: " << blocks << ", " << fileLevel << " of them outside functions\n";
+    size_t total = 0;
+    std::set<uint32_t> files;
+    for (size_t d = 0; d < byLevel.size(); ++d) {
+        auto& list = byLevel[d];
+        std::sort(list.begin(), list.end(), [&](uint32_t a, uint32_t b) {
+            const auto& fa = graph.functions[a];
+            const auto& fb = graph.functions[b];
+            return graph.files[fa.file].path != graph.files[fb.file].path
+                ? graph.files[fa.file].path < graph.files[fb.file].path : fa.headLine < fb.headLine;
+        });
+        out << "\n--- " << (d == 0 ? "functions testing the define" : "depth " + std::to_string(d) + " callers")
+            << " (" << list.size() << ") ---\n";
+        for (uint32_t id : list) {
+            const GraphFunction& fn = graph.functions[id];
+            out << "  " << graph.files[fn.file].path << ":" << (fn.headLine + 1) << "  " << fn.name;
+            if (d > 0) out << "  -> " << graph.functions[via[id]].name;
+            out << "\n";
+            files.insert(fn.file);
+        }
+        total += list.size();
+        std::cout << "  " << (d == 0 ? "testing the define" : "depth " + std::to_string(d) + " callers")
+            << ": " << list.size() << " function(s)\n";
     }
+    out << "\n--- SUMMARY: " << total << " function(s) in " << files.size() << " file(s) ---\n";
 
-    return { ifBlocks, funcBlocks };
+    fs::create_directory("Output");
+    std::string outName = "Output/IMPACT_" + sanitizeFileName(define) + ".txt";
+    writeFileIfChanged(outName, out.str());
+    std::cout << "'" << define << "': " << total << " function(s) in " << files.size() << " file(s), "
+        << us << " us - see " << outName << "\n";
+    return true;
 }
 
 /*******************************************************
- * collectPythonParameters():
- *   Scans all .py files for lines: if app.<XYZ>
- *   Gathers unique "XYZ" parameters
+ * Fuzzy picker
+ *
+ *  The define and param menus list hundreds of names. On a
+ *  terminal they are picked by typing: every key re-ranks the
+ *  names by a fuzzy subsequence match (bonuses for word starts
+ *  and runs, a penalty per skipped character). Up/Down move,
+ *  Tab marks several names for one batched scan, Enter takes
+ *  the marked names (or the highlighted one), Esc goes back.
+ *  A typed character only re-scores the names that matched
+ *  before it and Backspace returns to the earlier ranking, so
+ *  thousands of names answer within a few milliseconds.
+ *
+ *  With input from a pipe or file the menu stays line based:
+ *  numbers pick ("3 7 12" picks three), any other text lists
+ *  the names matching it, 0 goes back.
  *******************************************************/
-std::unordered_set<std::string> collectPythonParameters(const std::vector<std::string>& pyFiles) {
-    std::unordered_set<std::string> params;
+static const int FUZZY_MATCH = 16;
+static const int FUZZY_BOUNDARY = 24;   // first character, after '_' or a digit run, camelCase hump
+static const int FUZZY_RUN = 16;        // right after the previous matched character
+static const int FUZZY_GAP = 1;         // per skipped character
+static const int FUZZY_NONE = std::numeric_limits<int>::min() / 2;
+
+/** FuzzyIndex: the names of a menu, prepared once for matching */
+struct FuzzyIndex {
+    std::vector<std::string> folded;            // lower case
+    std::vector<std::vector<uint8_t>> bonus;    // per character
+    std::vector<uint64_t> chars;                // characters that occur (fuzzyCharBit)
+};
 
-    static const std::unordered_set<std::string> blacklist = {
-        "loggined", "VK_UP", "VK_RIGHT", "VK_LEFT", "VK_HOME", "VK_END",
-        "VK_DOWN", "VK_DELETE", "TARGET", "SELL", "BUY", "DIK_DOWN",
-        "DIK_F1", "DIK_F2", "DIK_F3", "DIK_F4", "DIK_H", "DIK_LALT",
-        "DIK_LCONTROL", "DIK_RETURN", "DIK_SYSRQ", "DIK_UP", "DIK_V",
-        "GetGlobalTime","GetTime","IsDevStage","IsEnableTestServerFlag",
-        "IsExistFile","IsPressed","IsWebPageMode",
-    };
+static uint64_t fuzzyCharBit(unsigned char c)
+{
+    if (c >= 'a' && c <= 'z') return 1ull << (c - 'a');
+    if (c >= '0' && c <= '9') return 1ull << (26 + c - '0');
+    if (c == '_') return 1ull << 36;
+    return 1ull << 37;
+}
 
-    for (auto& f : pyFiles) {
-        std::ifstream ifs(f);
-        if (!ifs.is_open()) continue;
+FuzzyIndex buildFuzzyIndex(const std::vector<std::string>& names)
+{
+    FuzzyIndex index;
+    for (const auto& name : names) {
+        std::string folded(name.size(), ' ');
+        std::vector<uint8_t> bonus(name.size(), 0);
+        uint64_t chars = 0;
+        for (size_t i = 0; i < name.size(); ++i) {
+            unsigned char c = (unsigned char)name[i];
+            unsigned char before = i ? (unsigned char)name[i - 1] : 0;
+            folded[i] = (char)std::tolower(c);
+            chars |= fuzzyCharBit((unsigned char)folded[i]);
+            if (i == 0 || !std::isalnum(before) ||
+                (std::isupper(c) && std::islower(before)) ||
+                (std::isdigit(c) != 0) != (std::isdigit(before) != 0)) {
+                bonus[i] = FUZZY_BOUNDARY;
+            }
+        }
+        index.folded.push_back(std::move(folded));
+        index.bonus.push_back(std::move(bonus));
+        index.chars.push_back(chars);
+    }
+    return index;
+}
 
-        std::string line;
-        while (std::getline(ifs, line)) {
-            std::smatch m;
-            size_t pos = line.find("if app.");
-            if (pos != std::string::npos) {
-                size_t start = pos + 7;
-                size_t end = line.find_first_of(" ():", start);
-                std::string param = line.substr(start, end - start);
-                if (!param.empty() && blacklist.find(param) == blacklist.end()) {
-                    params.insert(param);
+/** fuzzyScore(index, k, query, prev, cur):
+ *   Best alignment of the folded 'query' as a subsequence of
+ *   name k, FUZZY_NONE if it is none. 'prev' and 'cur' are
+ *   scratch rows.
+ */
+static int fuzzyScore(const FuzzyIndex& index, size_t k, const std::string& query,
+    std::vector<int>& prev, std::vector<int>& cur)
+{
+    const std::string& name = index.folded[k];
+    const std::vector<uint8_t>& bonus = index.bonus[k];
+    const size_t n = name.size();
+    if (query.size() > n) return FUZZY_NONE;
+    prev.assign(n, FUZZY_NONE);
+    cur.assign(n, FUZZY_NONE);
+    for (size_t j = 0; j < query.size(); ++j) {
+        int carry = FUZZY_NONE;     // best prev[i'] for i' < i, minus the gap
+        bool any = false;
+        for (size_t i = 0; i < n; ++i) {
+            int score = FUZZY_NONE;
+            if (name[i] == query[j]) {
+                int here = FUZZY_MATCH + bonus[i];
+                if (j == 0) {
+                    score = here - (int)i * FUZZY_GAP;
                 }
-            }
-            else if (std::regex_search(line, pythonIfAppRegex)) {
-                std::smatch m;
-                if (std::regex_search(line, m, pythonIfAppRegex) && m.size() > 1) {
-                    std::string param = m[1].str();
-                    if (blacklist.find(param) == blacklist.end()) {
-                        params.insert(param);
-                    }
+                else if (i > 0) {
+                    if (prev[i - 1] != FUZZY_NONE) score = prev[i - 1] + here + FUZZY_RUN;
+                    if (carry != FUZZY_NONE) score = std::max(score, carry + here);
                 }
             }
+            cur[i] = score;
+            any = any || score != FUZZY_NONE;
+            carry = std::max(carry == FUZZY_NONE ? FUZZY_NONE : carry - FUZZY_GAP, prev[i]);
         }
+        if (!any) return FUZZY_NONE;
+        std::swap(prev, cur);
     }
-    return params;
+    return *std::max_element(prev.begin(), prev.end());
 }
 
-/*******************************************************
- * Multi-threaded parsing (C++) to find #if <define> blocks + relevant functions
- *******************************************************/
-static std::atomic<size_t> nextFileIndex{ 0 };
-
-void parseWorkerDynamic(const std::vector<std::string>& files,
-    const std::regex& startDefineRegex,
-    std::atomic<size_t>& processed,
-    size_t totalLines,
-    std::vector<CodeBlock>& defineBlocksOut,
-    std::vector<CodeBlock>& functionBlocksOut)
+/** rankFuzzy(index, query, candidates):
+ *   The candidates matching 'query', best first (then shorter
+ *   names, then index order). An empty query keeps them all.
+ */
+std::vector<size_t> rankFuzzy(const FuzzyIndex& index, const std::string& query,
+    const std::vector<size_t>& candidates)
 {
-    std::vector<CodeBlock> localDefine;
-    std::vector<CodeBlock> localFunc;
-    thread_local size_t tls_processed = 0;
-
-    while (true) {
-        size_t idx = nextFileIndex.fetch_add(1, std::memory_order_relaxed);
-        if (idx >= files.size()) {
-            break;
+    if (query.empty()) return candidates;
+    std::string folded(query.size(), ' ');
+    uint64_t wanted = 0;
+    for (size_t i = 0; i < query.size(); ++i) {
+        folded[i] = (char)std::tolower((unsigned char)query[i]);
+        wanted |= fuzzyCharBit((unsigned char)folded[i]);
+    }
+    std::vector<std::pair<int, size_t>> scored;
+    std::vector<int> prev, cur;
+    for (size_t k : candidates) {
+        if ((index.chars[k] & wanted) != wanted) continue;
+        int score = fuzzyScore(index, k, folded, prev, cur);
+        if (score != FUZZY_NONE) scored.emplace_back(score, k);
+    }
+    std::sort(scored.begin(), scored.end(), [&](const auto& a, const auto& b) {
+        if (a.first != b.first) return a.first > b.first;
+        if (index.folded[a.second].size() != index.folded[b.second].size()) {
+            return index.folded[a.second].size() < index.folded[b.second].size();
         }
-        const auto& filename = files[idx];
+        return a.second < b.second;
+    });
+    std::vector<size_t> ranked;
+    ranked.reserve(scored.size());
+    for (const auto& s : scored) ranked.push_back(s.second);
+    return ranked;
+}
 
-        size_t lineCountThisFile = 0;
-        auto pr = parseFileSinglePass(filename, startDefineRegex,
-            processed, totalLines, lineCountThisFile);
+enum class PickerKey { None, Char, Up, Down, PageUp, PageDown, Tab, Enter, Backspace, Escape };
 
-        localDefine.insert(localDefine.end(), pr.first.begin(), pr.first.end());
-        localFunc.insert(localFunc.end(), pr.second.begin(), pr.second.end());
-        tls_processed += lineCountThisFile;
+#ifdef _WIN32
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+static bool interactiveConsole()
+{
+    return _isatty(_fileno(stdin)) && _isatty(_fileno(stdout));
+}
 
-        if (tls_processed >= 1000) {
-            processed.fetch_add(tls_processed);
-            tls_processed = 0;
-            printProgress(processed.load(), totalLines);
-        }
+/** RawConsole: unbuffered key input and ANSI output while in scope */
+struct RawConsole {
+    HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+    HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD inMode = 0, outMode = 0;
+    RawConsole()
+    {
+        GetConsoleMode(in, &inMode);
+        GetConsoleMode(out, &outMode);
+        SetConsoleMode(in, inMode & ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT | ENABLE_PROCESSED_INPUT));
+        SetConsoleMode(out, outMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    }
+    ~RawConsole()
+    {
+        SetConsoleMode(in, inMode);
+        SetConsoleMode(out, outMode);
     }
+};
 
-    // lock to merge local results into global
-    std::lock_guard<std::mutex> lock(consoleMutex);
-    defineBlocksOut.insert(defineBlocksOut.end(), localDefine.begin(), localDefine.end());
-    functionBlocksOut.insert(functionBlocksOut.end(), localFunc.begin(), localFunc.end());
-    if (tls_processed > 0) {
-        processed.fetch_add(tls_processed);
+static PickerKey readPickerKey(char& ch)
+{
+    int c = _getch();
+    if (c == 0 || c == 224) {
+        switch (_getch()) {
+        case 72: return PickerKey::Up;
+        case 80: return PickerKey::Down;
+        case 73: return PickerKey::PageUp;
+        case 81: return PickerKey::PageDown;
+        default: return PickerKey::None;
+        }
     }
+    if (c == 13) return PickerKey::Enter;
+    if (c == 9) return PickerKey::Tab;
+    if (c == 8) return PickerKey::Backspace;
+    if (c == 27 || c == 3) return PickerKey::Escape;
+    if (c < 32 || c > 126) return PickerKey::None;
+    ch = (char)c;
+    return PickerKey::Char;
 }
 
-/** parseAllFilesMultiThread(files, define):
- *   Spawns threads, reads all .h/.cpp in 'files' and returns
- *   matched #if <define> blocks + function blocks.
- */
-std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
-parseAllFilesMultiThread(const std::vector<std::string>& files, const std::string& define)
+static void consoleSize(size_t& rows, size_t& cols)
 {
-    auto startDefineRegex = createConditionalRegex(define);
-
-    std::cout << "Counting total lines...\n";
-    size_t totalLines = getTotalLineCount(files);
-    std::cout << "Total lines: " << totalLines << "\n";
-
-    unsigned int hwThreads = std::thread::hardware_concurrency();
-    if (hwThreads == 0) hwThreads = 2;
-    size_t numThreads = std::min<size_t>(hwThreads, files.size());
-    std::cout << "Starting " << numThreads << " thread(s)...\n";
-
-    std::atomic<size_t> processed{ 0 };
-    std::vector<CodeBlock> allDefineBlocks;
-    std::vector<CodeBlock> allFunctionBlocks;
-
-    nextFileIndex.store(0);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
+        rows = (size_t)(info.srWindow.Bottom - info.srWindow.Top + 1);
+        cols = (size_t)(info.srWindow.Right - info.srWindow.Left + 1);
+    }
+}
+#else
+static bool interactiveConsole()
+{
+    return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+}
 
-    std::vector<std::thread> threads;
-    auto startTime = high_resolution_clock::now();
-    for (size_t t = 0; t < numThreads; ++t) {
-        threads.emplace_back(parseWorkerDynamic,
-            std::cref(files),
-            std::cref(startDefineRegex),
-            std::ref(processed),
-            totalLines,
-            std::ref(allDefineBlocks),
-            std::ref(allFunctionBlocks));
+/** RawConsole: unbuffered, unechoed key input while in scope */
+struct RawConsole {
+    termios saved;
+    bool active = false;
+    RawConsole()
+    {
+        if (tcgetattr(STDIN_FILENO, &saved) != 0) return;
+        termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+        raw.c_iflag &= ~(IXON | ICRNL);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        active = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
     }
-    for (auto& th : threads) {
-        th.join();
+    ~RawConsole()
+    {
+        if (active) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
     }
+};
 
-    printProgress(totalLines, totalLines);
-    std::cout << "\n";
-
-    auto endTime = high_resolution_clock::now();
-    auto ms = duration_cast<milliseconds>(endTime - startTime).count();
-    std::cout << "Parsing define '" << define << "' finished in " << ms << " ms\n";
+static PickerKey readPickerKey(char& ch)
+{
+    unsigned char c;
+    if (read(STDIN_FILENO, &c, 1) != 1) return PickerKey::Escape;
+    if (c == 27) {
+        // a lone Esc, or the start of an arrow / page key sequence
+        pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        unsigned char seq[3];
+        if (poll(&pfd, 1, 30) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1) return PickerKey::Escape;
+        if ((seq[0] != '[' && seq[0] != 'O') || read(STDIN_FILENO, &seq[1], 1) != 1) return PickerKey::None;
+        if (seq[1] == 'A') return PickerKey::Up;
+        if (seq[1] == 'B') return PickerKey::Down;
+        if ((seq[1] == '5' || seq[1] == '6') && read(STDIN_FILENO, &seq[2], 1) == 1 && seq[2] == '~') {
+            return seq[1] == '5' ? PickerKey::PageUp : PickerKey::PageDown;
+        }
+        return PickerKey::None;
+    }
+    if (c == '\r' || c == '\n') return PickerKey::Enter;
+    if (c == '\t') return PickerKey::Tab;
+    if (c == 127 || c == 8) return PickerKey::Backspace;
+    if (c == 3 || c == 4) return PickerKey::Escape;     // Ctrl-C, Ctrl-D
+    if (c == 16) return PickerKey::Up;                  // Ctrl-P
+    if (c == 14) return PickerKey::Down;                // Ctrl-N
+    if (c < 32 || c > 126) return PickerKey::None;
+    ch = (char)c;
+    return PickerKey::Char;
+}
 
-    return { allDefineBlocks, allFunctionBlocks };
+static void consoleSize(size_t& rows, size_t& cols)
+{
+    winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+        rows = ws.ws_row;
+        cols = ws.ws_col;
+    }
 }
+#endif
+
+/** pickNamesByKey(title, index, names, details):
+ *   The terminal picker; redraws the whole list after every key.
+ */
+static std::vector<size_t> pickNamesByKey(const std::string& title, const FuzzyIndex& index,
+    const std::vector<std::string>& names, const std::vector<std::string>& details)
+{
+    RawConsole console;
+    std::string query;
+    std::vector<std::vector<size_t>> levels(1);   // levels[L]: ranking for the first L query characters
+    levels[0].resize(names.size());
+    std::iota(levels[0].begin(), levels[0].end(), 0);
+    std::vector<size_t> marked;
+    size_t cursor = 0, top = 0;
 
-/*******************************************************
- * Multi-threaded parsing (Python)
- *******************************************************/
-static std::atomic<size_t> nextPyFileIndex{ 0 };
-
-void parsePythonWorkerDynamic(const std::vector<std::string>& files,
-    const std::string& param,
-    std::atomic<size_t>& processed,
-    size_t totalLines,
-    std::vector<CodeBlock>& ifBlocksOut,
-    std::vector<CodeBlock>& funcBlocksOut)
-{
-    std::vector<CodeBlock> localIf;
-    std::vector<CodeBlock> localFunc;
-    thread_local size_t tls_processed = 0;
     while (true) {
-        size_t idx = nextPyFileIndex.fetch_add(1, std::memory_order_relaxed);
-        if (idx >= files.size()) {
+        const std::vector<size_t>& shown = levels.back();
+        size_t rows = 24, cols = 80;
+        consoleSize(rows, cols);
+        size_t visible = rows > 8 ? rows - 4 : 4;
+        if (cursor >= shown.size()) cursor = shown.empty() ? 0 : shown.size() - 1;
+        if (cursor < top) top = cursor;
+        if (cursor >= top + visible) top = cursor - visible + 1;
+
+        std::string frame = "\033[H\033[J" + title + "\r\n> " + query + "\r\n";
+        frame += "  " + std::to_string(shown.size()) + "/" + std::to_string(names.size());
+        if (!marked.empty()) frame += ", " + std::to_string(marked.size()) + " marked";
+        frame += " - Up/Down move, Tab mark, Enter scan, Esc back\r\n";
+        for (size_t r = top; r < shown.size() && r < top + visible; ++r) {
+            size_t k = shown[r];
+            bool isMarked = std::find(marked.begin(), marked.end(), k) != marked.end();
+            std::string line = std::string(r == cursor ? "> " : "  ") + (isMarked ? "[x] " : "[ ] ") +
+                names[k] + (k < details.size() ? details[k] : std::string());
+            if (line.size() >= cols) line.resize(cols - 1);
+            frame += line + "\r\n";
+        }
+        std::cout << frame << std::flush;
+
+        char ch = 0;
+        switch (readPickerKey(ch)) {
+        case PickerKey::Char:
+            query += ch;
+            levels.push_back(rankFuzzy(index, query, levels.back()));
+            cursor = top = 0;
+            break;
+        case PickerKey::Backspace:
+            if (!query.empty()) {
+                query.pop_back();
+                levels.pop_back();
+                cursor = top = 0;
+            }
+            break;
+        case PickerKey::Up:
+            if (cursor > 0) cursor--;
+            break;
+        case PickerKey::Down:
+            cursor++;
+            break;
+        case PickerKey::PageUp:
+            cursor = cursor > visible ? cursor - visible : 0;
+            break;
+        case PickerKey::PageDown:
+            cursor += visible;
+            break;
+        case PickerKey::Tab:
+            if (!shown.empty()) {
+                auto it = std::find(marked.begin(), marked.end(), shown[cursor]);
+                if (it == marked.end()) marked.push_back(shown[cursor]);
+                else marked.erase(it);
+                cursor++;
+            }
+            break;
+        case PickerKey::Enter:
+            if (marked.empty() && !shown.empty()) marked.push_back(shown[cursor]);
+            if (!marked.empty()) {
+                std::cout << "\033[H\033[J" << std::flush;
+                return marked;
+            }
+            break;
+        case PickerKey::Escape:
+            std::cout << "\033[H\033[J" << std::flush;
+            return std::vector<size_t>();
+        case PickerKey::None:
             break;
         }
-        const auto& filename = files[idx];
-
-        size_t lineCountThisFile = 0;
-        auto pr = parsePythonFileSinglePass(filename, param,
-            processed, totalLines,
-            lineCountThisFile);
+    }
+}
 
-        localIf.insert(localIf.end(), pr.first.begin(), pr.first.end());
-        localFunc.insert(localFunc.end(), pr.second.begin(), pr.second.end());
-        tls_processed += lineCountThisFile;
-        if (tls_processed >= 1000) {
-            processed.fetch_add(tls_processed);
-            tls_processed = 0;
-            printProgress(processed.load(), totalLines);
+/** pickNamesByLine(title, index, names, details):
+ *   The numbered menu for piped input.
+ */
+static std::vector<size_t> pickNamesByLine(const std::string& title, const FuzzyIndex& index,
+    const std::vector<std::string>& names, const std::vector<std::string>& details)
+{
+    std::vector<size_t> all(names.size());
+    std::iota(all.begin(), all.end(), 0);
+    std::vector<size_t> shown = all;
+    while (true) {
+        clearConsole();
+        std::cout << title << ":\n";
+        for (size_t k : shown) {
+            std::cout << (k + 1) << ") " << names[k] << (k < details.size() ? details[k] : std::string()) << "\n";
+        }
+        std::cout << "0) Back\nChoice (numbers, or text to filter): ";
+        std::string line;
+        do {
+            if (!std::getline(std::cin, line)) return std::vector<size_t>();
+            line = trimCopy(line);
+        } while (line.empty());
+
+        if (line.find_first_not_of("0123456789 ,") != std::string::npos) {
+            shown = rankFuzzy(index, line, all);
+            if (shown.empty()) {
+                std::cerr << "Nothing matches '" << line << "'.\n";
+                shown = all;
+            }
+            continue;
+        }
+        std::vector<size_t> picked;
+        bool valid = true;
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream numbers(line);
+        size_t n;
+        while (numbers >> n) {
+            if (n == 0) return std::vector<size_t>();
+            if (n > names.size()) valid = false;
+            else if (std::find(picked.begin(), picked.end(), n - 1) == picked.end()) picked.push_back(n - 1);
         }
+        if (valid && !picked.empty()) return picked;
+        std::cerr << "Invalid choice!\n";
+        shown = all;
     }
-
-    std::lock_guard<std::mutex> lock(consoleMutex);
-    ifBlocksOut.insert(ifBlocksOut.end(), localIf.begin(), localIf.end());
-    funcBlocksOut.insert(funcBlocksOut.end(), localFunc.begin(), localFunc.end());
 }
 
-/** parsePythonAllFilesMultiThread(pyFiles, param):
- *   Spawns threads to parse all .py files
- *   searching for if app.<param> + relevant functions
+/** pickNames(title, index, names, details):
+ *   Lets the user pick one or more of 'names' ('index' built
+ *   from them, optional 'details' shown after each). Returns
+ *   the picked indexes in pick order; empty = back.
  */
-std::pair<std::vector<CodeBlock>, std::vector<CodeBlock>>
-parsePythonAllFilesMultiThread(const std::vector<std::string>& pyFiles, const std::string& param)
+std::vector<size_t> pickNames(const std::string& title, const FuzzyIndex& index,
+    const std::vector<std::string>& names, const std::vector<std::string>& details = std::vector<std::string>())
 {
-    std::cout << "Counting total lines (Python)...\n";
-    size_t totalLines = getTotalLineCount(pyFiles);
-    std::cout << "Total Python lines: " << totalLines << "\n";
-
-    unsigned int hwThreads = std::thread::hardware_concurrency();
-    if (hwThreads == 0) hwThreads = 2;
-    size_t numThreads = std::min<size_t>(hwThreads, pyFiles.size());
-    std::cout << "Starting " << numThreads << " thread(s) for Python...\n";
-
-    std::atomic<size_t> processed{ 0 };
-    std::vector<CodeBlock> allIfBlocks;
-    std::vector<CodeBlock> allFuncBlocks;
+    if (interactiveConsole()) return pickNamesByKey(title, index, names, details);
+    return pickNamesByLine(title, index, names, details);
+}
 
-    nextPyFileIndex.store(0);
+/*******************************************************
+ * getSubdirectoriesOfCurrentPath():
+ *   Non-recursive listing of all subdirectories in the
+ *   current working directory (where the .exe is placed),
+ *   plus the source archives there (see "Source archives").
+ *******************************************************/
+std::vector<fs::path> getSubdirectoriesOfCurrentPath()
+{
+    std::vector<fs::path> dirs;
+    auto cur = fs::current_path();
+    for (auto& p : fs::directory_iterator(cur, fs::directory_options::skip_permission_denied))
+    {
+        if (fs::is_directory(p.path()) || isArchivePath(p.path())) {
+            dirs.push_back(p.path());
+        }
+    }
+    std::sort(dirs.begin(), dirs.end());
+    return dirs;
+}
 
-    std::vector<std::thread> threads;
-    auto startTime = high_resolution_clock::now();
-    for (size_t t = 0; t < numThreads; ++t) {
-        threads.emplace_back(parsePythonWorkerDynamic,
-            std::cref(pyFiles),
-            std::cref(param),
-            std::ref(processed),
-            totalLines,
-            std::ref(allIfBlocks),
-            std::ref(allFuncBlocks));
+/*******************************************************
+ * runConfigurationEvaluatorMenu():
+ *   Interactive front-end of the configuration evaluator.
+ *******************************************************/
+void runConfigurationEvaluatorMenu(bool hasClientHeader, const fs::path& clientPath,
+    const std::string& clientHeaderName,
+    bool hasServerHeader, const fs::path& serverPath,
+    const std::string& serverHeaderName)
+{
+    std::cout << "Evaluate which tree?\n";
+    if (hasClientHeader) std::cout << "1) Client\n";
+    if (hasServerHeader) std::cout << "2) Server\n";
+    std::cout << "0) Back\nChoice: ";
+    int tchoice;
+    std::cin >> tchoice;
+    std::cin.ignore(10000, '\n');
+    if (!std::cin || (tchoice == 1 && !hasClientHeader) || (tchoice == 2 && !hasServerHeader)
+        || (tchoice != 1 && tchoice != 2)) {
+        std::cin.clear();
+        return;
     }
-    for (auto& th : threads) {
-        th.join();
+
+    PPConfiguration cfg;
+    cfg.name = (tchoice == 1) ? "CLIENT" : "SERVER";
+    std::cout << "Assignments (e.g. ENABLE_X=on ENABLE_Y=off MAX_LEVEL=120, empty = header defaults):\n> ";
+    std::string line;
+    std::getline(std::cin, line);
+    std::istringstream iss(line);
+    std::string tok;
+    while (iss >> tok) {
+        if (!parseAssignment(tok, cfg)) {
+            std::cerr << "Invalid assignment '" << tok << "'.\n";
+            std::cout << "Press ENTER...\n";
+            std::cin.ignore(10000, '\n');
+            return;
+        }
     }
 
-    printProgress(totalLines, totalLines);
-    std::cout << "\n";
+    std::cout << "Query (e.g. ENABLE_X && !ENABLE_Y, empty = none):\n> ";
+    std::string query;
+    std::getline(std::cin, query);
+    query = trimCopy(query);
 
-    auto endTime = high_resolution_clock::now();
-    auto ms = duration_cast<milliseconds>(endTime - startTime).count();
-    std::cout << "Parsing (app." << param << ") finished in " << ms << " ms\n";
+    std::vector<std::string> queries;
+    if (!query.empty()) queries.push_back(query);
+    runConfigurationEvaluation(tchoice == 1 ? clientPath : serverPath,
+        tchoice == 1 ? clientHeaderName : serverHeaderName, { cfg }, queries);
 
-    return { allIfBlocks, allFuncBlocks };
+    std::cout << "Press ENTER...\n";
+    std::cin.ignore(10000, '\n');
 }
 
 /*******************************************************
- * findClientHeaderInUserInterface():
- *   Recursively scans the given path for "locale_inc.h"
- *   in any subdirectory that includes "UserInterface" in its path
+ * runPatternSearchMenu():
+ *   Searches the client or server sources for a custom
+ *   pattern (identifier glob or regular expression) with the
+ *   linear-time pattern engine. Hits go through the same block
+ *   and function extraction as define scans.
  *******************************************************/
-void findClientHeaderInUserInterface(const fs::path& startPath,
-    bool& hasClientHeader,
-    std::string& clientHeaderName)
+void runPatternSearchMenu(bool hasClientHeader, const fs::path& clientPath,
+    bool hasServerHeader, const fs::path& serverPath)
 {
-    hasClientHeader = false;
-    clientHeaderName.clear();
+    std::cout << "Search which tree?\n";
+    if (hasClientHeader) std::cout << "1) Client\n";
+    if (hasServerHeader) std::cout << "2) Server\n";
+    std::cout << "0) Back\nChoice: ";
+    int tchoice;
+    std::cin >> tchoice;
+    std::cin.ignore(10000, '\n');
+    if (!std::cin || (tchoice == 1 && !hasClientHeader) || (tchoice == 2 && !hasServerHeader)
+        || (tchoice != 1 && tchoice != 2)) {
+        std::cin.clear();
+        return;
+    }
 
-    try {
-        for (auto& p : fs::recursive_directory_iterator(startPath,
-            fs::directory_options::skip_permission_denied))
-        {
-            try {
-                if (fs::is_symlink(p.path())) continue;
-                auto st = p.status();
-                if (!fs::is_regular_file(st)) continue;
+    const std::string prefix = (tchoice == 1) ? "CLIENT" : "SERVER";
+    const fs::path& root = (tchoice == 1) ? clientPath : serverPath;
+    auto sourceFiles = findSourceFiles(root);
+    if (sourceFiles.empty()) {
+        std::cerr << "No .cpp/.h files found in " << root << ".\n";
+        std::cout << "Press ENTER...\n";
+        std::cin.ignore(10000, '\n');
+        return;
+    }
 
-                auto rel = p.path().string();
-                std::string lowerRel;
-                lowerRel.reserve(rel.size());
-                for (char c : rel) {
-                    lowerRel.push_back(std::tolower((unsigned char)c));
-                }
-                if (lowerRel.find("userinterface") == std::string::npos) {
-                    continue;
-                }
-                auto fn = p.path().filename().string();
-                std::string lowerFn;
-                for (char c : fn) {
-                    lowerFn.push_back(std::tolower((unsigned char)c));
-                }
-                if (lowerFn == "locale_inc.h") {
-                    hasClientHeader = true;
-                    clientHeaderName = p.path().string();
-                    return;
-                }
-            }
-            catch (...) { continue; }
+    while (true) {
+        clearConsole();
+        std::cout << prefix << " custom pattern search\n";
+        std::cout << "1) Identifier glob on #if/#ifdef/#ifndef/#elif (e.g. LOCALE_SERVICE_*)\n";
+        std::cout << "2) Regular expression on the whole #if/#elif line (e.g. LOCALE_\\w+\\s*>=)\n";
+        std::cout << "0) Back\nChoice: ";
+        int kind;
+        std::cin >> kind;
+        std::cin.ignore(10000, '\n');
+        if (!std::cin || kind == 0) {
+            std::cin.clear();
+            break;
+        }
+        if (kind != 1 && kind != 2) {
+            continue;
+        }
+
+        std::cout << "Pattern:\n> ";
+        std::string text;
+        std::getline(std::cin, text);
+        text = trimCopy(text);
+        if (text.empty()) {
+            continue;
+        }
+
+        CompiledPattern pattern;
+        std::string error;
+        if (!compilePattern(kind == 1 ? globToPattern(text) : text, pattern, error)) {
+            std::cerr << "Invalid pattern: " << error << "\n";
+            std::cout << "Press ENTER...\n";
+            std::cin.ignore(10000, '\n');
+            continue;
         }
+        pattern.source = text;
+
+        ScanQuery query;
+        query.pattern = &pattern;
+        query.matchLines = (kind == 2);
+        auto results = parseAllFilesMultiThread(sourceFiles, query);
+
+        std::string baseName = "PATTERN_" + sanitizeFileName(text);
+        writeOutputPerFile(prefix, baseName + "_DEFINE", results.first, &g_lastScan);
+        writeOutputPerFile(prefix, baseName + "_FUNC", results.second, &g_lastScan);
+
+        setColor(10);
+        std::cout << results.first.size() << " block(s), " << results.second.size()
+            << " function(s) - see 'Output/" << prefix << "_" << baseName << "_DEFINE_files'...\n";
+        setColor(7);
+        std::cout << "Press ENTER...\n";
+        std::cin.ignore(10000, '\n');
     }
-    catch (...) {}
 }
 
-/*******************************************************
- * findServerHeaderInCommon():
- *   Recursively scans for "service.h" or "commondefines.h"
- *   in a path containing "common" in its folder name
+/*******************************************************
+ * runIdentifierIndexMenu():
+ *   Builds / updates the identifier index over all configured
+ *   roots and answers symbol and define impact queries from it.
  *******************************************************/
-void findServerHeaderInCommon(const fs::path& startPath,
-    bool& hasServerHeader,
-    std::string& serverHeaderName)
+void runIdentifierIndexMenu(bool hasClientHeader, const fs::path& clientPath,
+    bool hasServerHeader, const fs::path& serverPath,
+    const std::string& pythonRoot)
 {
-    hasServerHeader = false;
-    serverHeaderName.clear();
-
-    try {
-        for (auto& p : fs::recursive_directory_iterator(startPath,
-            fs::directory_options::skip_permission_denied))
+    while (true) {
+        clearConsole();
+        std::cout << "Identifier index (" << INDEX_FILE << "): ";
         {
-            try {
-                if (fs::is_symlink(p.path())) continue;
-                auto st = p.status();
-                if (!fs::is_regular_file(st)) continue;
+            IdentifierIndex index;
+            if (loadIdentifierIndex(INDEX_FILE, index)) {
+                std::cout << index.files.size() << " file(s), " << index.header.identCount << " identifier(s)\n";
+            }
+            else {
+                std::cout << "not built yet\n";
+            }
+        }
+        std::cout << "1) Build / update index\n";
+        std::cout << "2) Query identifiers\n";
+        std::cout << "3) Define impact (functions and their callers)\n";
+        std::cout << "0) Back\nChoice: ";
+        int ichoice;
+        std::cin >> ichoice;
+        std::cin.ignore(10000, '\n');
+        if (!std::cin || ichoice == 0) {
+            std::cin.clear();
+            return;
+        }
 
-                auto rel = p.path().string();
-                std::string lowerRel;
-                lowerRel.reserve(rel.size());
-                for (char c : rel) {
-                    lowerRel.push_back(std::tolower((unsigned char)c));
-                }
-                if (lowerRel.find("common") == std::string::npos) {
-                    continue;
-                }
-                auto fn = p.path().filename().string();
-                std::string lowerFn;
-                for (char c : fn) {
-                    lowerFn.push_back(std::tolower((unsigned char)c));
-                }
-                if (lowerFn == "service.h" || lowerFn == "commondefines.h") {
-                    hasServerHeader = true;
-                    serverHeaderName = p.path().string();
-                    return;
-                }
+        if (ichoice == 1) {
+            std::vector<SourceScanTask> tasks;
+            if (hasClientHeader) addScanTasks(tasks, ScanSide::Client, findSourceFiles(clientPath));
+            if (hasServerHeader) addScanTasks(tasks, ScanSide::Server, findSourceFiles(serverPath));
+            if (!pythonRoot.empty()) addScanTasks(tasks, ScanSide::Python, findPythonFiles(pythonRoot));
+            if (tasks.empty()) {
+                std::cerr << "No files to index.\n";
+            }
+            else {
+                buildIdentifierIndex(tasks);
+            }
+            std::cout << "Press ENTER...\n";
+            std::cin.ignore(10000, '\n');
+        }
+        else if (ichoice == 2) {
+            while (true) {
+                std::cout << "Identifier (e.g. ITEM_UNIQUE or CHARACTER::ChangeEmpire, empty = back):\n> ";
+                std::string name;
+                std::getline(std::cin, name);
+                name = trimCopy(name);
+                if (!std::cin || name.empty()) break;
+                queryIdentifierIndex(name);
+            }
+        }
+        else if (ichoice == 3) {
+            std::cout << "Caller depth [" << DEFAULT_IMPACT_DEPTH << "]: ";
+            std::string text;
+            std::getline(std::cin, text);
+            size_t depth = DEFAULT_IMPACT_DEPTH;
+            if (!trimCopy(text).empty()) depth = (size_t)std::strtoul(text.c_str(), nullptr, 10);
+            while (true) {
+                std::cout << "Define (e.g. ENABLE_DRAGON_SOUL, empty = back):\n> ";
+                std::string name;
+                std::getline(std::cin, name);
+                name = trimCopy(name);
+                if (!std::cin || name.empty()) break;
+                queryDefineImpact(name, depth);
             }
-            catch (...) { continue; }
         }
     }
-    catch (...) {}
 }
 
 /*******************************************************
- * findPythonRoots():
- *   Lists subfolders named exactly "root" (not recursing).
- *   You could adjust to do a deeper search if needed.
+ * runUnifdefMenu():
+ *   Interactive front-end of the conditional rewriter.
  *******************************************************/
-void findPythonRoots(const fs::path& startPath,
-    std::vector<std::string>& pythonRoots)
+void runUnifdefMenu(bool hasClientHeader, const fs::path& clientPath,
+    bool hasServerHeader, const fs::path& serverPath)
 {
-    pythonRoots.clear();
-    try {
-        for (auto& p : fs::directory_iterator(startPath,
-            fs::directory_options::skip_permission_denied))
-        {
-            try {
-                if (!fs::is_directory(p.path())) continue;
-                auto wdir = p.path().filename().wstring();
-                std::wstring lowerW;
-                lowerW.reserve(wdir.size());
-                for (wchar_t wc : wdir) {
-                    lowerW.push_back(std::tolower(wc));
-                }
-                if (lowerW == L"root") {
-                    pythonRoots.push_back(p.path().string());
-                }
-            }
-            catch (...) { continue; }
+    std::cout << "Rewrite which tree?\n";
+    if (hasClientHeader) std::cout << "1) Client\n";
+    if (hasServerHeader) std::cout << "2) Server\n";
+    std::cout << "0) Back\nChoice: ";
+    int tchoice;
+    std::cin >> tchoice;
+    std::cin.ignore(10000, '\n');
+    if (!std::cin || (tchoice == 1 && !hasClientHeader) || (tchoice == 2 && !hasServerHeader)
+        || (tchoice != 1 && tchoice != 2)) {
+        std::cin.clear();
+        return;
+    }
+
+    PPConfiguration cfg;
+    std::cout << "Forced defines (e.g. ENABLE_X=on ENABLE_Y=off MAX_LEVEL=120):\n> ";
+    std::string line;
+    std::getline(std::cin, line);
+    std::istringstream iss(line);
+    std::string tok;
+    while (iss >> tok) {
+        if (!parseAssignment(tok, cfg)) {
+            std::cerr << "Invalid assignment '" << tok << "'.\n";
+            std::cout << "Press ENTER...\n";
+            std::cin.ignore(10000, '\n');
+            return;
         }
     }
-    catch (...) {}
+
+    std::cout << "1) Write rewritten tree\n";
+    std::cout << "2) Write unified diff\n";
+    std::cout << "Choice: ";
+    int ochoice;
+    std::cin >> ochoice;
+    std::cin.ignore(10000, '\n');
+    if (!std::cin || (ochoice != 1 && ochoice != 2)) {
+        std::cin.clear();
+        return;
+    }
+
+    runUnifdef(tchoice == 1 ? clientPath : serverPath, tchoice == 1 ? "CLIENT" : "SERVER", cfg, ochoice == 2);
+    std::cout << "Press ENTER...\n";
+    std::cin.ignore(10000, '\n');
 }
 
 /*******************************************************
- * findSourceFiles(path):
- *   Recursively collects all .h / .cpp files from startRoot
+ * Execution trace output
  *******************************************************/
-std::vector<std::string> findSourceFiles(const fs::path& startRoot)
+static void appendTraceMicros(std::string& out, uint64_t ns)
 {
-    std::vector<std::string> result;
-    static const std::unordered_set<std::string> validExtensions = { ".cpp", ".h" };
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%llu.%03u",
+        (unsigned long long)(ns / 1000), (unsigned)(ns % 1000));
+    out += buf;
+}
 
-    try {
-        for (auto& p : fs::recursive_directory_iterator(startRoot, fs::directory_options::skip_permission_denied))
+/** writeTraceFile(path):
+ *   Writes every recorded span as a complete ("X") trace event,
+ *   plus one thread_name record per thread. Runs at exit or,
+ *   from the trace watcher, while workers still record: each
+ *   buffer is copied under its mutex and serialized afterwards,
+ *   so spans that end later are simply not in the file.
+ */
+static bool writeTraceFile(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(traceRegistryMutex);
+    std::string out = "{\"traceEvents\":[\n";
+    size_t events = 0;
+    size_t dropped = 0;
+    bool first = true;
+    std::vector<TraceEvent> copied;
+    for (const auto& buffer : traceBuffers) {
+        std::string thread;
         {
-            try {
-                if (fs::is_symlink(p.path())) continue;
-                if (fs::is_regular_file(p.path())) {
-                    std::string ext = p.path().extension().string();
-                    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-                    if (validExtensions.count(ext)) {
-                        result.push_back(p.path().string());
-                    }
-                }
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            copied.assign(buffer->events.begin(), buffer->events.end());
+            dropped += buffer->dropped;
+            thread = buffer->thread;
+        }
+        if (!first) out += ",\n";
+        first = false;
+        out += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" + std::to_string(buffer->tid)
+            + ",\"args\":{\"name\":";
+        appendJsonString(out, thread + " " + std::to_string(buffer->tid));
+        out += "}}";
+        for (const auto& ev : copied) {
+            out += ",\n{\"ph\":\"X\",\"name\":";
+            appendJsonString(out, ev.name);
+            out += ",\"pid\":1,\"tid\":" + std::to_string(buffer->tid) + ",\"ts\":";
+            appendTraceMicros(out, ev.startNs);
+            out += ",\"dur\":";
+            appendTraceMicros(out, ev.durNs);
+            if (ev.file != TRACE_NO_FILE) {
+                out += ",\"args\":{\"file\":";
+                appendJsonString(out, g_files.path(ev.file));
+                if (ev.line != TRACE_NO_LINE) out += ",\"line\":" + std::to_string(ev.line + 1);
+                out += "}";
             }
-            catch (...) { continue; }
+            out += "}";
+            events++;
         }
     }
-    catch (...) {}
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
 
-    return result;
+    if (!writeFileAtomically(path, out)) {
+        std::cerr << "Error: Unable to write trace " << path << "\n";
+        return false;
+    }
+    std::cout << "Trace: " << events << " span(s) written to " << path;
+    if (dropped > 0) std::cout << " (" << dropped << " dropped, buffer full)";
+    std::cout << "\n";
+    return true;
+}
+
+static void writeTraceAtExit()
+{
+    writeTraceFile(g_tracePath);
+}
+
+/** onTracedInterrupt(): SIGINT outside of scans while tracing. */
+static void onTracedInterrupt(int)
+{
+    std::signal(SIGINT, onTracedInterrupt);
+    g_traceExitRequested = true;
+}
+
+/** startTraceWatcher():
+ *   A Ctrl-C that ends the program would skip the atexit
+ *   writer, and a signal handler cannot write files. So the
+ *   handlers only raise g_traceExitRequested; this thread polls
+ *   it, writes the trace and then ends the program the way the
+ *   Ctrl-C would have.
+ */
+static void startTraceWatcher()
+{
+    std::signal(SIGINT, onTracedInterrupt);
+    std::thread([] {
+        while (!g_traceExitRequested) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        std::cout << "\n";
+        writeTraceFile(g_tracePath);
+        std::cout.flush();
+        std::signal(SIGINT, SIG_DFL);
+        std::raise(SIGINT);
+    }).detach();
 }
 
 /*******************************************************
- * readDefines(filename):
- *   Collects #define <NAME> from a single header file
+ * Command line
+ *   Without arguments the interactive menus are used.
  *******************************************************/
-std::vector<std::string> readDefines(const std::string& filename) {
-    std::vector<std::string> result;
-    std::ifstream ifs(filename);
-    if (!ifs.is_open()) {
-        std::cerr << "Could not open " << filename << "!\n";
-        return result;
-    }
+void printUsage()
+{
+    std::cout <<
+        "Usage:\n"
+        "  DefineExtractor [global options]     interactive menus\n"
+        "  DefineExtractor --eval <root> [options]\n"
+        "      --header <file>                  header providing the macros\n"
+        "                                       (default: service.h/commondefines.h or locale_inc.h below <root>)\n"
+        "      --config <file>                  configuration file (repeatable)\n"
+        "      -D NAME[=VALUE], -U NAME         assignment applied to every configuration\n"
+        "      --query \"<expr>\"                 blocks compiled only under <expr> (repeatable)\n"
+        "  DefineExtractor --unifdef <root> -D NAME[=VALUE] | -U NAME ... [--diff] [--hard-links]\n"
+        "                                       remove the conditionals decided by the given defines\n"
+        "                                       (tree in Output/UNIFDEF_<root>/, or a unified diff;\n"
+        "                                       --hard-links links unchanged files instead of copying\n"
+        "                                       them where no reflink is possible - edits then reach the sources)\n"
+        "  DefineExtractor --compare <old root> <new root>\n"
+        "                                       define blocks and functions added, removed or modified\n"
+        "                                       between two trees or archives (Output/COMPARE_<old>_<new>.txt)\n"
+        "Global options (menus and batch modes):\n"
+        "  --reader uring|plain                 file reader backend (default: uring where available)\n"
+        "  --threads <n>                        at most <n> worker threads per pool\n"
+        "  --max-cpu <percent>                  use at most this share of the hardware threads\n"
+        "  --affinity                           pin scan workers to CPUs (round robin)\n"
+        "  --no-cache                           always parse, bypassing Output/RESULT_CACHE\n"
+        "  --json                               also export define results as JSON (blocks grouped by text)\n"
+        "  --time-budget <seconds>              stop each define/pattern/Python scan after this long with\n"
+        "                                       partial results; the next run resumes (Ctrl-C does the same)\n"
+        "  --trace <file>                       write a Chrome trace (Perfetto) of all scans at exit\n";
+}
 
-    std::string line;
-    while (std::getline(ifs, line)) {
-        size_t pos = line.find("#define ");
-        if (pos != std::string::npos) {
-            std::istringstream iss(line.substr(pos + 8)); // "#define "
-            std::string defineName;
-            iss >> defineName;
-            if (!defineName.empty()) {
-                result.push_back(defineName);
+/** parseGlobalOptions(argc, argv, rest):
+ *   Consumes the options that apply to every mode and copies
+ *   all other arguments to 'rest' (argv[0] included).
+ */
+bool parseGlobalOptions(int argc, char* argv[], std::vector<char*>& rest)
+{
+    rest.assign(argv, argv + 1);
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--reader") {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for --reader\n";
+                return false;
+            }
+            std::string v = argv[++i];
+            if (v == "uring") g_useUring = true;
+            else if (v == "plain") g_useUring = false;
+            else {
+                std::cerr << "Unknown reader '" << v << "'\n";
+                return false;
+            }
+        }
+        else if (arg == "--threads" || arg == "--max-cpu") {
+            long v = (i + 1 < argc) ? std::strtol(argv[i + 1], nullptr, 10) : 0;
+            if (v <= 0 || (arg == "--max-cpu" && v > 100)) {
+                std::cerr << "Invalid or missing value for " << arg << "\n";
+                return false;
+            }
+            i++;
+            if (arg == "--threads") g_maxThreads = (size_t)v;
+            else g_maxCpuPercent = (unsigned)v;
+        }
+        else if (arg == "--affinity") {
+            g_pinThreads = true;
+        }
+        else if (arg == "--no-cache") {
+            g_useResultCache = false;
+        }
+        else if (arg == "--json") {
+            g_jsonExport = true;
+        }
+        else if (arg == "--time-budget") {
+            double v = (i + 1 < argc) ? std::strtod(argv[i + 1], nullptr) : 0;
+            if (!(v > 0)) {
+                std::cerr << "Invalid or missing value for --time-budget\n";
+                return false;
+            }
+            i++;
+            g_timeBudgetSeconds = v;
+        }
+        else if (arg == "--trace") {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for --trace\n";
+                return false;
             }
+            g_tracePath = argv[++i];
+            g_tracing = true;
+        }
+        else {
+            rest.push_back(argv[i]);
         }
     }
-    return result;
+    return true;
 }
 
-/*******************************************************
- * getSubdirectoriesOfCurrentPath():
- *   Non-recursive listing of all subdirectories in the
- *   current working directory (where the .exe is placed).
- *******************************************************/
-std::vector<fs::path> getSubdirectoriesOfCurrentPath()
+int runCommandLine(int argc, char* argv[])
 {
-    std::vector<fs::path> dirs;
-    auto cur = fs::current_path();
-    for (auto& p : fs::directory_iterator(cur, fs::directory_options::skip_permission_denied))
-    {
-        if (fs::is_directory(p.path())) {
-            dirs.push_back(p.path());
+    std::string evalRoot;
+    std::string unifdefRoot;
+    std::string compareRoots[2];
+    bool diffOnly = false;
+    bool hardLinks = false;
+    std::string headerName;
+    std::vector<std::string> configFiles;
+    PPConfiguration extra;
+    std::vector<std::string> queries;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto needValue = [&](const char* opt) -> const char* {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << opt << "\n";
+                return nullptr;
+            }
+            return argv[++i];
+        };
+        if (arg == "--help" || arg == "-h") {
+            printUsage();
+            return 0;
+        }
+        else if (arg == "--eval") {
+            const char* v = needValue("--eval"); if (!v) return 1;
+            evalRoot = v;
+        }
+        else if (arg == "--unifdef") {
+            const char* v = needValue("--unifdef"); if (!v) return 1;
+            unifdefRoot = v;
+        }
+        else if (arg == "--compare") {
+            for (auto& root : compareRoots) {
+                const char* v = needValue("--compare"); if (!v) return 1;
+                root = v;
+            }
+        }
+        else if (arg == "--diff") {
+            diffOnly = true;
+        }
+        else if (arg == "--hard-links") {
+            hardLinks = true;
+        }
+        else if (arg == "--header") {
+            const char* v = needValue("--header"); if (!v) return 1;
+            headerName = v;
+        }
+        else if (arg == "--config") {
+            const char* v = needValue("--config"); if (!v) return 1;
+            configFiles.push_back(v);
+        }
+        else if (arg == "--query") {
+            const char* v = needValue("--query"); if (!v) return 1;
+            queries.push_back(v);
+        }
+        else if (arg == "-D" || arg == "-U") {
+            const char* v = needValue(arg.c_str()); if (!v) return 1;
+            if (!parseAssignment(arg + v, extra)) {
+                std::cerr << "Invalid assignment '" << v << "'\n";
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 2, "-D") == 0 || arg.compare(0, 2, "-U") == 0) {
+            if (!parseAssignment(arg, extra)) {
+                std::cerr << "Invalid assignment '" << arg << "'\n";
+                return 1;
+            }
+        }
+        else {
+            std::cerr << "Unknown option '" << arg << "'\n";
+            printUsage();
+            return 1;
         }
     }
-    std::sort(dirs.begin(), dirs.end());
-    return dirs;
+
+    if (!compareRoots[0].empty()) {
+        return runTreeComparison(compareRoots[0], compareRoots[1]) ? 0 : 1;
+    }
+    if (!unifdefRoot.empty()) {
+        // "." or "src/" name no folder themselves: label by the folder they resolve to
+        std::error_code ec;
+        fs::path named = fs::absolute(unifdefRoot, ec).lexically_normal();
+        if (!named.has_filename()) named = named.parent_path();
+        std::string label = named.filename().string();
+        if (label.empty()) label = "ROOT";
+        return runUnifdef(unifdefRoot, label, extra, diffOnly, hardLinks) ? 0 : 1;
+    }
+    if (evalRoot.empty()) {
+        printUsage();
+        return 1;
+    }
+    if (headerName.empty()) {
+        bool found = false;
+        findServerHeaderInCommon(evalRoot, found, headerName);
+        if (!found) findClientHeaderInUserInterface(evalRoot, found, headerName);
+        if (found) std::cout << "Using header " << headerName << "\n";
+    }
+
+    std::vector<PPConfiguration> configs;
+    for (const auto& path : configFiles) {
+        PPConfiguration cfg;
+        if (!loadConfigurationFile(path, cfg)) return 1;
+        cfg.assignments.insert(cfg.assignments.end(), extra.assignments.begin(), extra.assignments.end());
+        configs.push_back(cfg);
+    }
+    if (configs.empty()) {
+        extra.name = "cmdline";
+        configs.push_back(extra);
+    }
+
+    return runConfigurationEvaluation(evalRoot, headerName, configs, queries) ? 0 : 1;
 }
 
 /*******************************************************
@@ -1045,9 +11803,25 @@ std::vector<fs::path> getSubdirectoriesOfCurrentPath()
  *   2) Let the user pick which folder is for Client, which for Server, etc.
  *   3) Mark them in red or green (set / not set).
  *   4) Then proceed to parse code, searching for defines or python params.
+ *   Any command-line argument besides the global options
+ *   selects the batch mode instead.
  *******************************************************/
-int main()
+int main(int argc, char* argv[])
 {
+    std::vector<char*> args;
+    if (!parseGlobalOptions(argc, argv, args)) {
+        printUsage();
+        return 1;
+    }
+    if (g_tracing) {
+        traceThreadName("main");
+        std::atexit(writeTraceAtExit);
+        startTraceWatcher();
+    }
+    if (args.size() > 1) {
+        return runCommandLine((int)args.size(), args.data());
+    }
+
     bool hasClientHeader = false;
     bool hasServerHeader = false;
     bool hasPythonRoot = false;
@@ -1271,6 +12045,20 @@ int main()
             std::cout << "2) Server\n";
             if (hasPythonRoot)   setColor(10); else setColor(12);
             std::cout << "3) Python\n";
+            if (hasClientHeader && hasServerHeader && hasPythonRoot) setColor(10); else setColor(12);
+            std::cout << "5) Cross-Reference (Client + Server + Python)\n";
+            if (hasClientHeader && hasPythonRoot) setColor(10); else setColor(12);
+            std::cout << "6) Python Bindings (Client + Python)\n";
+            if (hasClientHeader || hasServerHeader) setColor(10); else setColor(12);
+            std::cout << "7) Configuration Evaluator\n";
+            if (hasClientHeader || hasServerHeader || hasPythonRoot) setColor(10); else setColor(12);
+            std::cout << "8) Watch Mode (pinned defines / params)\n";
+            if (hasClientHeader || hasServerHeader) setColor(10); else setColor(12);
+            std::cout << "9) Custom Pattern Search (Client / Server)\n";
+            if (hasClientHeader || hasServerHeader || hasPythonRoot) setColor(10); else setColor(12);
+            std::cout << "10) Identifier Index (build / query)\n";
+            if (hasClientHeader || hasServerHeader) setColor(10); else setColor(12);
+            std::cout << "11) Unifdef Rewrite (Client / Server)\n";
             setColor(7);
 
             std::cout << "4) Back to Path Settings\n";
@@ -1302,7 +12090,8 @@ int main()
                     std::cin.ignore(10000, '\n');
                     continue;
                 }
-                auto defines = readDefines(clientHeaderName);
+                MacroSymbolTable macros;
+                auto defines = loadHeaderDefines("CLIENT", clientPath, clientHeaderName, macros);
                 if (defines.empty()) {
                     std::cerr << "No #define entries in " << clientHeaderName << ".\n";
                     std::cout << "Press ENTER...\n";
@@ -1316,31 +12105,32 @@ int main()
                     std::cin.ignore(10000, '\n');
                     continue;
                 }
+                std::vector<std::string> details;
+                for (const auto& def : defines) details.push_back(describeMacro(macros.macros[def], clientHeaderName));
+                const FuzzyIndex index = buildFuzzyIndex(defines);
                 while (true) {
-                    clearConsole();
-                    std::cout << "CLIENT defines in " << clientHeaderName << ":\n";
-                    for (size_t i = 0; i < defines.size(); ++i) {
-                        std::cout << (i + 1) << ") " << defines[i] << "\n";
-                    }
-                    std::cout << "0) Back\nChoice: ";
-                    int dchoice;
-                    std::cin >> dchoice;
-                    std::cin.ignore(10000, '\n');
-                    if (!std::cin || dchoice == 0) {
+                    std::vector<size_t> picked = pickNames("CLIENT defines in " + clientHeaderName, index, defines, details);
+                    if (picked.empty()) {
                         break;
                     }
-                    if (dchoice < 1 || dchoice >(int)defines.size()) {
-                        std::cerr << "Invalid choice!\n";
-                        continue;
+                    std::vector<std::string> chosen;
+                    for (size_t k : picked) chosen.push_back(defines[k]);
+                    std::vector<uint8_t> complete;
+                    auto results = parseDefinesMultiThread(sourceFiles, chosen, complete);
+
+                    for (size_t k = 0; k < chosen.size(); ++k) {
+                        const PartialScan* partial = complete[k] ? nullptr : &g_lastScan;
+                        writeOutputPerFile("CLIENT", chosen[k] + "_DEFINE", results[k].first, partial);
+                        writeOutputPerFile("CLIENT", chosen[k] + "_FUNC", results[k].second, partial);
                     }
-                    std::string def = defines[dchoice - 1];
-                    auto results = parseAllFilesMultiThread(sourceFiles, def);
-
-                    writeOutputPerFile("CLIENT", def + "_DEFINE", results.first);
-                    writeOutputPerFile("CLIENT", def + "_FUNC", results.second);
 
                     setColor(10);
-                    std::cout << "Done for define '" << def << "' - see 'Output/CLIENT_" << def << "_DEFINE_by_file'...\n";
+                    if (chosen.size() == 1) {
+                        std::cout << "Done for define '" << chosen[0] << "' - see 'Output/CLIENT_" << chosen[0] << "_DEFINE_by_file'...\n";
+                    }
+                    else {
+                        std::cout << "Done for " << chosen.size() << " defines - see 'Output/CLIENT_<DEFINE>_DEFINE_by_file'...\n";
+                    }
                     setColor(7);
                     std::cout << "Press ENTER...\n";
                     std::cin.ignore(10000, '\n');
@@ -1355,7 +12145,8 @@ int main()
                     std::cin.ignore(10000, '\n');
                     continue;
                 }
-                auto defines = readDefines(serverHeaderName);
+                MacroSymbolTable macros;
+                auto defines = loadHeaderDefines("SERVER", serverPath, serverHeaderName, macros);
                 if (defines.empty()) {
                     std::cerr << "No #define entries in " << serverHeaderName << ".\n";
                     std::cout << "Press ENTER...\n";
@@ -1369,31 +12160,32 @@ int main()
                     std::cin.ignore(10000, '\n');
                     continue;
                 }
+                std::vector<std::string> details;
+                for (const auto& def : defines) details.push_back(describeMacro(macros.macros[def], serverHeaderName));
+                const FuzzyIndex index = buildFuzzyIndex(defines);
                 while (true) {
-                    clearConsole();
-                    std::cout << "SERVER defines in " << serverHeaderName << ":\n";
-                    for (size_t i = 0; i < defines.size(); ++i) {
-                        std::cout << (i + 1) << ") " << defines[i] << "\n";
-                    }
-                    std::cout << "0) Back\nChoice: ";
-                    int dchoice;
-                    std::cin >> dchoice;
-                    std::cin.ignore(10000, '\n');
-                    if (!std::cin || dchoice == 0) {
+                    std::vector<size_t> picked = pickNames("SERVER defines in " + serverHeaderName, index, defines, details);
+                    if (picked.empty()) {
                         break;
                     }
-                    if (dchoice < 1 || dchoice >(int)defines.size()) {
-                        std::cerr << "Invalid choice!\n";
-                        continue;
+                    std::vector<std::string> chosen;
+                    for (size_t k : picked) chosen.push_back(defines[k]);
+                    std::vector<uint8_t> complete;
+                    auto results = parseDefinesMultiThread(sourceFiles, chosen, complete);
+
+                    for (size_t k = 0; k < chosen.size(); ++k) {
+                        const PartialScan* partial = complete[k] ? nullptr : &g_lastScan;
+                        writeOutputPerFile("SERVER", chosen[k] + "_DEFINE", results[k].first, partial);
+                        writeOutputPerFile("SERVER", chosen[k] + "_FUNC", results[k].second, partial);
                     }
-                    std::string def = defines[dchoice - 1];
-                    auto results = parseAllFilesMultiThread(sourceFiles, def);
-
-                    writeOutputPerFile("SERVER", def + "_DEFINE", results.first);
-                    writeOutputPerFile("SERVER", def + "_FUNC", results.second);
 
                     setColor(10);
-                    std::cout << "Done for define '" << def << "' - see 'Output/SERVER_" << def << "_DEFINE_by_file'...\n";
+                    if (chosen.size() == 1) {
+                        std::cout << "Done for define '" << chosen[0] << "' - see 'Output/SERVER_" << chosen[0] << "_DEFINE_by_file'...\n";
+                    }
+                    else {
+                        std::cout << "Done for " << chosen.size() << " defines - see 'Output/SERVER_<DEFINE>_DEFINE_by_file'...\n";
+                    }
                     setColor(7);
                     std::cout << "Press ENTER...\n";
                     std::cin.ignore(10000, '\n');
@@ -1409,18 +12201,7 @@ int main()
                     continue;
                 }
                 // gather all .py files
-                std::vector<std::string> pyFiles;
-                try {
-                    for (auto& p : fs::recursive_directory_iterator(chosenPythonRoot,
-                        fs::directory_options::skip_permission_denied))
-                    {
-                        if (fs::is_symlink(p.path())) continue;
-                        if (fs::is_regular_file(p.path()) && p.path().extension() == ".py") {
-                            pyFiles.push_back(p.path().string());
-                        }
-                    }
-                }
-                catch (...) {}
+                auto pyFiles = findPythonFiles(chosenPythonRoot);
                 if (pyFiles.empty()) {
                     std::cerr << "No .py files found in " << chosenPythonRoot << ".\n";
                     std::cout << "Press ENTER...\n";
@@ -1437,63 +12218,116 @@ int main()
                 std::vector<std::string> params(paramSet.begin(), paramSet.end());
                 std::sort(params.begin(), params.end());
 
+                const FuzzyIndex index = buildFuzzyIndex(params);
                 while (true) {
-                    clearConsole();
-                    std::cout << "Python app.<param> found:\n";
-                    for (size_t i = 0; i < params.size(); ++i) {
-                        std::cout << (i + 1) << ") " << params[i] << "\n";
-                    }
-                    std::cout << "0) Back\nChoice: ";
-                    int pchoice;
-                    std::cin >> pchoice;
-                    std::cin.ignore(10000, '\n');
-                    if (!std::cin || pchoice == 0) {
+                    std::vector<size_t> picked = pickNames("Python app.<param> found", index, params);
+                    if (picked.empty()) {
                         break;
                     }
-                    if (pchoice < 1 || pchoice >(int)params.size()) {
-                        std::cerr << "Invalid choice!\n";
-                        continue;
-                    }
-                    std::string chosenParam = params[pchoice - 1];
-                    auto pyResults = parsePythonAllFilesMultiThread(pyFiles, chosenParam);
-
-                    fs::create_directory("Output");
-                    {
-                        std::ostringstream fname;
-                        fname << "Output/PYTHON_" << chosenParam << "_DEFINE.txt";
-                        std::ofstream out(fname.str());
-                        std::unordered_set<std::string> defFiles;
-                        for (auto& b : pyResults.first) {
-                            out << b.content << "\n";
-                            defFiles.insert(b.filename);
-                        }
-                        out << "\n--- SUMMARY (" << pyResults.first.size()
-                            << " if-block(s)) in files: ---\n";
-                        for (auto& fn : defFiles) {
-                            out << fn << "\n";
-                        }
-                    }
-                    {
-                        std::ostringstream fname;
-                        fname << "Output/PYTHON_" << chosenParam << "_FUNC.txt";
-                        std::ofstream out(fname.str());
-                        std::unordered_set<std::string> funcFiles;
-                        for (auto& b : pyResults.second) {
-                            out << b.content << "\n";
-                            funcFiles.insert(b.filename);
-                        }
-                        out << "\n--- SUMMARY (" << pyResults.second.size()
-                            << " function block(s)) in files: ---\n";
-                        for (auto& fn : funcFiles) {
-                            out << fn << "\n";
-                        }
+                    // one scan per param; an interrupted one ends the queue
+                    std::string done;
+                    for (size_t k : picked) {
+                        const std::string& chosenParam = params[k];
+                        auto pyResults = parsePythonAllFilesMultiThread(pyFiles, chosenParam);
+                        writePythonOutput(chosenParam, pyResults, &g_lastScan);
+                        done += (done.empty() ? "app." : ", app.") + chosenParam;
+                        if (!g_lastScan.unscanned.empty()) break;
                     }
                     setColor(10);
-                    std::cout << "Done for app." << chosenParam << ". Press ENTER...\n";
+                    std::cout << "Done for " << done << ". Press ENTER...\n";
                     setColor(7);
                     std::cin.ignore(10000, '\n');
                 }
             }
+            else if (choice == 5) {
+                // CROSS-REFERENCE
+                clearConsole();
+                if (!hasClientHeader && !hasServerHeader && !hasPythonRoot) {
+                    std::cerr << "No paths set. Please configure at least one root first.\n";
+                    std::cout << "Press ENTER...\n";
+                    std::cin.ignore(10000, '\n');
+                    continue;
+                }
+                runCrossReferenceScan(clientPath, hasClientHeader ? clientHeaderName : "",
+                    serverPath, hasServerHeader ? serverHeaderName : "",
+                    hasPythonRoot ? chosenPythonRoot : "");
+
+                setColor(10);
+                std::cout << "Done - see 'Output/CROSSREF_REPORT.txt'...\n";
+                setColor(7);
+                std::cout << "Press ENTER...\n";
+                std::cin.ignore(10000, '\n');
+            }
+            else if (choice == 6) {
+                // BINDING MAP
+                clearConsole();
+                if (!hasClientHeader || !hasPythonRoot) {
+                    std::cerr << "Client Path and Python Root must both be set.\n";
+                    std::cout << "Press ENTER...\n";
+                    std::cin.ignore(10000, '\n');
+                    continue;
+                }
+                runBindingMapMode(clientPath, clientHeaderName, chosenPythonRoot);
+            }
+            else if (choice == 7) {
+                // CONFIGURATION EVALUATOR
+                clearConsole();
+                if (!hasClientHeader && !hasServerHeader) {
+                    std::cerr << "No client or server header found. Please set a path first.\n";
+                    std::cout << "Press ENTER...\n";
+                    std::cin.ignore(10000, '\n');
+                    continue;
+                }
+                runConfigurationEvaluatorMenu(hasClientHeader, clientPath, clientHeaderName,
+                    hasServerHeader, serverPath, serverHeaderName);
+            }
+            else if (choice == 8) {
+                // WATCH MODE
+                clearConsole();
+                if (!hasClientHeader && !hasServerHeader && !hasPythonRoot) {
+                    std::cerr << "No paths set. Please configure at least one root first.\n";
+                    std::cout << "Press ENTER...\n";
+                    std::cin.ignore(10000, '\n');
+                    continue;
+                }
+                runWatchMode(clientPath, hasClientHeader ? clientHeaderName : "",
+                    serverPath, hasServerHeader ? serverHeaderName : "",
+                    hasPythonRoot ? chosenPythonRoot : "");
+            }
+            else if (choice == 9) {
+                // CUSTOM PATTERN SEARCH
+                clearConsole();
+                if (!hasClientHeader && !hasServerHeader) {
+                    std::cerr << "No client or server header found. Please set a path first.\n";
+                    std::cout << "Press ENTER...\n";
+                    std::cin.ignore(10000, '\n');
+                    continue;
+                }
+                runPatternSearchMenu(hasClientHeader, clientPath, hasServerHeader, serverPath);
+            }
+            else if (choice == 10) {
+                // IDENTIFIER INDEX
+                clearConsole();
+                if (!hasClientHeader && !hasServerHeader && !hasPythonRoot) {
+                    std::cerr << "No paths set. Please configure at least one root first.\n";
+                    std::cout << "Press ENTER...\n";
+                    std::cin.ignore(10000, '\n');
+                    continue;
+                }
+                runIdentifierIndexMenu(hasClientHeader, clientPath, hasServerHeader, serverPath,
+                    hasPythonRoot ? chosenPythonRoot : "");
+            }
+            else if (choice == 11) {
+                // UNIFDEF REWRITE
+                clearConsole();
+                if (!hasClientHeader && !hasServerHeader) {
+                    std::cerr << "No client or server header found. Please set a path first.\n";
+                    std::cout << "Press ENTER...\n";
+                    std::cin.ignore(10000, '\n');
+                    continue;
+                }
+                runUnifdefMenu(hasClientHeader, clientPath, hasServerHeader, serverPath);
+            }
             else {
                 // invalid
                 continue;
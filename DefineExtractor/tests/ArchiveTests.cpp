@@ -0,0 +1,613 @@
+/** ArchiveTests.cpp:
+ *   Round trips through Inflater, gunzip, TarReader and readZip.
+ *   The fixtures are built here: a small encoder writes stored
+ *   and fixed Huffman blocks, a dynamic block comes from zlib,
+ *   and gzip, tar and zip containers are put together by hand.
+ *   Truncated and corrupted copies must be rejected, or at least
+ *   never yield wrong content.
+ */
+#define main defineExtractorMain
+#include "../DefineExtractor.cpp"
+#undef main
+
+#include "TestSupport.h"
+
+/**** DEFLATE encoder ****/
+
+/** BitWriter: packs bits LSB first, as DEFLATE reads them */
+struct BitWriter {
+    std::string out;
+    uint64_t acc = 0;
+    unsigned count = 0;
+
+    void put(uint32_t value, unsigned bits)
+    {
+        acc |= (uint64_t)value << count;
+        count += bits;
+        while (count >= 8) {
+            out += (char)(acc & 0xFF);
+            acc >>= 8;
+            count -= 8;
+        }
+    }
+
+    /** putCode(code, bits): Huffman codes go in most significant bit first */
+    void putCode(uint32_t code, unsigned bits)
+    {
+        uint32_t reversed = 0;
+        for (unsigned i = 0; i < bits; ++i) reversed |= ((code >> i) & 1) << (bits - 1 - i);
+        put(reversed, bits);
+    }
+
+    void align()
+    {
+        if (count > 0) put(0, 8 - count);
+    }
+};
+
+/** Token: a literal byte (distance 0) or a back-reference */
+struct Token {
+    unsigned length;
+    unsigned distance;
+    unsigned char literal;
+};
+
+static Token literal(unsigned char c) { return Token{ 0, 0, c }; }
+static Token match(unsigned length, unsigned distance) { return Token{ length, distance, 0 }; }
+
+static void putFixedSymbol(BitWriter& w, unsigned symbol)
+{
+    if (symbol < 144) w.putCode(0x30 + symbol, 8);
+    else if (symbol < 256) w.putCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280) w.putCode(symbol - 256, 7);
+    else w.putCode(0xC0 + symbol - 280, 8);
+}
+
+/** fixedBlock(w, tokens, last): one block with the fixed Huffman codes */
+static void fixedBlock(BitWriter& w, const std::vector<Token>& tokens, bool last)
+{
+    static const unsigned lengthBase[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const unsigned lengthExtra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const unsigned distanceBase[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const unsigned distanceExtra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    w.put(last ? 1 : 0, 1);
+    w.put(1, 2);
+    for (const Token& t : tokens) {
+        if (t.distance == 0) {
+            putFixedSymbol(w, t.literal);
+            continue;
+        }
+        unsigned l = 28;
+        while (lengthBase[l] > t.length) --l;
+        putFixedSymbol(w, 257 + l);
+        w.put(t.length - lengthBase[l], lengthExtra[l]);
+        unsigned d = 29;
+        while (distanceBase[d] > t.distance) --d;
+        w.putCode(d, 5);
+        w.put(t.distance - distanceBase[d], distanceExtra[d]);
+    }
+    putFixedSymbol(w, 256);
+}
+
+/** storedBlock(w, data, last): one uncompressed block (data <= 65535 bytes) */
+static void storedBlock(BitWriter& w, const std::string& data, bool last)
+{
+    w.put(last ? 1 : 0, 1);
+    w.put(0, 2);
+    w.align();
+    w.put((uint32_t)data.size(), 16);
+    w.put((uint32_t)data.size() ^ 0xFFFF, 16);
+    w.out += data;
+}
+
+/** expand(tokens): what the tokens decode to */
+static std::string expand(const std::vector<Token>& tokens, std::string out = std::string())
+{
+    for (const Token& t : tokens) {
+        if (t.distance == 0) {
+            out += (char)t.literal;
+            continue;
+        }
+        for (unsigned i = 0; i < t.length; ++i) out += out[out.size() - t.distance];
+    }
+    return out;
+}
+
+/** inflate(data, size, out, pieces): runs the Inflater over memory */
+static bool inflate(const char* data, size_t size, std::string& out, size_t* pieces = nullptr)
+{
+    Inflater inflater;
+    ArchiveInput in(data, size);
+    out.clear();
+    if (pieces) *pieces = 0;
+    return inflater.run(in, [&](const char* d, size_t n) {
+        out.append(d, n);
+        if (pieces) ++*pieces;
+        return true;
+    });
+}
+
+static bool inflate(const std::string& data, std::string& out) { return inflate(data.data(), data.size(), out); }
+
+/** dynamicText(): the input of s_dynamicBlock, as generated by
+ *  "".join("line %d: the quick brown fox jumps %d times\n" % (i, i*i % 97) for i in range(40))
+ */
+static std::string dynamicText()
+{
+    std::string text;
+    for (int i = 0; i < 40; ++i) {
+        text += "line " + std::to_string(i) + ": the quick brown fox jumps " +
+            std::to_string(i * i % 97) + " times\n";
+    }
+    return text;
+}
+
+// zlib.compressobj(9, zlib.DEFLATED, -15) of dynamicText(): one dynamic Huffman block
+static const unsigned char s_dynamicBlock[] = {
+    0x7d, 0x94, 0x49, 0x0e, 0xc2, 0x30, 0x10, 0x04, 0xef, 0xbc, 0xc2, 0x4f, 0xc0, 0x33, 0xb1, 0x63,
+    0xf3, 0x1c, 0x50, 0x10, 0x61, 0x49, 0x58, 0x12, 0xc1, 0xf3, 0x11, 0x07, 0x24, 0xf7, 0xa5, 0xee,
+    0xa5, 0x49, 0x67, 0xaa, 0xc7, 0xd7, 0x71, 0x1a, 0xc2, 0x76, 0x17, 0x96, 0xd3, 0x10, 0x1e, 0xeb,
+    0x78, 0xb8, 0x84, 0xfd, 0x73, 0x7e, 0x4f, 0xe1, 0x38, 0x7f, 0xc2, 0x79, 0xbd, 0xdd, 0x5f, 0x61,
+    0x1b, 0x96, 0xf1, 0x36, 0xbc, 0x36, 0xd7, 0x1f, 0x19, 0x89, 0x8c, 0x2d, 0x69, 0x44, 0x76, 0x2d,
+    0xe9, 0x44, 0xd6, 0x96, 0xec, 0xf0, 0xeb, 0xb9, 0x45, 0x13, 0xa1, 0x96, 0x5a, 0x34, 0x13, 0xea,
+    0x32, 0xb5, 0xc7, 0x9f, 0x92, 0xac, 0x85, 0xd0, 0x2c, 0x0b, 0xa8, 0x84, 0x16, 0xd9, 0x6a, 0x44,
+    0x55, 0x2e, 0x28, 0xba, 0x32, 0x49, 0x10, 0xd9, 0x56, 0x2f, 0x2c, 0xfa, 0xea, 0x4d, 0x58, 0x34,
+    0xa6, 0x28, 0x1a, 0x73, 0xdd, 0x02, 0x2a, 0xcb, 0x3a, 0x17, 0x9d, 0x55, 0x69, 0x42, 0x44, 0x69,
+    0xae, 0xeb, 0x45, 0x6b, 0xbd, 0x5c, 0x8d, 0xa1, 0xb5, 0x28, 0x79, 0x0d, 0xb5, 0x25, 0xc9, 0x60,
+    0xa8, 0xad, 0x4a, 0x75, 0x0d, 0xb5, 0x75, 0x52, 0x07, 0x43, 0x6d, 0x55, 0xef, 0x1c, 0xbd, 0x75,
+    0x9a, 0x17, 0xbd, 0x55, 0xcd, 0x80, 0xde, 0x92, 0xee, 0x17, 0xbd, 0x15, 0x41, 0x51, 0x5b, 0x96,
+    0x3a, 0x38, 0x6a, 0x33, 0xb9, 0x0a, 0x47, 0x6d, 0x45, 0x32, 0x38, 0x6a, 0x4b, 0xfa, 0x38, 0xa2,
+    0x36, 0x93, 0xea, 0x38, 0x6a, 0x2b, 0xf2, 0x3c, 0x39, 0x6a, 0xcb, 0xa2, 0xd8, 0xf9, 0x85, 0xd4,
+    0x9d, 0xa1, 0xb6, 0xa8, 0x73, 0x59, 0x9b, 0xd4, 0xd7, 0xd9, 0xdb, 0x9f, 0xfd, 0x02,
+};
+
+static std::string dynamicBlock() { return std::string((const char*)s_dynamicBlock, sizeof(s_dynamicBlock)); }
+
+/** fixedStream(text): 'text' as literals, a run from distance 1 and a copy of all that, in one fixed block */
+static std::string fixedStream(const std::string& text, std::string* expected = nullptr)
+{
+    std::vector<Token> tokens;
+    for (char c : text) tokens.push_back(literal((unsigned char)c));
+    tokens.push_back(match(10, 1));
+    tokens.push_back(match((unsigned)std::min<size_t>(text.size() + 10, 258), (unsigned)text.size() + 10));
+    BitWriter w;
+    fixedBlock(w, tokens, true);
+    w.align();
+    if (expected) *expected = expand(tokens);
+    return w.out;
+}
+
+/**** gzip, tar and zip containers ****/
+
+static void putLE16(std::string& out, uint32_t v) { out += (char)(v & 0xFF); out += (char)((v >> 8) & 0xFF); }
+static void putLE32(std::string& out, uint32_t v) { putLE16(out, v & 0xFFFF); putLE16(out, v >> 16); }
+static void putLE64(std::string& out, uint64_t v) { putLE32(out, (uint32_t)v); putLE32(out, (uint32_t)(v >> 32)); }
+
+/** gzipMember(deflated, text, name): header (with FNAME if 'name' is given), data and trailer */
+static std::string gzipMember(const std::string& deflated, const std::string& text, const char* name = nullptr)
+{
+    std::string out = { '\x1f', '\x8b', 8, (char)(name ? 8 : 0), 0, 0, 0, 0, 0, 3 };
+    if (name) out.append(name, std::strlen(name) + 1);
+    out += deflated;
+    putLE32(out, crc32Update(0, text.data(), text.size()));
+    putLE32(out, (uint32_t)text.size());
+    return out;
+}
+
+/** runGunzip(data, out, error): gunzip over memory */
+static bool runGunzip(const std::string& data, std::string& out, std::string& error)
+{
+    ArchiveInput in(data.data(), data.size());
+    out.clear();
+    return gunzip(in, [&](const char* d, size_t n) { out.append(d, n); return true; }, error);
+}
+
+/** tarHeader(name, size, type): a ustar header block with its checksum */
+static std::string tarHeader(const std::string& name, size_t size, char type, const std::string& prefix = std::string())
+{
+    std::string h(TAR_BLOCK, '\0');
+    h.replace(0, std::min<size_t>(name.size(), 100), name.substr(0, 100));
+    std::snprintf(&h[100], 8, "%07o", 0644);
+    std::snprintf(&h[124], 12, "%011o", (unsigned)size);
+    h[156] = type;
+    std::memcpy(&h[257], "ustar\0" "00", 8);
+    h.replace(345, prefix.size(), prefix);
+    unsigned sum = 8 * ' ';
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        if (i < 148 || i >= 156) sum += (unsigned char)h[i];
+    }
+    std::snprintf(&h[148], 8, "%06o", sum);
+    h[155] = ' ';
+    return h;
+}
+
+/** tarEntry(header, body): header plus body padded to whole blocks */
+static std::string tarEntry(const std::string& header, const std::string& body)
+{
+    std::string out = header + body;
+    out.resize(out.size() + (TAR_BLOCK - body.size() % TAR_BLOCK) % TAR_BLOCK, '\0');
+    return out;
+}
+
+/** paxRecord(key, value): "<length> <key>=<value>\n", the length counting itself */
+static std::string paxRecord(const std::string& key, const std::string& value)
+{
+    size_t body = key.size() + value.size() + 3;
+    size_t length = body + std::to_string(body).size();
+    if (std::to_string(length).size() != std::to_string(body).size()) ++length;
+    return std::to_string(length) + " " + key + "=" + value + "\n";
+}
+
+/** ZipMember: one member of zip64Archive() */
+struct ZipMember {
+    std::string name;
+    std::string text;
+    bool deflate;
+};
+
+/** zip64Archive(members): every size and offset in the central
+ *  directory moved to the zip64 extra field, the end record
+ *  pointing to a zip64 end record through its locator
+ */
+static std::string zip64Archive(const std::vector<ZipMember>& members)
+{
+    std::string out, directory;
+    for (const ZipMember& m : members) {
+        std::string data = m.text;
+        if (m.deflate) {
+            BitWriter w;
+            std::vector<Token> tokens;
+            for (char c : m.text) tokens.push_back(literal((unsigned char)c));
+            fixedBlock(w, tokens, true);
+            w.align();
+            data = w.out;
+        }
+        uint32_t crc = crc32Update(0, m.text.data(), m.text.size());
+        uint64_t offset = out.size();
+
+        putLE32(out, 0x04034b50);
+        putLE16(out, 45);
+        putLE16(out, 0);
+        putLE16(out, m.deflate ? 8 : 0);
+        putLE32(out, 0);
+        putLE32(out, crc);
+        putLE32(out, (uint32_t)data.size());
+        putLE32(out, (uint32_t)m.text.size());
+        putLE16(out, (uint32_t)m.name.size());
+        putLE16(out, 0);
+        out += m.name;
+        out += data;
+
+        putLE32(directory, 0x02014b50);
+        putLE16(directory, 45);
+        putLE16(directory, 45);
+        putLE16(directory, 0);
+        putLE16(directory, m.deflate ? 8 : 0);
+        putLE32(directory, 0);
+        putLE32(directory, crc);
+        putLE32(directory, 0xFFFFFFFF);
+        putLE32(directory, 0xFFFFFFFF);
+        putLE16(directory, (uint32_t)m.name.size());
+        putLE16(directory, 4 + 24);
+        putLE16(directory, 0);
+        putLE16(directory, 0);
+        putLE16(directory, 0);
+        putLE32(directory, 0);
+        putLE32(directory, 0xFFFFFFFF);
+        directory += m.name;
+        putLE16(directory, 0x0001);
+        putLE16(directory, 24);
+        putLE64(directory, m.text.size());
+        putLE64(directory, data.size());
+        putLE64(directory, offset);
+    }
+    uint64_t cdOffset = out.size();
+    out += directory;
+
+    uint64_t zip64End = out.size();
+    putLE32(out, 0x06064b50);
+    putLE64(out, 44);
+    putLE16(out, 45);
+    putLE16(out, 45);
+    putLE32(out, 0);
+    putLE32(out, 0);
+    putLE64(out, members.size());
+    putLE64(out, members.size());
+    putLE64(out, directory.size());
+    putLE64(out, cdOffset);
+
+    putLE32(out, 0x07064b50);
+    putLE32(out, 0);
+    putLE64(out, zip64End);
+    putLE32(out, 1);
+
+    putLE32(out, 0x06054b50);
+    putLE16(out, 0);
+    putLE16(out, 0);
+    putLE16(out, 0xFFFF);
+    putLE16(out, 0xFFFF);
+    putLE32(out, 0xFFFFFFFF);
+    putLE32(out, 0xFFFFFFFF);
+    putLE16(out, 0);
+    return out;
+}
+
+/** runReadZip(bytes, members): readZip over 'bytes' written to a scratch file */
+static bool runReadZip(const std::string& bytes, std::map<std::string, std::string>& members)
+{
+    static const fs::path path = fs::temp_directory_path() / ("archive_tests_" + std::to_string(::getpid()) + ".zip");
+    {
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write(bytes.data(), (std::streamsize)bytes.size());
+    }
+    members.clear();
+    std::string error;
+    std::streambuf* saved = std::cerr.rdbuf(nullptr);   // the skip warnings are expected here
+    bool ok = readZip(path, members, error);
+    std::cerr.rdbuf(saved);
+    std::error_code ec;
+    fs::remove(path, ec);
+    return ok;
+}
+
+/**** tests ****/
+
+static void testCrc()
+{
+    CHECK_EQ(crc32Update(0, "123456789", 9), 0xCBF43926u, "CRC-32 check value");
+    uint32_t crc = crc32Update(0, "12345", 5);
+    CHECK_EQ(crc32Update(crc, "6789", 4), 0xCBF43926u, "CRC-32 in two pieces");
+}
+
+static void testStoredAndFixedBlocks()
+{
+    std::string out;
+    BitWriter w;
+    storedBlock(w, "stored block\n", true);
+    CHECK(inflate(w.out, out));
+    CHECK_EQ(out, std::string("stored block\n"), "stored block");
+
+    std::string expected;
+    std::string fixed = fixedStream("#define FIXED 1\n", &expected);
+    CHECK(inflate(fixed, out));
+    CHECK_EQ(out, expected, "fixed block with overlapping matches");
+
+    // stored, fixed and empty stored blocks in one stream; the fixed block starts mid-byte
+    std::vector<Token> tokens = { literal('a'), literal('b'), match(6, 2), literal('\n') };
+    BitWriter mixed;
+    storedBlock(mixed, "first\n", false);
+    fixedBlock(mixed, tokens, false);
+    storedBlock(mixed, "", false);
+    fixedBlock(mixed, { match(4, 10) }, true);
+    mixed.align();
+    std::string mixedExpected = expand({ match(4, 10) }, expand(tokens, "first\n"));
+    CHECK(inflate(mixed.out, out));
+    CHECK_EQ(out, mixedExpected, "stored and fixed blocks in one stream");
+
+    BitWriter badLength;
+    storedBlock(badLength, "abc", true);
+    badLength.out[3] ^= 1;   // NLEN no longer the complement of LEN
+    CHECK(!inflate(badLength.out, out));
+
+    BitWriter farBack;
+    fixedBlock(farBack, { literal('x'), match(3, 2) }, true);
+    farBack.align();
+    CHECK(!inflate(farBack.out, out));   // reference before the start of the output
+}
+
+static void testDynamicBlock()
+{
+    std::string block = dynamicBlock();
+    CHECK_EQ(((unsigned char)block[0] >> 1) & 3, 2, "block type of the zlib fixture");
+    std::string out;
+    CHECK(inflate(block, out));
+    CHECK_EQ(out, dynamicText(), "dynamic block");
+}
+
+/** the output buffer hands INFLATE_OUTPUT bytes to the sink and keeps the
+ *  last INFLATE_WINDOW; matches of the full window distance must keep
+ *  reading the right bytes across those moves
+ */
+static void testMatchAcrossFlush()
+{
+    std::vector<Token> tokens;
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < INFLATE_WINDOW; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        tokens.push_back(literal((unsigned char)(seed >> 16)));
+    }
+    size_t total = INFLATE_WINDOW;
+    for (unsigned i = 0; total < INFLATE_OUTPUT + 3 * INFLATE_WINDOW; ++i) {
+        Token t = (i % 5 == 4) ? match(131, 30001) : match(258, (unsigned)INFLATE_WINDOW);
+        if (i % 97 == 0) t = literal((unsigned char)i);
+        tokens.push_back(t);
+        total += t.distance ? t.length : 1;
+    }
+    BitWriter w;
+    size_t half = tokens.size() / 2;
+    fixedBlock(w, std::vector<Token>(tokens.begin(), tokens.begin() + half), false);
+    fixedBlock(w, std::vector<Token>(tokens.begin() + half, tokens.end()), true);
+    w.align();
+
+    std::string out;
+    size_t pieces = 0;
+    CHECK(inflate(w.out.data(), w.out.size(), out, &pieces));
+    CHECK(pieces >= 2);
+    CHECK_EQ(out.size(), total, "output size");
+    CHECK(out == expand(tokens));
+}
+
+static void testMultiMemberGzip()
+{
+    std::string fixedText, out, error;
+    std::string fixed = fixedStream("int member;\n", &fixedText);
+    std::string gz = gzipMember(dynamicBlock(), dynamicText(), "first.txt") + gzipMember(fixed, fixedText);
+    CHECK(runGunzip(gz, out, error));
+    CHECK_EQ(out, dynamicText() + fixedText, "two gzip members");
+
+    CHECK(runGunzip(gz + std::string(1024, '\0'), out, error));   // zero padding ends the stream
+    CHECK_EQ(out, dynamicText() + fixedText, "gzip with trailing padding");
+
+    std::string flagged = gzipMember(fixed, fixedText);
+    flagged[3] = 4 | 16 | 2;
+    static const char fields[] = "\x03\x00" "abc" "comment\0" "\x12\x34";   // extra, comment, header CRC
+    flagged.insert(10, std::string(fields, sizeof(fields) - 1));
+    CHECK(runGunzip(flagged, out, error));
+    CHECK_EQ(out, fixedText, "gzip optional header fields");
+
+    CHECK(!runGunzip("plain text", out, error));
+    CHECK_EQ(error, std::string("not a gzip file"), "plain text");
+}
+
+static void testTar()
+{
+    std::string longName = "src/" + std::string(150, 'n') + "/deep.h";
+    std::string prefixed = std::string(120, 'p');
+    std::string paxPath = "pax/" + std::string(110, 'x') + "/module.py";
+    std::string paxBody = "# pax member\nimport os\n";
+    std::string pax = paxRecord("path", paxPath) + paxRecord("size", std::to_string(paxBody.size()));
+
+    std::string tar;
+    tar += tarEntry(tarHeader("./src/a.cpp", 10, '0'), "int a=1;\n\n");
+    tar += tarEntry(tarHeader("././@LongLink", longName.size() + 1, 'L'), longName + '\0');
+    tar += tarEntry(tarHeader("truncated", 14, '0'), "#define DEEP\n\n");
+    tar += tarEntry(tarHeader("PaxHeaders/module.py", pax.size(), 'x'), pax);
+    tar += tarEntry(tarHeader("module.py", 999, '0'), paxBody);   // the pax size wins
+    tar += tarEntry(tarHeader("name.h", 4, '0', prefixed), "x;\n\n");
+    tar += tarEntry(tarHeader("notes.txt", 5, '0'), "skip\n");
+    tar += tarEntry(tarHeader("dir/", 0, '5'), "");
+    tar += std::string(2 * TAR_BLOCK, '\0');
+
+    std::map<std::string, std::string> expected = {
+        { "src/a.cpp", "int a=1;\n\n" },
+        { longName, "#define DEEP\n\n" },
+        { paxPath, paxBody },
+        { prefixed + "/name.h", "x;\n\n" },
+    };
+    for (size_t piece : { tar.size(), (size_t)1, (size_t)7, (size_t)513 }) {
+        std::map<std::string, std::string> members;
+        TarReader reader(members);
+        bool ok = true;
+        for (size_t pos = 0; pos < tar.size() && ok; pos += piece) {
+            ok = reader.feed(tar.data() + pos, std::min(piece, tar.size() - pos));
+        }
+        CHECK(ok);
+        CHECK(reader.complete());
+        CHECK_EQ(members.size(), expected.size(), "tar members, pieces of " << piece);
+        CHECK(members == expected);
+    }
+}
+
+static void testZip64()
+{
+    std::vector<ZipMember> members = {
+        { "z/stored.h", "#define STORED 1\n", false },
+        { "z/deflated.cpp", "#ifdef STORED\nint deflated;\n#endif\n", true },
+        { "z/readme.txt", "not a source member\n", false },
+    };
+    std::map<std::string, std::string> read;
+    CHECK(runReadZip(zip64Archive(members), read));
+    CHECK_EQ(read.size(), (size_t)2, "zip64 members");
+    CHECK_EQ(read["z/stored.h"], members[0].text, "stored member");
+    CHECK_EQ(read["z/deflated.cpp"], members[1].text, "deflated member");
+}
+
+/** every prefix of a stream shorter than the whole must fail */
+static void testTruncated()
+{
+    std::string out, error;
+    BitWriter stored;
+    storedBlock(stored, "stored block\n", true);
+    for (const std::string& stream : { stored.out, fixedStream("#define FIXED 1\n"), dynamicBlock() }) {
+        for (size_t n = 0; n < stream.size(); ++n) {
+            CHECK(!inflate(stream.data(), n, out));
+        }
+    }
+
+    std::string gz = gzipMember(dynamicBlock(), dynamicText(), "name");
+    for (size_t n = 0; n < gz.size(); ++n) {
+        CHECK(!runGunzip(gz.substr(0, n), out, error));
+    }
+
+    std::string tar = tarEntry(tarHeader("a.h", 700, '0'), std::string(700, 'a'));
+    for (size_t n = 1; n < tar.size(); ++n) {
+        std::map<std::string, std::string> members;
+        TarReader reader(members);
+        CHECK(reader.feed(tar.data(), n));
+        CHECK(!reader.complete());
+        reader.discardPartial();
+        CHECK(members.empty() || members["a.h"] == std::string(700, 'a'));
+    }
+
+    std::string zip = zip64Archive({ { "a.h", "#define A\n", false }, { "b.cpp", "int b;\n", true } });
+    for (size_t n = 0; n < zip.size(); ++n) {
+        std::map<std::string, std::string> members;
+        CHECK(!runReadZip(zip.substr(0, n), members));
+        CHECK(members.empty());
+    }
+}
+
+/** damaged bytes may be noticed or not, but must not crash nor yield wrong content */
+static void testCorrupt()
+{
+    std::string out, error;
+    std::string gz = gzipMember(dynamicBlock(), dynamicText());
+    for (size_t i = 0; i < gz.size(); ++i) {
+        if (i >= 4 && i < 10) continue;   // modification time, extra flags and OS are not checked
+        std::string damaged = gz;
+        damaged[i] ^= 0x5A;
+        CHECK(!runGunzip(damaged, out, error));
+    }
+    uint32_t seed = 7;
+    for (int round = 0; round < 2000; ++round) {
+        std::string damaged = dynamicBlock();
+        for (int k = 0; k < 3; ++k) {
+            seed = seed * 1103515245u + 12345u;
+            damaged[(seed >> 8) % damaged.size()] ^= (char)(1 << ((seed >> 4) % 8));
+        }
+        inflate(damaged, out);   // any result, as long as it returns
+    }
+
+    std::string tar = tarEntry(tarHeader("a.h", 10, '0'), "#define A\n") + std::string(2 * TAR_BLOCK, '\0');
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        if (i == 154 || i == 155) continue;   // terminators of the checksum field
+        std::string damaged = tar;
+        damaged[i] ^= 0x21;
+        std::map<std::string, std::string> members;
+        TarReader reader(members);
+        CHECK(!reader.feed(damaged.data(), damaged.size()));   // the checksum covers the whole header
+    }
+
+    std::vector<ZipMember> originals = { { "a.h", "#define A\n", false }, { "b.cpp", "int b = A;\n", true } };
+    std::string zip = zip64Archive(originals);
+    for (size_t i = 0; i < zip.size(); ++i) {
+        for (unsigned char flip : { 0x01, 0x80, 0xFF }) {
+            std::string damaged = zip;
+            damaged[i] ^= (char)flip;
+            std::map<std::string, std::string> members;
+            runReadZip(damaged, members);
+            for (const auto& member : members) {
+                CHECK(member.second == originals[0].text || member.second == originals[1].text);
+            }
+        }
+    }
+}
+
+int main()
+{
+    testCrc();
+    testStoredAndFixedBlocks();
+    testDynamicBlock();
+    testMatchAcrossFlush();
+    testMultiMemberGzip();
+    testTar();
+    testZip64();
+    testTruncated();
+    testCorrupt();
+    return testSummary("ArchiveTests");
+}
@@ -0,0 +1,279 @@
+/** PreprocessorTests.cpp:
+ *   Tables for PPExpressionEvaluator (unsigned promotion,
+ *   tri-state && / ||, unknown names, division by zero),
+ *   evaluateRegions and the #if chain rewriting of
+ *   unifdefLines. Macro tables are written as "NAME=body"
+ *   items separated by ';': "NAME" alone is defined without a
+ *   body, "NAME(x)=body" is function-like, "!NAME" is undefined.
+ */
+#define main defineExtractorMain
+#include "../DefineExtractor.cpp"
+#undef main
+
+#include "TestSupport.h"
+
+/** specItems(spec): the ';'-separated items of 'spec' */
+static std::vector<std::string> specItems(const std::string& spec)
+{
+    std::vector<std::string> items;
+    std::stringstream in(spec);
+    std::string item;
+    while (std::getline(in, item, ';')) {
+        item = trimCopy(item);
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+/** macroTable(spec): the table described by 'spec' (see above) */
+static MacroTable macroTable(const std::string& spec)
+{
+    MacroTable table;
+    for (const std::string& item : specItems(spec)) {
+        if (item[0] == '!') {
+            table.undefined.insert(item.substr(1));
+            continue;
+        }
+        size_t eq = item.find('=');
+        applyDefineDirective(table, eq == std::string::npos ? item : item.substr(0, eq) + " " + item.substr(eq + 1));
+    }
+    return table;
+}
+
+/** sourceLines(text): 'text' split at '\n' */
+static std::vector<std::string> sourceLines(const std::string& text)
+{
+    std::vector<std::string> lines;
+    std::stringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) lines.push_back(line);
+    return lines;
+}
+
+/**** PPExpressionEvaluator ****/
+
+struct ExpressionCase {
+    const char* expr;
+    const char* macros;
+    bool unknownIsZero;
+    bool ok;            // no syntax error
+    bool known;
+    long long value;
+};
+
+static const ExpressionCase s_expressionCases[] = {
+    // unsigned promotion: one unsigned operand makes the operation unsigned
+    { "-1 < 0u", "", true, true, true, 0 },
+    { "-1 < 0", "", true, true, true, 1 },
+    { "-1 > 0u", "", true, true, true, 1 },
+    { "0u - 1 > 0", "", true, true, true, 1 },
+    { "(1 ? -1 : 0u) > 0", "", true, true, true, 1 },
+    { "18446744073709551615 == -1", "", true, true, true, 1 },
+    { "18446744073709551615 > 0", "", true, true, true, 1 },
+    { "-1 >> 1", "", true, true, true, -1 },
+    { "0xFFFFFFFFFFFFFFFFu >> 63", "", true, true, true, 1 },
+    { "!0u - 2 < 0", "", true, true, true, 1 },
+    { "-2 / 2u > 0", "", true, true, true, 1 },
+    { "U - 1 > 0", "U=0u", true, true, true, 1 },
+
+    // && and || decide as soon as one operand does, whatever the other
+    { "X && 0", "", false, true, true, 0 },
+    { "0 && X", "", false, true, true, 0 },
+    { "X || 1", "", false, true, true, 1 },
+    { "1 || X", "", false, true, true, 1 },
+    { "X && 1", "", false, true, false, 0 },
+    { "X || 0", "", false, true, false, 0 },
+    { "X && Y", "", false, true, false, 0 },
+    { "defined(X) || defined A", "A", false, true, true, 1 },
+    { "(X || 1) && !(Y && 0)", "", false, true, true, 1 },
+
+    // unknown names stay unknown through every other operator
+    { "X", "", false, true, false, 0 },
+    { "!X", "", false, true, false, 0 },
+    { "-X", "", false, true, false, 0 },
+    { "X + 1 > 0", "", false, true, false, 0 },
+    { "X * 0", "", false, true, false, 0 },
+    { "defined(X)", "", false, true, false, 0 },
+    { "F(1) == 2", "", false, true, false, 0 },
+    { "F(1)", "F(x)=x", false, true, false, 0 },
+    { "X ? 2 : 2", "", false, true, true, 2 },
+    { "X ? 1 : 2", "", false, true, false, 0 },
+    { "1 ? X : 0", "", false, true, false, 0 },
+    { "A == 1", "A=X", false, true, false, 0 },
+    // ... unless listed as undefined, or everything undefined is 0
+    { "!D", "!D", false, true, true, 1 },
+    { "defined D", "!D", false, true, true, 0 },
+    { "D(1) + 2", "!D", false, true, true, 2 },
+    { "X", "", true, true, true, 0 },
+    { "defined(X) || X(3) + 1 == 1", "", true, true, true, 1 },
+
+    // macro bodies
+    { "A + B", "A=1;B=A + 1", true, true, true, 3 },
+    { "E", "E", true, true, true, 1 },
+    { "defined(E) && E", "E", true, true, true, 1 },
+    { "V >= 0x0200 && V < 0x0300", "V=0x0250", true, true, true, 1 },
+
+    // division by zero is no syntax error, the value is just unknown
+    { "1 / 0", "", true, true, false, 0 },
+    { "1 % 0", "", true, true, false, 0 },
+    { "1 / Z", "", true, true, false, 0 },
+    { "(-9223372036854775807 - 1) / -1", "", true, true, false, 0 },
+    { "1 / 0 || 1", "", true, true, true, 1 },
+    { "0 && 1 / 0", "", true, true, true, 0 },
+    { "1 / 0 && 1", "", true, true, false, 0 },
+    { "1u / 0 == 0", "", true, true, false, 0 },
+
+    // syntax errors
+    { "1 +", "", true, false, false, 0 },
+    { "(1", "", true, false, false, 0 },
+    { "1 2", "", true, false, false, 0 },
+    { "defined(", "", true, false, false, 0 },
+    { "1 ? 2", "", true, false, false, 0 },
+    { "0x1G", "", true, false, false, 0 },
+    { "A", "A=1 +", true, false, false, 0 },
+};
+
+static void testExpressions()
+{
+    for (const ExpressionCase& c : s_expressionCases) {
+        MacroTable table = macroTable(c.macros);
+        bool ok = true;
+        PPExpressionEvaluator ev(c.expr, table, c.unknownIsZero);
+        PPValue v = ev.evaluate(ok);
+        CHECK_EQ(ok, c.ok, "syntax of '" << c.expr << "'");
+        if (!c.ok) continue;
+        CHECK_EQ(v.known, c.known, "known of '" << c.expr << "' [" << c.macros << "]");
+        if (c.known && v.known) CHECK_EQ(v.v, c.value, "value of '" << c.expr << "' [" << c.macros << "]");
+    }
+}
+
+/**** evaluateRegions ****/
+
+struct RegionCase {
+    const char* source;
+    const char* macros;
+    const char* pinned;     // names separated by ';'
+    const char* expected;   // per region: A(ctive), D(ead) or U(nknown)
+    size_t warnings;
+};
+
+static const RegionCase s_regionCases[] = {
+    { "#if A\n#elif B\n#else\n#endif", "A=0;B=1", "", "DAD", 0 },
+    { "#if A\n#elif B\n#else\n#endif", "A=0;B=0", "", "DDA", 0 },
+    { "#ifdef A\n#else\n#endif", "A", "", "AD", 0 },
+    { "#ifndef A\n#else\n#endif", "A", "", "DA", 0 },
+    { "#if 0\n#if 1\n#else\n#endif\n#endif", "", "", "DDD", 0 },
+    // an unknown #if: a true #elif after it may or may not win, the #else cannot
+    { "#if 1/0\n#elif 1\n#else\n#endif", "", "", "UUD", 1 },
+    { "#if 1/0\n#elif 0\n#else\n#endif", "", "", "UDU", 1 },
+    { "#if 1\n#elif 1/0\n#else\n#endif", "", "", "ADD", 0 },
+    { "#if 0\n#elif 1/0\n#elif 1\n#else\n#endif", "", "", "DUUD", 1 },
+    // everything nested in an unknown branch is unknown or dead
+    { "#if 1/0\n#if 1\n#else\n#endif\n#endif", "", "", "UUD", 1 },
+    { "#if (\n#endif", "", "", "U", 1 },
+    // #define / #undef only count in active code
+    { "#define X 2\n#if X == 2\n#endif", "", "", "A", 0 },
+    { "#if 0\n#define Y\n#endif\n#ifdef Y\n#endif", "", "", "DD", 0 },
+    { "#undef A\n#if A\n#endif", "A=1", "", "D", 0 },
+    { "#if 1/0\n#undef A\n#endif\n#if A\n#endif", "A=1", "", "UA", 1 },
+    // ... except for pinned names
+    { "#undef A\n#if A\n#endif", "A=1", "A", "A", 0 },
+    { "#define A 0\n#if A\n#endif", "A=1", "A", "A", 0 },
+};
+
+static void testRegions()
+{
+    for (const RegionCase& c : s_regionCases) {
+        DirectiveScan scan = scanPreprocessorDirectives(sourceLines(c.source));
+        std::vector<std::string> names = specItems(c.pinned);
+        std::unordered_set<std::string> pinned(names.begin(), names.end());
+        std::vector<size_t> warnings;
+        std::vector<uint8_t> states = evaluateRegions(scan, macroTable(c.macros), pinned, &warnings);
+        std::string text;
+        for (uint8_t s : states) text += s == REGION_ACTIVE ? 'A' : s == REGION_DEAD ? 'D' : 'U';
+        CHECK_EQ(text, std::string(c.expected), "regions of '" << c.source << "'");
+        CHECK_EQ(warnings.size(), c.warnings, "warnings of '" << c.source << "'");
+    }
+}
+
+/**** unifdefLines ****/
+
+struct UnifdefCase {
+    const char* source;
+    const char* forced;
+    const char* expected;   // the rewritten source
+    size_t resolved;        // chains touched
+};
+
+static const UnifdefCase s_unifdefCases[] = {
+    // resolved chains disappear
+    { "#if A\na\n#else\ne\n#endif", "A=1", "a", 1 },
+    { "#ifdef B\nb\n#else\ne\n#endif", "!B", "e", 1 },
+    { "#ifndef A\nn\n#endif\nx", "A", "x", 1 },
+    // a dropped first branch turns the next unknown #elif into #if
+    { "#if B\nb\n#elif X\nx\n#else\ne\n#endif", "!B", "#if X\nx\n#else\ne\n#endif", 1 },
+    { "#if B\nb\n#elif X\nx\n#endif", "!B", "#if X\nx\n#endif", 1 },
+    // a true #elif after a kept branch becomes #else, the rest goes
+    { "#if X\nx\n#elif A\na\n#else\ne\n#endif", "A=1", "#if X\nx\n#else\na\n#endif", 1 },
+    { "#if X\nx\n#elif A\na\n#elif Y\ny\n#endif", "A=1", "#if X\nx\n#else\na\n#endif", 1 },
+    { "#ifdef B\nb\n#elif defined(X)\nx\n#elif A\na\n#elif Y\ny\n#endif", "A=1;!B",
+        "#if defined(X)\nx\n#else\na\n#endif", 1 },
+    // a false #elif just goes
+    { "#if X\nx\n#elif B\nb\n#else\ne\n#endif", "!B", "#if X\nx\n#else\ne\n#endif", 1 },
+    // partly decided conditions keep the rest of the expression
+    { "#if A && X\nax\n#endif", "A=1", "#if X\nax\n#endif", 1 },
+    { "#if B || X\nx\n#endif", "!B", "#if X\nx\n#endif", 1 },
+    { "#if X\nx\n#elif (Y && A)\ny\n#endif", "A=1", "#if X\nx\n#elif Y\ny\n#endif", 1 },
+    { "#if B\nb\n#elif X || B\nx\n#endif", "!B", "#if X\nx\n#endif", 1 },
+    // nesting
+    { "#if X\n#ifdef A\nin\n#endif\n#endif", "A", "#if X\nin\n#endif", 1 },
+    { "#if A\n#if X\nx\n#endif\n#endif", "A=1", "#if X\nx\n#endif", 1 },
+    { "#if B\n#if A\na\n#endif\n#endif\nz", "!B;A=1", "z", 1 },
+    // untouched
+    { "#if X\nx\n#elif Y\ny\n#endif", "A=1", "#if X\nx\n#elif Y\ny\n#endif", 0 },
+};
+
+/** unifdefText(source, forced, resolved, ok): 'source' as unifdefFile() would write it */
+static std::string unifdefText(const std::string& source, const MacroTable& forced, size_t& resolved, bool& ok)
+{
+    DirectiveScan scan = scanPreprocessorDirectives(sourceLines(source));
+    std::vector<uint8_t> keep;
+    std::map<size_t, std::string> replaced;
+    resolved = 0;
+    ok = unifdefLines(scan, forced, keep, replaced, resolved);
+    std::string text;
+    for (size_t i = 0; ok && i < scan.lines.size(); ++i) {
+        if (!keep[i]) continue;
+        if (!text.empty()) text += '\n';
+        auto r = replaced.find(i);
+        text += r == replaced.end() ? scan.lines[i] : r->second;
+    }
+    return text;
+}
+
+static void testUnifdef()
+{
+    for (const UnifdefCase& c : s_unifdefCases) {
+        size_t resolved = 0;
+        bool ok = false;
+        std::string text = unifdefText(c.source, macroTable(c.forced), resolved, ok);
+        CHECK(ok);
+        CHECK_EQ(text, std::string(c.expected), "unifdef of '" << c.source << "' [" << c.forced << "]");
+        CHECK_EQ(resolved, c.resolved, "chains resolved in '" << c.source << "'");
+    }
+
+    size_t resolved = 0;
+    bool ok = true;
+    for (const char* unbalanced : { "#if A\na", "a\n#endif", "#else\n#endif" }) {
+        unifdefText(unbalanced, macroTable("A=1"), resolved, ok);
+        CHECK(!ok);
+    }
+}
+
+int main()
+{
+    testExpressions();
+    testRegions();
+    testUnifdef();
+    return testSummary("PreprocessorTests");
+}
@@ -0,0 +1,45 @@
+/** TestSupport.h:
+ *   Minimal checks for the test programs. Each program includes
+ *   DefineExtractor.cpp with its main() renamed, so the static
+ *   helpers can be called directly, and returns testSummary().
+ */
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+static int g_testChecks = 0;
+static int g_testFailures = 0;
+
+/** CHECK(condition): counts a failure and reports where it happened */
+#define CHECK(condition)                                                                        \
+    do {                                                                                        \
+        ++g_testChecks;                                                                         \
+        if (!(condition)) {                                                                     \
+            ++g_testFailures;                                                                   \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition "\n";     \
+        }                                                                                       \
+    } while (0)
+
+/** CHECK_EQ(actual, expected, context): as CHECK, printing both values and 'context' */
+#define CHECK_EQ(actual, expected, context)                                                     \
+    do {                                                                                        \
+        ++g_testChecks;                                                                         \
+        auto&& checkActual = (actual);                                                          \
+        auto&& checkExpected = (expected);                                                      \
+        if (!(checkActual == checkExpected)) {                                                  \
+            ++g_testFailures;                                                                   \
+            std::ostringstream checkOut;                                                        \
+            checkOut << __FILE__ << ":" << __LINE__ << ": " << context << ": got '"             \
+                << checkActual << "', expected '" << checkExpected << "'\n";                    \
+            std::cerr << checkOut.str();                                                        \
+        }                                                                                       \
+    } while (0)
+
+/** testSummary(name): prints the totals; the exit code for main() */
+static int testSummary(const char* name)
+{
+    std::cout << name << ": " << g_testChecks << " checks, " << g_testFailures << " failed\n";
+    return g_testFailures == 0 ? 0 : 1;
+}